@@ -27,9 +27,18 @@ struct Launch_Settings {
     int s = 256;
     int d = 8;
     bool animate = false;
+    Image_Format frame_format = Image_Format::png;
     float exp = 1.0f;
+    Tonemap_Op tonemap = Tonemap_Op::exposure;
     bool w_from_ar = false;
     bool no_bvh = false;
+    int rr_depth = 3;
+    bool aovs = false;
+    int denoise = 0;
+    HDR_Format env_format = HDR_Format::rgb32f;
+    std::string checkpoint_file;
+    float checkpoint_interval = 60.0f;
+    bool resume = false;
 };
 
 class App {
@@ -0,0 +1,348 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+    Storage for one kind of mesh element. It behaves like the std::list it replaces:
+    iterators stay valid until their own element is erased, new elements go on the
+    end of the iteration order, and erasing never disturbs other elements. But the
+    elements themselves live in large chunks rather than one heap node apiece, so
+    walking the mesh touches far less memory.
+
+    Each element has a 32-bit slot number giving its position in storage. Slots
+    of erased elements are reused by later insertions, and compact() repacks the
+    live elements into slots 0..size()-1 in iteration order (which invalidates
+    every iterator, so the caller must remap any it holds). An element can be
+    found from its slot in O(1), and put back in a particular free slot, so that
+    records of where elements were (like undo deltas) can skip searching.
+*/
+template<typename T> class Element_List {
+
+    // Iteration order links, or free list links once erased; the list's
+    // sentinel is a bare Links
+    struct Links {
+        Links* prev = nullptr;
+        Links* next = nullptr;
+        uint32_t slot = UINT32_MAX;
+        bool live = false;
+    };
+    struct Node : Links {
+        template<typename... Args> Node(Args&&... args) : value(std::forward<Args>(args)...) {
+        }
+        T value;
+    };
+    struct Storage {
+        alignas(Node) unsigned char bytes[sizeof(Node)];
+    };
+
+public:
+    template<bool Const> class Iter {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, const T*, T*>;
+        using reference = std::conditional_t<Const, const T&, T&>;
+
+        Iter() = default;
+        template<bool C = Const, typename = std::enable_if_t<C>>
+        Iter(const Iter<false>& it) : links(it.links) {
+        }
+
+        reference operator*() const {
+            return static_cast<Node*>(links)->value;
+        }
+        pointer operator->() const {
+            return &static_cast<Node*>(links)->value;
+        }
+
+        Iter& operator++() {
+            links = links->next;
+            return *this;
+        }
+        Iter operator++(int) {
+            Iter ret = *this;
+            links = links->next;
+            return ret;
+        }
+        Iter& operator--() {
+            links = links->prev;
+            return *this;
+        }
+        Iter operator--(int) {
+            Iter ret = *this;
+            links = links->prev;
+            return ret;
+        }
+
+        /// Position of the element in storage
+        uint32_t slot() const {
+            return links->slot;
+        }
+
+        template<bool C> bool operator==(const Iter<C>& it) const {
+            return links == it.links;
+        }
+        template<bool C> bool operator!=(const Iter<C>& it) const {
+            return links != it.links;
+        }
+        /// Orders by slot, so that sorted containers of references don't depend on
+        /// where the allocator happened to put things
+        template<bool C> bool operator<(const Iter<C>& it) const {
+            if(links->slot != it.links->slot) return links->slot < it.links->slot;
+            return links < it.links;
+        }
+
+    private:
+        explicit Iter(Links* l) : links(l) {
+        }
+        Links* links = nullptr;
+
+        friend class Element_List;
+        template<bool> friend class Iter;
+    };
+
+    using iterator = Iter<false>;
+    using const_iterator = Iter<true>;
+
+    /// Old-to-new iterator mapping produced by compact(). Holds on to the old
+    /// storage, so it must be used before it is destroyed.
+    class Remap {
+    public:
+        iterator operator()(const_iterator old) const {
+            return iterator(to_new[old.slot()]);
+        }
+
+    private:
+        std::vector<std::unique_ptr<Storage[]>> old_chunks;
+        std::vector<Links*> to_new;
+        friend class Element_List;
+    };
+
+    Element_List() {
+        sentinel.prev = sentinel.next = &sentinel;
+    }
+    ~Element_List() {
+        clear();
+    }
+
+    Element_List(const Element_List& src) = delete;
+    Element_List& operator=(const Element_List& src) = delete;
+
+    Element_List(Element_List&& src) noexcept {
+        sentinel.prev = sentinel.next = &sentinel;
+        take(src);
+    }
+    Element_List& operator=(Element_List&& src) noexcept {
+        if(this != &src) {
+            clear();
+            take(src);
+        }
+        return *this;
+    }
+
+    iterator begin() {
+        return iterator(sentinel.next);
+    }
+    iterator end() {
+        return iterator(&sentinel);
+    }
+    const_iterator begin() const {
+        return const_iterator(sentinel.next);
+    }
+    const_iterator end() const {
+        return const_iterator(const_cast<Links*>(&sentinel));
+    }
+
+    size_t size() const {
+        return n;
+    }
+    bool empty() const {
+        return n == 0;
+    }
+    /// Number of slots in use or free for reuse
+    size_t capacity() const {
+        return n_slots;
+    }
+    /// Approximate heap memory held by the list
+    size_t bytes() const {
+        return (n_slots + chunk_left) * sizeof(Storage);
+    }
+
+    template<typename... Args> iterator emplace_back(Args&&... args) {
+
+        if(free_head) {
+            Links* l = free_head;
+            unlink_free(l);
+            return construct(l, l->slot, std::forward<Args>(args)...);
+        }
+        void* place = grow();
+        return construct(place, n_slots++, std::forward<Args>(args)...);
+    }
+
+    /// Like emplace_back, but reuses the given slot if it is free
+    template<typename... Args> iterator emplace_at(uint32_t slot, Args&&... args) {
+
+        Links* l = links_at(slot);
+        if(!l || l->live) return emplace_back(std::forward<Args>(args)...);
+        unlink_free(l);
+        return construct(l, slot, std::forward<Args>(args)...);
+    }
+
+    /// The element in the given slot, or end() if there is none
+    iterator find_slot(uint32_t slot) {
+        Links* l = links_at(slot);
+        return l && l->live ? iterator(l) : end();
+    }
+
+    void erase(const_iterator it) {
+        assert(it.links != &sentinel);
+        Links* l = it.links;
+        l->prev->next = l->next;
+        l->next->prev = l->prev;
+        static_cast<Node*>(l)->value.~T();
+        l->live = false;
+        l->prev = nullptr;
+        l->next = free_head;
+        if(free_head) free_head->prev = l;
+        free_head = l;
+        n--;
+    }
+
+    void clear() {
+        for(Links* l = sentinel.next; l != &sentinel; l = l->next) {
+            static_cast<Node*>(l)->value.~T();
+        }
+        sentinel.prev = sentinel.next = &sentinel;
+        chunks.clear();
+        chunk_first.clear();
+        free_head = nullptr;
+        n = n_slots = 0;
+        chunk_free = nullptr;
+        chunk_left = 0;
+    }
+
+    /// Move every element into one contiguous block, in iteration order
+    Remap compact() {
+
+        Remap remap;
+        remap.to_new.resize(n_slots, nullptr);
+        remap.old_chunks = std::move(chunks);
+        chunks.clear();
+        chunk_first.clear();
+
+        Links* first = sentinel.next;
+        size_t count = n;
+        sentinel.prev = sentinel.next = &sentinel;
+        free_head = nullptr;
+        n = n_slots = 0;
+        chunk_free = nullptr;
+        chunk_left = 0;
+        reserve(count);
+
+        for(Links* l = first; l != &sentinel;) {
+            Links* next = l->next;
+            Node* old = static_cast<Node*>(l);
+            remap.to_new[old->slot] = emplace_back(std::move(old->value)).links;
+            old->value.~T();
+            l = next;
+        }
+        return remap;
+    }
+
+    /// Make room for at least this many more elements without further allocation
+    void reserve(size_t count) {
+        if(count > chunk_left) {
+            // Any rest of the previous chunk is abandoned, so slots stay consecutive
+            chunk_first.push_back(n_slots);
+            chunks.emplace_back(new Storage[count]);
+            chunk_free = chunks.back().get();
+            chunk_left = count;
+        }
+    }
+
+private:
+    template<typename... Args> iterator construct(void* place, uint32_t slot, Args&&... args) {
+        Node* node = new(place) Node(std::forward<Args>(args)...);
+        node->slot = slot;
+        node->live = true;
+        node->prev = sentinel.prev;
+        node->next = &sentinel;
+        sentinel.prev->next = node;
+        sentinel.prev = node;
+        n++;
+        return iterator(node);
+    }
+
+    void unlink_free(Links* l) {
+        if(l->prev) {
+            l->prev->next = l->next;
+        } else {
+            free_head = l->next;
+        }
+        if(l->next) l->next->prev = l->prev;
+    }
+
+    Links* links_at(uint32_t slot) {
+        if(slot >= n_slots) return nullptr;
+        size_t c = std::upper_bound(chunk_first.begin(), chunk_first.end(), slot) -
+                   chunk_first.begin() - 1;
+        return std::launder(reinterpret_cast<Node*>(&chunks[c][slot - chunk_first[c]]));
+    }
+
+    void* grow() {
+        if(chunk_left == 0) {
+            // Chunks double in size, so small meshes stay small
+            reserve(std::max<size_t>(n_slots, min_chunk));
+        }
+        chunk_left--;
+        return chunk_free++;
+    }
+
+    void take(Element_List& src) {
+        chunks = std::move(src.chunks);
+        chunk_first = std::move(src.chunk_first);
+        free_head = src.free_head;
+        n = src.n;
+        n_slots = src.n_slots;
+        chunk_free = src.chunk_free;
+        chunk_left = src.chunk_left;
+        if(n) {
+            sentinel.next = src.sentinel.next;
+            sentinel.prev = src.sentinel.prev;
+            sentinel.next->prev = &sentinel;
+            sentinel.prev->next = &sentinel;
+        }
+        src.sentinel.prev = src.sentinel.next = &src.sentinel;
+        src.chunks.clear();
+        src.chunk_first.clear();
+        src.free_head = nullptr;
+        src.n = src.n_slots = 0;
+        src.chunk_free = nullptr;
+        src.chunk_left = 0;
+    }
+
+    static constexpr size_t min_chunk = 32;
+
+    Links sentinel;
+    // Erased elements' storage, linked through Links::next
+    Links* free_head = nullptr;
+    std::vector<std::unique_ptr<Storage[]>> chunks;
+    // Slot of the first element of each chunk
+    std::vector<uint32_t> chunk_first;
+    // Unused tail of the newest chunk
+    Storage* chunk_free = nullptr;
+    size_t chunk_left = 0;
+    size_t n = 0;
+    uint32_t n_slots = 0;
+};
@@ -1,12 +1,16 @@
 
 #include "halfedge.h"
 
-#include <map>
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <set>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "../gui/widgets.h"
+#include "../util/thread_pool.h"
 
 Halfedge_Mesh::Halfedge_Mesh() {
     next_id = Gui::n_Widget_IDs;
@@ -45,52 +49,56 @@ Halfedge_Mesh::ElementRef Halfedge_Mesh::copy_to(Halfedge_Mesh& mesh, unsigned i
     mesh.clear();
     ElementRef ret = vertices_begin();
 
-    // These maps will be used to identify elements of the old mesh
-    // with elements of the new mesh.  (Note that we can use a single
-    // map for both interior and boundary faces, because the map
-    // doesn't care which list of faces these iterators come from.)
-    std::unordered_map<unsigned int, HalfedgeRef> halfedgeOldToNew(n_halfedges());
-    std::unordered_map<unsigned int, VertexRef> vertexOldToNew(n_vertices());
-    std::unordered_map<unsigned int, EdgeRef> edgeOldToNew(n_edges());
-    std::unordered_map<unsigned int, FaceRef> faceOldToNew(n_faces());
+    // These tables will be used to identify elements of the old mesh
+    // with elements of the new mesh, indexed by the old element's slot.
+    std::vector<HalfedgeRef> halfedgeOldToNew(halfedges.capacity());
+    std::vector<VertexRef> vertexOldToNew(vertices.capacity());
+    std::vector<EdgeRef> edgeOldToNew(edges.capacity());
+    std::vector<FaceRef> faceOldToNew(faces.capacity());
+
+    mesh.halfedges.reserve(n_halfedges());
+    mesh.vertices.reserve(n_vertices());
+    mesh.edges.reserve(n_edges());
+    mesh.faces.reserve(n_faces());
 
     // Copy geometry from the original mesh and create a map from
     // pointers in the original mesh to those in the new mesh.
     for(HalfedgeCRef h = halfedges_begin(); h != halfedges_end(); h++) {
-        auto hn = mesh.halfedges.insert(mesh.halfedges.end(), *h);
+        auto hn = mesh.halfedges.emplace_back(*h);
         if(h->id() == eid) ret = hn;
-        halfedgeOldToNew[h->id()] = hn;
+        halfedgeOldToNew[h.slot()] = hn;
     }
     for(VertexCRef v = vertices_begin(); v != vertices_end(); v++) {
-        auto vn = mesh.vertices.insert(mesh.vertices.end(), *v);
+        auto vn = mesh.vertices.emplace_back(*v);
         if(v->id() == eid) ret = vn;
-        vertexOldToNew[v->id()] = vn;
+        vertexOldToNew[v.slot()] = vn;
     }
     for(EdgeCRef e = edges_begin(); e != edges_end(); e++) {
-        auto en = mesh.edges.insert(mesh.edges.end(), *e);
+        auto en = mesh.edges.emplace_back(*e);
         if(e->id() == eid) ret = en;
-        edgeOldToNew[e->id()] = en;
+        edgeOldToNew[e.slot()] = en;
     }
     for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
-        auto fn = mesh.faces.insert(mesh.faces.end(), *f);
+        auto fn = mesh.faces.emplace_back(*f);
         if(f->id() == eid) ret = fn;
-        faceOldToNew[f->id()] = fn;
+        faceOldToNew[f.slot()] = fn;
     }
 
-    // "Search and replace" old pointers with new ones.
+    // "Search and replace" old pointers with new ones. The copied references
+    // still point into this mesh, so their slots index the tables above.
     for(HalfedgeRef he = mesh.halfedges_begin(); he != mesh.halfedges_end(); he++) {
-        he->next() = halfedgeOldToNew[he->next()->id()];
-        he->twin() = halfedgeOldToNew[he->twin()->id()];
-        he->vertex() = vertexOldToNew[he->vertex()->id()];
-        he->edge() = edgeOldToNew[he->edge()->id()];
-        he->face() = faceOldToNew[he->face()->id()];
+        he->next() = halfedgeOldToNew[he->next().slot()];
+        he->twin() = halfedgeOldToNew[he->twin().slot()];
+        he->vertex() = vertexOldToNew[he->vertex().slot()];
+        he->edge() = edgeOldToNew[he->edge().slot()];
+        he->face() = faceOldToNew[he->face().slot()];
     }
     for(VertexRef v = mesh.vertices_begin(); v != mesh.vertices_end(); v++)
-        v->halfedge() = halfedgeOldToNew[v->halfedge()->id()];
+        v->halfedge() = halfedgeOldToNew[v->halfedge().slot()];
     for(EdgeRef e = mesh.edges_begin(); e != mesh.edges_end(); e++)
-        e->halfedge() = halfedgeOldToNew[e->halfedge()->id()];
+        e->halfedge() = halfedgeOldToNew[e->halfedge().slot()];
     for(FaceRef f = mesh.faces_begin(); f != mesh.faces_end(); f++)
-        f->halfedge() = halfedgeOldToNew[f->halfedge()->id()];
+        f->halfedge() = halfedgeOldToNew[f->halfedge().slot()];
 
     mesh.render_dirty_flag = true;
     mesh.next_id = next_id;
@@ -265,71 +273,304 @@ void Halfedge_Mesh::to_mesh(GL::Mesh& mesh, bool split_faces) const {
     std::vector<GL::Mesh::Vert> verts;
     std::vector<GL::Mesh::Index> idxs;
 
+    Thread_Pool& pool = Thread_Pool::global();
+    const size_t grain = 1024;
+
+    std::vector<FaceCRef> face_list;
+    face_list.reserve(n_faces());
+    for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+        if(!f->is_boundary()) face_list.push_back(f);
+    }
+
+    // Count each face's triangles in parallel, then find where each face's
+    // triangles go, so faces can be written in parallel too
+    std::vector<size_t> tri_offset(face_list.size() + 1, 0);
+    pool.parallel_for(
+        0, face_list.size(),
+        [&](size_t begin, size_t end) {
+            for(size_t fi = begin; fi < end; fi++) {
+                unsigned int d = face_list[fi]->degree();
+                assert(d >= 3);
+                tri_offset[fi + 1] = d - 2;
+            }
+        },
+        grain);
+    for(size_t fi = 0; fi < face_list.size(); fi++) tri_offset[fi + 1] += tri_offset[fi];
+    idxs.resize(3 * tri_offset.back());
+
     if(split_faces) {
 
-        std::vector<GL::Mesh::Vert> face_verts;
-        for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+        verts.resize(3 * tri_offset.back());
+
+        pool.parallel_for(
+            0, face_list.size(),
+            [&](size_t begin, size_t end) {
+                std::vector<Vec3> face_verts;
+                for(size_t fi = begin; fi < end; fi++) {
+
+                    FaceCRef f = face_list[fi];
+                    HalfedgeCRef h = f->halfedge();
+                    face_verts.clear();
+                    do {
+                        face_verts.push_back(h->vertex()->pos);
+                        h = h->next();
+                    } while(h != f->halfedge());
+
+                    Vec3 v0 = face_verts[0];
+                    size_t idx = 3 * tri_offset[fi];
+                    for(size_t i = 1; i <= face_verts.size() - 2; i++, idx += 3) {
+                        Vec3 v1 = face_verts[i];
+                        Vec3 v2 = face_verts[i + 1];
+                        Vec3 n = cross(v1 - v0, v2 - v0).unit();
+                        if(flip_orientation) n = -n;
+                        verts[idx] = {v0, n, f->_id};
+                        verts[idx + 1] = {v1, n, f->_id};
+                        verts[idx + 2] = {v2, n, f->_id};
+                        idxs[idx] = (GL::Mesh::Index)idx;
+                        idxs[idx + 1] = (GL::Mesh::Index)(idx + 1);
+                        idxs[idx + 2] = (GL::Mesh::Index)(idx + 2);
+                    }
+                }
+            },
+            grain);
 
-            if(f->is_boundary()) continue;
+    } else {
 
-            HalfedgeCRef h = f->halfedge();
-            face_verts.clear();
-            do {
-                VertexCRef v = h->vertex();
-                Vec3 n = v->normal();
-                if(flip_orientation) n = -n;
-                face_verts.push_back({v->pos, n, f->id()});
-                h = h->next();
-            } while(h != f->halfedge());
-
-            Vec3 v0 = face_verts[0].pos;
-            for(size_t i = 1; i <= face_verts.size() - 2; i++) {
-                Vec3 v1 = face_verts[i].pos;
-                Vec3 v2 = face_verts[i + 1].pos;
-                Vec3 n = cross(v1 - v0, v2 - v0).unit();
-                if(flip_orientation) n = -n;
-                GL::Mesh::Index idx = (GL::Mesh::Index)verts.size();
-                verts.push_back({v0, n, f->_id});
-                verts.push_back({v1, n, f->_id});
-                verts.push_back({v2, n, f->_id});
-                idxs.push_back(idx);
-                idxs.push_back(idx + 1);
-                idxs.push_back(idx + 2);
-            }
+        // Vertices are written in list order; their storage slots, which the mesh
+        // keeps up to date as it is edited, find each one's linear index in O(1)
+        std::vector<GL::Mesh::Index> slot_to_idx(vertices.capacity());
+        std::vector<VertexCRef> vert_list;
+        vert_list.reserve(n_vertices());
+        for(VertexCRef v = vertices_begin(); v != vertices_end(); v++) {
+            slot_to_idx[v.slot()] = (GL::Mesh::Index)vert_list.size();
+            vert_list.push_back(v);
         }
 
-    } else {
+        verts.resize(vert_list.size());
+        pool.parallel_for(
+            0, vert_list.size(),
+            [&](size_t begin, size_t end) {
+                for(size_t vi = begin; vi < end; vi++) {
+                    VertexCRef v = vert_list[vi];
+                    Vec3 n = v->normal();
+                    if(flip_orientation) n = -n;
+                    verts[vi] = {v->pos, n, v->_id};
+                }
+            },
+            grain);
+
+        pool.parallel_for(
+            0, face_list.size(),
+            [&](size_t begin, size_t end) {
+                std::vector<GL::Mesh::Index> face_verts;
+                for(size_t fi = begin; fi < end; fi++) {
+
+                    FaceCRef f = face_list[fi];
+                    HalfedgeCRef h = f->halfedge();
+                    face_verts.clear();
+                    do {
+                        face_verts.push_back(slot_to_idx[h->vertex().slot()]);
+                        h = h->next();
+                    } while(h != f->halfedge());
+
+                    size_t idx = 3 * tri_offset[fi];
+                    for(size_t j = 1; j <= face_verts.size() - 2; j++, idx += 3) {
+                        idxs[idx] = face_verts[0];
+                        idxs[idx + 1] = face_verts[j];
+                        idxs[idx + 2] = face_verts[j + 1];
+                    }
+                }
+            },
+            grain);
+    }
+
+    mesh.recreate(std::move(verts), std::move(idxs));
+}
+
+void Halfedge_Mesh::to_mesh_adaptive(GL::Mesh& mesh,
+                                     const std::function<float(Vec3, Vec3, Vec3)>& screen_error,
+                                     float tolerance, size_t max_levels,
+                                     size_t max_triangles) const {
 
-        // Need to build this map to get vertex's linear index in O(lg n)
-        std::map<VertexCRef, Index> vref_to_idx;
-        Index i = 0;
-        for(VertexCRef v = vertices_begin(); v != vertices_end(); v++, i++) {
-            vref_to_idx[v] = i;
-            Vec3 n = v->normal();
-            if(flip_orientation) n = -n;
-            verts.push_back({v->pos, n, v->_id});
+    using Index = GL::Mesh::Index;
+    using Tri = std::array<Index, 3>;
+    const Index none = std::numeric_limits<Index>::max();
+
+    std::vector<GL::Mesh::Vert> verts;
+    std::vector<Tri> tris, next;
+
+    std::vector<Index> slot_to_idx(vertices.capacity());
+    verts.reserve(n_vertices());
+    for(VertexCRef v = vertices_begin(); v != vertices_end(); v++) {
+        slot_to_idx[v.slot()] = (Index)verts.size();
+        Vec3 n = v->normal();
+        if(flip_orientation) n = -n;
+        verts.push_back({v->pos, n, v->_id});
+    }
+    tris.reserve(n_faces());
+    for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+        if(f->is_boundary()) continue;
+        HalfedgeCRef h = f->halfedge();
+        Index first = slot_to_idx[h->vertex().slot()];
+        Index prev = slot_to_idx[h->next()->vertex().slot()];
+        for(h = h->next()->next(); h != f->halfedge(); h = h->next()) {
+            Index cur = slot_to_idx[h->vertex().slot()];
+            tris.push_back({first, prev, cur});
+            prev = cur;
         }
+    }
 
-        for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+    // New points lie on the cubic through each edge that is tangent to the surface
+    // at both ends, as in PN triangles. Unlike the vertex rules of Loop or
+    // Catmull-Clark, this depends on nothing but the edge, so neighbors can be
+    // refined to different depths and still meet.
+    auto midpoint = [&](Index a, Index b) {
+        GL::Mesh::Vert va = verts[a], vb = verts[b];
+        Vec3 e = vb.pos - va.pos;
+        Vec3 pos = 0.5f * (va.pos + vb.pos) +
+                   (dot(e, vb.norm) * vb.norm - dot(e, va.norm) * va.norm) / 8.0f;
+        // The average normal, reflected across the plane normal to the edge
+        Vec3 n = va.norm + vb.norm;
+        float ee = dot(e, e);
+        if(ee > 0.0f) n -= 2.0f * dot(e, n) / ee * e;
+        n = n.norm_squared() > 0.0f ? n.unit() : va.norm;
+        return GL::Mesh::Vert{pos, n, va.id};
+    };
+    // The curve stays within the hull of its control points, so the farther of
+    // the inner two from the edge bounds how far the curve strays from it
+    auto error = [&](Index a, Index b) {
+        Vec3 pa = verts[a].pos, pb = verts[b].pos, e = pb - pa;
+        Vec3 da = dot(e, verts[a].norm) * verts[a].norm / 3.0f;
+        Vec3 db = dot(e, verts[b].norm) * verts[b].norm / 3.0f;
+        return screen_error(pa, pb, da.norm_squared() > db.norm_squared() ? da : db);
+    };
+
+    auto key = [](Index a, Index b) {
+        return a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+    };
+    // Each edge seen this level: the triangles on either side, and its midpoint
+    // (none if it stays whole, pending until the split is settled)
+    const Index pending = none - 1;
+    struct Edge_Split {
+        Index mid = none;
+        Index faces[2] = {none, none};
+    };
+    std::unordered_map<uint64_t, Edge_Split> mids;
+    auto edge_mids = [&](const Tri& t, Index (&m)[3]) {
+        int n_split = 0;
+        for(int i = 0; i < 3; i++) {
+            m[i] = mids.find(key(t[i], t[(i + 1) % 3]))->second.mid;
+            if(m[i] != none) n_split++;
+        }
+        return n_split;
+    };
+    // Splitting an edge adds one triangle on each side of it
+    auto cost = [](const Edge_Split& e) { return e.faces[1] == none ? size_t(1) : size_t(2); };
+
+    // Edges that are too coarse, with their errors
+    std::vector<std::pair<float, uint64_t>> coarse;
+    std::vector<Index> work;
+
+    for(size_t level = 0; level < max_levels && tris.size() < max_triangles; level++) {
+
+        mids.clear();
+        mids.reserve(2 * tris.size());
+        coarse.clear();
+        for(Index ti = 0; ti < (Index)tris.size(); ti++) {
+            const Tri& t = tris[ti];
+            for(int i = 0; i < 3; i++) {
+                Index a = t[i], b = t[(i + 1) % 3];
+                auto [entry, fresh] = mids.try_emplace(key(a, b));
+                Edge_Split& e = entry->second;
+                e.faces[e.faces[0] == none ? 0 : 1] = ti;
+                if(!fresh) continue;
+                float err = error(a, b);
+                if(err > tolerance) coarse.push_back({err, key(a, b)});
+            }
+        }
 
-            if(f->is_boundary()) continue;
+        // Once the budget runs short, only the edges that stray the most are split
+        size_t room = max_triangles - tris.size(), used = 0;
+        if(2 * coarse.size() > room) {
+            std::nth_element(coarse.begin(), coarse.begin() + room / 2, coarse.end(),
+                             [](const auto& l, const auto& r) { return l.first > r.first; });
+            coarse.resize(room / 2);
+        }
+        if(coarse.empty()) break;
+        for(const auto& [err, k] : coarse) {
+            Edge_Split& e = mids[k];
+            e.mid = pending;
+            used += cost(e);
+        }
 
-            std::vector<Index> face_verts;
-            HalfedgeCRef h = f->halfedge();
-            do {
-                face_verts.push_back(vref_to_idx[h->vertex()]);
-                h = h->next();
-            } while(h != f->halfedge());
+        // A face with two split edges splits its third too, so each face becomes
+        // two triangles or four and refinement doesn't pile up slivers. Only faces
+        // next to a changed edge are looked at again. When the budget can't cover
+        // a forced split, one of the face's two splits is dropped instead, and from
+        // then on always, so the closure ends within the budget.
+        work.clear();
+        for(Index ti = 0; ti < (Index)tris.size(); ti++) {
+            Index m[3];
+            if(edge_mids(tris[ti], m) == 2) work.push_back(ti);
+        }
+        bool full = false;
+        while(!work.empty()) {
+            Index ti = work.back();
+            work.pop_back();
+            const Tri& t = tris[ti];
+            Index m[3];
+            if(edge_mids(t, m) != 2) continue;
+
+            int i = m[0] == none ? 0 : m[1] == none ? 1 : 2;
+            Edge_Split* e = &mids[key(t[i], t[(i + 1) % 3])];
+            if(!full && used + cost(*e) <= room) {
+                e->mid = pending;
+                used += cost(*e);
+            } else {
+                full = true;
+                i = m[0] != none ? 0 : 1;
+                e = &mids[key(t[i], t[(i + 1) % 3])];
+                e->mid = none;
+                used -= cost(*e);
+            }
+            for(Index other : e->faces) {
+                if(other != none && other != ti) work.push_back(other);
+            }
+        }
+
+        for(const Tri& t : tris) {
+            for(int i = 0; i < 3; i++) {
+                Edge_Split& e = mids[key(t[i], t[(i + 1) % 3])];
+                if(e.mid != pending) continue;
+                e.mid = (Index)verts.size();
+                verts.push_back(midpoint(t[i], t[(i + 1) % 3]));
+            }
+        }
 
-            assert(face_verts.size() >= 3);
-            for(size_t j = 1; j <= face_verts.size() - 2; j++) {
-                idxs.push_back((GL::Mesh::Index)face_verts[0]);
-                idxs.push_back((GL::Mesh::Index)face_verts[j]);
-                idxs.push_back((GL::Mesh::Index)face_verts[j + 1]);
+        next.clear();
+        next.reserve(tris.size() + used);
+        for(const Tri& t : tris) {
+            Index m[3];
+            int n_split = edge_mids(t, m);
+            if(n_split == 0) {
+                next.push_back(t);
+            } else if(n_split == 3) {
+                next.push_back({t[0], m[0], m[2]});
+                next.push_back({m[0], t[1], m[1]});
+                next.push_back({m[2], m[1], t[2]});
+                next.push_back({m[0], m[1], m[2]});
+            } else {
+                int i = m[0] != none ? 0 : m[1] != none ? 1 : 2;
+                next.push_back({t[i], m[i], t[(i + 2) % 3]});
+                next.push_back({m[i], t[(i + 1) % 3], t[(i + 2) % 3]});
             }
         }
+        std::swap(tris, next);
     }
 
+    std::vector<Index> idxs;
+    idxs.reserve(3 * tris.size());
+    for(const Tri& t : tris) idxs.insert(idxs.end(), t.begin(), t.end());
     mesh.recreate(std::move(verts), std::move(idxs));
 }
 
@@ -367,6 +608,155 @@ std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> Halfedge_Mesh::
     return std::nullopt;
 }
 
+std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> Halfedge_Mesh::warnings_local() {
+
+    std::vector<VertexRef> verts = changed_vertices();
+
+    // Ops tend to create vertices on top of their neighbors, so compare each
+    // changed vertex against the vertices around it
+    std::vector<std::pair<Vec3, VertexRef>> v_pos;
+    for(VertexRef v : verts) {
+        HalfedgeRef h = v->halfedge();
+        do {
+            v_pos.push_back({h->twin()->vertex()->pos, h->twin()->vertex()});
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+        v_pos.push_back({v->pos, v});
+    }
+    std::sort(v_pos.begin(), v_pos.end());
+    for(size_t i = 1; i < v_pos.size(); i++) {
+        if(!(v_pos[i - 1].first < v_pos[i].first) && v_pos[i - 1].second != v_pos[i].second) {
+            return {{v_pos[i].second, "Vertices with identical positions."}};
+        }
+    }
+
+    for(VertexRef v : verts) {
+        std::vector<unsigned int> others;
+        HalfedgeRef h = v->halfedge();
+        do {
+            unsigned int other = h->twin()->vertex()->id();
+            if(other == v->id()) {
+                return {{h->edge(), "Edge wrapping single vertex."}};
+            }
+            if(std::find(others.begin(), others.end(), other) != others.end()) {
+                return {{h->edge(), "Multiple edges across same vertices."}};
+            }
+            others.push_back(other);
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+    }
+
+    return std::nullopt;
+}
+
+bool Halfedge_Mesh::erasing(VertexRef v) const {
+    return verased.count(v) > 0;
+}
+bool Halfedge_Mesh::erasing(EdgeRef e) const {
+    return eerased.count(e) > 0;
+}
+bool Halfedge_Mesh::erasing(FaceRef f) const {
+    return ferased.count(f) > 0;
+}
+bool Halfedge_Mesh::erasing(HalfedgeRef h) const {
+    return herased.count(h) > 0;
+}
+
+Halfedge_Mesh::Problem Halfedge_Mesh::check_links(HalfedgeRef h) {
+
+    if(erasing(h->next())) {
+        return {{h, "A live halfedge's next was erased!"}};
+    }
+    if(erasing(h->twin())) {
+        return {{h, "A live halfedge's twin was erased!"}};
+    }
+    if(erasing(h->vertex())) {
+        return {{h, "A live halfedge's vertex was erased!"}};
+    }
+    if(erasing(h->face())) {
+        return {{h, "A live halfedge's face was erased!"}};
+    }
+    if(erasing(h->edge())) {
+        return {{h, "A live halfedge's edge was erased!"}};
+    }
+    return std::nullopt;
+}
+
+Halfedge_Mesh::Problem Halfedge_Mesh::check_twin(HalfedgeRef h) {
+
+    if(h->twin() == h) {
+        return {{h, "A halfedge's twin is itself!"}};
+    }
+    if(h->twin()->twin() != h) {
+        return {{h, "A halfedge's twin's twin is not itself!"}};
+    }
+    return std::nullopt;
+}
+
+Halfedge_Mesh::Problem Halfedge_Mesh::check_vertex(VertexRef v) {
+
+    // Check whether each halfedge incident on a vertex points to that vertex
+    HalfedgeRef h = v->halfedge();
+    if(erasing(h)) {
+        return {{v, "A vertex's halfedge is erased!"}};
+    }
+
+    size_t steps = 0;
+    do {
+        if(h->vertex() != v) {
+            return {{h, "A vertex's halfedge does not point to that vertex!"}};
+        }
+        // validate_local() hasn't checked every link this walk follows
+        if(++steps > halfedges.size()) {
+            return {{v, "A vertex's halfedges do not lead back around to it!"}};
+        }
+        h = h->twin()->next();
+    } while(h != v->halfedge());
+    return std::nullopt;
+}
+
+Halfedge_Mesh::Problem Halfedge_Mesh::check_edge(EdgeRef e) {
+
+    // Check whether each halfedge incident on an edge points to that edge
+    HalfedgeRef h = e->halfedge();
+    if(erasing(h)) {
+        return {{e, "An edge's halfedge is erased!"}};
+    }
+
+    size_t steps = 0;
+    do {
+        if(h->edge() != e) {
+            return {{h, "An edge's halfedge does not point to that edge!"}};
+        }
+        if(++steps > 2) {
+            return {{h, "A halfedge's twin's twin is not itself!"}};
+        }
+        h = h->twin();
+    } while(h != e->halfedge());
+    return std::nullopt;
+}
+
+Halfedge_Mesh::Problem Halfedge_Mesh::check_face(FaceRef f) {
+
+    // Check whether each halfedge incident on a face points to that face
+    HalfedgeRef h = f->halfedge();
+    if(erasing(h)) {
+        return {{f, "A face's halfedge is erased!"}};
+    }
+
+    size_t steps = 0;
+    do {
+        if(h->face() != f) {
+            return {{h, "A face's halfedge does not point to that face!"}};
+        }
+        if(++steps > halfedges.size()) {
+            return {{f, "A face's halfedges do not lead back around to it!"}};
+        }
+        h = h->next();
+    } while(h != f->halfedge());
+    return std::nullopt;
+}
+
 std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> Halfedge_Mesh::validate() {
 
     for(VertexRef v = vertices_begin(); v != vertices_end(); v++) {
@@ -375,114 +765,162 @@ std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> Halfedge_Mesh::
         if(!finite) return {{v, "A vertex position was set to a non-finite value."}};
     }
 
-    std::set<HalfedgeRef> permutation;
+    // Which halfedges are some halfedge's next, by slot
+    std::vector<bool> permutation(halfedges.capacity(), false);
 
     // Check valid halfedge permutation
     for(HalfedgeRef h = halfedges_begin(); h != halfedges_end(); h++) {
 
-        if(herased.find(h) != herased.end()) continue;
-
-        if(herased.find(h->next()) != herased.end()) {
-            return {{h, "A live halfedge's next was erased!"}};
-        }
-        if(herased.find(h->twin()) != herased.end()) {
-            return {{h, "A live halfedge's twin was erased!"}};
-        }
-        if(verased.find(h->vertex()) != verased.end()) {
-            return {{h, "A live halfedge's vertex was erased!"}};
-        }
-        if(ferased.find(h->face()) != ferased.end()) {
-            return {{h, "A live halfedge's face was erased!"}};
-        }
-        if(eerased.find(h->edge()) != eerased.end()) {
-            return {{h, "A live halfedge's edge was erased!"}};
-        }
+        if(erasing(h)) continue;
+        if(Problem p = check_links(h)) return p;
 
         // Check whether each halfedge's next points to a unique halfedge
-        if(permutation.find(h->next()) == permutation.end()) {
-            permutation.insert(h->next());
-        } else {
+        if(permutation[h->next().slot()]) {
             return {{h->next(), "A halfedge is the next of multiple halfedges!"}};
         }
+        permutation[h->next().slot()] = true;
     }
 
     for(HalfedgeRef h = halfedges_begin(); h != halfedges_end(); h++) {
 
-        if(herased.find(h) != herased.end()) continue;
+        if(erasing(h)) continue;
 
         // Check whether each halfedge was pointed to by a halfedge
-        if(permutation.find(h) == permutation.end()) {
+        if(!permutation[h.slot()]) {
             return {{h, "A halfedge is the next of zero halfedges!"}};
         }
-
-        // Check twin relationships
-        if(h->twin() == h) {
-            return {{h, "A halfedge's twin is itself!"}};
-        }
-        if(h->twin()->twin() != h) {
-            return {{h, "A halfedge's twin's twin is not itself!"}};
-        }
+        if(Problem p = check_twin(h)) return p;
     }
 
-    // Check whether each halfedge incident on a vertex points to that vertex
     for(VertexRef v = vertices_begin(); v != vertices_end(); v++) {
+        if(erasing(v)) continue;
+        if(Problem p = check_vertex(v)) return p;
+    }
+    for(EdgeRef e = edges_begin(); e != edges_end(); e++) {
+        if(erasing(e)) continue;
+        if(Problem p = check_edge(e)) return p;
+    }
+    for(FaceRef f = faces_begin(); f != faces_end(); f++) {
+        if(erasing(f)) continue;
+        if(Problem p = check_face(f)) return p;
+    }
 
-        if(verased.find(v) != verased.end()) continue;
+    do_erase();
+    return std::nullopt;
+}
 
-        HalfedgeRef h = v->halfedge();
-        if(herased.find(h) != herased.end()) {
-            return {{v, "A vertex's halfedge is erased!"}};
-        }
+std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> Halfedge_Mesh::validate_local() {
 
-        do {
-            if(h->vertex() != v) {
-                return {{h, "A vertex's halfedge does not point to that vertex!"}};
-            }
+    assert(logging);
+
+    // The halfedges around each changed vertex and those of created elements,
+    // then the rest of their faces. Walks give up after visiting every halfedge,
+    // since the links they follow haven't been checked yet.
+    std::unordered_set<unsigned int> seen;
+    std::vector<HalfedgeRef> local;
+    auto add = [&](HalfedgeRef h) {
+        if(!erasing(h) && seen.insert(h->id()).second) local.push_back(h);
+    };
+
+    for(VertexRef v : changed_vertices()) {
+        HalfedgeRef h = v->halfedge();
+        for(size_t steps = 0; steps <= halfedges.size() && !erasing(h); steps++) {
+            add(h);
+            add(h->twin());
             h = h->twin()->next();
-        } while(h != v->halfedge());
+            if(h == v->halfedge()) break;
+        }
+    }
+    for(auto h = halfedges.end();
+        h != halfedges.begin() && std::prev(h)->id() >= log.first_new_id;) {
+        add(--h);
+    }
+    for(auto e = edges.end(); e != edges.begin() && std::prev(e)->id() >= log.first_new_id;) {
+        if(!erasing(--e)) add(e->halfedge());
+    }
+    for(auto f = faces.end(); f != faces.begin() && std::prev(f)->id() >= log.first_new_id;) {
+        if(!erasing(--f)) add(f->halfedge());
     }
 
-    // Check whether each halfedge incident on an edge points to that edge
-    for(EdgeRef e = edges_begin(); e != edges_end(); e++) {
-
-        if(eerased.find(e) != eerased.end()) continue;
+    // Each halfedge's next loop must close without passing through any halfedge
+    // twice, which makes each halfedge on it the next of exactly one other
+    std::unordered_set<unsigned int> looped;
+    for(size_t i = 0; i < local.size(); i++) {
 
-        HalfedgeRef h = e->halfedge();
-        if(herased.find(h) != herased.end()) {
-            return {{e, "An edge's halfedge is erased!"}};
-        }
+        HalfedgeRef h = local[i];
+        if(looped.count(h->id())) continue;
 
+        std::unordered_set<unsigned int> loop;
+        HalfedgeRef l = h;
         do {
-            if(h->edge() != e) {
-                return {{h, "An edge's halfedge does not point to that edge!"}};
+            if(Problem p = check_links(l)) return p;
+            if(!loop.insert(l->id()).second) {
+                return {{l, "A halfedge is the next of multiple halfedges!"}};
             }
-            h = h->twin();
-        } while(h != e->halfedge());
+            add(l);
+            l = l->next();
+        } while(l != h);
+        looped.insert(loop.begin(), loop.end());
     }
 
-    // Check whether each halfedge incident on a face points to that face
-    for(FaceRef f = faces_begin(); f != faces_end(); f++) {
-
-        if(ferased.find(f) != ferased.end()) continue;
-
-        HalfedgeRef h = f->halfedge();
-        if(herased.find(h) != herased.end()) {
-            return {{f, "A face's halfedge is erased!"}};
-        }
+    std::vector<VertexRef> local_verts;
+    std::vector<EdgeRef> local_edges;
+    std::vector<FaceRef> local_faces;
+    for(HalfedgeRef h : local) {
+        if(Problem p = check_twin(h)) return p;
+        if(seen.insert(h->vertex()->id()).second) local_verts.push_back(h->vertex());
+        if(seen.insert(h->edge()->id()).second) local_edges.push_back(h->edge());
+        if(seen.insert(h->face()->id()).second) local_faces.push_back(h->face());
+    }
 
-        do {
-            if(h->face() != f) {
-                return {{h, "A face's halfedge does not point to that face!"}};
-            }
-            h = h->next();
-        } while(h != f->halfedge());
+    for(VertexRef v : local_verts) {
+        Vec3 p = v->pos;
+        bool finite = std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z);
+        if(!finite) return {{v, "A vertex position was set to a non-finite value."}};
     }
+    for(VertexRef v : local_verts) {
+        if(Problem p = check_vertex(v)) return p;
+    }
+    for(EdgeRef e : local_edges) {
+        if(Problem p = check_edge(e)) return p;
+    }
+    for(FaceRef f : local_faces) {
+        if(Problem p = check_face(f)) return p;
+    }
+
+    do_erase();
+    return std::nullopt;
+}
 
+std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> Halfedge_Mesh::checkpoint() {
+#if !defined(NDEBUG) || defined(SCOTTY3D_MESH_CHECKS)
+    return validate();
+#else
     do_erase();
     return std::nullopt;
+#endif
 }
 
 void Halfedge_Mesh::do_erase() {
+    if(logging) {
+        log_around.erase(std::remove_if(log_around.begin(), log_around.end(),
+                                        [this](VertexRef v) { return erasing(v); }),
+                         log_around.end());
+        for(auto& v : verased) log.erased.push_back(v->id());
+        for(auto& e : eerased) log.erased.push_back(e->id());
+        for(auto& f : ferased) log.erased.push_back(f->id());
+        for(auto& h : herased) log.erased.push_back(h->id());
+    }
+    if(recording) {
+        // Elements both created and erased by the op don't concern the delta
+        auto record = [this](unsigned int id) {
+            if(id < delta.before.next_id) delta.erased.push_back(id);
+        };
+        for(auto& v : verased) record(v->id());
+        for(auto& e : eerased) record(e->id());
+        for(auto& f : ferased) record(f->id());
+        for(auto& h : herased) record(h->id());
+    }
     for(auto& v : verased) {
         vertices.erase(v);
     }
@@ -501,6 +939,502 @@ void Halfedge_Mesh::do_erase() {
     herased.clear();
 }
 
+void Halfedge_Mesh::begin_change_log(ElementRef elem) {
+
+    logging = true;
+    log = {};
+    log.first_new_id = next_id;
+    log_around = around(elem);
+}
+
+std::vector<Halfedge_Mesh::VertexRef> Halfedge_Mesh::around(ElementRef elem) {
+
+    // The vertices of every face around the element's vertices
+    std::vector<VertexRef> verts;
+    std::visit(overloaded{[&](VertexRef vert) { verts.push_back(vert); },
+                          [&](EdgeRef edge) {
+                              verts.push_back(edge->halfedge()->vertex());
+                              verts.push_back(edge->halfedge()->twin()->vertex());
+                          },
+                          [&](HalfedgeRef halfedge) {
+                              verts.push_back(halfedge->vertex());
+                              verts.push_back(halfedge->twin()->vertex());
+                          },
+                          [&](FaceRef face) {
+                              HalfedgeRef h = face->halfedge();
+                              do {
+                                  verts.push_back(h->vertex());
+                                  h = h->next();
+                              } while(h != face->halfedge());
+                          }},
+               elem);
+
+    std::unordered_set<unsigned int> seen;
+    std::vector<VertexRef> ret;
+    auto add = [&](VertexRef v) {
+        if(seen.insert(v->id()).second) ret.push_back(v);
+    };
+    for(VertexRef v : verts) {
+        add(v);
+        HalfedgeRef h = v->halfedge();
+        do {
+            add(h->twin()->vertex());
+            if(!h->face()->is_boundary()) {
+                HalfedgeRef fh = h->face()->halfedge();
+                do {
+                    add(fh->vertex());
+                    fh = fh->next();
+                } while(fh != h->face()->halfedge());
+            }
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+    }
+    return ret;
+}
+
+Halfedge_Mesh::Change_Log Halfedge_Mesh::end_change_log() {
+    logging = false;
+    log.end_id = next_id;
+    for(VertexRef v : log_around) log.around.push_back(v->id());
+    log_around.clear();
+    return std::move(log);
+}
+
+std::vector<Halfedge_Mesh::VertexRef> Halfedge_Mesh::changed_vertices() {
+
+    std::unordered_set<unsigned int> seen;
+    std::vector<VertexRef> verts;
+    auto add = [&](VertexRef v) {
+        if(!erasing(v) && seen.insert(v->id()).second) verts.push_back(v);
+    };
+
+    for(VertexRef v : log_around) add(v);
+
+    // Created elements sit at the end of their lists
+    for(auto v = vertices.end(); v != vertices.begin() && std::prev(v)->id() >= log.first_new_id;) {
+        add(--v);
+    }
+    for(auto h = halfedges.end();
+        h != halfedges.begin() && std::prev(h)->id() >= log.first_new_id;) {
+        if(!erasing(--h)) add(h->vertex());
+    }
+    return verts;
+}
+
+// Records where elements sit in storage, for Delta::State::slots
+template<typename... R> static void note_slots(Halfedge_Mesh::Delta::State& state, R... refs) {
+    (state.slots.push_back({refs->id(), refs.slot()}), ...);
+}
+
+// Calls f on every id a delta state mentions, whether as an element or a neighbor
+template<typename F> static void for_each_id(const Halfedge_Mesh::Delta::State& state, F&& f) {
+    for(const auto& v : state.vertices) {
+        f(v.id);
+        f(v.halfedge);
+    }
+    for(const auto& e : state.edges) {
+        f(e.id);
+        f(e.halfedge);
+    }
+    for(const auto& fc : state.faces) {
+        f(fc.id);
+        f(fc.halfedge);
+    }
+    for(const auto& h : state.halfedges) {
+        f(h.id);
+        f(h.next);
+        f(h.twin);
+        f(h.vertex);
+        f(h.edge);
+        f(h.face);
+    }
+}
+
+// Sorts a state's slots by id, keeping one for each id the state still mentions
+static void finish_slots(Halfedge_Mesh::Delta::State& state) {
+
+    std::vector<unsigned int> ids;
+    for_each_id(state, [&](unsigned int id) { ids.push_back(id); });
+    std::sort(ids.begin(), ids.end());
+
+    auto& slots = state.slots;
+    std::sort(slots.begin(), slots.end());
+    auto unused = [&](const std::pair<unsigned int, uint32_t>& s) {
+        return !std::binary_search(ids.begin(), ids.end(), s.first);
+    };
+    slots.erase(std::remove_if(slots.begin(), slots.end(), unused), slots.end());
+    auto same_id = [](const auto& a, const auto& b) { return a.first == b.first; };
+    slots.erase(std::unique(slots.begin(), slots.end(), same_id), slots.end());
+    slots.shrink_to_fit();
+}
+
+void Halfedge_Mesh::begin_delta(ElementRef elem) {
+
+    recording = true;
+    delta = {};
+    delta.before.next_id = next_id;
+    delta_vertices.clear();
+    delta_edges.clear();
+    delta_faces.clear();
+    delta_halfedges.clear();
+
+    // Ids are unique across element types, so one set covers them all
+    std::unordered_set<unsigned int> seen;
+    auto add_vertex = [&](VertexRef v) {
+        if(!seen.insert(v->id()).second) return;
+        delta_vertices.push_back(v);
+        delta.before.vertices.push_back({v->id(), v->halfedge()->id(), v->pos});
+        note_slots(delta.before, v, v->halfedge());
+    };
+    auto add_edge = [&](EdgeRef e) {
+        if(!seen.insert(e->id()).second) return;
+        delta_edges.push_back(e);
+        delta.before.edges.push_back({e->id(), e->halfedge()->id()});
+        note_slots(delta.before, e, e->halfedge());
+    };
+    auto add_face = [&](FaceRef f) {
+        if(!seen.insert(f->id()).second) return false;
+        delta_faces.push_back(f);
+        delta.before.faces.push_back({f->id(), f->halfedge()->id(), f->boundary});
+        note_slots(delta.before, f, f->halfedge());
+        return true;
+    };
+    auto add_halfedge = [&](HalfedgeRef h) {
+        if(!seen.insert(h->id()).second) return;
+        delta_halfedges.push_back(h);
+        delta.before.halfedges.push_back({h->id(), h->next()->id(), h->twin()->id(),
+                                          h->vertex()->id(), h->edge()->id(), h->face()->id()});
+        note_slots(delta.before, h, h->next(), h->twin(), h->vertex(), h->edge(), h->face());
+    };
+
+    // Every face (boundary loops included) around the vertices near elem, along with
+    // everything on it and the twins of its halfedges
+    for(VertexRef v : around(elem)) {
+        add_vertex(v);
+        HalfedgeRef h = v->halfedge();
+        do {
+            FaceRef f = h->face();
+            if(add_face(f)) {
+                HalfedgeRef fh = f->halfedge();
+                do {
+                    add_halfedge(fh);
+                    add_halfedge(fh->twin());
+                    add_vertex(fh->vertex());
+                    add_edge(fh->edge());
+                    fh = fh->next();
+                } while(fh != f->halfedge());
+            }
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+    }
+}
+
+static bool same(const Halfedge_Mesh::Delta::Vertex_State& a,
+                 const Halfedge_Mesh::Delta::Vertex_State& b) {
+    return a.id == b.id && a.halfedge == b.halfedge && a.pos == b.pos;
+}
+static bool same(const Halfedge_Mesh::Delta::Edge_State& a,
+                 const Halfedge_Mesh::Delta::Edge_State& b) {
+    return a.id == b.id && a.halfedge == b.halfedge;
+}
+static bool same(const Halfedge_Mesh::Delta::Face_State& a,
+                 const Halfedge_Mesh::Delta::Face_State& b) {
+    return a.id == b.id && a.halfedge == b.halfedge && a.boundary == b.boundary;
+}
+static bool same(const Halfedge_Mesh::Delta::Halfedge_State& a,
+                 const Halfedge_Mesh::Delta::Halfedge_State& b) {
+    return a.id == b.id && a.next == b.next && a.twin == b.twin && a.vertex == b.vertex &&
+           a.edge == b.edge && a.face == b.face;
+}
+
+// Drops the elements of a delta's before state that came through unchanged, and
+// records the after state of the rest that survived
+template<typename S, typename R, typename F>
+static void keep_changed(std::vector<S>& before, const std::vector<R>& refs,
+                         const std::vector<unsigned int>& erased, std::vector<S>& after,
+                         F&& state_of) {
+    size_t kept = 0;
+    for(size_t i = 0; i < before.size(); i++) {
+        if(!std::binary_search(erased.begin(), erased.end(), before[i].id)) {
+            S now = state_of(refs[i]);
+            if(same(now, before[i])) continue;
+            after.push_back(now);
+        }
+        before[kept++] = before[i];
+    }
+    before.resize(kept);
+    before.shrink_to_fit();
+}
+
+Halfedge_Mesh::Delta Halfedge_Mesh::end_delta() {
+
+    assert(recording);
+    do_erase();
+    recording = false;
+    std::sort(delta.erased.begin(), delta.erased.end());
+
+    Delta::State& after = delta.after;
+    auto vertex_state = [&](VertexRef v) {
+        note_slots(after, v, v->halfedge());
+        return Delta::Vertex_State{v->id(), v->halfedge()->id(), v->pos};
+    };
+    auto edge_state = [&](EdgeRef e) {
+        note_slots(after, e, e->halfedge());
+        return Delta::Edge_State{e->id(), e->halfedge()->id()};
+    };
+    auto face_state = [&](FaceRef f) {
+        note_slots(after, f, f->halfedge());
+        return Delta::Face_State{f->id(), f->halfedge()->id(), f->boundary};
+    };
+    auto halfedge_state = [&](HalfedgeRef h) {
+        note_slots(after, h, h->next(), h->twin(), h->vertex(), h->edge(), h->face());
+        return Delta::Halfedge_State{h->id(),           h->next()->id(), h->twin()->id(),
+                                     h->vertex()->id(), h->edge()->id(), h->face()->id()};
+    };
+
+    keep_changed(delta.before.vertices, delta_vertices, delta.erased, after.vertices,
+                 vertex_state);
+    keep_changed(delta.before.edges, delta_edges, delta.erased, after.edges, edge_state);
+    keep_changed(delta.before.faces, delta_faces, delta.erased, after.faces, face_state);
+    keep_changed(delta.before.halfedges, delta_halfedges, delta.erased, after.halfedges,
+                 halfedge_state);
+
+    // Created elements sit at the end of their lists
+    unsigned int first_new = delta.before.next_id;
+    for(auto v = vertices.end(); v != vertices.begin() && std::prev(v)->id() >= first_new;) {
+        after.vertices.push_back(vertex_state(--v));
+    }
+    for(auto e = edges.end(); e != edges.begin() && std::prev(e)->id() >= first_new;) {
+        after.edges.push_back(edge_state(--e));
+    }
+    for(auto f = faces.end(); f != faces.begin() && std::prev(f)->id() >= first_new;) {
+        after.faces.push_back(face_state(--f));
+    }
+    for(auto h = halfedges.end(); h != halfedges.begin() && std::prev(h)->id() >= first_new;) {
+        after.halfedges.push_back(halfedge_state(--h));
+    }
+    after.next_id = next_id;
+    finish_slots(delta.before);
+    finish_slots(after);
+
+    delta_vertices.clear();
+    delta_edges.clear();
+    delta_faces.clear();
+    delta_halfedges.clear();
+    return std::move(delta);
+}
+
+void Halfedge_Mesh::undo(const Delta& d) {
+    apply(d.before, d.after, {}, d.erased);
+}
+
+void Halfedge_Mesh::redo(const Delta& d) {
+    apply(d.after, d.before, d.erased, {});
+}
+
+void Halfedge_Mesh::apply(const Delta::State& state, const Delta::State& from,
+                          const std::vector<unsigned int>& state_erased,
+                          const std::vector<unsigned int>& from_erased) {
+
+    do_erase();
+
+    // The mesh is in the other state of the delta, from. Ids at or past a state's
+    // next_id, or erased on the way to it, don't exist in that state.
+    auto absent = [](const Delta::State& s, const std::vector<unsigned int>& erased,
+                     unsigned int id) {
+        return id >= s.next_id || std::binary_search(erased.begin(), erased.end(), id);
+    };
+    auto slot_of = [](const Delta::State& s, unsigned int id) {
+        auto it = std::lower_bound(s.slots.begin(), s.slots.end(),
+                                   std::pair<unsigned int, uint32_t>{id, 0});
+        return it != s.slots.end() && it->first == id ? it->second : UINT32_MAX;
+    };
+
+    std::unordered_map<unsigned int, VertexRef> vmap;
+    std::unordered_map<unsigned int, EdgeRef> emap;
+    std::unordered_map<unsigned int, FaceRef> fmap;
+    std::unordered_map<unsigned int, HalfedgeRef> hmap;
+
+    // Unless the mesh has been copied or compacted since, every element involved
+    // is still in the slot it was recorded in
+    bool found = true;
+    auto find = [&](auto& list, auto& map, const Delta::State& s, unsigned int id) {
+        if(!found || map.count(id)) return;
+        auto it = list.find_slot(slot_of(s, id));
+        if(it != list.end() && it->id() == id) {
+            map.emplace(id, it);
+        } else {
+            found = false;
+        }
+    };
+    // What the state needs that exists now
+    auto want = [&](auto& list, auto& map, unsigned int id) {
+        if(!absent(from, from_erased, id)) find(list, map, state, id);
+    };
+    for(const auto& v : state.vertices) {
+        want(vertices, vmap, v.id);
+        want(halfedges, hmap, v.halfedge);
+    }
+    for(const auto& e : state.edges) {
+        want(edges, emap, e.id);
+        want(halfedges, hmap, e.halfedge);
+    }
+    for(const auto& f : state.faces) {
+        want(faces, fmap, f.id);
+        want(halfedges, hmap, f.halfedge);
+    }
+    for(const auto& h : state.halfedges) {
+        want(halfedges, hmap, h.id);
+        want(halfedges, hmap, h.next);
+        want(halfedges, hmap, h.twin);
+        want(vertices, vmap, h.vertex);
+        want(edges, emap, h.edge);
+        want(faces, fmap, h.face);
+    }
+
+    // What exists now that the state doesn't have
+    std::vector<VertexRef> dead_vertices;
+    std::vector<EdgeRef> dead_edges;
+    std::vector<FaceRef> dead_faces;
+    std::vector<HalfedgeRef> dead_halfedges;
+    auto doomed = [&](auto& list, auto& dead, const auto& states) {
+        std::unordered_map<unsigned int, typename std::decay_t<decltype(dead)>::value_type> map;
+        for(const auto& s : states) {
+            if(!absent(state, state_erased, s.id)) continue;
+            find(list, map, from, s.id);
+            if(found) dead.push_back(map.at(s.id));
+        }
+    };
+    doomed(vertices, dead_vertices, from.vertices);
+    doomed(edges, dead_edges, from.edges);
+    doomed(faces, dead_faces, from.faces);
+    doomed(halfedges, dead_halfedges, from.halfedges);
+
+    if(found) {
+        for(VertexRef v : dead_vertices) vertices.erase(v);
+        for(EdgeRef e : dead_edges) edges.erase(e);
+        for(FaceRef f : dead_faces) faces.erase(f);
+        for(HalfedgeRef h : dead_halfedges) halfedges.erase(h);
+    } else {
+        vmap.clear();
+        emap.clear();
+        fmap.clear();
+        hmap.clear();
+
+        // Every id the state mentions is below its next_id
+        enum : uint8_t { unused, wanted, dropped };
+        std::vector<uint8_t> mark(state.next_id, unused);
+        for_each_id(state, [&](unsigned int id) { mark[id] = wanted; });
+        for(unsigned int id : state_erased) mark[id] = dropped;
+
+        // Find the elements we need in one pass over the mesh, erasing as we go
+        auto scan = [&](auto& list, auto& map) {
+            for(auto it = list.begin(); it != list.end();) {
+                auto cur = it++;
+                unsigned int id = cur->id();
+                if(id >= state.next_id || mark[id] == dropped) {
+                    list.erase(cur);
+                } else if(mark[id] == wanted) {
+                    map.emplace(id, cur);
+                }
+            }
+        };
+        scan(vertices, vmap);
+        scan(edges, emap);
+        scan(faces, fmap);
+        scan(halfedges, hmap);
+    }
+
+    // Bring back whatever is missing, where it used to be if that slot is still
+    // free, then set everything to its recorded state
+    for(const auto& v : state.vertices) {
+        if(!vmap.count(v.id)) {
+            vmap.emplace(v.id, vertices.emplace_at(slot_of(state, v.id), Vertex(v.id)));
+        }
+    }
+    for(const auto& e : state.edges) {
+        if(!emap.count(e.id)) {
+            emap.emplace(e.id, edges.emplace_at(slot_of(state, e.id), Edge(e.id)));
+        }
+    }
+    for(const auto& f : state.faces) {
+        if(!fmap.count(f.id)) {
+            fmap.emplace(f.id, faces.emplace_at(slot_of(state, f.id), Face(f.id, f.boundary)));
+        }
+    }
+    for(const auto& h : state.halfedges) {
+        if(!hmap.count(h.id)) {
+            hmap.emplace(h.id, halfedges.emplace_at(slot_of(state, h.id), Halfedge(h.id)));
+        }
+    }
+
+    for(const auto& v : state.vertices) {
+        VertexRef vert = vmap.at(v.id);
+        vert->_halfedge = hmap.at(v.halfedge);
+        vert->pos = v.pos;
+    }
+    for(const auto& e : state.edges) {
+        emap.at(e.id)->_halfedge = hmap.at(e.halfedge);
+    }
+    for(const auto& f : state.faces) {
+        FaceRef face = fmap.at(f.id);
+        face->_halfedge = hmap.at(f.halfedge);
+        face->boundary = f.boundary;
+    }
+    for(const auto& h : state.halfedges) {
+        hmap.at(h.id)->set_neighbors(hmap.at(h.next), hmap.at(h.twin), vmap.at(h.vertex),
+                                     emap.at(h.edge), fmap.at(h.face));
+    }
+
+    next_id = state.next_id;
+    render_dirty_flag = true;
+}
+
+size_t Halfedge_Mesh::Delta::bytes() const {
+    auto state_bytes = [](const State& s) {
+        return s.vertices.capacity() * sizeof(Vertex_State) +
+               s.edges.capacity() * sizeof(Edge_State) +
+               s.faces.capacity() * sizeof(Face_State) +
+               s.halfedges.capacity() * sizeof(Halfedge_State);
+    };
+    return sizeof(Delta) + state_bytes(before) + state_bytes(after) +
+           (before.slots.capacity() + after.slots.capacity()) *
+               sizeof(std::pair<unsigned int, uint32_t>) +
+           erased.capacity() * sizeof(unsigned int);
+}
+
+size_t Halfedge_Mesh::bytes() const {
+    return sizeof(Halfedge_Mesh) + vertices.bytes() + edges.bytes() + faces.bytes() +
+           halfedges.bytes();
+}
+
+bool Halfedge_Mesh::fragmented() const {
+    // Free slots outnumbering live elements means most of what we walk is holes
+    return halfedges.capacity() > 2 * halfedges.size() ||
+           vertices.capacity() > 2 * vertices.size();
+}
+
+void Halfedge_Mesh::compact() {
+
+    do_erase();
+
+    auto hmap = halfedges.compact();
+    auto vmap = vertices.compact();
+    auto emap = edges.compact();
+    auto fmap = faces.compact();
+
+    for(Halfedge& h : halfedges) {
+        h._next = hmap(h._next);
+        h._twin = hmap(h._twin);
+        h._vertex = vmap(h._vertex);
+        h._edge = emap(h._edge);
+        h._face = fmap(h._face);
+    }
+    for(Vertex& v : vertices) v._halfedge = hmap(v._halfedge);
+    for(Edge& e : edges) e._halfedge = hmap(e._halfedge);
+    for(Face& f : faces) f._halfedge = hmap(f._halfedge);
+}
+
 std::string Halfedge_Mesh::from_mesh(const GL::Mesh& mesh) {
 
     auto idx = mesh.indices();
@@ -526,20 +1460,422 @@ std::string Halfedge_Mesh::from_mesh(const GL::Mesh& mesh) {
     return {};
 }
 
-bool Halfedge_Mesh::subdivide(SubD strategy) {
+// Per-element data, with elements of each kind numbered from zero
+struct Halfedge_Mesh::Flat {
+    // Per halfedge
+    std::vector<uint32_t> next, twin, vertex, edge, face;
+    // Per vertex, edge, and face
+    std::vector<uint32_t> vertex_halfedge, edge_halfedge, face_halfedge;
+    std::vector<Vec3> pos;
+    std::vector<uint8_t> boundary;
+
+    void resize(size_t n_halfedges, size_t n_vertices, size_t n_edges, size_t n_faces) {
+        for(auto* v : {&next, &twin, &vertex, &edge, &face}) v->resize(n_halfedges);
+        vertex_halfedge.resize(n_vertices);
+        pos.resize(n_vertices);
+        edge_halfedge.resize(n_edges);
+        face_halfedge.resize(n_faces);
+        boundary.assign(n_faces, 0);
+    }
+};
 
-    std::vector<std::vector<Index>> polys;
-    std::vector<Vec3> verts;
-    std::unordered_map<unsigned int, Index> layout;
+void Halfedge_Mesh::to_flat(Flat& flat) {
+
+    do_erase();
+
+    Thread_Pool& pool = Thread_Pool::global();
+    const size_t grain = 1024;
+
+    // Number the elements in iteration order, and look those numbers up by slot
+    std::vector<HalfedgeRef> h_refs;
+    std::vector<VertexRef> v_refs;
+    std::vector<EdgeRef> e_refs;
+    std::vector<FaceRef> f_refs;
+    std::vector<uint32_t> h_index(halfedges.capacity()), v_index(vertices.capacity());
+    std::vector<uint32_t> e_index(edges.capacity()), f_index(faces.capacity());
+    h_refs.reserve(halfedges.size());
+    v_refs.reserve(vertices.size());
+    e_refs.reserve(edges.size());
+    f_refs.reserve(faces.size());
+    for(HalfedgeRef h = halfedges_begin(); h != halfedges_end(); h++) {
+        h_index[h.slot()] = (uint32_t)h_refs.size();
+        h_refs.push_back(h);
+    }
+    for(VertexRef v = vertices_begin(); v != vertices_end(); v++) {
+        v_index[v.slot()] = (uint32_t)v_refs.size();
+        v_refs.push_back(v);
+    }
+    for(EdgeRef e = edges_begin(); e != edges_end(); e++) {
+        e_index[e.slot()] = (uint32_t)e_refs.size();
+        e_refs.push_back(e);
+    }
+    for(FaceRef f = faces_begin(); f != faces_end(); f++) {
+        f_index[f.slot()] = (uint32_t)f_refs.size();
+        f_refs.push_back(f);
+    }
+
+    flat.resize(h_refs.size(), v_refs.size(), e_refs.size(), f_refs.size());
+    pool.parallel_for(
+        0, h_refs.size(),
+        [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                HalfedgeRef h = h_refs[i];
+                flat.next[i] = h_index[h->next().slot()];
+                flat.twin[i] = h_index[h->twin().slot()];
+                flat.vertex[i] = v_index[h->vertex().slot()];
+                flat.edge[i] = e_index[h->edge().slot()];
+                flat.face[i] = f_index[h->face().slot()];
+            }
+        },
+        grain);
+    pool.parallel_for(
+        0, v_refs.size(),
+        [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                flat.vertex_halfedge[i] = h_index[v_refs[i]->halfedge().slot()];
+                flat.pos[i] = v_refs[i]->pos;
+            }
+        },
+        grain);
+    for(size_t i = 0; i < e_refs.size(); i++) {
+        flat.edge_halfedge[i] = h_index[e_refs[i]->halfedge().slot()];
+    }
+    for(size_t i = 0; i < f_refs.size(); i++) {
+        flat.face_halfedge[i] = h_index[f_refs[i]->halfedge().slot()];
+        flat.boundary[i] = f_refs[i]->is_boundary();
+    }
+}
+
+void Halfedge_Mesh::from_flat(const Flat& flat) {
+
+    clear();
+
+    Thread_Pool& pool = Thread_Pool::global();
+    const size_t grain = 1024;
+
+    size_t n_halfedges = flat.next.size(), n_vertices = flat.pos.size();
+    size_t n_edges = flat.edge_halfedge.size(), n_faces = flat.face_halfedge.size();
+
+    // Allocation has to be serial, but then every element can be linked independently
+    std::vector<HalfedgeRef> h_refs(n_halfedges);
+    std::vector<VertexRef> v_refs(n_vertices);
+    std::vector<EdgeRef> e_refs(n_edges);
+    std::vector<FaceRef> f_refs(n_faces);
+    halfedges.reserve(n_halfedges);
+    vertices.reserve(n_vertices);
+    edges.reserve(n_edges);
+    faces.reserve(n_faces);
+    for(size_t i = 0; i < n_vertices; i++) v_refs[i] = new_vertex();
+    for(size_t i = 0; i < n_edges; i++) e_refs[i] = new_edge();
+    for(size_t i = 0; i < n_faces; i++) f_refs[i] = new_face(flat.boundary[i]);
+    for(size_t i = 0; i < n_halfedges; i++) h_refs[i] = new_halfedge();
+
+    pool.parallel_for(
+        0, n_halfedges,
+        [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                HalfedgeRef h = h_refs[i];
+                h->next() = h_refs[flat.next[i]];
+                h->twin() = h_refs[flat.twin[i]];
+                h->vertex() = v_refs[flat.vertex[i]];
+                h->edge() = e_refs[flat.edge[i]];
+                h->face() = f_refs[flat.face[i]];
+            }
+        },
+        grain);
+    pool.parallel_for(
+        0, n_vertices,
+        [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                v_refs[i]->halfedge() = h_refs[flat.vertex_halfedge[i]];
+                v_refs[i]->pos = flat.pos[i];
+            }
+        },
+        grain);
+    pool.parallel_for(
+        0, n_edges,
+        [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                e_refs[i]->halfedge() = h_refs[flat.edge_halfedge[i]];
+            }
+        },
+        grain);
+    for(size_t i = 0; i < n_faces; i++) f_refs[i]->halfedge() = h_refs[flat.face_halfedge[i]];
+}
+
+/*
+    Splits every face into quads, one for each of its corners, joining a new vertex
+    on each edge to a new vertex in the middle of the face. Every halfedge h is split
+    into halves 2h (from its vertex) and 2h+1 (from its edge point). Each interior
+    corner c, numbered in halfedge order, adds a spoke pair: from the edge point of
+    the halfedge leaving the corner into the face point, and back out to it. Boundary
+    loops just have their halfedges split.
+
+    New vertices are the old vertices, then edge points, then face points; new edges
+    are the halves of old edges, then spokes; new faces are the quads, then the
+    boundary loops.
+*/
+void Halfedge_Mesh::refine_quads(const Flat& coarse, Flat& fine, bool smooth) {
+
+    Thread_Pool& pool = Thread_Pool::global();
+    const size_t grain = 1024;
+
+    size_t n_halfedges = coarse.next.size(), n_vertices = coarse.pos.size();
+    size_t n_edges = coarse.edge_halfedge.size(), n_faces = coarse.face_halfedge.size();
+
+    // Interior faces and boundary loops are numbered separately
+    std::vector<uint32_t> face_index(n_faces), corner(n_halfedges, UINT32_MAX);
+    uint32_t n_interior = 0, n_boundary = 0, n_corners = 0;
+    for(size_t f = 0; f < n_faces; f++) {
+        face_index[f] = coarse.boundary[f] ? n_boundary++ : n_interior++;
+    }
+    for(size_t h = 0; h < n_halfedges; h++) {
+        if(!coarse.boundary[coarse.face[h]]) corner[h] = n_corners++;
+    }
+
+    uint32_t edge_points = (uint32_t)n_vertices;
+    uint32_t face_points = (uint32_t)(n_vertices + n_edges);
+    uint32_t spokes = (uint32_t)(2 * n_halfedges), spoke_edges = (uint32_t)(2 * n_edges);
+    fine.resize(2 * n_halfedges + 2 * n_corners, n_vertices + n_edges + n_interior,
+                2 * n_edges + n_corners, n_corners + n_boundary);
+
+    // Positions: face points are centroids; edge points and vertices either stay put
+    // or follow the Catmull-Clark rules
+    pool.parallel_for(
+        0, n_faces,
+        [&](size_t begin, size_t end) {
+            for(size_t f = begin; f < end; f++) {
+                if(coarse.boundary[f]) continue;
+                uint32_t h = coarse.face_halfedge[f];
+                Vec3 sum;
+                float degree = 0.0f;
+                do {
+                    sum += coarse.pos[coarse.vertex[h]];
+                    degree += 1.0f;
+                    h = coarse.next[h];
+                } while(h != coarse.face_halfedge[f]);
+                fine.pos[face_points + face_index[f]] = sum / degree;
+            }
+        },
+        grain);
+    pool.parallel_for(
+        0, n_edges,
+        [&](size_t begin, size_t end) {
+            for(size_t e = begin; e < end; e++) {
+                uint32_t h = coarse.edge_halfedge[e], t = coarse.twin[h];
+                Vec3 mid = coarse.pos[coarse.vertex[h]] + coarse.pos[coarse.vertex[t]];
+                if(smooth) {
+                    mid += fine.pos[face_points + face_index[coarse.face[h]]];
+                    mid += fine.pos[face_points + face_index[coarse.face[t]]];
+                    fine.pos[edge_points + e] = mid / 4.0f;
+                } else {
+                    fine.pos[edge_points + e] = mid / 2.0f;
+                }
+            }
+        },
+        grain);
+    pool.parallel_for(
+        0, n_vertices,
+        [&](size_t begin, size_t end) {
+            for(size_t v = begin; v < end; v++) {
+                Vec3 p = coarse.pos[v];
+                if(!smooth) {
+                    fine.pos[v] = p;
+                    continue;
+                }
+                // Average of the surrounding face points (q) and edge midpoints (r)
+                Vec3 q, r;
+                float n = 0.0f;
+                uint32_t h = coarse.vertex_halfedge[v];
+                do {
+                    q += fine.pos[face_points + face_index[coarse.face[h]]];
+                    r += (p + coarse.pos[coarse.vertex[coarse.twin[h]]]) / 2.0f;
+                    n += 1.0f;
+                    h = coarse.next[coarse.twin[h]];
+                } while(h != coarse.vertex_halfedge[v]);
+                fine.pos[v] = (q / n + 2.0f * r / n + (n - 3.0f) * p) / n;
+            }
+        },
+        grain);
+
+    // Connectivity: each old halfedge fills in its halves and its corner's spokes
+    pool.parallel_for(
+        0, n_halfedges,
+        [&](size_t begin, size_t end) {
+            for(size_t h = begin; h < end; h++) {
+
+                uint32_t next = coarse.next[h], twin = coarse.twin[h], e = coarse.edge[h];
+                uint32_t first = 2 * (uint32_t)h, second = first + 1;
+                bool leads = coarse.edge_halfedge[e] == h;
+
+                fine.vertex[first] = coarse.vertex[h];
+                fine.vertex[second] = edge_points + e;
+                fine.twin[first] = 2 * twin + 1;
+                fine.twin[second] = 2 * twin;
+                fine.edge[first] = 2 * e + !leads;
+                fine.edge[second] = 2 * e + leads;
+                fine.next[second] = 2 * next;
+
+                if(corner[h] == UINT32_MAX) {
+                    fine.next[first] = second;
+                    fine.face[first] = fine.face[second] =
+                        n_corners + face_index[coarse.face[h]];
+                    continue;
+                }
+
+                // The quad of this corner runs (second half of the previous halfedge),
+                // first, out, in; the quad of the next corner runs second, ...
+                uint32_t quad = corner[h], next_quad = corner[next];
+                uint32_t out = spokes + 2 * quad, in = out + 1;
+                fine.next[first] = out;
+                fine.next[in] = second;
+                fine.next[spokes + 2 * next_quad] = in;
+                fine.face[first] = fine.face[out] = quad;
+                fine.face[second] = fine.face[in] = next_quad;
+                fine.twin[out] = in;
+                fine.twin[in] = out;
+                fine.vertex[out] = edge_points + e;
+                fine.vertex[in] = face_points + face_index[coarse.face[h]];
+                fine.edge[out] = fine.edge[in] = spoke_edges + quad;
+                fine.edge_halfedge[spoke_edges + quad] = out;
+                fine.face_halfedge[quad] = first;
+            }
+        },
+        grain);
+
+    for(size_t v = 0; v < n_vertices; v++) {
+        fine.vertex_halfedge[v] = 2 * coarse.vertex_halfedge[v];
+    }
+    for(size_t e = 0; e < n_edges; e++) {
+        uint32_t h = coarse.edge_halfedge[e];
+        fine.edge_halfedge[2 * e] = 2 * h;
+        fine.edge_halfedge[2 * e + 1] = 2 * h + 1;
+        fine.vertex_halfedge[edge_points + e] = 2 * h + 1;
+    }
+    for(size_t f = 0; f < n_faces; f++) {
+        uint32_t h = coarse.face_halfedge[f];
+        if(coarse.boundary[f]) {
+            fine.face_halfedge[n_corners + face_index[f]] = 2 * h;
+            fine.boundary[n_corners + face_index[f]] = 1;
+        } else {
+            fine.vertex_halfedge[face_points + face_index[f]] = spokes + 2 * corner[h] + 1;
+        }
+    }
+}
+
+/*
+    Splits every triangle of a closed triangle mesh into four, placing the vertices
+    by the Loop rules. Halfedges are split into halves as in refine_quads(); then each
+    halfedge h adds the pair 2H+2h, running from its edge point to the previous
+    halfedge's edge point (cutting off h's corner), and 2H+2h+1 going back (inside
+    the middle triangle).
+
+    New vertices are the old vertices, then edge points; new edges are the halves of
+    old edges, then one per corner; new faces are the corners, then the middles.
+*/
+void Halfedge_Mesh::refine_loop(const Flat& coarse, Flat& fine) {
+
+    Thread_Pool& pool = Thread_Pool::global();
+    const size_t grain = 1024;
+
+    size_t n_halfedges = coarse.next.size(), n_vertices = coarse.pos.size();
+    size_t n_edges = coarse.edge_halfedge.size(), n_faces = coarse.face_halfedge.size();
+
+    uint32_t edge_points = (uint32_t)n_vertices;
+    uint32_t cuts = (uint32_t)(2 * n_halfedges), cut_edges = (uint32_t)(2 * n_edges);
+    uint32_t middles = (uint32_t)n_halfedges;
+    fine.resize(4 * n_halfedges, n_vertices + n_edges, 2 * n_edges + n_halfedges,
+                n_halfedges + n_faces);
+
+    pool.parallel_for(
+        0, n_vertices,
+        [&](size_t begin, size_t end) {
+            for(size_t v = begin; v < end; v++) {
+                Vec3 sum;
+                float n = 0.0f;
+                uint32_t h = coarse.vertex_halfedge[v];
+                do {
+                    sum += coarse.pos[coarse.vertex[coarse.twin[h]]];
+                    n += 1.0f;
+                    h = coarse.next[coarse.twin[h]];
+                } while(h != coarse.vertex_halfedge[v]);
+                float u = n == 3.0f ? 3.0f / 16.0f : 3.0f / (8.0f * n);
+                fine.pos[v] = (1.0f - n * u) * coarse.pos[v] + u * sum;
+            }
+        },
+        grain);
+    pool.parallel_for(
+        0, n_edges,
+        [&](size_t begin, size_t end) {
+            for(size_t e = begin; e < end; e++) {
+                uint32_t h = coarse.edge_halfedge[e], t = coarse.twin[h];
+                Vec3 a = coarse.pos[coarse.vertex[h]], b = coarse.pos[coarse.vertex[t]];
+                Vec3 c = coarse.pos[coarse.vertex[coarse.next[coarse.next[h]]]];
+                Vec3 d = coarse.pos[coarse.vertex[coarse.next[coarse.next[t]]]];
+                fine.pos[edge_points + e] = 3.0f / 8.0f * (a + b) + 1.0f / 8.0f * (c + d);
+            }
+        },
+        grain);
+
+    pool.parallel_for(
+        0, n_halfedges,
+        [&](size_t begin, size_t end) {
+            for(size_t h = begin; h < end; h++) {
+
+                uint32_t next = coarse.next[h], twin = coarse.twin[h], e = coarse.edge[h];
+                uint32_t first = 2 * (uint32_t)h, second = first + 1;
+                uint32_t cut = cuts + 2 * (uint32_t)h, back = cut + 1;
+                uint32_t next_cut = cuts + 2 * next;
+                bool leads = coarse.edge_halfedge[e] == h;
+
+                fine.vertex[first] = coarse.vertex[h];
+                fine.vertex[second] = edge_points + e;
+                fine.twin[first] = 2 * twin + 1;
+                fine.twin[second] = 2 * twin;
+                fine.edge[first] = 2 * e + !leads;
+                fine.edge[second] = 2 * e + leads;
+
+                // The corner triangle at h's vertex runs (second half of the previous
+                // halfedge), first, cut; the next corner's runs second, ...
+                fine.next[first] = cut;
+                fine.next[second] = 2 * next;
+                fine.next[next_cut] = second;
+                fine.next[back] = next_cut + 1;
+                fine.face[first] = fine.face[cut] = (uint32_t)h;
+                fine.face[second] = next;
+                fine.face[back] = middles + coarse.face[h];
+                fine.twin[cut] = back;
+                fine.twin[back] = cut;
+                fine.vertex[cut] = edge_points + e;
+                fine.vertex[next_cut + 1] = edge_points + e;
+                fine.edge[cut] = fine.edge[back] = cut_edges + (uint32_t)h;
+                fine.edge_halfedge[cut_edges + h] = cut;
+                fine.face_halfedge[h] = first;
+            }
+        },
+        grain);
+
+    for(size_t v = 0; v < n_vertices; v++) {
+        fine.vertex_halfedge[v] = 2 * coarse.vertex_halfedge[v];
+    }
+    for(size_t e = 0; e < n_edges; e++) {
+        uint32_t h = coarse.edge_halfedge[e];
+        fine.edge_halfedge[2 * e] = 2 * h;
+        fine.edge_halfedge[2 * e + 1] = 2 * h + 1;
+        fine.vertex_halfedge[edge_points + e] = 2 * h + 1;
+    }
+    for(size_t f = 0; f < n_faces; f++) {
+        fine.face_halfedge[middles + f] = cuts + 2 * coarse.face_halfedge[f] + 1;
+    }
+}
+
+bool Halfedge_Mesh::subdivide(SubD strategy, size_t levels) {
 
     switch(strategy) {
-    case SubD::linear: {
-        linear_subdivide_positions();
-    } break;
+    case SubD::linear: break;
 
     case SubD::catmullclark: {
         if(has_boundary()) return false;
-        catmullclark_subdivide_positions();
     } break;
 
     case SubD::loop: {
@@ -547,50 +1883,41 @@ bool Halfedge_Mesh::subdivide(SubD strategy) {
         for(FaceRef f = faces_begin(); f != faces_end(); f++) {
             if(f->degree() != 3) return false;
         }
-        loop_subdivide();
-        return true;
     } break;
 
     default: assert(false);
     }
 
-    Index idx = 0;
-    size_t nV = vertices.size();
-    size_t nE = edges.size();
-    size_t nF = faces.size() - n_boundaries();
-    verts.resize(nV + nE + nF);
-
-    for(VertexRef v = vertices_begin(); v != vertices_end(); v++, idx++) {
-        verts[idx] = v->new_pos;
-        layout[v->id()] = idx;
-    }
-    for(EdgeRef e = edges_begin(); e != edges_end(); e++, idx++) {
-        verts[idx] = e->new_pos;
-        layout[e->id()] = idx;
-    }
-    for(FaceRef f = faces_begin(); f != faces_end(); f++) {
-        if(f->is_boundary()) continue;
-        verts[idx] = f->new_pos;
-        layout[f->id()] = idx;
-        idx++;
+    // Each level is refined straight from the last one's arrays, so only the final
+    // mesh is ever built out of elements
+    Flat coarse, fine;
+    to_flat(coarse);
+    for(size_t i = 0; i < levels; i++) {
+        if(strategy == SubD::loop) {
+            refine_loop(coarse, fine);
+        } else {
+            refine_quads(coarse, fine, strategy == SubD::catmullclark);
+        }
+        std::swap(coarse, fine);
     }
+    from_flat(coarse);
+    return true;
+}
 
-    for(auto f = faces_begin(); f != faces_end(); f++) {
-        if(f->is_boundary()) continue;
-        Index i = layout[f->id()];
-        HalfedgeRef h = f->halfedge();
-        do {
-            Index j = layout[h->edge()->id()];
-            Index k = layout[h->next()->vertex()->id()];
-            Index l = layout[h->next()->edge()->id()];
-            std::vector<Index> quad = {i, j, k, l};
-            polys.push_back(quad);
-            h = h->next();
-        } while(h != f->halfedge());
+// Whether a polygon has at least three vertices, all distinct
+static bool polygon_valid(const std::vector<Halfedge_Mesh::Index>& polygon) {
+    if(polygon.size() < 3) return false;
+    if(polygon.size() <= 16) {
+        for(size_t i = 0; i < polygon.size(); i++) {
+            for(size_t j = i + 1; j < polygon.size(); j++) {
+                if(polygon[i] == polygon[j]) return false;
+            }
+        }
+        return true;
     }
-
-    from_poly(polys, verts);
-    return true;
+    std::vector<Halfedge_Mesh::Index> sorted = polygon;
+    std::sort(sorted.begin(), sorted.end());
+    return std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end();
 }
 
 std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& polygons,
@@ -603,10 +1930,8 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
     // must have at least three vertices.  Note that there are no special conditions
     // on the vertex indices, i.e., they do not have to start at 0 or 1, nor does
     // the collection of indices have to be contiguous.  Overall, this initializer
-    // is designed to be robust but perhaps not incredibly fast (though of course
-    // this does not affect the performance of the resulting data structure).  One
-    // could also implement faster initializers that handle important special cases
-    // (e.g., all triangles, or data that is known to be manifold). Since there are
+    // is designed to be robust, and runs in time close to linear in the size of
+    // the input by matching twins with a sort rather than an ordered map. Since there are
     // no strong conditions on the indices of polygons, we assume that the list of
     // vertex positions is given in lexicographic order (i.e., that the lowest index
     // appearing in any polygon corresponds to the first entry of the list of
@@ -614,37 +1939,29 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
 
     // define some types, to improve readability
     typedef std::vector<Index> IndexList;
-    typedef IndexList::const_iterator IndexListCRef;
-    typedef std::vector<IndexList> PolygonList;
-    typedef PolygonList::const_iterator PolygonListCRef;
-    typedef std::pair<Index, Index> IndexPair; // ordered pair of vertex indices,
-                                               // corresponding to an edge of an
-                                               // oriented polygon
 
     // Clear any existing elements.
     clear();
 
-    // Since the vertices in our halfedge mesh are stored in a linked list,
-    // we will temporarily need to keep track of the correspondence between
-    // indices of vertices in our input and pointers to vertices in the new
-    // mesh (which otherwise can't be accessed by index).  Note that since
-    // we're using a general-purpose map (rather than, say, a vector), we can
-    // be a bit more flexible about the indexing scheme: input vertex indices
-    // aren't required to be 0-based or 1-based; in fact, the set of indices
-    // doesn't even have to be contiguous.  Taking advantage of this fact makes
-    // our conversion a bit more robust to different types of input, including
-    // data that comes from a subset of a full mesh.
-
-    // maps a vertex index to the corresponding vertex
-    std::map<Index, VertexRef> indexToVertex;
-
-    // Also store the vertex degree, i.e., the number of polygons that use each
-    // vertex; this information will be used to check that the mesh is manifold.
-    std::map<VertexRef, Size> vertexDegree;
+    Size nPolygons = polygons.size();
+    Thread_Pool& pool = Thread_Pool::global();
+
+    // First, we do some basic sanity checks on the input. Polygons are checked
+    // independently, so this pass is spread over the thread pool; we report the
+    // first bad polygon, just as a serial pass would.
+    Size bad = pool.parallel_reduce(
+        0, nPolygons, nPolygons,
+        [&](size_t lo, size_t hi) {
+            for(size_t p = lo; p < hi; p++) {
+                if(!polygon_valid(polygons[p])) return p;
+            }
+            return nPolygons;
+        },
+        [](size_t a, size_t b) { return std::min(a, b); }, 1024);
 
-    // First, we do some basic sanity checks on the input.
-    for(PolygonListCRef p = polygons.begin(); p != polygons.end(); p++) {
-        if(p->size() < 3) {
+    if(bad < nPolygons) {
+        const IndexList& p = polygons[bad];
+        if(p.size() < 3) {
             // Refuse to build the mesh if any of the polygons have fewer than three
             // vertices.(Note that if we omit this check the code will still
             // constructsomething fairlymeaningful for 1- and 2-point polygons, but
@@ -653,113 +1970,180 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
             // these rather degenerate cases.)
             return "Each polygon must have at least three vertices.";
         }
+        // Otherwise the polygon repeats a vertex, which (for simplicity) we don't handle.
+        std::stringstream stream;
+        stream << "One of the input polygons does not have distinct vertices!" << std::endl;
+        stream << "(vertex indices:";
+        for(Index i : p) {
+            stream << " " << i;
+        }
+        stream << ")" << std::endl;
+        return stream.str();
+    }
 
-        // We want to count the number of distinct vertex indices in this
-        // polygon, to make sure it's the same as the number of vertices
-        // in the polygon---if they disagree, then the polygon is not valid
-        // (or at least, for simplicity we don't handle polygons of this type!).
-        std::set<Index> polygonIndices;
-
-        // loop over polygon vertices
-        for(IndexListCRef i = p->begin(); i != p->end(); i++) {
-            polygonIndices.insert(*i);
+    // Offset of each polygon's first corner in the list of all corners. Each
+    // corner will become the halfedge leaving it, in this order.
+    std::vector<Size> polygonStart(nPolygons + 1, 0);
+    Index maxIndex = 0;
+    for(Size p = 0; p < nPolygons; p++) {
+        polygonStart[p + 1] = polygonStart[p] + polygons[p].size();
+        for(Index i : polygons[p]) maxIndex = std::max(maxIndex, i);
+    }
+    Size nCorners = polygonStart[nPolygons];
 
-            // allocate one vertex for each new index we encounter
-            if(indexToVertex.find(*i) == indexToVertex.end()) {
-                VertexRef v = new_vertex();
-                v->halfedge() = halfedges.end(); // this vertex doesn't yet point to any halfedge
-                indexToVertex[*i] = v;
-                vertexDegree[v] = 1; // we've now seen this vertex only once
-            } else {
-                // keep track of the number of times we've seen this vertex
-                vertexDegree[indexToVertex[*i]]++;
+    // Since the vertices in our halfedge mesh can't be accessed by index, we
+    // temporarily need to keep track of the correspondence between indices of
+    // vertices in our input and vertices in the new mesh. Input vertex indices
+    // aren't required to be 0-based or 1-based; in fact, the set of indices
+    // doesn't even have to be contiguous. Taking advantage of this fact makes our
+    // conversion a bit more robust to different types of input, including data
+    // that comes from a subset of a full mesh. When the indices are reasonably
+    // dense we look them up in a table directly; otherwise we first find each
+    // one's rank among the distinct indices.
+    bool dense = maxIndex < 2 * nCorners + verts.size();
+    std::vector<Index> distinct;
+    if(!dense) {
+        distinct.reserve(nCorners);
+        for(const IndexList& p : polygons) distinct.insert(distinct.end(), p.begin(), p.end());
+        std::sort(distinct.begin(), distinct.end());
+        distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+    }
+    auto rank = [&](Index i) -> Size {
+        if(dense) return i;
+        return std::lower_bound(distinct.begin(), distinct.end(), i) - distinct.begin();
+    };
+
+    // Vertices are numbered (and allocated) in the order in which their index
+    // first appears. We also store the vertex degree, i.e., the number of polygons
+    // that use each vertex; this information will be used to check that the mesh
+    // is manifold.
+    std::vector<uint32_t> rankToVertex(dense ? maxIndex + 1 : distinct.size(), UINT32_MAX);
+    std::vector<VertexRef> vertexRefs;
+    std::vector<Size> vertexDegree;
+    std::vector<uint32_t> cornerVertex(nCorners);
+
+    vertices.reserve(std::min(rankToVertex.size(), nCorners));
+    for(Size p = 0, c = 0; p < nPolygons; p++) {
+        for(Index i : polygons[p]) {
+            uint32_t& v = rankToVertex[rank(i)];
+            if(v == UINT32_MAX) {
+                v = (uint32_t)vertexRefs.size();
+                VertexRef ref = new_vertex();
+                ref->halfedge() = halfedges.end(); // this vertex doesn't yet point to any halfedge
+                vertexRefs.push_back(ref);
+                vertexDegree.push_back(0);
             }
-        } // end loop over polygon vertices
+            vertexDegree[v]++;
+            cornerVertex[c++] = v;
+        }
+    }
 
-        // check that all vertices of the current polygon are distinct
-        Size degree = p->size(); // number of vertices in this polygon
-        if(polygonIndices.size() < degree) {
-            std::stringstream stream;
-            stream << "One of the input polygons does not have distinct vertices!" << std::endl;
-            stream << "(vertex indices:";
-            for(IndexListCRef i = p->begin(); i != p->end(); i++) {
-                stream << " " << *i;
+    // Next we find each halfedge's twin. Sorting all halfedges on their unordered
+    // pair of vertices (then on the order they will be created in) puts each one
+    // right next to its twin, if it has one.
+    struct Side {
+        uint64_t key;
+        uint32_t halfedge;
+        bool reversed;
+    };
+    std::vector<Side> sides(nCorners);
+    pool.parallel_for(
+        0, nPolygons,
+        [&](size_t lo, size_t hi) {
+            for(size_t p = lo; p < hi; p++) {
+                Size start = polygonStart[p], degree = polygons[p].size();
+                for(Size i = 0; i < degree; i++) {
+                    uint64_t a = cornerVertex[start + i];
+                    uint64_t b = cornerVertex[start + (i + 1) % degree];
+                    sides[start + i] = {std::min(a, b) << 32 | std::max(a, b),
+                                        (uint32_t)(start + i), a > b};
+                }
             }
-            stream << ")" << std::endl;
-            return stream.str();
-        } // end check that polygon vertices are distinct
+        },
+        1024);
+    std::sort(sides.begin(), sides.end(), [](const Side& l, const Side& r) {
+        return l.key != r.key ? l.key < r.key : l.halfedge < r.halfedge;
+    });
+
+    std::vector<uint32_t> twin(nCorners, UINT32_MAX);
+    // Halfedge that repeats an earlier oriented edge, if any; as with the other
+    // checks, we report the first one
+    Size repeated = nCorners;
+    for(Size s = 0; s < nCorners;) {
+        Size e = s + 1;
+        while(e < nCorners && sides[e].key == sides[s].key) e++;
+        // Group [s, e) shares a pair of vertices: at most one halfedge may go each way
+        uint32_t first[2] = {UINT32_MAX, UINT32_MAX};
+        for(Size i = s; i < e; i++) {
+            uint32_t& other = first[sides[i].reversed];
+            if(other == UINT32_MAX) {
+                other = sides[i].halfedge;
+            } else {
+                repeated = std::min<Size>(repeated, sides[i].halfedge);
+            }
+        }
+        if(first[0] != UINT32_MAX && first[1] != UINT32_MAX) {
+            twin[first[0]] = first[1];
+            twin[first[1]] = first[0];
+        }
+        s = e;
+    }
 
-    } // end basic sanity checks on input
+    if(repeated < nCorners) {
+        Size p = std::upper_bound(polygonStart.begin(), polygonStart.end(), repeated) -
+                 polygonStart.begin() - 1;
+        Size i = repeated - polygonStart[p], degree = polygons[p].size();
+        Index a = polygons[p][i], b = polygons[p][(i + 1) % degree];
+        std::stringstream stream;
+        stream << "Found multiple oriented edges with indices (" << a << ", " << b << ")."
+               << std::endl;
+        stream << "This means that either (i) more than two faces contain this "
+                  "edge (hence the surface is nonmanifold), or"
+               << std::endl;
+        stream << "(ii) there are exactly two faces containing this edge, but "
+                  "they have the same orientation (hence the surface is"
+               << std::endl;
+        stream << "not consistently oriented." << std::endl;
+        return stream.str();
+    }
 
     // The number of faces is just the number of polygons in the input.
-    Size nFaces = polygons.size();
-    for(Size i = 0; i < nFaces; i++) new_face();
-
-    // We will store a map from ordered pairs of vertex indices to
-    // the corresponding halfedge object in our new (halfedge) mesh;
-    // this map gets constructed during the next loop over polygons.
-    std::map<IndexPair, HalfedgeRef> pairToHalfedge;
+    faces.reserve(nPolygons);
+    for(Size i = 0; i < nPolygons; i++) new_face();
 
-    // Next, we actually build the halfedge connectivity by again looping over
+    // Now we actually build the halfedge connectivity by again looping over
     // polygons
-    PolygonListCRef p;
-    FaceRef f;
-    for(p = polygons.begin(), f = faces.begin(); p != polygons.end(); p++, f++) {
+    halfedges.reserve(nCorners);
+    edges.reserve(nCorners / 2);
+    std::vector<HalfedgeRef> halfedgeRefs(nCorners);
+    FaceRef f = faces.begin();
+    for(Size p = 0; p < nPolygons; p++, f++) {
 
-        std::vector<HalfedgeRef> faceHalfedges; // cyclically ordered list of the half
-                                                // edges of this face
-        Size degree = p->size();                // number of vertices in this polygon
+        Size start = polygonStart[p];
+        Size degree = polygons[p].size(); // number of vertices in this polygon
 
         // loop over the halfedges of this face (equivalently, the ordered pairs of
         // consecutive vertices)
-        for(Index i = 0; i < degree; i++) {
+        for(Index i = start; i < start + degree; i++) {
+
+            HalfedgeRef hab = new_halfedge();
+            halfedgeRefs[i] = hab;
+
+            // link the new halfedge to its face
+            hab->face() = f;
+            hab->face()->halfedge() = hab;
 
-            Index a = (*p)[i];                // current index
-            Index b = (*p)[(i + 1) % degree]; // next index, in cyclic order
-            IndexPair ab(a, b);
-            HalfedgeRef hab;
-
-            // check if this halfedge already exists; if so, we have a problem!
-            if(pairToHalfedge.find(ab) != pairToHalfedge.end()) {
-                std::stringstream stream;
-                stream << "Found multiple oriented edges with indices (" << a << ", " << b << ")."
-                       << std::endl;
-                stream << "This means that either (i) more than two faces contain this "
-                          "edge (hence the surface is nonmanifold), or"
-                       << std::endl;
-                stream << "(ii) there are exactly two faces containing this edge, but "
-                          "they have the same orientation (hence the surface is"
-                       << std::endl;
-                stream << "not consistently oriented." << std::endl;
-                return stream.str();
-            } else // otherwise, the halfedge hasn't been allocated yet
-            {
-                // so, we point this vertex pair to a new halfedge
-                hab = new_halfedge();
-                pairToHalfedge[ab] = hab;
-
-                // link the new halfedge to its face
-                hab->face() = f;
-                hab->face()->halfedge() = hab;
-
-                // also link it to its starting vertex
-                hab->vertex() = indexToVertex[a];
-                hab->vertex()->halfedge() = hab;
-
-                // keep a list of halfedges in this face, so that we can later
-                // link them together in a loop (via their "next" pointers)
-                faceHalfedges.push_back(hab);
-            }
-
-            // Also, check if the twin of this halfedge has already been constructed
-            // (during construction of a different face).  If so, link the twins
-            // together and allocate their shared halfedge.  By the end of this pass
-            // over polygons, the only halfedges that will not have a twin will hence
-            // be those that sit along the domain boundary.
-            IndexPair ba(b, a);
-            std::map<IndexPair, HalfedgeRef>::iterator iba = pairToHalfedge.find(ba);
-            if(iba != pairToHalfedge.end()) {
-                HalfedgeRef hba = iba->second;
+            // also link it to its starting vertex
+            hab->vertex() = vertexRefs[cornerVertex[i]];
+            hab->vertex()->halfedge() = hab;
+
+            // If the twin of this halfedge has already been constructed (during
+            // construction of a different face), link the twins together and
+            // allocate their shared edge. By the end of this pass over polygons,
+            // the only halfedges that will not have a twin will hence be those
+            // that sit along the domain boundary.
+            if(twin[i] < i) {
+                HalfedgeRef hba = halfedgeRefs[twin[i]];
 
                 // link the twins
                 hab->twin() = hba;
@@ -770,11 +2154,11 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
                 hab->edge() = e;
                 hba->edge() = e;
                 e->halfedge() = hab;
-            } else { // If we didn't find a twin...
-                // ...mark this halfedge as being twinless by pointing
-                // it to the end of the list of halfedges. If it remains
-                // twinless by the end of the current loop over polygons,
-                // it will be linked to a boundary face in the next pass.
+            } else {
+                // ...otherwise mark this halfedge as being twinless (for now) by
+                // pointing it to the end of the list of halfedges. If it remains
+                // twinless by the end of the current loop over polygons, it will
+                // be linked to a boundary face in the next pass.
                 hab->twin() = halfedges.end();
             }
         } // end loop over the current polygon's halfedges
@@ -783,7 +2167,7 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
         // we can link them together via their "next" pointers.
         for(Index i = 0; i < degree; i++) {
             Index j = (i + 1) % degree; // index of the next halfedge, in cyclic order
-            faceHalfedges[i]->next() = faceHalfedges[j];
+            halfedgeRefs[start + i]->next() = halfedgeRefs[start + j];
         }
 
     } // done building basic halfedge connectivity
@@ -889,7 +2273,8 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
     }
 
     // Finally, we check that all vertices are manifold.
-    for(VertexRef v = vertices.begin(); v != vertices.end(); v++) {
+    for(Size n = 0; n < vertexRefs.size(); n++) {
+        VertexRef v = vertexRefs[n];
         // First check that this vertex is not a "floating" vertex;
         // if it is then we do not have a valid 2-manifold surface.
         if(v->halfedge() == halfedges.end()) {
@@ -910,7 +2295,7 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
             h = h->twin()->next();
         } while(h != v->halfedge());
 
-        Size cmp = vertexDegree[v];
+        Size cmp = vertexDegree[n];
         if(count != cmp) {
             return "At least one of the vertices is nonmanifold.";
         }
@@ -928,20 +2313,13 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
         return stream.str();
     }
 
-    // Since an STL map internally sorts its keys, we can iterate over the map
-    // from vertex indices to vertex iterators to visit our (input) vertices in
-    // lexicographic order
-    int i = 0;
-    for(std::map<Index, VertexRef>::const_iterator e = indexToVertex.begin();
-        e != indexToVertex.end(); e++) {
-        // grab a pointer to the vertex associated with the current key (i.e., the
-        // current index)
-        VertexRef v = e->second;
-
+    // Ranks increase with the input index, so walking the ranks visits our
+    // (input) vertices in lexicographic order
+    Size i = 0;
+    for(uint32_t v : rankToVertex) {
         // set the att of this vertex to the corresponding
         // position in the input
-        v->pos = verts[i];
-        i++;
+        if(v != UINT32_MAX) vertexRefs[v]->pos = verts[i++];
     }
     return {};
 }
@@ -67,7 +67,8 @@
     data structure.  But it's worth making a few comments about how this
     particular implementation works---especially how things like boundaries
     are handled.  First and foremost, the "pointers" used in this
-    implementation are actually STL iterators.  STL stands for the "standard
+    implementation are actually iterators into an Element_List, which works
+    just like an STL std::list (see element_list.h).  STL stands for the "standard
     template library," and is a basic part of C++ that provides some very
     convenient and powerful data structures and algorithms---if you've never
     looked at the STL before, now would be a great time to get familiar!  At
@@ -127,7 +128,8 @@
 
 #pragma once
 
-#include <list>
+#include <functional>
+#include <limits>
 #include <optional>
 #include <set>
 #include <string>
@@ -135,6 +137,7 @@
 #include <vector>
 
 #include "../platform/gl.h"
+#include "element_list.h"
 
 // Types of sub-division
 enum class SubD { linear, catmullclark, loop };
@@ -160,13 +163,15 @@ public:
 
     /*
         Rather than using raw pointers to mesh elements, we store references
-        as STL::iterators---for convenience, we give shorter names to these
-        iterators (e.g., EdgeRef instead of list<Edge>::iterator).
+        as iterators---for convenience, we give shorter names to these
+        iterators (e.g., EdgeRef instead of Element_List<Edge>::iterator).
+        Comparing two references with < orders them by their position in
+        storage, so std::set and std::map of references work too.
     */
-    using VertexRef = std::list<Vertex>::iterator;
-    using EdgeRef = std::list<Edge>::iterator;
-    using FaceRef = std::list<Face>::iterator;
-    using HalfedgeRef = std::list<Halfedge>::iterator;
+    using VertexRef = Element_List<Vertex>::iterator;
+    using EdgeRef = Element_List<Edge>::iterator;
+    using FaceRef = Element_List<Face>::iterator;
+    using HalfedgeRef = Element_List<Halfedge>::iterator;
 
     /* This is a special kind of reference that can refer to any of the four
        element types. */
@@ -178,10 +183,10 @@ public:
         used so frequently, we will use "CIter" as a shorthand abbreviation for
         "constant iterator."
     */
-    using VertexCRef = std::list<Vertex>::const_iterator;
-    using EdgeCRef = std::list<Edge>::const_iterator;
-    using FaceCRef = std::list<Face>::const_iterator;
-    using HalfedgeCRef = std::list<Halfedge>::const_iterator;
+    using VertexCRef = Element_List<Vertex>::const_iterator;
+    using EdgeCRef = Element_List<Edge>::const_iterator;
+    using FaceCRef = Element_List<Face>::const_iterator;
+    using HalfedgeCRef = Element_List<Halfedge>::const_iterator;
     using ElementCRef = std::variant<VertexCRef, EdgeCRef, HalfedgeCRef, FaceCRef>;
 
     //////////////////////////////////////////////////////////////////////////////////////////
@@ -193,6 +198,7 @@ public:
     // for dangling references to elements that will be erased.
     // The rest of the codebase will automatically call validate() after each op,
     // but you may need to be aware of this when implementing global ops.
+    // Between the steps of an op, call checkpoint() rather than validate().
     // Specifically, when you need to collapse an edge in iostropic_remesh() or simplify(),
     // you should call collapse_edge_erase() instead of collapse_edge()
 
@@ -286,43 +292,21 @@ public:
     void triangulate();
     void addEdge(std::vector<HalfedgeRef>& hEgs,
     std::vector<VertexRef>& vtx, long v0Idx, long v1Idx);
-    /*
-        Compute new vertex positions for a mesh that splits each polygon
-        into quads (by inserting a vertex at the face midpoint and each
-        of the edge midpoints).  The new vertex positions will be stored
-        in the members Vertex::new_pos, Edge::new_pos, and
-        Face::new_pos.  The values of the positions are based on
-        simple linear interpolation, e.g., the edge midpoints and face
-        centroids.
-    */
-    void linear_subdivide_positions();
-
-    /*
-        Compute new vertex positions for a mesh that splits each polygon
-        into quads (by inserting a vertex at the face midpoint and each
-        of the edge midpoints).  The new vertex positions will be stored
-        in the members Vertex::new_pos, Edge::new_pos, and
-        Face::new_pos.  The values of the positions are based on
-        the Catmull-Clark rules for subdivision.
-    */
-    void catmullclark_subdivide_positions();
-
-    /*
-        Sub-divide each face based on the Loop subdivision rule
-    */
-    void loop_subdivide();
 
     /*
-        Isotropic remeshing
+        Isotropic remeshing: splits, collapses, and flips edges toward a target length,
+        then smooths. The target is the mean edge length, or if given, target_length
+        evaluated at each vertex, so that it can vary over the surface.
     */
-    double mean_edge_len();
-    std::optional<VertexRef> collapse_edge_remesh(EdgeRef e, std::vector<EdgeRef>& E);
-    bool isotropic_remesh();
+    bool isotropic_remesh(const std::function<float(Vec3)>& target_length = {},
+                          int passes = 6);
 
     /*
-        Mesh simplification
+        Mesh simplification: collapses the edges of least quadric error until at most
+        target_faces triangles remain (by default, a quarter of them) or no collapse
+        costs less than max_error
     */
-    bool simplify();
+    bool simplify(size_t target_faces = 0, float max_error = std::numeric_limits<float>::max());
 
     //////////////////////////////////////////////////////////////////////////////////////////
     // End student operations, begin methods students should use
@@ -537,16 +521,16 @@ public:
         new element. (These methods cannot have const versions, because they modify the mesh!)
     */
     HalfedgeRef new_halfedge() {
-        return halfedges.insert(halfedges.end(), Halfedge(next_id++));
+        return halfedges.emplace_back(Halfedge(next_id++));
     }
     VertexRef new_vertex() {
-        return vertices.insert(vertices.end(), Vertex(next_id++));
+        return vertices.emplace_back(Vertex(next_id++));
     }
     EdgeRef new_edge() {
-        return edges.insert(edges.end(), Edge(next_id++));
+        return edges.emplace_back(Edge(next_id++));
     }
     FaceRef new_face(bool boundary = false) {
-        return faces.insert(faces.end(), Face(next_id++, boundary));
+        return faces.emplace_back(Face(next_id++, boundary));
     }
 
     /*
@@ -637,6 +621,9 @@ public:
     /// Check if half-edge mesh is valid
     std::optional<std::pair<ElementRef, std::string>> validate();
     std::optional<std::pair<ElementRef, std::string>> warnings();
+    /// Use between the steps of an op: runs validate() in debug builds (or with
+    /// SCOTTY3D_MESH_CHECKS defined), and otherwise only erases elements.
+    std::optional<std::pair<ElementRef, std::string>> checkpoint();
 
     //////////////////////////////////////////////////////////////////////////////////////////
     // End methods students should use, begin internal methods - you don't need to use these
@@ -658,10 +645,21 @@ public:
 
     /// Clear mesh of all elements.
     void clear();
-    /// Creates new sub-divided mesh with provided scheme
-    bool subdivide(SubD strategy);
+    /// Creates new sub-divided mesh with provided scheme, applied levels times
+    bool subdivide(SubD strategy, size_t levels = 1);
     /// Export to renderable vertex-index mesh. Indexes the mesh.
     void to_mesh(GL::Mesh& mesh, bool split_faces) const;
+    /// Export a smooth triangle mesh, refined only where the surface needs it.
+    /// screen_error(a, b, d) gives the size in pixels of offset d on the edge from a
+    /// to b (zero if the edge can't be seen); edges are split (at most max_levels
+    /// times) while the curve through them strays from the straight edge by more
+    /// than tolerance pixels, worst first, and never past max_triangles triangles.
+    /// Splits are decided per edge, so neighboring faces always agree and the
+    /// result has no cracks.
+    void to_mesh_adaptive(GL::Mesh& mesh,
+                          const std::function<float(Vec3, Vec3, Vec3)>& screen_error,
+                          float tolerance, size_t max_levels,
+                          size_t max_triangles = std::numeric_limits<size_t>::max()) const;
     /// Create mesh from polygon list
     std::string from_poly(const std::vector<std::vector<Index>>& polygons,
                           const std::vector<Vec3>& verts);
@@ -673,6 +671,80 @@ public:
     /// or validate() are called
     void do_erase();
 
+    /// What a local operation did to the mesh, so that data derived from it (like
+    /// the model editor's buffers) can be patched rather than rebuilt. Elements
+    /// created since the log began have ids in [first_new_id, end_id), and sit at
+    /// the end of their lists.
+    struct Change_Log {
+        unsigned int first_new_id = 0, end_id = 0;
+        std::vector<unsigned int> erased;
+        /// Surviving vertices of the faces around the element the log began at
+        std::vector<unsigned int> around;
+        bool empty() const {
+            return first_new_id == end_id && erased.empty();
+        }
+    };
+    /// Start logging a local operation on elem
+    void begin_change_log(ElementRef elem);
+    Change_Log end_change_log();
+
+    /// Like validate() and warnings(), but only check what the logged operation
+    /// could have changed: the faces around the element the log began at and
+    /// anything created since. Must be called while logging.
+    std::optional<std::pair<ElementRef, std::string>> validate_local();
+    std::optional<std::pair<ElementRef, std::string>> warnings_local();
+
+    /// Undo record for a local operation: the state of just the elements it touched,
+    /// before and after. Elements are named by id rather than reference, so a delta
+    /// still applies after the mesh has been copied (copies keep ids). Ids at or past
+    /// before.next_id were created by the operation; erased lists those it destroyed.
+    struct Delta {
+        struct Vertex_State {
+            unsigned int id, halfedge;
+            Vec3 pos;
+        };
+        struct Edge_State {
+            unsigned int id, halfedge;
+        };
+        struct Face_State {
+            unsigned int id, halfedge;
+            bool boundary;
+        };
+        struct Halfedge_State {
+            unsigned int id, next, twin, vertex, edge, face;
+        };
+        struct State {
+            std::vector<Vertex_State> vertices;
+            std::vector<Edge_State> edges;
+            std::vector<Face_State> faces;
+            std::vector<Halfedge_State> halfedges;
+            unsigned int next_id = 0;
+            /// Storage slot of each id the state mentions when it was recorded,
+            /// sorted by id, so applying it seldom has to search the mesh
+            std::vector<std::pair<unsigned int, uint32_t>> slots;
+        };
+        State before, after;
+        std::vector<unsigned int> erased;
+        size_t bytes() const;
+    };
+    /// Start recording a delta for a local operation on elem. Whatever the operation
+    /// changes or erases must lie in the faces around the vertices of the faces around
+    /// elem's vertices (as it does for all the local ops above); it may create anything.
+    void begin_delta(ElementRef elem);
+    Delta end_delta();
+    /// Put the mesh back in the state before or after a delta. It must currently be
+    /// in the state after or before it, respectively.
+    void undo(const Delta& delta);
+    void redo(const Delta& delta);
+    /// Approximate memory held by the mesh's elements
+    size_t bytes() const;
+
+    /// Erased elements leave holes in storage that later insertions fill in. When
+    /// a lot of the mesh has been erased (e.g. after simplification), compact()
+    /// packs the survivors together again. WARNING: invalidates all references.
+    void compact();
+    bool fragmented() const;
+
     void mark_dirty();
     bool flipped() const {
         return flip_orientation;
@@ -687,10 +759,10 @@ public:
     static unsigned int id_of(ElementRef elem);
 
 private:
-    std::list<Vertex> vertices;
-    std::list<Edge> edges;
-    std::list<Face> faces;
-    std::list<Halfedge> halfedges;
+    Element_List<Vertex> vertices;
+    Element_List<Edge> edges;
+    Element_List<Face> faces;
+    Element_List<Halfedge> halfedges;
 
     unsigned int next_id;
     bool flip_orientation = false;
@@ -699,37 +771,52 @@ private:
     std::set<EdgeRef> eerased;
     std::set<FaceRef> ferased;
     std::set<HalfedgeRef> herased;
-};
 
-/*
-    Some algorithms need to know how to compare two iterators (std::map)
-    Here we just say that one iterator comes before another if the address of the
-    object it points to is smaller. (You should not have to worry about this!)
-*/
-inline bool operator<(const Halfedge_Mesh::HalfedgeRef& i, const Halfedge_Mesh::HalfedgeRef& j) {
-    return &*i < &*j;
-}
-inline bool operator<(const Halfedge_Mesh::VertexRef& i, const Halfedge_Mesh::VertexRef& j) {
-    return &*i < &*j;
-}
-inline bool operator<(const Halfedge_Mesh::EdgeRef& i, const Halfedge_Mesh::EdgeRef& j) {
-    return &*i < &*j;
-}
-inline bool operator<(const Halfedge_Mesh::FaceRef& i, const Halfedge_Mesh::FaceRef& j) {
-    return &*i < &*j;
-}
-inline bool operator<(const Halfedge_Mesh::HalfedgeCRef& i, const Halfedge_Mesh::HalfedgeCRef& j) {
-    return &*i < &*j;
-}
-inline bool operator<(const Halfedge_Mesh::VertexCRef& i, const Halfedge_Mesh::VertexCRef& j) {
-    return &*i < &*j;
-}
-inline bool operator<(const Halfedge_Mesh::EdgeCRef& i, const Halfedge_Mesh::EdgeCRef& j) {
-    return &*i < &*j;
-}
-inline bool operator<(const Halfedge_Mesh::FaceCRef& i, const Halfedge_Mesh::FaceCRef& j) {
-    return &*i < &*j;
-}
+    bool logging = false;
+    Change_Log log;
+    std::vector<VertexRef> log_around;
+    std::vector<VertexRef> around(ElementRef elem);
+
+    // The delta being recorded, and references to the elements in its before state
+    bool recording = false;
+    Delta delta;
+    std::vector<VertexRef> delta_vertices;
+    std::vector<EdgeRef> delta_edges;
+    std::vector<FaceRef> delta_faces;
+    std::vector<HalfedgeRef> delta_halfedges;
+    void apply(const Delta::State& state, const Delta::State& from,
+               const std::vector<unsigned int>& state_erased,
+               const std::vector<unsigned int>& from_erased);
+
+    // Connectivity as index arrays, so subdivide() can refine in parallel and
+    // build only the final mesh
+    struct Flat;
+    void to_flat(Flat& flat);
+    void from_flat(const Flat& flat);
+    static void refine_quads(const Flat& coarse, Flat& fine, bool smooth);
+    static void refine_loop(const Flat& coarse, Flat& fine);
+
+    // Unchecked local operations on triangle meshes for isotropic_remesh() and simplify(),
+    // which apply a great many of them. The caller is responsible for the checks the
+    // regular operations make. Collapsing keeps h's vertex and erases the collapsed
+    // elements right away rather than through erase().
+    VertexRef split_edge_fast(EdgeRef e);
+    void flip_edge_fast(EdgeRef e);
+    void collapse_edge_fast(HalfedgeRef h);
+
+    // Checks shared by validate() and validate_local()
+    using Problem = std::optional<std::pair<ElementRef, std::string>>;
+    Problem check_links(HalfedgeRef h);
+    Problem check_twin(HalfedgeRef h);
+    Problem check_vertex(VertexRef v);
+    Problem check_edge(EdgeRef e);
+    Problem check_face(FaceRef f);
+    bool erasing(VertexRef v) const;
+    bool erasing(EdgeRef e) const;
+    bool erasing(FaceRef f) const;
+    bool erasing(HalfedgeRef h) const;
+    std::vector<VertexRef> changed_vertices();
+};
 
 /*
     Some algorithms need to know how to hash references (std::unordered_map)
@@ -380,6 +380,14 @@ Mode Manager::item_options(Undo& undo, Mode cur_mode, Scene_Item& item, Pose& ol
                 }
                 if(ImGui::Checkbox("Show Wireframe", &obj.opt.wireframe)) update();
                 if(ImGui::Checkbox("Render", &obj.opt.render)) update();
+                if(ImGui::Checkbox("Adaptive Subdivision", &obj.opt.render_subd)) update();
+                if(obj.opt.render_subd) {
+                    ImGui::DragFloat("Pixel Error", &obj.opt.subd_error, 0.05f, 0.05f, 10.0f,
+                                     "%.2f");
+                    activate();
+                    ImGui::SliderInt("Max Levels", &obj.opt.subd_levels, 1, 8);
+                    activate();
+                }
             }
             if(ImGui::Combo("Use Implicit Shape", (int*)&obj.opt.shape_type, PT::Shape_Type_Names,
                             (int)PT::Shape_Type::count)) {
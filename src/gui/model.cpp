@@ -1,6 +1,8 @@
 
 #include <algorithm>
 #include <imgui/imgui.h>
+#include <iterator>
+#include <unordered_set>
 
 #include "manager.h"
 #include "model.h"
@@ -19,9 +21,9 @@ Model::Model()
 
 void Model::begin_transform() {
 
-    my_mesh->copy_to(old_mesh);
-
     auto elem = *selected_element();
+    my_mesh->begin_delta(elem);
+
     trans_begin = {};
     std::visit(overloaded{[&](Halfedge_Mesh::VertexRef vert) {
                               trans_begin.verts = {vert->pos};
@@ -64,8 +66,10 @@ void Model::update_vertex(Halfedge_Mesh::VertexRef vert) {
         vert_sizes[v->id()] = d;
 
         if(!h->face()->is_boundary()) {
-            size_t idx = id_to_info[h->face()->id()].instance;
-            face_viz(h->face(), face_mesh.edit_verts(), face_mesh.edit_indices(), idx);
+            const ElemInfo& info = id_to_info[h->face()->id()];
+            size_t begin = info.instance, end = info.instance + info.count;
+            face_viz(h->face(), face_mesh.edit_verts(begin, end),
+                     face_mesh.edit_indices(begin, end), begin);
 
             Halfedge_Mesh::HalfedgeRef fh = h->face()->halfedge();
             do {
@@ -323,9 +327,11 @@ void Model::face_viz(Halfedge_Mesh::FaceRef face, std::vector<GL::Mesh::Vert>& v
         h = h->next();
     } while(h != face->halfedge());
 
-    id_to_info[face->id()] = {face, insert_at};
-
-    if(face_verts.size() < 3) return;
+    if(face_verts.size() < 3) {
+        id_to_info[face->id()] = {face, insert_at, 0};
+        return;
+    }
+    id_to_info[face->id()] = {face, insert_at, (face_verts.size() - 2) * 3};
 
     size_t max = insert_at + (face_verts.size() - 2) * 3;
     if(verts.size() < max) verts.resize(max);
@@ -358,6 +364,7 @@ void Model::rebuild() {
 
     id_to_info.clear();
     vert_sizes.clear();
+    face_garbage = 0;
 
     std::vector<GL::Mesh::Vert> verts;
     std::vector<GL::Mesh::Index> idxs;
@@ -410,12 +417,228 @@ void Model::rebuild() {
     validate();
 }
 
+// The vertices of a mesh element
+static std::vector<Halfedge_Mesh::VertexRef> element_vertices(Halfedge_Mesh::ElementRef elem) {
+
+    std::vector<Halfedge_Mesh::VertexRef> verts;
+    std::visit(overloaded{[&](Halfedge_Mesh::VertexRef vert) { verts.push_back(vert); },
+                          [&](Halfedge_Mesh::EdgeRef edge) {
+                              verts.push_back(edge->halfedge()->vertex());
+                              verts.push_back(edge->halfedge()->twin()->vertex());
+                          },
+                          [&](Halfedge_Mesh::HalfedgeRef halfedge) {
+                              verts.push_back(halfedge->vertex());
+                              verts.push_back(halfedge->twin()->vertex());
+                          },
+                          [&](Halfedge_Mesh::FaceRef face) {
+                              auto h = face->halfedge();
+                              do {
+                                  verts.push_back(h->vertex());
+                                  h = h->next();
+                              } while(h != face->halfedge());
+                          }},
+               elem);
+    return verts;
+}
+
+void Model::patch(Halfedge_Mesh::ElementRef result, const Halfedge_Mesh::Change_Log& log) {
+
+    if(!my_mesh) return;
+    Halfedge_Mesh& mesh = *my_mesh;
+
+    // The local check after an op keeps warnings from elsewhere in the mesh,
+    // but not if the op erased what they were about
+    if(std::find(log.erased.begin(), log.erased.end(), warn_id) != log.erased.end()) {
+        warn_id = 0;
+        warn_msg = {};
+    }
+    if(mesh.render_dirty_flag) return;
+
+    for(unsigned int id : log.erased) remove_info(id);
+
+    // Vertices whose surroundings may have changed
+    std::unordered_set<unsigned int> seen;
+    std::vector<Halfedge_Mesh::VertexRef> seeds;
+    auto seed = [&](Halfedge_Mesh::VertexRef v) {
+        if(seen.insert(v->id()).second) seeds.push_back(v);
+    };
+
+    for(unsigned int id : log.around) {
+        auto entry = id_to_info.find(id);
+        if(entry != id_to_info.end()) seed(std::get<Halfedge_Mesh::VertexRef>(entry->second.ref));
+    }
+    for(Halfedge_Mesh::VertexRef v : element_vertices(result)) seed(v);
+
+    // Created elements sit at the end of their lists
+    for(auto v = mesh.vertices_end();
+        v != mesh.vertices_begin() && std::prev(v)->id() >= log.first_new_id;) {
+        seed(--v);
+    }
+    for(auto e = mesh.edges_end();
+        e != mesh.edges_begin() && std::prev(e)->id() >= log.first_new_id;) {
+        for(Halfedge_Mesh::VertexRef v : element_vertices(--e)) seed(v);
+    }
+    for(auto f = mesh.faces_end();
+        f != mesh.faces_begin() && std::prev(f)->id() >= log.first_new_id;) {
+        for(Halfedge_Mesh::VertexRef v : element_vertices(--f)) seed(v);
+    }
+    for(auto h = mesh.halfedges_end();
+        h != mesh.halfedges_begin() && std::prev(h)->id() >= log.first_new_id;) {
+        seed((--h)->vertex());
+    }
+
+    // Vertex sizes depend on the lengths of incident edges, so neighbors of the
+    // seeds are resized too, along with the edges and halfedges around them.
+    size_t n_seeds = seeds.size();
+    for(size_t i = 0; i < n_seeds; i++) {
+        auto h = seeds[i]->halfedge();
+        do {
+            seed(h->twin()->vertex());
+            h = h->twin()->next();
+        } while(h != seeds[i]->halfedge());
+    }
+
+    for(Halfedge_Mesh::VertexRef v : seeds) {
+        float d;
+        Mat4 transform;
+        vertex_viz(v, d, transform);
+        vert_sizes[v->id()] = d;
+        place_instance(spheres, v, transform);
+    }
+
+    std::unordered_set<unsigned int> done;
+    for(size_t i = 0; i < n_seeds; i++) {
+        auto h = seeds[i]->halfedge();
+        do {
+            auto f = h->face();
+            if(done.insert(f->id()).second) {
+                if(f->is_boundary()) {
+                    remove_info(f->id());
+                } else {
+                    place_face(f);
+                }
+            }
+            h = h->twin()->next();
+        } while(h != seeds[i]->halfedge());
+    }
+    for(Halfedge_Mesh::VertexRef v : seeds) {
+        auto h = v->halfedge();
+        do {
+            if(done.insert(h->edge()->id()).second) place_edge(h->edge());
+            for(auto he : {h, h->twin()}) {
+                if(!done.insert(he->id()).second) continue;
+                if(he->is_boundary()) {
+                    remove_info(he->id());
+                    continue;
+                }
+                Mat4 transform;
+                halfedge_viz(he, transform);
+                place_instance(arrows, he, transform);
+            }
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+    }
+
+    // Fall back on a full rebuild if the patch missed something, or if patched
+    // faces have left face_mesh mostly holes
+    if(spheres.size() != mesh.n_vertices() || face_garbage > face_mesh.verts().size() / 2) {
+        rebuild();
+    }
+}
+
+void Model::place_face(Halfedge_Mesh::FaceRef face) {
+
+    size_t degree = face->degree();
+    size_t count = degree >= 3 ? (degree - 2) * 3 : 0;
+
+    // Faces that changed degree no longer fit in place, so move to the end
+    size_t at = face_mesh.verts().size();
+    auto entry = id_to_info.find(face->id());
+    if(entry != id_to_info.end()) {
+        if(entry->second.count == count) {
+            at = entry->second.instance;
+        } else {
+            clear_face(entry->second.instance, entry->second.count);
+        }
+    }
+
+    face_viz(face, face_mesh.edit_verts(at, at + count), face_mesh.edit_indices(at, at + count),
+             at);
+
+    // New halfedge arrows are placed relative to their face
+    auto h = face->halfedge();
+    do {
+        if(id_to_info.count(h->id())) {
+            halfedge_viz(h, arrows.get(id_to_info[h->id()].instance).transform);
+        }
+        h = h->next();
+    } while(h != face->halfedge());
+}
+
+void Model::place_edge(Halfedge_Mesh::EdgeRef e) {
+
+    // Same rule as rebuild(): no edges between two different boundary faces
+    auto h = e->halfedge();
+    if(h->is_boundary() && h->twin()->is_boundary() && h->face() != h->twin()->face()) {
+        remove_info(e->id());
+        return;
+    }
+
+    Mat4 transform;
+    edge_viz(e, transform);
+    place_instance(cylinders, e, transform);
+}
+
+void Model::place_instance(GL::Instances& inst, Halfedge_Mesh::ElementRef ref,
+                           const Mat4& transform) {
+
+    unsigned int id = Halfedge_Mesh::id_of(ref);
+    auto entry = id_to_info.find(id);
+    if(entry == id_to_info.end()) {
+        id_to_info[id] = {ref, inst.add(transform, id)};
+    } else {
+        inst.get(entry->second.instance).transform = transform;
+    }
+}
+
+void Model::remove_instance(GL::Instances& inst, size_t idx) {
+    inst.remove(idx);
+    if(idx < inst.size()) id_to_info[inst.get(idx).id].instance = idx;
+}
+
+void Model::clear_face(size_t begin, size_t count) {
+    // Degenerate triangles don't draw anything
+    std::vector<GL::Mesh::Vert>& verts = face_mesh.edit_verts(begin, begin + count);
+    for(size_t i = begin; i < begin + count; i++) verts[i] = {};
+    face_garbage += count;
+}
+
+void Model::remove_info(unsigned int id) {
+
+    auto entry = id_to_info.find(id);
+    if(entry == id_to_info.end()) return;
+
+    ElemInfo info = entry->second;
+    id_to_info.erase(entry);
+    vert_sizes.erase(id);
+
+    // The reference may be dangling, so only its type is used
+    std::visit(
+        overloaded{[&](Halfedge_Mesh::VertexRef) { remove_instance(spheres, info.instance); },
+                   [&](Halfedge_Mesh::EdgeRef) { remove_instance(cylinders, info.instance); },
+                   [&](Halfedge_Mesh::HalfedgeRef) { remove_instance(arrows, info.instance); },
+                   [&](Halfedge_Mesh::FaceRef) { clear_face(info.instance, info.count); }},
+        info.ref);
+}
+
 bool Model::begin_bevel(std::string& err) {
 
     auto sel = selected_element();
     if(!sel.has_value()) return false;
 
-    my_mesh->copy_to(old_mesh);
+    // The delta stays open until end_transform(), so it also covers the drag
+    my_mesh->begin_delta(*sel);
+    my_mesh->begin_change_log(*sel);
 
     auto new_face = std::visit(
         overloaded{[&](Halfedge_Mesh::VertexRef vert) {
@@ -433,18 +656,25 @@ bool Model::begin_bevel(std::string& err) {
                    [&](auto) -> std::optional<Halfedge_Mesh::FaceRef> { return std::nullopt; }},
         *sel);
 
-    if(!new_face.has_value()) return false;
+    if(!new_face.has_value()) {
+        // The op may have changed the mesh before giving up
+        bool changed = !my_mesh->end_change_log().empty();
+        Halfedge_Mesh::Delta delta = my_mesh->end_delta();
+        if(changed) my_mesh->undo(delta);
+        return false;
+    }
     Halfedge_Mesh::FaceRef face = new_face.value();
 
-    err = validate();
+    err = validate(true);
+    Halfedge_Mesh::Change_Log log = my_mesh->end_change_log();
     if(!err.empty()) {
 
-        *my_mesh = std::move(old_mesh);
+        my_mesh->undo(my_mesh->end_delta());
         return false;
 
     } else {
 
-        my_mesh->render_dirty_flag = true;
+        patch(face, log);
         set_selected(face);
 
         trans_begin = {};
@@ -506,21 +736,35 @@ bool Model::keydown(Widgets& widgets, SDL_Keysym key, Camera& cam) {
 }
 
 template<typename T>
-std::string Model::update_mesh(Undo& undo, Scene_Object& obj, Halfedge_Mesh&& before,
-                               Halfedge_Mesh::ElementRef ref, T&& op) {
+std::string Model::update_mesh(Undo& undo, Scene_Object& obj, Halfedge_Mesh::ElementRef ref,
+                               T&& op) {
 
-    unsigned int id = Halfedge_Mesh::id_of(ref);
+    my_mesh->begin_delta(ref);
+    my_mesh->begin_change_log(ref);
     std::optional<Halfedge_Mesh::ElementRef> new_ref = op(*my_mesh, ref);
-    if(!new_ref.has_value()) return {};
+    if(!new_ref.has_value()) {
+        // The op may have changed the mesh before giving up
+        bool changed = !my_mesh->end_change_log().empty();
+        Halfedge_Mesh::Delta delta = my_mesh->end_delta();
+        if(changed) {
+            my_mesh->undo(delta);
+            obj.set_mesh_dirty();
+        }
+        return {};
+    }
 
-    auto err = validate();
+    auto err = validate(true);
+    Halfedge_Mesh::Change_Log log = my_mesh->end_change_log();
+    Halfedge_Mesh::Delta delta = my_mesh->end_delta();
     if(!err.empty()) {
-        obj.take_mesh(std::move(before));
+        my_mesh->undo(delta);
+        obj.set_mesh_dirty();
     } else {
-        my_mesh->render_dirty_flag = true;
+        // Only the neighborhood of the op needs redrawing
+        patch(*new_ref, log);
         obj.set_mesh_dirty();
         set_selected(*new_ref);
-        undo.update_mesh(obj.id(), std::move(before), id, std::move(op));
+        undo.update_mesh(obj.id(), std::move(delta));
     }
 
     return err;
@@ -537,6 +781,8 @@ std::string Model::update_mesh_global(Undo& undo, Scene_Object& obj, Halfedge_Me
     if(!err.empty()) {
         obj.take_mesh(std::move(before));
     } else {
+        // Nothing holds references into the mesh across global ops
+        if(my_mesh->fragmented()) my_mesh->compact();
         my_mesh->render_dirty_flag = true;
         obj.set_mesh_dirty();
         selected_elem_id = 0;
@@ -546,9 +792,9 @@ std::string Model::update_mesh_global(Undo& undo, Scene_Object& obj, Halfedge_Me
     return err;
 }
 
-std::string Model::validate() {
+std::string Model::validate(bool local) {
 
-    auto valid = my_mesh->validate();
+    auto valid = local ? my_mesh->validate_local() : my_mesh->validate();
     if(valid.has_value()) {
         auto& msg = valid.value();
         err_id = Halfedge_Mesh::id_of(msg.first);
@@ -556,12 +802,12 @@ std::string Model::validate() {
         return msg.second;
     }
 
-    auto warn = my_mesh->warnings();
+    auto warn = local ? my_mesh->warnings_local() : my_mesh->warnings();
     if(warn.has_value()) {
         auto& msg = warn.value();
         warn_id = Halfedge_Mesh::id_of(msg.first);
         warn_msg = msg.second;
-    } else {
+    } else if(!local) {
         warn_id = 0;
         warn_msg = {};
     }
@@ -634,20 +880,25 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
 
     ImGui::Separator();
     ImGui::Text("Global Operations");
+    ImGui::SliderInt("Levels", &subd_levels, 1, 4);
+    size_t levels = (size_t)subd_levels;
     if(ImGui::Button("Linear")) {
         mesh.copy_to(before);
-        return update_mesh_global(undo, obj, std::move(before),
-                                  [](Halfedge_Mesh& m) { return m.subdivide(SubD::linear); });
+        return update_mesh_global(undo, obj, std::move(before), [levels](Halfedge_Mesh& m) {
+            return m.subdivide(SubD::linear, levels);
+        });
     }
     if(Manager::wrap_button("Catmull-Clark")) {
         mesh.copy_to(before);
-        return update_mesh_global(undo, obj, std::move(before),
-                                  [](Halfedge_Mesh& m) { return m.subdivide(SubD::catmullclark); });
+        return update_mesh_global(undo, obj, std::move(before), [levels](Halfedge_Mesh& m) {
+            return m.subdivide(SubD::catmullclark, levels);
+        });
     }
     if(Manager::wrap_button("Loop")) {
         mesh.copy_to(before);
-        return update_mesh_global(undo, obj, std::move(before),
-                                  [](Halfedge_Mesh& m) { return m.subdivide(SubD::loop); });
+        return update_mesh_global(undo, obj, std::move(before), [levels](Halfedge_Mesh& m) {
+            return m.subdivide(SubD::loop, levels);
+        });
     }
     if(ImGui::Button("Triangulate")) {
         mesh.copy_to(before);
@@ -661,10 +912,19 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
         return update_mesh_global(undo, obj, std::move(before),
                                   [](Halfedge_Mesh& m) { return m.isotropic_remesh(); });
     }
-    if(Manager::wrap_button("Simplify")) {
+
+    ImGui::SliderFloat("Keep", &simplify_ratio, 0.01f, 0.99f, "%.2f");
+    ImGui::DragFloat("Max Error", &simplify_error, 0.0001f, 0.0f, 1.0f, "%.4f");
+    if(ImGui::Button("Simplify")) {
+        size_t n = mesh.n_faces() - mesh.n_boundaries();
+        size_t target = std::max((size_t)(n * simplify_ratio), (size_t)1);
+        float max_error =
+            simplify_error > 0.0f ? simplify_error : std::numeric_limits<float>::max();
         mesh.copy_to(before);
         return update_mesh_global(undo, obj, std::move(before),
-                                  [](Halfedge_Mesh& m) { return m.simplify(); });
+                                  [target, max_error](Halfedge_Mesh& m) {
+                                      return m.simplify(target, max_error);
+                                  });
     }
 
     {
@@ -681,9 +941,8 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
                 overloaded{
                     [&](Halfedge_Mesh::VertexRef vert) -> std::string {
                         if(ImGui::Button("Erase [del]")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), vert,
+                                undo, obj, vert,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef vert) {
                                     return m.erase_vertex(std::get<Halfedge_Mesh::VertexRef>(vert));
                                 });
@@ -692,33 +951,29 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
                     },
                     [&](Halfedge_Mesh::EdgeRef edge) -> std::string {
                         if(ImGui::Button("Erase [del]")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), edge,
+                                undo, obj, edge,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                     return m.erase_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                 });
                         }
                         if(Manager::wrap_button("Collapse")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), edge,
+                                undo, obj, edge,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                     return m.collapse_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                 });
                         }
                         if(Manager::wrap_button("Flip")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), edge,
+                                undo, obj, edge,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                     return m.flip_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                 });
                         }
                         if(Manager::wrap_button("Split")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), edge,
+                                undo, obj, edge,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                     return m.split_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                 });
@@ -727,9 +982,8 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
                     },
                     [&](Halfedge_Mesh::FaceRef face) -> std::string {
                         if(ImGui::Button("Collapse")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), face,
+                                undo, obj, face,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef face) {
                                     return m.collapse_face(std::get<Halfedge_Mesh::FaceRef>(face));
                                 });
@@ -854,14 +1108,10 @@ void Model::erase_selected(Undo& undo, Scene_Maybe obj_opt) {
     if(!sel_.has_value()) return;
 
     Halfedge_Mesh::ElementRef sel = sel_.value();
-    Halfedge_Mesh& mesh = *my_mesh;
-
-    Halfedge_Mesh before;
-    mesh.copy_to(before);
 
     std::visit(overloaded{[&](Halfedge_Mesh::VertexRef vert) {
                               return update_mesh(
-                                  undo, obj, std::move(before), vert,
+                                  undo, obj, vert,
                                   [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef vert) {
                                       return m.erase_vertex(
                                           std::get<Halfedge_Mesh::VertexRef>(vert));
@@ -869,7 +1119,7 @@ void Model::erase_selected(Undo& undo, Scene_Maybe obj_opt) {
                           },
                           [&](Halfedge_Mesh::EdgeRef edge) {
                               return update_mesh(
-                                  undo, obj, std::move(before), edge,
+                                  undo, obj, edge,
                                   [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                       return m.erase_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                   });
@@ -912,14 +1162,15 @@ void Model::render(Scene_Maybe obj_opt, Widgets& widgets, Camera& cam) {
 
 std::string Model::end_transform(Widgets& widgets, Undo& undo, Scene_Object& obj) {
 
+    // apply_transform() has kept the render data up to date as we went
     obj.set_mesh_dirty();
-    my_mesh->render_dirty_flag = true;
 
     auto err = validate();
+    Halfedge_Mesh::Delta delta = my_mesh->end_delta();
     if(!err.empty()) {
-        obj.take_mesh(std::move(old_mesh));
+        my_mesh->undo(delta);
     } else {
-        undo.update_mesh_full(obj.id(), std::move(old_mesh));
+        undo.update_mesh(obj.id(), std::move(delta));
     }
     return err;
 }
@@ -39,8 +39,7 @@ public:
 
 private:
     template<typename T>
-    std::string update_mesh(Undo& undo, Scene_Object& obj, Halfedge_Mesh&& before,
-                            Halfedge_Mesh::ElementRef ref, T&& op);
+    std::string update_mesh(Undo& undo, Scene_Object& obj, Halfedge_Mesh::ElementRef ref, T&& op);
     template<typename T>
     std::string update_mesh_global(Undo& undo, Scene_Object& obj, Halfedge_Mesh&& before, T&& op);
 
@@ -51,6 +50,7 @@ private:
     std::optional<std::reference_wrapper<Scene_Object>> set_my_obj(Scene_Maybe obj_opt);
     std::optional<Halfedge_Mesh::ElementRef> selected_element();
     void rebuild();
+    void patch(Halfedge_Mesh::ElementRef result, const Halfedge_Mesh::Change_Log& log);
 
     void update_vertex(Halfedge_Mesh::VertexRef vert);
     void vertex_viz(Halfedge_Mesh::VertexRef v, float& size, Mat4& transform);
@@ -59,7 +59,16 @@ private:
     void face_viz(Halfedge_Mesh::FaceRef face, std::vector<GL::Mesh::Vert>& verts,
                   std::vector<GL::Mesh::Index>& idxs, size_t insert_at);
 
-    std::string validate();
+    void place_face(Halfedge_Mesh::FaceRef face);
+    void place_edge(Halfedge_Mesh::EdgeRef edge);
+    void place_instance(GL::Instances& inst, Halfedge_Mesh::ElementRef ref,
+                        const Mat4& transform);
+    void remove_instance(GL::Instances& inst, size_t idx);
+    void clear_face(size_t begin, size_t count);
+    void remove_info(unsigned int id);
+
+    // Local validation only checks around the op in the mesh's change log
+    std::string validate(bool local = false);
     std::string warn_msg, err_msg;
 
     // This all needs to be updated when the mesh connectivity changes
@@ -67,11 +76,18 @@ private:
     unsigned int selected_elem_id = 0, hovered_elem_id = 0;
 
     Halfedge_Mesh* my_mesh = nullptr;
-    Halfedge_Mesh old_mesh;
 
     enum class Bevel { face, edge, vert };
     Bevel beveling;
 
+    // How many times each press of a subdivision button subdivides
+    int subd_levels = 1;
+
+    // Fraction of faces a press of Simplify keeps, and the largest quadric error it
+    // accepts for a collapse (zero for no limit)
+    float simplify_ratio = 0.25f;
+    float simplify_error = 0.0f;
+
     struct Transform_Data {
         std::vector<Vec3> verts;
         Vec3 center;
@@ -88,12 +104,18 @@ private:
     // be updated (along with the instance data) by build_halfedge whenever
     // the mesh changes its connectivity. Note that build_halfedge also
     // re-indexes the mesh elements in the provided half-edge mesh.
+    // Local ops patch these in place (see patch()) rather than rebuilding them.
+    // For faces, instance is the offset of the face's triangles in face_mesh,
+    // and count the number of vertices they take up.
     struct ElemInfo {
         Halfedge_Mesh::ElementRef ref;
         size_t instance = 0;
+        size_t count = 0;
     };
     std::unordered_map<unsigned int, ElemInfo> id_to_info;
     std::unordered_map<unsigned int, float> vert_sizes;
+    // Vertices of face_mesh no longer used by any face
+    size_t face_garbage = 0;
 };
 
 } // namespace Gui
@@ -76,15 +76,17 @@ void Simulate::build_scene(Scene& scene) {
     scene.for_items([&, this](Scene_Item& item) {
         if(item.is<Scene_Object>()) {
             Scene_Object& obj = item.get<Scene_Object>();
-            futures.push_back(thread_pool.enqueue([&]() {
-                if(obj.is_shape()) {
-                    PT::Shape shape(obj.opt.shape);
-                    return PT::Object(std::move(shape), obj.id(), 0, obj.pose.transform());
-                } else {
-                    PT::Tri_Mesh mesh(obj.posed_mesh(), use_bvh);
-                    return PT::Object(std::move(mesh), obj.id(), 0, obj.pose.transform());
-                }
-            }));
+            futures.push_back(thread_pool.enqueue(
+                [&]() {
+                    if(obj.is_shape()) {
+                        PT::Shape shape(obj.opt.shape);
+                        return PT::Object(std::move(shape), obj.id(), 0, obj.pose.transform());
+                    } else {
+                        PT::Tri_Mesh mesh(obj.posed_mesh(), use_bvh);
+                        return PT::Object(std::move(mesh), obj.id(), 0, obj.pose.transform());
+                    }
+                },
+                Task_Priority::interactive));
         }
     });
 
@@ -3,7 +3,6 @@
 #include <iomanip>
 #include <iostream>
 #include <nfd/nfd.h>
-#include <sf_libs/stb_image_write.h>
 #include <sstream>
 
 #include "animate.h"
@@ -641,7 +640,11 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     if(method == 1) {
         ImGui::InputInt("Samples", &out_samples, 1, 100);
         ImGui::InputInt("Max Ray Depth", &out_depth, 1, 32);
+        ImGui::InputInt("Roulette Depth", &out_rr_depth, 1, 32);
+        ImGui::InputInt("Denoise Passes", &out_denoise, 1, 2);
         ImGui::SliderFloat("Exposure", &exposure, 0.01f, 10.0f, "%.2f", 2.5f);
+        ImGui::Combo("Tonemap", (int*)&tonemap_op, Tonemap_Op_Names, (int)Tonemap_Op::count);
+        ImGui::Checkbox("AOVs (saved in EXR files)", &use_aovs);
     } else {
         ImGui::Combo("Samples", (int*)&msaa.samples, GL::Sample_Count_Names, msaa.n_options());
         out_samples = msaa.n_samples();
@@ -651,6 +654,8 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     out_h = std::max(1, out_h);
     out_samples = std::max(1, out_samples);
     out_depth = std::max(1, out_depth);
+    out_rr_depth = std::max(0, out_rr_depth);
+    out_denoise = std::clamp(out_denoise, 0, 10);
 
     if(ImGui::Button("Set Width via AR")) {
         out_w = (size_t)std::ceil(cam.get_ar() * out_h);
@@ -667,9 +672,18 @@ std::string Widget_Render::step(Animate& animate, Scene& scene) {
 
     if(animating) {
 
+        // Frames are written in the background; stop at the first one that fails
+        std::string err = writer.error();
+        if(!err.empty()) {
+            pathtracer.cancel();
+            animating = false;
+            writer.wait();
+            return err;
+        }
+
         if(next_frame == max_frame) {
             animating = false;
-            return {};
+            return writer.wait();
         }
         if(folder.empty()) {
             animating = false;
@@ -678,28 +692,29 @@ std::string Widget_Render::step(Animate& animate, Scene& scene) {
 
         Camera cam = animate.set_time(scene, (float)next_frame);
 
-        if(method == 0) {
-
-            animate.step_sim(scene);
-            std::vector<unsigned char> data;
-
-            Renderer::get().save(scene, cam, out_w, out_h, out_samples);
-            Renderer::get().saved(data);
-
+        auto frame_path = [&](Image_Format format) {
             std::stringstream str;
             str << std::setfill('0') << std::setw(4) << next_frame;
 #ifdef _WIN32
-            std::string path = folder + "\\" + str.str() + ".png";
+            return folder + "\\" + str.str() + Image_Format_Extensions[(int)format];
 #else
-            std::string path = folder + "/" + str.str() + ".png";
+            return folder + "/" + str.str() + Image_Format_Extensions[(int)format];
 #endif
+        };
 
-            stbi_flip_vertically_on_write(true);
-            if(!stbi_write_png(path.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                               (int)out_w * 4)) {
-                animating = false;
-                return "Failed to write output!";
-            }
+        if(method == 0) {
+
+            animate.step_sim(scene);
+
+            Image_Writer::Job job;
+            job.path = frame_path(Image_Format::png);
+            job.w = out_w;
+            job.h = out_h;
+            job.flip = true;
+
+            Renderer::get().save(scene, cam, out_w, out_h, out_samples);
+            Renderer::get().saved(job.ldr);
+            writer.write(std::move(job));
 
             next_frame++;
         } else {
@@ -710,23 +725,18 @@ std::string Widget_Render::step(Animate& animate, Scene& scene) {
             }
 
             if(!pathtracer.in_progress()) {
-                std::vector<unsigned char> data;
-
-                pathtracer.get_output().tonemap_to(data, exposure);
-                std::stringstream str;
-                str << std::setfill('0') << std::setw(4) << next_frame;
-#ifdef _WIN32
-                std::string path = folder + "\\" + str.str() + ".png";
-#else
-                std::string path = folder + "/" + str.str() + ".png";
-#endif
 
-                stbi_flip_vertically_on_write(false);
-                if(!stbi_write_png(path.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                                   (int)out_w * 4)) {
-                    animating = false;
-                    return "Failed to write output!";
+                // Encoding happens on the writer threads while the next frame traces
+                Image_Writer::Job job;
+                job.path = frame_path(frame_format);
+                job.format = frame_format;
+                job.hdr = pathtracer.get_output().copy();
+                job.exposure = exposure;
+                job.op = tonemap_op;
+                if(use_aovs && frame_format == Image_Format::exr) {
+                    job.channels = pathtracer.get_aovs().channels();
                 }
+                writer.write(std::move(job));
 
                 animate.step_sim(scene);
                 pathtracer.begin_render(scene, cam);
@@ -753,6 +763,10 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
     }
     ImGui::SameLine();
     ImGui::InputText("##path", output_path, sizeof(output_path));
+    if(method == 1) {
+        ImGui::Combo("Format", (int*)&frame_format, Image_Format_Names,
+                     (int)Image_Format::count);
+    }
 
     ImGui::Separator();
     ImGui::Text("Render");
@@ -762,6 +776,7 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
         if(ImGui::Button("Cancel")) {
             pathtracer.cancel();
             animating = false;
+            writer.wait();
         }
 
         ImGui::SameLine();
@@ -782,6 +797,9 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
                 init = true;
                 ray_log.clear();
                 pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh);
+                pathtracer.set_roulette_depth(out_rr_depth);
+                pathtracer.set_aovs(use_aovs);
+                pathtracer.set_denoise(out_denoise);
             }
         }
     }
@@ -791,8 +809,8 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
     float h = (w / out_w) * out_h;
 
     if(method == 1) {
-        ImGui::Image((ImTextureID)(long long)pathtracer.get_output_texture(exposure).get_id(),
-                     {w, h});
+        const GL::Tex2D& tex = pathtracer.get_output_texture(exposure, tonemap_op);
+        ImGui::Image((ImTextureID)(long long)tex.get_id(), {w, h});
     } else {
         ImGui::Image((ImTextureID)(long long)Renderer::get().saved(), {w, h}, {0.0f, 1.0f},
                      {1.0f, 0.0f});
@@ -835,6 +853,9 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
                 ret = true;
                 ray_log.clear();
                 pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh);
+                pathtracer.set_roulette_depth(out_rr_depth);
+                pathtracer.set_aovs(use_aovs);
+                pathtracer.set_denoise(out_denoise);
                 pathtracer.begin_render(scene, cam.get());
             } else {
                 Renderer::get().save(scene, cam.get(), out_w, out_h, out_samples);
@@ -845,28 +866,36 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
     ImGui::SameLine();
     if(ImGui::Button("Save Image")) {
         char* path = nullptr;
-        NFD_SaveDialog("png", nullptr, &path);
+        NFD_SaveDialog(method == 1 ? "png,exr,pfm" : "png", nullptr, &path);
         if(path) {
 
             std::string spath(path);
-            if(!postfix(spath, ".png")) {
-                spath += ".png";
-            }
+            Image_Writer::Job job;
+            job.format = Image_Writer::format_of(spath);
+            if(method == 0) job.format = Image_Format::png;
 
-            std::vector<unsigned char> data;
+            const char* ext = Image_Format_Extensions[(int)job.format];
+            if(!postfix(spath, ext)) {
+                spath += ext;
+            }
+            job.path = spath;
 
             if(method == 1) {
-                pathtracer.get_output().tonemap_to(data, exposure);
-                stbi_flip_vertically_on_write(false);
+                job.hdr = pathtracer.get_output().copy();
+                job.exposure = exposure;
+                job.op = tonemap_op;
+                if(use_aovs && job.format == Image_Format::exr) {
+                    job.channels = pathtracer.get_aovs().channels();
+                }
             } else {
-                Renderer::get().saved(data);
-                stbi_flip_vertically_on_write(true);
+                Renderer::get().saved(job.ldr);
+                job.w = out_w;
+                job.h = out_h;
+                job.flip = true;
             }
 
-            if(!stbi_write_png(spath.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                               (int)out_w * 4)) {
-                err = "Failed to write png!";
-            }
+            std::string write_err = Image_Writer::write_now(job);
+            if(!write_err.empty()) err = write_err;
             free(path);
         }
     }
@@ -884,8 +913,8 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
     float h = (w / out_w) * out_h;
 
     if(method == 1) {
-        ImGui::Image((ImTextureID)(long long)pathtracer.get_output_texture(exposure).get_id(),
-                     {w, h});
+        const GL::Tex2D& tex = pathtracer.get_output_texture(exposure, tonemap_op);
+        ImGui::Image((ImTextureID)(long long)tex.get_id(), {w, h});
 
         if(!pathtracer.in_progress() && has_rendered) {
             auto [build, render] = pathtracer.completion_time();
@@ -908,13 +937,38 @@ std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera
     info("\theight: %d", set.h);
     info("\tsamples: %d", set.s);
     info("\tmax depth: %d", set.d);
+    info("\troulette depth: %d", set.rr_depth);
+    info("\tenvironment map format: %s", HDR_Format_Names[(int)set.env_format]);
     info("\texposure: %f", set.exp);
+    info("\ttonemap: %s", Tonemap_Op_Names[(int)set.tonemap]);
     info("\trender threads: %u", std::thread::hardware_concurrency());
     if(set.no_bvh) info("\tusing object list instead of BVH");
+    if(set.aovs) info("\twriting AOVs");
+    if(set.denoise > 0) info("\tdenoise passes: %d", set.denoise);
+    if(!set.checkpoint_file.empty()) {
+        info("\tcheckpoint: %s (every %.0fs)", set.checkpoint_file.c_str(),
+             set.checkpoint_interval);
+    }
+
+    if(set.resume && set.checkpoint_file.empty()) return "Resuming requires a checkpoint file!";
+    if(set.animate && !set.checkpoint_file.empty()) {
+        return "Checkpoints are not supported for animation renders!";
+    }
+    if(set.aovs) {
+        Image_Format format =
+            set.animate ? set.frame_format : Image_Writer::format_of(set.output_file);
+        if(format != Image_Format::exr) return "AOVs can only be written to EXR files!";
+    }
 
     out_w = set.w;
     out_h = set.h;
     pathtracer.set_params(set.w, set.h, set.s, set.d, !set.no_bvh);
+    pathtracer.set_roulette_depth(set.rr_depth);
+    pathtracer.set_env_map_format(set.env_format);
+    pathtracer.set_aovs(set.aovs);
+    pathtracer.set_denoise(set.denoise);
+    use_aovs = set.aovs;
+    pathtracer.set_checkpoint(set.checkpoint_file, set.checkpoint_interval);
 
     auto print_progress = [](float f) {
         std::cout << "Progress: [";
@@ -942,6 +996,7 @@ std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera
         max_frame = animate.n_frames();
         next_frame = 0;
         folder = set.output_file;
+        frame_format = set.frame_format;
         while(next_frame < max_frame) {
             std::string err = step(animate, scene);
             if(!err.empty()) return err;
@@ -950,20 +1005,34 @@ std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera
         }
         std::cout << std::endl;
 
+        std::string err = writer.wait();
+        if(!err.empty()) return err;
+
     } else {
 
-        pathtracer.begin_render(scene, cam);
+        if(set.resume) {
+            std::string err = pathtracer.resume_render(scene, cam);
+            if(!err.empty()) return err;
+        } else {
+            pathtracer.begin_render(scene, cam);
+        }
         while(pathtracer.in_progress()) {
             print_progress(pathtracer.progress());
             std::this_thread::sleep_for(std::chrono::milliseconds(250));
         }
         std::cout << std::endl;
 
-        std::vector<unsigned char> data;
-        pathtracer.get_output().tonemap_to(data, set.exp);
-        if(!stbi_write_png(set.output_file.c_str(), set.w, set.h, 4, data.data(), set.w * 4)) {
-            return "Failed to write output!";
-        }
+        // The format follows the output file's extension
+        Image_Writer::Job job;
+        job.path = set.output_file;
+        job.format = Image_Writer::format_of(set.output_file);
+        job.hdr = pathtracer.get_output().copy();
+        job.exposure = set.exp;
+        job.op = set.tonemap;
+        if(set.aovs) job.channels = pathtracer.get_aovs().channels();
+
+        std::string err = Image_Writer::write_now(job);
+        if(!err.empty()) return err;
     }
 
     return {};
@@ -4,6 +4,7 @@
 #include "../lib/mathlib.h"
 #include "../rays/pathtracer.h"
 #include "../scene/scene.h"
+#include "../util/image_writer.h"
 
 class Undo;
 struct Launch_Settings;
@@ -113,8 +114,11 @@ private:
     mutable std::mutex log_mut;
     GL::Lines ray_log;
 
-    int out_w, out_h, out_samples = 32, out_depth = 8;
+    int out_w, out_h, out_samples = 32, out_depth = 8, out_rr_depth = 3, out_denoise = 0;
     float exposure = 1.0f;
+    Tonemap_Op tonemap_op = Tonemap_Op::exposure;
+    bool use_aovs = false;
+    Image_Format frame_format = Image_Format::png;
     bool use_bvh = true;
 
     bool has_rendered = false;
@@ -126,6 +130,7 @@ private:
 
     char output_path[256] = {};
     std::string folder;
+    Image_Writer writer;
 
     GL::MSAA msaa;
     PT::Pathtracer pathtracer;
@@ -13,7 +13,8 @@ int main(int argc, char** argv) {
     args.add_option("-s,--scene", set.scene_file, "Scene file to load");
     args.add_option("--env_map", set.env_map_file, "Override scene environment map");
     args.add_flag("--headless", set.headless, "Path-trace scene without opening the GUI");
-    args.add_option("-o,--output", set.output_file, "Image file to write (if headless)");
+    args.add_option("-o,--output", set.output_file,
+                    "Image file to write, as PNG, EXR, or PFM by extension (if headless)");
     args.add_flag("--animate", set.animate, "Output animation frames (if headless)");
     args.add_flag("--no_bvh", set.no_bvh, "Don't use BVH (if headless)");
     args.add_option("--width", set.w, "Output image width (if headless)");
@@ -23,6 +24,37 @@ int main(int argc, char** argv) {
     args.add_option("--depth", set.d, "Maximum ray depth (if headless)");
     args.add_option("--samples", set.s, "Pixel samples (if headless)");
     args.add_option("--exposure", set.exp, "Output exposure (if headless)");
+    args.add_flag("--aovs", set.aovs,
+                  "Also write depth, normal, albedo, etc. layers; requires EXR output (if headless)");
+    args.add_option("--denoise", set.denoise,
+                    "Denoising filter passes to run on the finished render (if headless)");
+    args.add_option("--rr_depth", set.rr_depth,
+                    "Bounces before paths may be terminated by Russian roulette (if headless)");
+    args.add_option("--checkpoint", set.checkpoint_file,
+                    "Periodically save render progress to this file (if headless)");
+    args.add_option("--checkpoint_interval", set.checkpoint_interval,
+                    "Seconds between checkpoint saves (if headless)");
+    args.add_flag("--resume", set.resume, "Continue rendering from the checkpoint file (if headless)");
+
+    std::map<std::string, HDR_Format> formats;
+    for(int i = 0; i < (int)HDR_Format::count; i++) formats[HDR_Format_Names[i]] = (HDR_Format)i;
+    args.add_option("--env_format", set.env_format,
+                    "Storage format of environment maps; compact formats clamp bright texels "
+                    "(if headless)")
+        ->transform(CLI::CheckedTransformer(formats, CLI::ignore_case));
+
+    std::map<std::string, Tonemap_Op> tonemaps;
+    for(int i = 0; i < (int)Tonemap_Op::count; i++) tonemaps[Tonemap_Op_Names[i]] = (Tonemap_Op)i;
+    args.add_option("--tonemap", set.tonemap, "Tonemapping operator for the output (if headless)")
+        ->transform(CLI::CheckedTransformer(tonemaps, CLI::ignore_case));
+
+    std::map<std::string, Image_Format> frame_formats;
+    for(int i = 0; i < (int)Image_Format::count; i++) {
+        frame_formats[Image_Format_Names[i]] = (Image_Format)i;
+    }
+    args.add_option("--frame_format", set.frame_format,
+                    "File format of animation frames (if headless)")
+        ->transform(CLI::CheckedTransformer(frame_formats, CLI::ignore_case));
 
     CLI11_PARSE(args, argc, argv);
 
@@ -2,6 +2,7 @@
 #include "gl.h"
 #include "../lib/log.h"
 
+#include <algorithm>
 #include <fstream>
 
 namespace GL {
@@ -163,6 +164,73 @@ TexID Tex2D::get_id() const {
     return id;
 }
 
+void Buffer_Ranges::add(size_t begin, size_t end) {
+    if(everything || begin >= end) return;
+    if(ranges.size() == max_ranges) {
+        all();
+        return;
+    }
+    ranges.push_back({begin, end});
+}
+
+void Buffer_Ranges::all() {
+    ranges.clear();
+    everything = true;
+}
+
+void Buffer_Ranges::clear() {
+    ranges.clear();
+    everything = false;
+}
+
+bool Buffer_Ranges::empty() const {
+    return !everything && ranges.empty();
+}
+
+bool Buffer_Ranges::whole() const {
+    return everything;
+}
+
+std::vector<std::pair<size_t, size_t>> Buffer_Ranges::merged() const {
+    std::vector<std::pair<size_t, size_t>> sorted = ranges, ret;
+    std::sort(sorted.begin(), sorted.end());
+    for(auto& r : sorted) {
+        if(!ret.empty() && r.first <= ret.back().second) {
+            ret.back().second = std::max(ret.back().second, r.second);
+        } else {
+            ret.push_back(r);
+        }
+    }
+    return ret;
+}
+
+// Uploads the changed parts of data to the buffer bound to target. The buffer is
+// reallocated with room to grow when it is too small (or far too big), so that
+// appending a few elements doesn't mean uploading all of them again.
+static void upload(GLenum target, Buffer_Ranges& ranges, size_t& cap, const void* data,
+                   size_t size, size_t elem_size) {
+
+    const char* bytes = static_cast<const char*>(data);
+
+    if(size > cap || size < cap / 4) {
+        cap = size + size / 2;
+        glBufferData(target, cap * elem_size, nullptr, GL_DYNAMIC_DRAW);
+        ranges.all();
+    }
+
+    if(ranges.whole()) {
+        glBufferSubData(target, 0, size * elem_size, bytes);
+    } else {
+        for(auto [begin, end] : ranges.merged()) {
+            end = std::min(end, size);
+            if(begin >= end) continue;
+            glBufferSubData(target, begin * elem_size, (end - begin) * elem_size,
+                            bytes + begin * elem_size);
+        }
+    }
+    ranges.clear();
+}
+
 Mesh::Mesh() {
     create();
 }
@@ -185,6 +253,14 @@ Mesh::Mesh(Mesh&& src) {
     src.n_elem = 0;
     _bbox = src._bbox;
     src._bbox.reset();
+    vbo_cap = src.vbo_cap;
+    src.vbo_cap = 0;
+    ebo_cap = src.ebo_cap;
+    src.ebo_cap = 0;
+    vert_ranges = std::move(src.vert_ranges);
+    src.vert_ranges.all();
+    idx_ranges = std::move(src.idx_ranges);
+    src.idx_ranges.all();
     _verts = std::move(src._verts);
     _idxs = std::move(src._idxs);
 }
@@ -203,6 +279,14 @@ void Mesh::operator=(Mesh&& src) {
     src.n_elem = 0;
     _bbox = src._bbox;
     src._bbox.reset();
+    vbo_cap = src.vbo_cap;
+    src.vbo_cap = 0;
+    ebo_cap = src.ebo_cap;
+    src.ebo_cap = 0;
+    vert_ranges = std::move(src.vert_ranges);
+    src.vert_ranges.all();
+    idx_ranges = std::move(src.idx_ranges);
+    src.idx_ranges.all();
     _verts = std::move(src._verts);
     _idxs = std::move(src._idxs);
 }
@@ -244,26 +328,32 @@ void Mesh::destroy() {
     glDeleteBuffers(1, &vbo);
     glDeleteVertexArrays(1, &vao);
     ebo = vao = vbo = 0;
+    vbo_cap = ebo_cap = 0;
+    vert_ranges.all();
+    idx_ranges.all();
 }
 
 void Mesh::update() {
     glBindVertexArray(vao);
 
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Vert) * _verts.size(), _verts.data(), GL_DYNAMIC_DRAW);
+    upload(GL_ARRAY_BUFFER, vert_ranges, vbo_cap, _verts.data(), _verts.size(), sizeof(Vert));
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Index) * _idxs.size(), _idxs.data(),
-                 GL_DYNAMIC_DRAW);
+    upload(GL_ELEMENT_ARRAY_BUFFER, idx_ranges, ebo_cap, _idxs.data(), _idxs.size(),
+           sizeof(Index));
 
     glBindVertexArray(0);
 
+    n_elem = (GLuint)_idxs.size();
     dirty = false;
 }
 
 void Mesh::recreate(std::vector<Vert>&& vertices, std::vector<Index>&& indices) {
 
     dirty = true;
+    vert_ranges.all();
+    idx_ranges.all();
     _verts = std::move(vertices);
     _idxs = std::move(indices);
 
@@ -286,11 +376,25 @@ Mesh Mesh::copy() const {
 
 std::vector<Mesh::Vert>& Mesh::edit_verts() {
     dirty = true;
+    vert_ranges.all();
     return _verts;
 }
 
 std::vector<Mesh::Index>& Mesh::edit_indices() {
     dirty = true;
+    idx_ranges.all();
+    return _idxs;
+}
+
+std::vector<Mesh::Vert>& Mesh::edit_verts(size_t begin, size_t end) {
+    dirty = true;
+    vert_ranges.add(begin, end);
+    return _verts;
+}
+
+std::vector<Mesh::Index>& Mesh::edit_indices(size_t begin, size_t end) {
+    dirty = true;
+    idx_ranges.add(begin, end);
     return _idxs;
 }
 
@@ -324,6 +428,10 @@ Instances::Instances(Instances&& src) {
     src.vbo = 0;
     dirty = src.dirty;
     src.dirty = true;
+    vbo_cap = src.vbo_cap;
+    src.vbo_cap = 0;
+    ranges = std::move(src.ranges);
+    src.ranges.all();
 }
 
 Instances::~Instances() {
@@ -342,6 +450,10 @@ void Instances::operator=(Instances&& src) {
     src.vbo = 0;
     dirty = src.dirty;
     src.dirty = true;
+    vbo_cap = src.vbo_cap;
+    src.vbo_cap = 0;
+    ranges = std::move(src.ranges);
+    src.ranges.all();
 }
 
 void Instances::create() {
@@ -379,27 +491,41 @@ void Instances::render() {
 
 Instances::Info& Instances::get(size_t idx) {
     dirty = true;
+    ranges.add(idx, idx + 1);
     return data[idx];
 }
 
 size_t Instances::add(const Mat4& transform, GLuint id) {
     data.emplace_back(Info{id, transform});
     dirty = true;
+    ranges.add(data.size() - 1, data.size());
     return data.size() - 1;
 }
 
+void Instances::remove(size_t idx) {
+    data[idx] = data.back();
+    data.pop_back();
+    dirty = true;
+    ranges.add(idx, idx + 1);
+}
+
+size_t Instances::size() const {
+    return data.size();
+}
+
 void Instances::clear(size_t n) {
     data.clear();
     if(n > 0) {
         data.reserve(n);
     }
     dirty = true;
+    ranges.all();
 }
 
 void Instances::update() {
     glBindVertexArray(_mesh.vao);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Info) * data.size(), data.data(), GL_DYNAMIC_DRAW);
+    upload(GL_ARRAY_BUFFER, ranges, vbo_cap, data.data(), data.size(), sizeof(Info));
     glBindVertexArray(0);
     dirty = false;
 }
@@ -410,6 +536,8 @@ void Instances::destroy() {
 
     glDeleteBuffers(1, &vbo);
     vbo = 0;
+    vbo_cap = 0;
+    ranges.all();
     _mesh.destroy();
 }
 
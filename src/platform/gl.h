@@ -56,6 +56,25 @@ private:
     GLuint id;
 };
 
+/// Parts of a buffer that have changed since it was last uploaded. Tracking
+/// gives up and re-uploads the whole buffer once there are too many to be worth it.
+class Buffer_Ranges {
+public:
+    void add(size_t begin, size_t end);
+    void all();
+    void clear();
+
+    bool empty() const;
+    bool whole() const;
+    /// Sorted, with overlapping and adjacent ranges merged
+    std::vector<std::pair<size_t, size_t>> merged() const;
+
+private:
+    static constexpr size_t max_ranges = 256;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    bool everything = true;
+};
+
 class Mesh {
 public:
     typedef GLuint Index;
@@ -80,6 +99,9 @@ public:
     void recreate(std::vector<Vert>&& vertices, std::vector<Index>&& indices);
     std::vector<Vert>& edit_verts();
     std::vector<Index>& edit_indices();
+    /// Edit only elements [begin, end), so only they are re-uploaded
+    std::vector<Vert>& edit_verts(size_t begin, size_t end);
+    std::vector<Index>& edit_indices(size_t begin, size_t end);
     Mesh copy() const;
 
     BBox bbox() const;
@@ -97,6 +119,10 @@ private:
     GLuint n_elem = 0;
     bool dirty = true;
 
+    // Allocated buffer sizes, in elements
+    size_t vbo_cap = 0, ebo_cap = 0;
+    Buffer_Ranges vert_ranges, idx_ranges;
+
     std::vector<Vert> _verts;
     std::vector<Index> _idxs;
 
@@ -121,6 +147,9 @@ public:
     void render();
     size_t add(const Mat4& transform, GLuint id = 0);
     Info& get(size_t idx);
+    /// Removes an instance by moving the last one into its place
+    void remove(size_t idx);
+    size_t size() const;
     void clear(size_t n = 0);
     const Mesh& mesh() const;
 
@@ -131,6 +160,8 @@ private:
 
     GLuint vbo = 0;
     bool dirty = false;
+    size_t vbo_cap = 0;
+    Buffer_Ranges ranges;
 
     Mesh _mesh;
     std::vector<Info> data;
@@ -0,0 +1,138 @@
+
+#include "aov.h"
+
+#include <istream>
+#include <ostream>
+#include <type_traits>
+
+namespace PT {
+
+const char* AOV_Names[(int)AOV::count] = {"depth",    "normal",  "albedo",
+                                          "material", "samples", "variance"};
+
+// EXR channel suffixes for each AOV's components
+static const std::vector<const char*> aov_channels[(int)AOV::count] = {
+    {"Z"}, {"X", "Y", "Z"}, {"R", "G", "B"}, {"id"}, {"count"}, {"R", "G", "B"}};
+
+void AOV_Buffer::resize(size_t _w, size_t _h) {
+    w = _w;
+    h = _h;
+    pixels.clear();
+    pixels.resize(w * h);
+}
+
+void AOV_Buffer::clear() {
+    resize(w, h);
+}
+
+bool AOV_Buffer::empty() const {
+    return pixels.empty();
+}
+
+std::pair<size_t, size_t> AOV_Buffer::dimension() const {
+    return {w, h};
+}
+
+void AOV_Buffer::add(size_t x, size_t y, const AOV_Sample& aov, Spectrum radiance) {
+
+    assert(x < w && y < h);
+    Pixel& p = pixels[y * w + x];
+
+    p.samples += 1.0f;
+    p.sum += radiance;
+    p.sum_sq += radiance * radiance;
+
+    if(aov.hit) {
+        p.hits += 1.0f;
+        p.depth += aov.depth;
+        p.normal += aov.normal;
+        p.albedo += aov.albedo;
+        if(p.material < 0 || aov.material < p.material) p.material = aov.material;
+    }
+}
+
+void AOV_Buffer::merge(const AOV_Buffer& other, size_t y0) {
+
+    assert(other.w == w && y0 <= h);
+
+    size_t n = std::min(other.h, h - y0) * w;
+    for(size_t i = 0; i < n; i++) {
+        Pixel& p = pixels[y0 * w + i];
+        const Pixel& o = other.pixels[i];
+        p.hits += o.hits;
+        p.samples += o.samples;
+        p.depth += o.depth;
+        p.normal += o.normal;
+        p.albedo += o.albedo;
+        p.sum += o.sum;
+        p.sum_sq += o.sum_sq;
+        if(o.material >= 0 && (p.material < 0 || o.material < p.material)) {
+            p.material = o.material;
+        }
+    }
+}
+
+Spectrum AOV_Buffer::at(AOV aov, size_t x, size_t y) const {
+
+    assert(x < w && y < h);
+    const Pixel& p = pixels[y * w + x];
+    float inv_hits = p.hits > 0.0f ? 1.0f / p.hits : 0.0f;
+
+    switch(aov) {
+    case AOV::depth: {
+        float depth = p.hits > 0.0f ? p.depth * inv_hits : std::numeric_limits<float>::infinity();
+        return Spectrum(depth);
+    }
+    case AOV::normal: {
+        Vec3 n = p.normal * inv_hits;
+        return Spectrum(n.x, n.y, n.z);
+    }
+    case AOV::albedo: return p.albedo * inv_hits;
+    case AOV::material: return Spectrum((float)p.material);
+    case AOV::samples: return Spectrum(p.samples);
+    case AOV::variance: {
+        if(p.samples < 2.0f) return {};
+        Spectrum mean = p.sum * (1.0f / p.samples);
+        Spectrum var = (p.sum_sq - p.sum * mean) * (1.0f / (p.samples - 1.0f));
+        var = Spectrum(std::max(var.r, 0.0f), std::max(var.g, 0.0f), std::max(var.b, 0.0f));
+        return var * (1.0f / p.samples);
+    }
+    default: return {};
+    }
+}
+
+void AOV_Buffer::write(std::ostream& out) const {
+    static_assert(std::is_trivially_copyable_v<Pixel>);
+    out.write((const char*)pixels.data(), pixels.size() * sizeof(Pixel));
+}
+
+bool AOV_Buffer::read(std::istream& in) {
+    in.read((char*)pixels.data(), pixels.size() * sizeof(Pixel));
+    return (bool)in;
+}
+
+std::vector<Image_Writer::Channel> AOV_Buffer::channels() const {
+
+    std::vector<Image_Writer::Channel> ret;
+
+    for(int a = 0; a < (int)AOV::count; a++) {
+        size_t first = ret.size();
+        for(const char* c : aov_channels[a]) {
+            Image_Writer::Channel channel;
+            channel.name = std::string(AOV_Names[a]) + "." + c;
+            channel.data.resize(w * h);
+            ret.push_back(std::move(channel));
+        }
+        for(size_t y = 0; y < h; y++) {
+            for(size_t x = 0; x < w; x++) {
+                Spectrum v = at((AOV)a, x, y);
+                for(size_t c = 0; c < aov_channels[a].size(); c++) {
+                    ret[first + c].data[y * w + x] = v.data[c];
+                }
+            }
+        }
+    }
+    return ret;
+}
+
+} // namespace PT
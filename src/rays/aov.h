@@ -0,0 +1,67 @@
+
+#pragma once
+
+#include <iosfwd>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../lib/spectrum.h"
+#include "../util/image_writer.h"
+
+namespace PT {
+
+/// Arbitrary output variables: per-pixel data written alongside the rendered image
+enum class AOV : int { depth, normal, albedo, material, samples, variance, count };
+extern const char* AOV_Names[(int)AOV::count];
+
+/// Properties of the first surface a camera ray hits
+struct AOV_Sample {
+    bool hit = false;
+    float depth = 0.0f;
+    Vec3 normal;
+    Spectrum albedo;
+    int material = -1;
+};
+
+/// Running per-pixel totals from which each AOV is computed. Render epochs fill
+/// small buffers a band of rows at a time, which are merged into the pathtracer's.
+class AOV_Buffer {
+public:
+    void resize(size_t w, size_t h);
+    void clear();
+    bool empty() const;
+    std::pair<size_t, size_t> dimension() const;
+
+    /// Record one camera path through pixel (x,y) and the radiance it carried
+    void add(size_t x, size_t y, const AOV_Sample& aov, Spectrum radiance);
+    /// Add other's totals to the rows starting at y0 (rows past the end are dropped)
+    void merge(const AOV_Buffer& other, size_t y0 = 0);
+
+    /// Value of an AOV at pixel (x,y); scalar AOVs are returned in every channel.
+    /// Depth, normal, and albedo are averaged over paths that hit a surface; pixels
+    /// that saw several materials report the lowest index; variance is that of the
+    /// pixel's mean radiance.
+    Spectrum at(AOV aov, size_t x, size_t y) const;
+
+    /// One EXR channel per AOV component, named like "normal.X"
+    std::vector<Image_Writer::Channel> channels() const;
+
+    /// Raw totals, for render checkpoints; read() expects the buffer to be sized already
+    void write(std::ostream& out) const;
+    bool read(std::istream& in);
+
+private:
+    struct Pixel {
+        float hits = 0.0f, samples = 0.0f;
+        float depth = 0.0f;
+        Vec3 normal;
+        Spectrum albedo;
+        int material = -1;
+        Spectrum sum, sum_sq;
+    };
+
+    size_t w = 0, h = 0;
+    std::vector<Pixel> pixels;
+};
+
+} // namespace PT
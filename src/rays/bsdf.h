@@ -127,6 +127,18 @@ public:
                           underlying);
     }
 
+    // Fraction of light reflected or transmitted at normal incidence, for AOVs.
+    // Emitters report white.
+    Spectrum albedo() const {
+        return std::visit(
+            overloaded{[](const BSDF_Lambertian& l) { return l.albedo * PI_F; },
+                       [](const BSDF_Mirror& m) { return m.reflectance; },
+                       [](const BSDF_Glass& g) { return g.transmittance; },
+                       [](const BSDF_Diffuse&) { return Spectrum{1.0f}; },
+                       [](const BSDF_Refract& r) { return r.transmittance; }},
+            underlying);
+    }
+
     bool is_discrete() const {
         return std::visit(overloaded{[](const BSDF_Lambertian&) { return false; },
                                      [](const BSDF_Diffuse&) { return false; },
@@ -0,0 +1,307 @@
+
+#include "denoise.h"
+#include "../util/simd.h"
+#include "../util/thread_pool.h"
+
+#include <algorithm>
+
+namespace PT {
+
+// B3 spline taps for offsets -2..2
+static const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+// Divide albedo out only down to this, so dark surfaces don't amplify noise
+static const float min_albedo = 0.01f;
+
+// Per-pixel features that steer the filter, stored as separate planes
+struct Denoise_Guide {
+    size_t w = 0, h = 0;
+    std::vector<float> nx, ny, nz, z, dz, hit;
+    std::vector<Spectrum> albedo;
+};
+
+// Demodulated radiance and the variance of its luminance
+struct Denoise_Signal {
+    std::vector<float> r, g, b, var;
+
+    void resize(size_t n) {
+        r.resize(n);
+        g.resize(n);
+        b.resize(n);
+        var.resize(n);
+    }
+};
+
+static float luma(float r, float g, float b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// Run f(begin, end) over blocks of rows on the shared pool
+template<typename F> static void parallel_rows(size_t h, size_t w, F&& f) {
+    const size_t min_pixels_per_chunk = 1 << 12;
+    Thread_Pool::global().parallel_for(0, h, f, min_pixels_per_chunk / std::max<size_t>(w, 1) + 1);
+}
+
+// 3x3 Gaussian blur of the variance at (x,y), clamping at the borders
+static float blurred_variance(const std::vector<float>& var, size_t w, size_t h, size_t x,
+                              size_t y) {
+    static const float k[3] = {0.25f, 0.5f, 0.25f};
+    float ret = 0.0f;
+    for(int dy = -1; dy <= 1; dy++) {
+        size_t qy = (size_t)std::clamp((long long)y + dy, 0ll, (long long)h - 1);
+        for(int dx = -1; dx <= 1; dx++) {
+            size_t qx = (size_t)std::clamp((long long)x + dx, 0ll, (long long)w - 1);
+            ret += k[dy + 1] * k[dx + 1] * var[qy * w + qx];
+        }
+    }
+    return ret;
+}
+
+static void filter_pixel(const Denoise_Guide& G, const Denoise_Signal& in, Denoise_Signal& out,
+                         const Denoise_Settings& set, size_t step, size_t x, size_t y) {
+
+    size_t w = G.w, h = G.h, p = y * w + x;
+
+    float l_p = luma(in.r[p], in.g[p], in.b[p]);
+    float std_p = std::sqrt(blurred_variance(in.var, w, h, x, y));
+    float inv_l = 1.0f / (set.sigma_color * std_p + 1e-6f);
+    float z_scale = set.sigma_depth * G.dz[p] * step;
+
+    float sum_w = 0.0f, sum_w2var = 0.0f;
+    float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
+
+    for(int dy = -2; dy <= 2; dy++) {
+        long long qy = (long long)y + dy * (long long)step;
+        if(qy < 0 || qy >= (long long)h) continue;
+
+        for(int dx = -2; dx <= 2; dx++) {
+            long long qx = (long long)x + dx * (long long)step;
+            if(qx < 0 || qx >= (long long)w) continue;
+
+            size_t q = (size_t)qy * w + (size_t)qx;
+            if(G.hit[q] != G.hit[p]) continue;
+
+            float l_q = luma(in.r[q], in.g[q], in.b[q]);
+            float n_dot = G.nx[p] * G.nx[q] + G.ny[p] * G.ny[q] + G.nz[p] * G.nz[q];
+            float dist = std::sqrt((float)(dx * dx + dy * dy));
+
+            float e = std::abs(l_p - l_q) * inv_l +
+                      std::abs(G.z[p] - G.z[q]) / (z_scale * dist + 1e-4f) +
+                      set.sigma_normal * std::max(G.hit[p] - n_dot, 0.0f);
+            float wt = kernel[dx + 2] * kernel[dy + 2] * std::exp(-e);
+
+            sum_w += wt;
+            sum_w2var += wt * wt * in.var[q];
+            sum_r += wt * in.r[q];
+            sum_g += wt * in.g[q];
+            sum_b += wt * in.b[q];
+        }
+    }
+
+    // The center tap always has positive weight
+    float inv_w = 1.0f / sum_w;
+    out.r[p] = sum_r * inv_w;
+    out.g[p] = sum_g * inv_w;
+    out.b[p] = sum_b * inv_w;
+    out.var[p] = sum_w2var * inv_w * inv_w;
+}
+
+#ifdef SIMD_SSE2
+
+// Filter four horizontally adjacent pixels starting at (x,y). Every tap must lie
+// inside the image horizontally; taps above or below it are skipped per row.
+static void filter_pixels4(const Denoise_Guide& G, const Denoise_Signal& in, Denoise_Signal& out,
+                           const Denoise_Settings& set, size_t step, size_t x, size_t y) {
+
+    size_t w = G.w, h = G.h, p = y * w + x;
+
+    auto load = [](const std::vector<float>& v, size_t i) { return _mm_loadu_ps(&v[i]); };
+    auto luma4 = [](__m128 r, __m128 g, __m128 b) {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126f)),
+                                     _mm_mul_ps(g, _mm_set1_ps(0.7152f))),
+                          _mm_mul_ps(b, _mm_set1_ps(0.0722f)));
+    };
+    auto abs4 = [](__m128 v) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), v); };
+
+    // Blurred variance, as in blurred_variance(); x - 1 and x + 4 are in range here
+    static const float k[3] = {0.25f, 0.5f, 0.25f};
+    __m128 var_p = _mm_setzero_ps();
+    for(int dy = -1; dy <= 1; dy++) {
+        size_t qy = (size_t)std::clamp((long long)y + dy, 0ll, (long long)h - 1);
+        for(int dx = -1; dx <= 1; dx++) {
+            __m128 v = load(in.var, qy * w + x + dx);
+            var_p = _mm_add_ps(var_p, _mm_mul_ps(_mm_set1_ps(k[dy + 1] * k[dx + 1]), v));
+        }
+    }
+
+    __m128 l_p = luma4(load(in.r, p), load(in.g, p), load(in.b, p));
+    __m128 std_p = _mm_sqrt_ps(var_p);
+    __m128 l_scale = _mm_mul_ps(_mm_set1_ps(set.sigma_color), std_p);
+    __m128 inv_l = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(l_scale, _mm_set1_ps(1e-6f)));
+    __m128 z_scale = _mm_mul_ps(_mm_set1_ps(set.sigma_depth * step), load(G.dz, p));
+    __m128 nx_p = load(G.nx, p), ny_p = load(G.ny, p), nz_p = load(G.nz, p);
+    __m128 z_p = load(G.z, p), hit_p = load(G.hit, p);
+
+    __m128 sum_w = _mm_setzero_ps(), sum_w2var = _mm_setzero_ps();
+    __m128 sum_r = _mm_setzero_ps(), sum_g = _mm_setzero_ps(), sum_b = _mm_setzero_ps();
+
+    for(int dy = -2; dy <= 2; dy++) {
+        long long qy = (long long)y + dy * (long long)step;
+        if(qy < 0 || qy >= (long long)h) continue;
+
+        for(int dx = -2; dx <= 2; dx++) {
+            size_t q = (size_t)qy * w + x + dx * (long long)step;
+
+            __m128 r_q = load(in.r, q), g_q = load(in.g, q), b_q = load(in.b, q);
+            __m128 n_dot = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(nx_p, load(G.nx, q)), _mm_mul_ps(ny_p, load(G.ny, q))),
+                _mm_mul_ps(nz_p, load(G.nz, q)));
+            float dist = std::sqrt((float)(dx * dx + dy * dy));
+
+            __m128 e_l = _mm_mul_ps(abs4(_mm_sub_ps(l_p, luma4(r_q, g_q, b_q))), inv_l);
+            __m128 e_z = _mm_div_ps(
+                abs4(_mm_sub_ps(z_p, load(G.z, q))),
+                _mm_add_ps(_mm_mul_ps(z_scale, _mm_set1_ps(dist)), _mm_set1_ps(1e-4f)));
+            __m128 e_n = _mm_mul_ps(_mm_set1_ps(set.sigma_normal),
+                                    _mm_max_ps(_mm_sub_ps(hit_p, n_dot), _mm_setzero_ps()));
+            __m128 e = _mm_add_ps(_mm_add_ps(e_l, e_z), e_n);
+
+            __m128 wt = _mm_mul_ps(_mm_set1_ps(kernel[dx + 2] * kernel[dy + 2]), SIMD::exp_neg(e));
+            wt = _mm_and_ps(wt, _mm_cmpeq_ps(hit_p, load(G.hit, q)));
+
+            sum_w = _mm_add_ps(sum_w, wt);
+            sum_w2var = _mm_add_ps(sum_w2var, _mm_mul_ps(_mm_mul_ps(wt, wt), load(in.var, q)));
+            sum_r = _mm_add_ps(sum_r, _mm_mul_ps(wt, r_q));
+            sum_g = _mm_add_ps(sum_g, _mm_mul_ps(wt, g_q));
+            sum_b = _mm_add_ps(sum_b, _mm_mul_ps(wt, b_q));
+        }
+    }
+
+    __m128 inv_w = _mm_div_ps(_mm_set1_ps(1.0f), sum_w);
+    _mm_storeu_ps(&out.r[p], _mm_mul_ps(sum_r, inv_w));
+    _mm_storeu_ps(&out.g[p], _mm_mul_ps(sum_g, inv_w));
+    _mm_storeu_ps(&out.b[p], _mm_mul_ps(sum_b, inv_w));
+    _mm_storeu_ps(&out.var[p], _mm_mul_ps(sum_w2var, _mm_mul_ps(inv_w, inv_w)));
+}
+
+#endif
+
+static void filter_pass(const Denoise_Guide& G, const Denoise_Signal& in, Denoise_Signal& out,
+                        const Denoise_Settings& set, size_t step) {
+
+    parallel_rows(G.h, G.w, [&](size_t begin, size_t end) {
+        for(size_t y = begin; y < end; y++) {
+            size_t x = 0;
+#ifdef SIMD_SSE2
+            // Vectorize the span where every tap is inside the image horizontally
+            size_t margin = 2 * step;
+            for(; x < margin && x < G.w; x++) filter_pixel(G, in, out, set, step, x, y);
+            for(; x + 4 + margin <= G.w; x += 4) filter_pixels4(G, in, out, set, step, x, y);
+#endif
+            for(; x < G.w; x++) filter_pixel(G, in, out, set, step, x, y);
+        }
+    });
+}
+
+HDR_Image denoise(const HDR_Image& image, const AOV_Buffer& aovs, const Denoise_Settings& set) {
+
+    auto [w, h] = image.dimension();
+    assert(aovs.dimension() == image.dimension());
+
+    HDR_Image ret(w, h);
+    size_t n = w * h;
+
+    Denoise_Guide G;
+    G.w = w;
+    G.h = h;
+    for(auto* plane : {&G.nx, &G.ny, &G.nz, &G.z, &G.dz, &G.hit}) plane->resize(n);
+    G.albedo.resize(n);
+
+    Denoise_Signal a, b;
+    a.resize(n);
+    b.resize(n);
+
+    // Gather features and divide albedo out of the radiance and its variance
+    parallel_rows(h, w, [&](size_t begin, size_t end) {
+        for(size_t y = begin; y < end; y++) {
+            for(size_t x = 0; x < w; x++) {
+                size_t p = y * w + x;
+
+                float depth = aovs.at(AOV::depth, x, y).r;
+                bool hit = std::isfinite(depth);
+                Spectrum normal = aovs.at(AOV::normal, x, y);
+                Vec3 nrm(normal.r, normal.g, normal.b);
+                if(nrm.norm_squared() > 0.0f) nrm.normalize();
+
+                Spectrum albedo(1.0f);
+                if(hit) {
+                    Spectrum al = aovs.at(AOV::albedo, x, y);
+                    albedo = Spectrum(std::max(al.r, min_albedo), std::max(al.g, min_albedo),
+                                      std::max(al.b, min_albedo));
+                }
+
+                G.hit[p] = hit ? 1.0f : 0.0f;
+                G.z[p] = hit ? depth : 0.0f;
+                G.nx[p] = nrm.x;
+                G.ny[p] = nrm.y;
+                G.nz[p] = nrm.z;
+                G.albedo[p] = albedo;
+
+                Spectrum c = image.at(x, y);
+                Spectrum var = aovs.at(AOV::variance, x, y);
+                a.r[p] = c.r / albedo.r;
+                a.g[p] = c.g / albedo.g;
+                a.b[p] = c.b / albedo.b;
+                a.var[p] = luma(var.r / (albedo.r * albedo.r), var.g / (albedo.g * albedo.g),
+                                var.b / (albedo.b * albedo.b));
+            }
+        }
+    });
+
+    // Depth gradients scale the depth tolerance, so slanted surfaces still blur
+    // along themselves. Pixels with too few samples to estimate their variance
+    // fall back to the luminance variance of their neighbourhood.
+    parallel_rows(h, w, [&](size_t begin, size_t end) {
+        for(size_t y = begin; y < end; y++) {
+            for(size_t x = 0; x < w; x++) {
+                size_t p = y * w + x;
+
+                size_t x0 = x > 0 ? x - 1 : x, x1 = std::min(x + 1, w - 1);
+                size_t y0 = y > 0 ? y - 1 : y, y1 = std::min(y + 1, h - 1);
+                float span_x = (float)std::max<size_t>(x1 - x0, 1);
+                float span_y = (float)std::max<size_t>(y1 - y0, 1);
+                float gx = std::abs(G.z[y * w + x1] - G.z[y * w + x0]) / span_x;
+                float gy = std::abs(G.z[y1 * w + x] - G.z[y0 * w + x]) / span_y;
+                G.dz[p] = G.hit[p] > 0.0f ? std::max(gx, gy) : 0.0f;
+
+                if(aovs.at(AOV::samples, x, y).r >= 2.0f) continue;
+
+                float sum = 0.0f, sum_sq = 0.0f, count = 0.0f;
+                for(size_t qy = y0; qy <= y1; qy++) {
+                    for(size_t qx = x0; qx <= x1; qx++) {
+                        size_t q = qy * w + qx;
+                        float l = luma(a.r[q], a.g[q], a.b[q]);
+                        sum += l;
+                        sum_sq += l * l;
+                        count += 1.0f;
+                    }
+                }
+                float mean = sum / count;
+                a.var[p] = std::max(sum_sq / count - mean * mean, 0.0f);
+            }
+        }
+    });
+
+    for(int i = 0; i < set.iterations; i++) {
+        filter_pass(G, a, b, set, size_t(1) << i);
+        std::swap(a, b);
+    }
+
+    for(size_t p = 0; p < n; p++) {
+        Spectrum albedo = G.albedo[p];
+        ret.set(p, Spectrum(a.r[p] * albedo.r, a.g[p] * albedo.g, a.b[p] * albedo.b));
+    }
+    return ret;
+}
+
+} // namespace PT
@@ -0,0 +1,29 @@
+
+#pragma once
+
+#include "../util/hdr_image.h"
+#include "aov.h"
+
+namespace PT {
+
+struct Denoise_Settings {
+    /// Filter passes; each doubles the footprint (5, 9, 17, ... pixels across),
+    /// trading time for the ability to smooth out lower frequency noise.
+    int iterations = 4;
+    /// Edge stopping: how many standard deviations of noise two pixels' luminance
+    /// may differ by, how sharply normals must agree, and how far depth may stray
+    /// from the local gradient before the filter stops blurring across them.
+    float sigma_color = 4.0f;
+    float sigma_normal = 64.0f;
+    float sigma_depth = 1.0f;
+};
+
+/// Edge-avoiding a-trous wavelet filter guided by the AOVs, after Dammertz et al.
+/// and SVGF. Albedo is divided out before filtering so texture detail survives,
+/// and each pass weights neighbours by how much their luminance differs relative
+/// to the (filtered) per-pixel variance. Returns the filtered image; the AOVs must
+/// match the image's size.
+HDR_Image denoise(const HDR_Image& image, const AOV_Buffer& aovs,
+                  const Denoise_Settings& settings = {});
+
+} // namespace PT
@@ -6,6 +6,7 @@
 #include "../lib/mathlib.h"
 #include "../lib/spectrum.h"
 #include "../util/hdr_image.h"
+#include "../util/mip_map.h"
 
 #include "light.h"
 #include "samplers.h"
@@ -40,14 +41,25 @@ struct Env_Sphere {
 
 struct Env_Map {
 
-    Env_Map(HDR_Image&& img) : image(std::move(img)), image_sampler(image) {
+    // Radiance is kept as float unless a compact format is asked for. Compact
+    // formats clamp bright texels (rgb9e5 tops out at 65408), so importance
+    // sampling is then built from the same quantized texels that are looked up.
+    Env_Map(HDR_Image&& img, HDR_Format format = HDR_Format::rgb32f)
+        : image(quantize(img, format), format), image_sampler(img) {
     }
 
     Vec3 sample() const;
     Spectrum evaluate(Vec3 dir) const;
+    /// Average radiance over a cone of directions with the given half-angle (radians)
+    Spectrum evaluate(Vec3 dir, float spread) const;
     float pdf(Vec3 dir) const;
 
-    HDR_Image image;
+    static const HDR_Image& quantize(HDR_Image& img, HDR_Format format) {
+        if(img.format() != format) img.convert(format);
+        return img;
+    }
+
+    Mip_Map image;
     Samplers::Sphere::Uniform uniform_sampler;
     Samplers::Sphere::Image image_sampler;
 };
@@ -78,6 +90,13 @@ public:
         return std::visit([&dir](const auto& h) { return h.evaluate(dir); }, underlying);
     }
 
+    Spectrum evaluate(Vec3 dir, float spread) const {
+        return std::visit(
+            overloaded{[&](const Env_Map& m) { return m.evaluate(dir, spread); },
+                       [&](const auto& h) { return h.evaluate(dir); }},
+            underlying);
+    }
+
     bool is_discrete() const {
         return false;
     }
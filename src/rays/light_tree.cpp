@@ -0,0 +1,168 @@
+
+#include "light_tree.h"
+#include "../util/rand.h"
+
+namespace PT {
+
+static float safe_acos(float c) {
+    return std::acos(clamp(c, -1.0f, 1.0f));
+}
+
+float Light_Bounds::importance(Vec3 from, bool falloff) const {
+
+    if(power <= 0.0f) return 0.0f;
+
+    Vec3 to = from - bounds.center();
+    float d2 = to.norm_squared();
+    float r2 = (bounds.max - bounds.min).norm_squared() / 4.0f;
+
+    // Angle between the cone axis and the direction to the point
+    float cos_w = d2 > 0.0f ? dot(axis, to / std::sqrt(d2)) : 1.0f;
+    if(two_sided) cos_w = std::abs(cos_w);
+
+    // Angle subtended by the bounding sphere of the emitters, as seen from the point
+    float cos_b = d2 > r2 ? std::sqrt(1.0f - r2 / d2) : -1.0f;
+
+    // Smallest angle between the point and any emitting normal in the cone
+    float theta = safe_acos(cos_w) - safe_acos(cos_theta_o) - safe_acos(cos_b);
+    theta = std::max(theta, 0.0f);
+    if(theta >= theta_e) return 0.0f;
+
+    float ret = power * std::cos(theta);
+    if(falloff) ret /= std::max({d2, r2, EPS_F});
+    return ret;
+}
+
+Light_Bounds Light_Bounds::merge(const Light_Bounds& l, const Light_Bounds& r) {
+
+    Light_Bounds ret;
+    ret.bounds = l.bounds;
+    ret.bounds.enclose(r.bounds);
+    ret.power = l.power + r.power;
+    ret.theta_e = std::max(l.theta_e, r.theta_e);
+    ret.two_sided = l.two_sided || r.two_sided;
+
+    // Find the smallest cone containing both normal cones
+    float theta_l = safe_acos(l.cos_theta_o);
+    float theta_r = safe_acos(r.cos_theta_o);
+    float theta_d = safe_acos(dot(l.axis, r.axis));
+
+    if(std::min(theta_d + theta_r, PI_F) <= theta_l) {
+        ret.axis = l.axis;
+        ret.cos_theta_o = l.cos_theta_o;
+        return ret;
+    }
+    if(std::min(theta_d + theta_l, PI_F) <= theta_r) {
+        ret.axis = r.axis;
+        ret.cos_theta_o = r.cos_theta_o;
+        return ret;
+    }
+
+    float theta_o = (theta_l + theta_d + theta_r) / 2.0f;
+    Vec3 rot_axis = cross(l.axis, r.axis);
+    if(theta_o >= PI_F || rot_axis.norm_squared() == 0.0f) {
+        ret.axis = l.axis;
+        ret.cos_theta_o = -1.0f;
+        return ret;
+    }
+
+    // Rotate l's axis toward r's so the new cone just reaches the far side of l's
+    ret.axis = Mat4::rotate(Degrees(theta_o - theta_l), rot_axis).rotate(l.axis).unit();
+    ret.cos_theta_o = std::cos(theta_o);
+    return ret;
+}
+
+void Light_Tree::build(std::vector<Light_Bounds>&& lights, bool distance_falloff) {
+
+    clear();
+    falloff = distance_falloff;
+    if(lights.empty()) return;
+
+    nodes.reserve(2 * lights.size() - 1);
+    build_node(lights, 0, lights.size());
+}
+
+size_t Light_Tree::build_node(std::vector<Light_Bounds>& lights, size_t start, size_t end) {
+
+    size_t idx = nodes.size();
+    nodes.emplace_back();
+
+    if(end - start == 1) {
+        nodes[idx].bounds = lights[start];
+        nodes[idx].leaf = true;
+        return idx;
+    }
+
+    // Split at the median centroid along the widest axis
+    BBox centroids;
+    for(size_t i = start; i < end; i++) centroids.enclose(lights[i].bounds.center());
+
+    Vec3 extent = centroids.max - centroids.min;
+    int axis = 0;
+    if(extent.y > extent[axis]) axis = 1;
+    if(extent.z > extent[axis]) axis = 2;
+
+    size_t mid = (start + end) / 2;
+    std::nth_element(lights.begin() + start, lights.begin() + mid, lights.begin() + end,
+                     [axis](const Light_Bounds& a, const Light_Bounds& b) {
+                         return a.bounds.center()[axis] < b.bounds.center()[axis];
+                     });
+
+    size_t l = build_node(lights, start, mid);
+    size_t r = build_node(lights, mid, end);
+
+    nodes[idx].l = l;
+    nodes[idx].r = r;
+    nodes[idx].bounds = Light_Bounds::merge(nodes[l].bounds, nodes[r].bounds);
+    return idx;
+}
+
+void Light_Tree::clear() {
+    nodes.clear();
+}
+
+bool Light_Tree::empty() const {
+    return nodes.empty();
+}
+
+std::pair<size_t, float> Light_Tree::sample(Vec3 from) const {
+
+    if(nodes.empty()) return {0, 0.0f};
+
+    size_t idx = 0;
+    float prob = 1.0f;
+    while(!nodes[idx].leaf) {
+        const Node& node = nodes[idx];
+        float l = nodes[node.l].bounds.importance(from, falloff);
+        float r = nodes[node.r].bounds.importance(from, falloff);
+        if(l + r <= 0.0f) return {0, 0.0f};
+
+        float p_l = l / (l + r);
+        if(RNG::coin_flip(p_l)) {
+            idx = node.l;
+            prob *= p_l;
+        } else {
+            idx = node.r;
+            prob *= 1.0f - p_l;
+        }
+    }
+    return {nodes[idx].bounds.index, prob};
+}
+
+bool Light_Tree::crosses(const BBox& box, const Ray& ray) {
+
+    // Slab test, padded so that flat bounds (e.g. a single quad light) still get hit
+    float t0 = 0.0f, t1 = std::numeric_limits<float>::infinity();
+    for(int a = 0; a < 3; a++) {
+        float inv = 1.0f / ray.dir[a];
+        float n = (box.min[a] - EPS_F - ray.point[a]) * inv;
+        float f = (box.max[a] + EPS_F - ray.point[a]) * inv;
+        if(n > f) std::swap(n, f);
+        t0 = std::max(t0, n);
+        t1 = std::min(t1, f);
+        if(t0 > t1) return false;
+    }
+    return true;
+}
+
+} // namespace PT
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <utility>
+#include <vector>
+
+#include "../lib/mathlib.h"
+
+namespace PT {
+
+/// Conservative description of one or more emitters, used to estimate how much
+/// light they could contribute to a given point.
+struct Light_Bounds {
+
+    BBox bounds;
+    /// Total emitted power (luminance)
+    float power = 0.0f;
+    /// Cone containing every emitting normal, as an axis and the cosine of its half-angle
+    Vec3 axis = Vec3(0.0f, 1.0f, 0.0f);
+    float cos_theta_o = -1.0f;
+    /// Angle beyond the normal cone over which emission falls off to zero
+    float theta_e = PI_F / 2.0f;
+    bool two_sided = false;
+    /// Position of the emitter in the light list the tree was built for
+    size_t index = 0;
+
+    float importance(Vec3 from, bool falloff) const;
+    static Light_Bounds merge(const Light_Bounds& l, const Light_Bounds& r);
+};
+
+/// Binary hierarchy over a set of emitters. Lights are chosen by walking down the
+/// tree, picking each child in proportion to its estimated contribution.
+class Light_Tree {
+public:
+    /// If falloff is set, emitted light is assumed to fall off with squared distance
+    void build(std::vector<Light_Bounds>&& lights, bool falloff);
+    void clear();
+    bool empty() const;
+
+    /// Choose an emitter to light the point from. Returns the emitter index and the
+    /// probability of choosing it; the probability is zero if no emitter could contribute.
+    std::pair<size_t, float> sample(Vec3 from) const;
+
+    /// Sum the probability of sample(ray.point) choosing emitter i, times light_pdf(i),
+    /// over every emitter whose bounds the ray passes through, skipping the rest of the tree.
+    /// The probabilities are computed with the same walk sample() takes.
+    template<typename F> float pdf(const Ray& ray, F&& light_pdf) const {
+        if(nodes.empty()) return 0.0f;
+
+        float ret = 0.0f;
+        std::array<std::pair<size_t, float>, 2 * max_depth + 1> stack;
+        size_t top = 0;
+        stack[top++] = {0, 1.0f};
+
+        while(top) {
+            auto [idx, prob] = stack[--top];
+            const Node& node = nodes[idx];
+            if(!crosses(node.bounds.bounds, ray)) continue;
+
+            if(node.leaf) {
+                ret += prob * light_pdf(node.bounds.index);
+                continue;
+            }
+
+            float l = nodes[node.l].bounds.importance(ray.point, falloff);
+            float r = nodes[node.r].bounds.importance(ray.point, falloff);
+            if(l + r <= 0.0f) continue;
+            if(l > 0.0f) stack[top++] = {node.l, prob * l / (l + r)};
+            if(r > 0.0f) stack[top++] = {node.r, prob * r / (l + r)};
+        }
+        return ret;
+    }
+
+private:
+    static constexpr size_t max_depth = 64;
+
+    struct Node {
+        Light_Bounds bounds;
+        size_t l = 0, r = 0;
+        bool leaf = false;
+    };
+
+    size_t build_node(std::vector<Light_Bounds>& lights, size_t start, size_t end);
+    static bool crosses(const BBox& box, const Ray& ray);
+
+    std::vector<Node> nodes;
+    bool falloff = true;
+};
+
+} // namespace PT
@@ -1,13 +1,32 @@
 
 #include "pathtracer.h"
+#include "denoise.h"
 #include "../geometry/util.h"
 #include "../gui/render.h"
 
 #include <SDL2/SDL.h>
+#include <filesystem>
+#include <fstream>
 #include <thread>
 
 namespace PT {
 
+static const char checkpoint_magic[8] = {'S', '3', 'D', 'C', 'K', 'P', 'T', '\0'};
+static const unsigned int checkpoint_version = 2;
+
+static void hash_bytes(unsigned long long& hash, const void* data, size_t size) {
+    // FNV-1a
+    const unsigned char* bytes = (const unsigned char*)data;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+}
+
+template<typename T> static void hash_value(unsigned long long& hash, const T& value) {
+    hash_bytes(hash, &value, sizeof(T));
+}
+
 Pathtracer::Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim)
     : thread_pool(std::thread::hardware_concurrency()), gui(gui), camera(screen_dim),
       scene(List<Object>()) {
@@ -23,11 +42,72 @@ Pathtracer::~Pathtracer() {
     thread_pool.stop();
 }
 
+static Light_Bounds delta_light_bounds(const Scene_Light& light, size_t index) {
+
+    Mat4 T = light.pose.transform();
+
+    Light_Bounds ret;
+    ret.bounds.enclose(T * Vec3{});
+    ret.power = light.radiance().luma();
+    ret.index = index;
+
+    // Spot lights point down their local y axis, fading out between the two angle bounds
+    if(light.opt.type == Light_Type::spot) {
+        ret.axis = T.rotate(Vec3(0.0f, 1.0f, 0.0f)).unit();
+        ret.cos_theta_o = std::cos(Radians(light.opt.angle_bounds.x / 2.0f));
+        ret.theta_e =
+            Radians(std::max(light.opt.angle_bounds.y - light.opt.angle_bounds.x, 0.0f) / 2.0f);
+    }
+    return ret;
+}
+
+static Light_Bounds area_light_bounds(const GL::Mesh& mesh, const Mat4& T, Spectrum emissive,
+                                      size_t index) {
+
+    const auto& verts = mesh.verts();
+    const auto& idxs = mesh.indices();
+
+    Light_Bounds ret;
+    ret.index = index;
+    ret.two_sided = true;
+
+    // Area-weighted average normal gives the cone axis
+    float area = 0.0f;
+    Vec3 normal_sum;
+    for(size_t i = 0; i + 2 < idxs.size(); i += 3) {
+        Vec3 v0 = T * verts[idxs[i]].pos;
+        Vec3 v1 = T * verts[idxs[i + 1]].pos;
+        Vec3 v2 = T * verts[idxs[i + 2]].pos;
+        Vec3 n = cross(v1 - v0, v2 - v0);
+        area += n.norm() / 2.0f;
+        normal_sum += n;
+        ret.bounds.enclose(v0);
+        ret.bounds.enclose(v1);
+        ret.bounds.enclose(v2);
+    }
+    ret.power = emissive.luma() * area;
+
+    if(normal_sum.norm_squared() > 0.0f) {
+        ret.axis = normal_sum.unit();
+        ret.cos_theta_o = 1.0f;
+        for(size_t i = 0; i + 2 < idxs.size(); i += 3) {
+            Vec3 v0 = T * verts[idxs[i]].pos;
+            Vec3 n = cross(T * verts[idxs[i + 1]].pos - v0, T * verts[idxs[i + 2]].pos - v0);
+            if(n.norm_squared() == 0.0f) continue;
+            ret.cos_theta_o = std::min(ret.cos_theta_o, std::abs(dot(n.unit(), ret.axis)));
+        }
+    }
+    return ret;
+}
+
 void Pathtracer::build_lights(Scene& layout_scene) {
 
     point_lights.clear();
+    directional_lights.clear();
     env_light.reset();
 
+    std::vector<Light_Bounds> point_light_bounds;
+
     layout_scene.for_items([&, this](const Scene_Item& item) {
         if(item.is<Scene_Light>()) {
 
@@ -36,12 +116,13 @@ void Pathtracer::build_lights(Scene& layout_scene) {
 
             switch(light.opt.type) {
             case Light_Type::directional: {
+                directional_lights.push_back(point_lights.size());
                 point_lights.push_back(
                     Delta_Light(Directional_Light(r), light.id(), light.pose.transform()));
             } break;
             case Light_Type::sphere: {
                 if(light.opt.has_emissive_map) {
-                    env_light = Env_Light(Env_Map(light.emissive_copy()));
+                    env_light = Env_Light(Env_Map(light.emissive_copy(), env_format));
                 } else {
                     env_light = Env_Light(Env_Sphere(r));
                 }
@@ -50,10 +131,12 @@ void Pathtracer::build_lights(Scene& layout_scene) {
                 env_light = Env_Light(Env_Hemisphere(r));
             } break;
             case Light_Type::point: {
+                point_light_bounds.push_back(delta_light_bounds(light, point_lights.size()));
                 point_lights.push_back(
                     Delta_Light(Point_Light(r), light.id(), light.pose.transform()));
             } break;
             case Light_Type::spot: {
+                point_light_bounds.push_back(delta_light_bounds(light, point_lights.size()));
                 point_lights.push_back(Delta_Light(Spot_Light(r, light.opt.angle_bounds),
                                                    light.id(), light.pose.transform()));
             } break;
@@ -61,9 +144,45 @@ void Pathtracer::build_lights(Scene& layout_scene) {
             }
         }
     });
+
+    // Point light radiance doesn't fall off with distance in this renderer
+    point_light_tree.build(std::move(point_light_bounds), false);
 }
 
-void Pathtracer::build_scene(Scene& layout_scene) {
+// Refines the object's mesh until no edge strays more than the object's pixel
+// error from the surface, as seen from the camera. Edges outside the view
+// frustum stay as they are, and the object gets at most two triangles per
+// pixel, so geometry right up against the camera can't refine without bound.
+static void refine_for_camera(const Scene_Object& obj, const Camera& cam, size_t out_w,
+                              size_t out_h, GL::Mesh& mesh) {
+
+    Mat4 V = cam.get_view() * obj.pose.transform();
+    float near = cam.get_near();
+    float tan_y = std::tan(Radians(cam.get_fov()) / 2.0f), tan_x = cam.get_ar() * tan_y;
+    float norm_y = std::sqrt(1.0f + tan_y * tan_y), norm_x = std::sqrt(1.0f + tan_x * tan_x);
+    // Size of a pixel at unit distance
+    float pixel = 2.0f * tan_y / (float)out_h;
+
+    // Whether a view space sphere lies wholly nearer than the near plane or
+    // beyond one of the sides
+    auto outside = [&](Vec3 c, float r) {
+        float depth = -c.z;
+        return depth + r < near || (std::abs(c.x) - tan_x * depth) / norm_x > r ||
+               (std::abs(c.y) - tan_y * depth) / norm_y > r;
+    };
+
+    obj.get_mesh().to_mesh_adaptive(
+        mesh,
+        [&](Vec3 a, Vec3 b, Vec3 d) {
+            Vec3 pa = V * a, pb = V * b, m = 0.5f * (pa + pb);
+            float offset = (V * (0.5f * (a + b) + d) - m).norm();
+            if(outside(m, 0.5f * (pb - pa).norm() + offset)) return 0.0f;
+            return offset / (std::max(m.norm(), near) * pixel);
+        },
+        obj.opt.subd_error, (size_t)obj.opt.subd_levels, 2 * out_w * out_h);
+}
+
+void Pathtracer::build_scene(Scene& layout_scene, const Camera& cam) {
 
     // It would be nice to let the interface be usable here (as with
     // the path-tracing part), but this would cause too much hassle with
@@ -80,6 +199,10 @@ void Pathtracer::build_scene(Scene& layout_scene) {
 
     std::vector<std::future<std::vector<Object>>> futures;
     std::vector<Object> area_light_list;
+    std::vector<Light_Bounds> area_light_list_bounds;
+    // Adaptively refined meshes; they are filled in by the tasks below, but GL
+    // objects have to be created on this thread
+    std::vector<std::unique_ptr<GL::Mesh>> refined_meshes;
 
     layout_scene.for_items([&, this](Scene_Item& item) {
         if(item.is<Scene_Object>()) {
@@ -90,6 +213,12 @@ void Pathtracer::build_scene(Scene& layout_scene) {
 
             if(!obj.opt.render) return;
 
+            GL::Mesh* refined = nullptr;
+            if(obj.is_editable() && obj.opt.render_subd && !obj.armature.has_bones()) {
+                refined_meshes.push_back(std::make_unique<GL::Mesh>());
+                refined = refined_meshes.back().get();
+            }
+
             switch(opt.type) {
             case Material_Type::lambertian: {
                 materials.push_back(BSDF(BSDF_Lambertian(opt.albedo.to_linear())));
@@ -107,25 +236,38 @@ void Pathtracer::build_scene(Scene& layout_scene) {
                 materials.push_back(BSDF(BSDF_Diffuse(obj.material.emissive())));
                 // NOTE(max): we use an approximate triangle mesh for shape objects
                 // because PT::Object only supports sampling triangles
+                Spectrum emissive = obj.material.emissive();
                 if(obj.is_shape()) {
-                    area_light_list.push_back(Object(Tri_Mesh(obj.opt.shape.mesh(), false),
-                                                     obj.id(), idx, obj.pose.transform()));
+                    GL::Mesh mesh = obj.opt.shape.mesh();
+                    area_light_list_bounds.push_back(area_light_bounds(
+                        mesh, obj.pose.transform(), emissive, area_light_list.size()));
+                    area_light_list.push_back(Object(Tri_Mesh(mesh, scene_use_bvh), obj.id(), idx,
+                                                     obj.pose.transform()));
                 } else {
-                    area_light_list.push_back(Object(Tri_Mesh(obj.posed_mesh(), false), obj.id(),
-                                                     idx, obj.pose.transform()));
+                    // Lights are sampled from the same mesh that is traced, so refine now
+                    if(refined) refine_for_camera(obj, cam, out_w, out_h, *refined);
+                    const GL::Mesh& mesh = refined ? *refined : obj.posed_mesh();
+                    area_light_list_bounds.push_back(area_light_bounds(
+                        mesh, obj.pose.transform(), emissive, area_light_list.size()));
+                    area_light_list.push_back(Object(Tri_Mesh(mesh, scene_use_bvh), obj.id(), idx,
+                                                     obj.pose.transform()));
                 }
             } break;
             default: return;
             }
 
             bool use_bvh = scene_use_bvh;
-            futures.push_back(thread_pool.enqueue([&obj, use_bvh, idx]() {
+            bool refine = refined && opt.type != Material_Type::diffuse_light;
+            size_t w = out_w, h = out_h;
+            futures.push_back(thread_pool.enqueue([&obj, &cam, use_bvh, idx, refined, refine, w,
+                                                   h]() {
                 std::vector<Object> objs;
                 if(obj.is_shape()) {
                     Shape shape(obj.opt.shape);
                     objs.emplace_back(std::move(shape), obj.id(), idx, obj.pose.transform());
                 } else {
-                    Tri_Mesh mesh(obj.posed_mesh(), use_bvh);
+                    if(refine) refine_for_camera(obj, cam, w, h, *refined);
+                    Tri_Mesh mesh(refined ? *refined : obj.posed_mesh(), use_bvh);
                     objs.emplace_back(std::move(mesh), obj.id(), idx, obj.pose.transform());
                 }
                 return objs;
@@ -163,7 +305,8 @@ void Pathtracer::build_scene(Scene& layout_scene) {
         std::move(std::begin(result), std::end(result), std::back_inserter(obj_list));
     }
 
-    area_lights = List(std::move(area_light_list));
+    area_lights = std::move(area_light_list);
+    area_light_tree.build(std::move(area_light_list_bounds), true);
     build_lights(layout_scene);
 
     if(scene_use_bvh) {
@@ -179,6 +322,14 @@ void Pathtracer::set_samples(size_t samples) {
     n_samples = samples;
 }
 
+void Pathtracer::set_env_map_format(HDR_Format format) {
+    env_format = format;
+}
+
+void Pathtracer::set_roulette_depth(size_t depth) {
+    rr_depth = depth;
+}
+
 void Pathtracer::set_params(size_t w, size_t h, size_t samples, size_t depth, bool use_bvh) {
     out_w = w;
     out_h = h;
@@ -186,48 +337,134 @@ void Pathtracer::set_params(size_t w, size_t h, size_t samples, size_t depth, bo
     max_depth = depth;
     scene_use_bvh = use_bvh;
     accumulator.resize(out_w, out_h);
+    if(need_aovs()) aovs.resize(out_w, out_h);
+}
+
+void Pathtracer::set_aovs(bool enabled) {
+    aovs_enabled = enabled;
+    if(need_aovs()) {
+        aovs.resize(out_w, out_h);
+    } else {
+        aovs.resize(0, 0);
+    }
+}
+
+void Pathtracer::set_denoise(int iterations) {
+    denoise_iterations = std::max(iterations, 0);
+    set_aovs(aovs_enabled);
+}
+
+bool Pathtracer::need_aovs() const {
+    // The denoiser is guided by the AOVs
+    return aovs_enabled || denoise_iterations > 0;
 }
 
 void Pathtracer::log_ray(const Ray& ray, float t, Spectrum color) {
     gui.log_ray(ray, t, color);
 }
 
-void Pathtracer::accumulate(const HDR_Image& sample) {
+bool Pathtracer::stale(size_t generation) const {
+    return render_generation.load(std::memory_order_relaxed) != generation;
+}
+
+bool Pathtracer::accumulate(const HDR_Image& sample, size_t epoch, size_t generation) {
 
     std::lock_guard<std::mutex> lock(accumulator_mut);
 
+    // Cancelled after the last sample was traced
+    if(stale(generation)) return false;
+
     accumulator_samples++;
+    epoch_done[epoch] = true;
     for(size_t j = 0; j < out_h; j++) {
         for(size_t i = 0; i < out_w; i++) {
-            Spectrum& s = accumulator.at(i, j);
-            const Spectrum& n = sample.at(i, j);
-            s += (n - s) * (1.0f / accumulator_samples);
+            Spectrum& m = accumulator.at(i, j);
+            m += (sample.at(i, j) - m) * (1.0f / accumulator_samples);
         }
     }
+    return accumulator_samples == epoch_samples.size();
 }
 
-void Pathtracer::do_trace(size_t samples) {
+bool Pathtracer::merge_aovs(const AOV_Buffer& band, size_t y0, size_t epoch,
+                            size_t generation) {
 
+    std::lock_guard<std::mutex> lock(accumulator_mut);
+
+    if(stale(generation)) return false;
+    if(aovs.dimension().first == band.dimension().first) aovs.merge(band, y0);
+    epoch_aov_rows[epoch] = std::min(y0 + band.dimension().second, out_h);
+    return true;
+}
+
+void Pathtracer::do_trace(size_t epoch, size_t generation) {
+
+    if(stale(generation)) return;
+
+    RNG::seed(epoch_seeds[epoch]);
+
+    size_t samples = epoch_samples[epoch];
     HDR_Image sample(out_w, out_h);
+
+    // AOVs are plain totals, so they are recorded a band of rows at a time and
+    // added to the shared buffer as each band finishes, rather than every epoch
+    // holding a frame's worth. Bands finished by an epoch that is later abandoned
+    // stay counted; they are genuine samples, so the AOVs just see a few more.
+    // Bands already in a checkpoint's totals are traced again but not recorded.
+    const size_t band_rows = 16;
+    size_t aov_start = epoch_aov_rows[epoch];
+    AOV_Buffer aov_band;
+    if(need_aovs()) aov_band.resize(out_w, band_rows);
+
     for(size_t j = 0; j < out_h; j++) {
+        bool record_aovs = !aov_band.empty() && j >= aov_start;
         for(size_t i = 0; i < out_w; i++) {
 
             size_t sampled = 0;
             for(size_t s = 0; s < samples; s++) {
 
-                Spectrum p = trace_pixel(i, j);
+                AOV_Sample aov;
+                Spectrum p = trace_pixel(i, j, record_aovs ? &aov : nullptr);
                 if(p.valid()) {
                     sample.at(i, j) += p;
                     sampled++;
+                    if(record_aovs) aov_band.add(i, j % band_rows, aov, p);
                 }
 
-                if(cancel_flag) return;
+                if(stale(generation)) return;
             }
 
             if(sampled > 0) sample.at(i, j) *= (1.0f / sampled);
         }
+
+        if(record_aovs && (j % band_rows == band_rows - 1 || j + 1 == out_h)) {
+            if(!merge_aovs(aov_band, j - j % band_rows, epoch, generation)) return;
+            aov_band.clear();
+        }
     }
-    accumulate(sample);
+    bool finished = accumulate(sample, epoch, generation);
+    checkpoint(finished, generation);
+    if(finished) denoise_output(generation);
+}
+
+void Pathtracer::denoise_output(size_t generation) {
+
+    if(denoise_iterations <= 0 || aovs.empty()) return;
+
+    // Every epoch has been accumulated, so nothing else writes the inputs now
+    Uint64 start = SDL_GetPerformanceCounter();
+    Denoise_Settings settings;
+    settings.iterations = denoise_iterations;
+    HDR_Image result = denoise(accumulator, aovs, settings);
+    Uint64 time = SDL_GetPerformanceCounter() - start;
+
+    {
+        std::lock_guard<std::mutex> lock(accumulator_mut);
+        if(stale(generation)) return;
+        denoised = std::move(result);
+        has_denoised = true;
+    }
+    info("Denoised output with %d passes in %.3fs.", denoise_iterations,
+         (float)(time / (double)SDL_GetPerformanceFrequency()));
 }
 
 bool Pathtracer::in_progress() const {
@@ -253,67 +490,385 @@ void Pathtracer::begin_render(Scene& layout_scene, const Camera& cam, bool add_s
     size_t samples_per_epoch = std::max(size_t(1), n_samples / (n_threads * 10));
 
     cancel();
-    total_epochs = n_samples / samples_per_epoch + !!(n_samples % samples_per_epoch);
+    has_denoised = false;
 
     if(!add_samples) {
         accumulator.clear({});
+        aovs.clear();
         accumulator_samples = 0;
+        epoch_samples.clear();
+        epoch_seeds.clear();
+        epoch_done.clear();
+        epoch_aov_rows.clear();
         build_time = SDL_GetPerformanceCounter();
-        build_scene(layout_scene);
+        build_scene(layout_scene, cam);
         build_time = SDL_GetPerformanceCounter() - build_time;
+        if(!checkpoint_path.empty()) checkpoint_hash = scene_hash(layout_scene, cam);
     }
-    render_time = SDL_GetPerformanceCounter();
 
     camera = cam;
 
     for(size_t s = 0; s < n_samples; s += samples_per_epoch) {
         size_t samples = (s + samples_per_epoch) > n_samples ? n_samples - s : samples_per_epoch;
-        thread_pool.enqueue([samples, this]() {
-            do_trace(samples);
-            size_t completed = completed_epochs++;
-            if(completed + 1 == total_epochs) {
-                Uint64 done = SDL_GetPerformanceCounter();
-                render_time = done - render_time;
-            }
-        });
+        epoch_samples.push_back(samples);
+        epoch_seeds.push_back(RNG::bits());
+        epoch_done.push_back(false);
+        epoch_aov_rows.push_back(0);
+    }
+    enqueue_epochs();
+}
+
+std::string Pathtracer::resume_render(Scene& layout_scene, const Camera& cam) {
+
+    if(checkpoint_path.empty()) return "No checkpoint file given!";
+
+    if(!std::filesystem::exists(checkpoint_path)) {
+        info("No checkpoint found at %s, starting a new render.", checkpoint_path.c_str());
+        begin_render(layout_scene, cam);
+        return {};
+    }
+
+    cancel();
+
+    build_time = SDL_GetPerformanceCounter();
+    build_scene(layout_scene, cam);
+    build_time = SDL_GetPerformanceCounter() - build_time;
+
+    camera = cam;
+    checkpoint_hash = scene_hash(layout_scene, cam);
+
+    aovs.clear();
+    has_denoised = false;
+
+    std::string err = load_checkpoint(checkpoint_hash);
+    if(!err.empty()) return err;
+
+    info("Resuming render from %s (%zu/%zu epochs done).", checkpoint_path.c_str(),
+         accumulator_samples, epoch_samples.size());
+    enqueue_epochs();
+    return {};
+}
+
+void Pathtracer::enqueue_epochs() {
+
+    total_epochs = 0;
+    for(bool done : epoch_done) total_epochs += !done;
+
+    render_time = SDL_GetPerformanceCounter();
+    last_checkpoint = render_time;
+    if(total_epochs == 0) render_time = 0;
+
+    size_t generation = render_generation.load();
+    for(size_t e = 0; e < epoch_samples.size(); e++) {
+        if(epoch_done[e]) continue;
+        thread_pool.submit(
+            [e, generation, this]() {
+                do_trace(e, generation);
+                size_t completed = completed_epochs++;
+                if(completed + 1 == total_epochs) {
+                    Uint64 done = SDL_GetPerformanceCounter();
+                    render_time = done - render_time;
+                }
+            },
+            Task_Priority::background);
     }
 }
 
 void Pathtracer::cancel() {
-    cancel_flag = true;
+    // Running epochs notice the new generation within a sample, so clearing the
+    // pool only has to wait that long before the scene can be rebuilt.
+    render_generation++;
     thread_pool.clear();
+
+    // The pool is idle now, so no epoch can finish the render behind our back;
+    // a render cut short records how long it ran
+    if(completed_epochs < total_epochs) render_time = SDL_GetPerformanceCounter() - render_time;
+
+    // Abandoned epochs are dropped, so that adding samples afterwards traces just
+    // the new ones. Their seeds go with them; new epochs get fresh ones.
+    {
+        std::lock_guard<std::mutex> lock(accumulator_mut);
+        size_t kept = 0;
+        for(size_t e = 0; e < epoch_samples.size(); e++) {
+            if(!epoch_done[e]) continue;
+            epoch_samples[kept] = epoch_samples[e];
+            epoch_seeds[kept] = epoch_seeds[e];
+            epoch_aov_rows[kept] = epoch_aov_rows[e];
+            kept++;
+        }
+        epoch_samples.resize(kept);
+        epoch_seeds.resize(kept);
+        epoch_done.assign(kept, true);
+        epoch_aov_rows.resize(kept);
+    }
     completed_epochs = 0;
     total_epochs = 0;
-    cancel_flag = false;
-    if(completed_epochs < total_epochs) 
-        render_time = SDL_GetPerformanceCounter() - render_time;
+}
+
+void Pathtracer::set_checkpoint(std::string path, float interval) {
+    checkpoint_path = std::move(path);
+    checkpoint_interval = interval;
+}
+
+unsigned long long Pathtracer::scene_hash(Scene& layout_scene, const Camera& cam) {
+
+    // Anything that changes the converged image has to go into the hash, so that
+    // a checkpoint is never resumed into a different render.
+    unsigned long long hash = 14695981039346656037ull;
+
+    hash_value(hash, out_w);
+    hash_value(hash, out_h);
+    hash_value(hash, n_samples);
+    hash_value(hash, max_depth);
+    hash_value(hash, rr_depth);
+    hash_value(hash, env_format);
+    // The AOVs are checkpointed too, and guide the denoiser
+    hash_value(hash, need_aovs());
+    hash_value(hash, denoise_iterations);
+
+    Mat4 view = cam.get_view();
+    hash_bytes(hash, view.data, sizeof(view.data));
+    hash_value(hash, cam.get_fov());
+    hash_value(hash, cam.get_ar());
+    hash_value(hash, cam.get_ap());
+    hash_value(hash, cam.get_dist());
+
+    layout_scene.for_items([&](Scene_Item& item) {
+        hash_value(hash, item.id());
+
+        if(item.is<Scene_Object>()) {
+
+            Scene_Object& obj = item.get<Scene_Object>();
+            const Material::Options& opt = obj.material.opt;
+            if(!obj.opt.render) return;
+
+            Mat4 T = obj.pose.transform();
+            hash_bytes(hash, T.data, sizeof(T.data));
+            hash_value(hash, opt.type);
+            hash_bytes(hash, opt.albedo.data, sizeof(opt.albedo.data));
+            hash_bytes(hash, opt.reflectance.data, sizeof(opt.reflectance.data));
+            hash_bytes(hash, opt.transmittance.data, sizeof(opt.transmittance.data));
+            Spectrum emissive = obj.material.emissive();
+            hash_bytes(hash, emissive.data, sizeof(emissive.data));
+            hash_value(hash, opt.ior);
+
+            if(obj.is_shape()) {
+                hash_value(hash, obj.opt.shape.get<Sphere>().radius);
+            } else {
+                if(obj.opt.render_subd) {
+                    hash_value(hash, obj.opt.subd_error);
+                    hash_value(hash, obj.opt.subd_levels);
+                }
+                const GL::Mesh& mesh = obj.posed_mesh();
+                for(const GL::Mesh::Vert& v : mesh.verts()) {
+                    hash_bytes(hash, v.pos.data, sizeof(v.pos.data));
+                }
+                const auto& idxs = mesh.indices();
+                hash_bytes(hash, idxs.data(), idxs.size() * sizeof(GL::Mesh::Index));
+            }
+
+        } else if(item.is<Scene_Light>()) {
+
+            const Scene_Light& light = item.get<Scene_Light>();
+            Mat4 T = light.pose.transform();
+            Spectrum r = light.radiance();
+            hash_bytes(hash, T.data, sizeof(T.data));
+            hash_bytes(hash, r.data, sizeof(r.data));
+            hash_value(hash, light.opt.type);
+            hash_bytes(hash, light.opt.angle_bounds.data, sizeof(light.opt.angle_bounds.data));
+            std::string map = light.opt.has_emissive_map ? light.emissive_loaded() : "";
+            hash_bytes(hash, map.data(), map.size());
+
+        } else if(item.is<Scene_Particles>()) {
+
+            const Scene_Particles& particles = item.get<Scene_Particles>();
+            Spectrum color = particles.opt.color.to_linear();
+            hash_bytes(hash, color.data, sizeof(color.data));
+            hash_value(hash, particles.opt.scale);
+            for(const Scene_Particles::Particle& p : particles.get_particles()) {
+                hash_bytes(hash, p.pos.data, sizeof(p.pos.data));
+            }
+        }
+    });
+
+    return hash;
+}
+
+void Pathtracer::checkpoint(bool force, size_t generation) {
+
+    if(checkpoint_path.empty() || stale(generation)) return;
+
+    std::lock_guard<std::mutex> lock(checkpoint_mut);
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    double elapsed = (now - last_checkpoint) / (double)SDL_GetPerformanceFrequency();
+    if(!force && elapsed < checkpoint_interval) return;
+
+    std::string err = save_checkpoint();
+    if(!err.empty()) warn("Failed to write checkpoint: %s", err.c_str());
+    last_checkpoint = now;
+}
+
+std::string Pathtracer::save_checkpoint() {
+
+    HDR_Image snapshot;
+    const HDR_Image& image = snapshot;
+    std::vector<bool> done;
+    std::vector<size_t> aov_rows;
+    AOV_Buffer aov_totals;
+    unsigned long long samples;
+    {
+        std::lock_guard<std::mutex> lock(accumulator_mut);
+        snapshot = accumulator.copy();
+        done = epoch_done;
+        aov_rows = epoch_aov_rows;
+        aov_totals = aovs;
+        samples = accumulator_samples;
+    }
+
+    // Write to a temporary file first so that being killed mid-write never
+    // destroys the previous checkpoint.
+    std::string tmp_path = checkpoint_path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if(!out) return "Could not open " + tmp_path;
+
+    auto put = [&out](auto value) { out.write((const char*)&value, sizeof(value)); };
+
+    out.write(checkpoint_magic, sizeof(checkpoint_magic));
+    put(checkpoint_version);
+    put(checkpoint_hash);
+    put((unsigned long long)out_w);
+    put((unsigned long long)out_h);
+    put(samples);
+    put((unsigned long long)epoch_samples.size());
+    for(size_t e = 0; e < epoch_samples.size(); e++) {
+        put((unsigned long long)epoch_samples[e]);
+        put(epoch_seeds[e]);
+        put((unsigned char)done[e]);
+        put((unsigned long long)aov_rows[e]);
+    }
+
+    std::vector<float> pixels(out_w * out_h * 3);
+    for(size_t i = 0; i < out_w * out_h; i++) {
+        Spectrum p = image.at(i);
+        pixels[3 * i] = p.r;
+        pixels[3 * i + 1] = p.g;
+        pixels[3 * i + 2] = p.b;
+    }
+    out.write((const char*)pixels.data(), pixels.size() * sizeof(float));
+    if(!aov_totals.empty()) aov_totals.write(out);
+
+    out.close();
+    if(!out) return "Could not write " + tmp_path;
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, checkpoint_path, ec);
+    if(ec) return ec.message();
+    return {};
+}
+
+std::string Pathtracer::load_checkpoint(unsigned long long hash) {
+
+    std::ifstream in(checkpoint_path, std::ios::binary);
+    if(!in) return "Could not open " + checkpoint_path;
+
+    auto get = [&in](auto& value) { in.read((char*)&value, sizeof(value)); };
+
+    char magic[sizeof(checkpoint_magic)] = {};
+    unsigned int version = 0;
+    unsigned long long file_hash = 0, w = 0, h = 0, samples = 0, epochs = 0;
+
+    in.read(magic, sizeof(magic));
+    get(version);
+    if(!in || !std::equal(magic, magic + sizeof(magic), checkpoint_magic) ||
+       version != checkpoint_version) {
+        return checkpoint_path + " is not a render checkpoint.";
+    }
+
+    get(file_hash);
+    get(w);
+    get(h);
+    get(samples);
+    get(epochs);
+    if(!in) return "Checkpoint is truncated.";
+
+    if(file_hash != hash || w != out_w || h != out_h) {
+        return "Checkpoint was written for a different scene or render settings.";
+    }
+
+    std::vector<size_t> e_samples(epochs), e_aov_rows(epochs);
+    std::vector<unsigned long long> e_seeds(epochs);
+    std::vector<bool> e_done(epochs);
+    size_t n_done = 0;
+    for(size_t e = 0; e < epochs; e++) {
+        unsigned long long es = 0, rows = 0;
+        unsigned char ed = 0;
+        get(es);
+        get(e_seeds[e]);
+        get(ed);
+        get(rows);
+        e_samples[e] = es;
+        e_done[e] = ed != 0;
+        e_aov_rows[e] = rows;
+        n_done += ed != 0;
+    }
+
+    std::vector<float> pixels(out_w * out_h * 3);
+    in.read((char*)pixels.data(), pixels.size() * sizeof(float));
+    if(!in || n_done != samples) return "Checkpoint is truncated.";
+
+    // The hash covers whether AOVs were recorded, so they're there if needed
+    AOV_Buffer aov_totals;
+    if(need_aovs()) {
+        aov_totals.resize(out_w, out_h);
+        if(!aov_totals.read(in)) return "Checkpoint is truncated.";
+    }
+
+    std::lock_guard<std::mutex> lock(accumulator_mut);
+    epoch_samples = std::move(e_samples);
+    epoch_seeds = std::move(e_seeds);
+    epoch_done = std::move(e_done);
+    epoch_aov_rows = std::move(e_aov_rows);
+    if(need_aovs()) aovs = std::move(aov_totals);
+    accumulator_samples = samples;
+    for(size_t i = 0; i < out_w * out_h; i++) {
+        accumulator.at(i) = Spectrum(pixels[3 * i], pixels[3 * i + 1], pixels[3 * i + 2]);
+    }
+    return {};
 }
 
 const HDR_Image& Pathtracer::get_output() {
-    return accumulator;
+    return has_denoised ? denoised : accumulator;
+}
+
+const AOV_Buffer& Pathtracer::get_aovs() {
+    return aovs;
 }
 
-const GL::Tex2D& Pathtracer::get_output_texture(float exposure) {
+const GL::Tex2D& Pathtracer::get_output_texture(float exposure, Tonemap_Op op) {
     std::lock_guard<std::mutex> lock(accumulator_mut);
-    return accumulator.get_texture(exposure);
+    return (has_denoised ? denoised : accumulator).get_texture(exposure, op);
 }
 
-Vec3 Pathtracer::sample_area_lights(Vec3 from) {
-    if(!area_lights.empty() && env_light.has_value()) {
-        if(RNG::coin_flip(0.5f)) return env_light.value().sample();
-        return area_lights.sample(from);
+std::optional<Vec3> Pathtracer::sample_area_lights(Vec3 from) {
+    if(area_light_tree.empty()) {
+        if(env_light.has_value()) return env_light.value().sample();
+        return std::nullopt;
     }
-    if(env_light.has_value()) {
+    if(env_light.has_value() && RNG::coin_flip(0.5f)) {
         return env_light.value().sample();
     }
-    return area_lights.sample(from);
+    auto [light, prob] = area_light_tree.sample(from);
+    if(prob == 0.0f) return std::nullopt;
+    return area_lights[light].sample(from);
 }
 
 float Pathtracer::area_lights_pdf(Vec3 from, Vec3 dir) {
     int n = 0;
     float pdf = 0.0f;
-    if(!area_lights.empty()) {
-        pdf += area_lights.pdf(Ray(from, dir));
+    if(!area_light_tree.empty()) {
+        Ray ray(from, dir);
+        pdf += area_light_tree.pdf(ray, [&](size_t light) { return area_lights[light].pdf(ray); });
         n++;
     }
     if(env_light.has_value()) {
@@ -328,29 +883,28 @@ Spectrum Pathtracer::point_lighting(const Shading_Info& hit) {
 
     if(hit.bsdf.is_discrete()) return {};
 
-    Spectrum radiance;
-    for(auto& light : point_lights) {
+    auto light_radiance = [&](const Delta_Light& light) -> Spectrum {
         Light_Sample sample = light.sample(hit.pos);
         Vec3 in_dir = hit.world_to_object.rotate(sample.direction);
 
         Spectrum attenuation = hit.bsdf.evaluate(hit.out_dir, in_dir);
-        if(attenuation.luma() == 0.0f) continue;
+        if(attenuation.luma() == 0.0f) return {};
 
-       
         Ray shadow_ray(hit.pos, sample.direction, Vec2{EPS_F, sample.distance - EPS_F});
 
         Trace shadow = scene.hit(shadow_ray);
-        (void) shadow;
-        if(!shadow.hit) {
-            radiance += attenuation * sample.radiance;
-            // printf("NO\n");
-        }
-        // else{
-        //     printf("yes\n");
-        // }
+        if(shadow.hit) return {};
+        return attenuation * sample.radiance;
+    };
+
+    Spectrum radiance;
+    for(size_t light : directional_lights) {
+        radiance += light_radiance(point_lights[light]);
     }
-    // if (radiance.r > 0.0f)
-    //         printf("radiance%f %f %f\n", radiance.r, radiance.g, radiance.b);
+
+    // Sample a single point/spot light in proportion to its estimated contribution
+    auto [light, prob] = point_light_tree.sample(hit.pos);
+    if(prob > 0.0f) radiance += light_radiance(point_lights[light]) * (1.0f / prob);
 
     return radiance;
 }
@@ -3,6 +3,7 @@
 
 #include <atomic>
 #include <mutex>
+#include <optional>
 #include <unordered_map>
 
 #include "../lib/mathlib.h"
@@ -10,9 +11,11 @@
 #include "../util/hdr_image.h"
 #include "../util/thread_pool.h"
 
+#include "aov.h"
 #include "bsdf.h"
 #include "env_light.h"
 #include "light.h"
+#include "light_tree.h"
 #include "object.h"
 
 namespace Gui {
@@ -28,62 +31,122 @@ public:
 
     void set_params(size_t w, size_t h, size_t pixel_samples, size_t depth, bool use_bvh);
     void set_samples(size_t samples);
+    // Paths that have bounced at least this many times are randomly terminated
+    // based on their throughput (Russian roulette)
+    void set_roulette_depth(size_t depth);
+    // Storage for environment map texels, which are read at every level of their pyramid
+    void set_env_map_format(HDR_Format format);
+
+    // Also record first-hit depth, normals, etc. and per-pixel statistics while rendering
+    void set_aovs(bool enabled);
+    // Filter the finished image with this many denoising passes (0 disables denoising)
+    void set_denoise(int iterations);
 
     const HDR_Image& get_output();
-    const GL::Tex2D& get_output_texture(float exposure);
+    const AOV_Buffer& get_aovs();
+    const GL::Tex2D& get_output_texture(float exposure, Tonemap_Op op = Tonemap_Op::exposure);
     size_t visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t level);
 
     void begin_render(Scene& scene, const Camera& camera, bool add_samples = false);
+    std::string resume_render(Scene& scene, const Camera& camera);
     void cancel();
     bool in_progress() const;
     float progress() const;
     std::pair<float, float> completion_time() const;
 
+    /// Periodically write the accumulator to path (every interval seconds) while rendering,
+    /// so that an interrupted render can be continued with resume_render().
+    void set_checkpoint(std::string path, float interval);
+
 private:
     struct Shading_Info {
         const BSDF& bsdf;
         Mat4 world_to_object, object_to_world;
         Vec3 pos, out_dir, normal;
         size_t depth = 0;
+        /// Half-angle of the cone of directions the path arriving here stands for
+        float spread = 0.0f;
     };
 
-    void build_scene(Scene& scene);
+    void build_scene(Scene& scene, const Camera& camera);
     void build_lights(Scene& scene);
-    void do_trace(size_t samples);
-    void accumulate(const HDR_Image& sample);
+    void enqueue_epochs();
+    void do_trace(size_t epoch, size_t generation);
+    bool accumulate(const HDR_Image& sample, size_t epoch, size_t generation);
+    bool merge_aovs(const AOV_Buffer& band, size_t y0, size_t epoch, size_t generation);
+    bool need_aovs() const;
+    bool stale(size_t generation) const;
+    void denoise_output(size_t generation);
     bool tonemap();
 
+    unsigned long long scene_hash(Scene& scene, const Camera& camera);
+    void checkpoint(bool force, size_t generation);
+    std::string save_checkpoint();
+    std::string load_checkpoint(unsigned long long hash);
+
     Gui::Widget_Render& gui;
     unsigned long long render_time, build_time;
     Thread_Pool thread_pool;
-    bool cancel_flag = false;
+    // Bumped by cancel(). Epochs remember the generation they were queued in and
+    // abandon their work as soon as it changes; the worker threads stay alive.
+    std::atomic<size_t> render_generation{0};
 
+    // The running mean, kept in full precision: rounded to a compact format after
+    // every epoch, late samples would fall below half an ulp of the stored value
+    // and stop counting
     HDR_Image accumulator;
     std::mutex accumulator_mut;
     size_t total_epochs, accumulator_samples;
     std::atomic<size_t> completed_epochs;
 
-    Spectrum trace_pixel(size_t x, size_t y);
+    bool aovs_enabled = false;
+    AOV_Buffer aovs;
+
+    // Replaces the accumulator as the output once a denoised render completes
+    int denoise_iterations = 0;
+    HDR_Image denoised;
+    bool has_denoised = false;
+
+    // Each epoch traces with its own seed, so a resumed render repeats the missing work exactly.
+    // AOVs are recorded a band at a time, so each epoch also notes how many of its rows are
+    // in, and a resumed epoch skips recording those again.
+    std::vector<size_t> epoch_samples;
+    std::vector<unsigned long long> epoch_seeds;
+    std::vector<bool> epoch_done;
+    std::vector<size_t> epoch_aov_rows;
+
+    std::string checkpoint_path;
+    float checkpoint_interval = 0.0f;
+    unsigned long long checkpoint_hash = 0, last_checkpoint = 0;
+    std::mutex checkpoint_mut;
+
+    Spectrum trace_pixel(size_t x, size_t y, AOV_Sample* aov = nullptr);
     Spectrum sample_direct_lighting(const Shading_Info& hit);
-    Spectrum sample_indirect_lighting(const Shading_Info& hit);
 
-    std::pair<Spectrum, Spectrum> trace(const Ray& ray);
+    std::pair<Spectrum, Spectrum> trace(const Ray& ray, AOV_Sample* aov = nullptr);
     Spectrum point_lighting(const Shading_Info& hit);
-    Vec3 sample_area_lights(Vec3 from);
+    std::optional<Vec3> sample_area_lights(Vec3 from);
     float area_lights_pdf(Vec3 from, Vec3 dir);
 
     void log_ray(const Ray& ray, float t, Spectrum color = Spectrum{1.0f});
 
     Object scene;
-    List<Object> area_lights;
+    std::vector<Object> area_lights;
+    Light_Tree area_light_tree;
     bool scene_use_bvh = true;
 
     std::vector<BSDF> materials;
     std::vector<Delta_Light> point_lights;
+    // Directional lights reach every point equally, so they are always evaluated;
+    // the rest are chosen stochastically from the tree
+    std::vector<size_t> directional_lights;
+    Light_Tree point_light_tree;
     std::optional<Env_Light> env_light;
 
     Camera camera;
     size_t out_w, out_h, n_samples, max_depth;
+    size_t rr_depth = 3;
+    HDR_Format env_format = HDR_Format::rgb32f;
 };
 
 } // namespace PT
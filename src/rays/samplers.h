@@ -30,6 +30,24 @@ struct Triangle {
     Vec3 v0, v1, v2;
 };
 
+/// Discrete distribution over indices [0, weights.size()), sampled in constant time
+/// using Walker's alias method.
+struct Alias {
+    Alias() = default;
+    Alias(const std::vector<float>& weights);
+    size_t sample() const;
+    float pmf(size_t i) const;
+
+    /// Fill in prob and alias (n entries each) for the given weights, returning their sum.
+    /// Used directly by samplers that pack many tables into one array.
+    static float build(const float* weights, size_t n, float* prob, unsigned int* alias);
+    static size_t sample(const float* prob, const unsigned int* alias, size_t n);
+
+    std::vector<float> prob, _pmf;
+    std::vector<unsigned int> alias;
+    float total = 0.0f;
+};
+
 namespace Hemisphere {
 
 struct Uniform {
@@ -55,9 +73,15 @@ struct Image {
     Image(const HDR_Image& image);
     Vec3 sample() const;
     float pdf(Vec3 dir) const;
+    float solid_angle(size_t row) const;
 
     size_t w = 0, h = 0;
-    std::vector<float> _pdf, _cdf;
+    // Solid angle density of each pixel
+    std::vector<float> _pdf;
+    // Marginal distribution over rows, then one alias table per row over its pixels
+    Alias rows;
+    std::vector<float> col_prob;
+    std::vector<unsigned int> col_alias;
     float total = 0.0f;
 };
 
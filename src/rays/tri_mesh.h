@@ -6,6 +6,7 @@
 
 #include "bvh.h"
 #include "list.h"
+#include "samplers.h"
 #include "trace.h"
 
 namespace PT {
@@ -60,6 +61,11 @@ public:
 private:
     bool use_bvh = true;
     std::vector<Tri_Mesh_Vert> verts;
+
+    // Triangles are sampled in proportion to their area (emission is uniform over a mesh)
+    std::vector<unsigned int> sample_idxs;
+    Samplers::Alias triangle_sampler;
+    float total_area = 0.0f;
     BVH<Triangle> triangle_bvh;
     List<Triangle> triangle_list;
 };
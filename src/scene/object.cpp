@@ -216,5 +216,6 @@ void Scene_Object::render(const Mat4& view, bool solid, bool depth_only, bool po
 bool operator!=(const Scene_Object::Options& l, const Scene_Object::Options& r) {
     return std::string(l.name) != std::string(r.name) || l.shape_type != r.shape_type ||
            l.smooth_normals != r.smooth_normals || l.wireframe != r.wireframe ||
-           l.shape != r.shape || l.render != r.render;
+           l.shape != r.shape || l.render != r.render || l.render_subd != r.render_subd ||
+           l.subd_error != r.subd_error || l.subd_levels != r.subd_levels;
 }
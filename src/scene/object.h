@@ -65,6 +65,10 @@ public:
         bool wireframe = false;
         bool smooth_normals = false;
         bool render = true;
+        /// Refine adaptively for the render camera when path tracing
+        bool render_subd = false;
+        float subd_error = 0.5f;
+        int subd_levels = 4;
         PT::Shape_Type shape_type = PT::Shape_Type::none;
         PT::Shape shape;
     };
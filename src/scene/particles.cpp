@@ -2,6 +2,7 @@
 #include "../geometry/util.h"
 #include "../rays/pathtracer.h"
 #include "../util/rand.h"
+#include "../util/thread_pool.h"
 
 #include "particles.h"
 #include "renderer.h"
@@ -128,13 +129,22 @@ void Scene_Particles::gen_instances() {
 
 void Scene_Particles::step2(const PT::Object& scene, float dt) {
 
+    // Particles only read the scene, so they can all be moved at once
+    std::vector<unsigned char> alive(particles.size());
+    Thread_Pool::global().parallel_for(
+        0, particles.size(),
+        [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                alive[i] = particles[i].update(scene, dt, radius * opt.scale);
+            }
+        },
+        64);
+
     std::vector<Particle> next;
     next.reserve(particles.size());
 
-    for(Particle& p : particles) {
-        if(p.update(scene, dt, radius * opt.scale)) {
-            next.emplace_back(p);
-        }
+    for(size_t i = 0; i < particles.size(); i++) {
+        if(alive[i]) next.emplace_back(particles[i]);
     }
 
     particle_cooldown -= dt;
@@ -3,11 +3,13 @@
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
+#include <deque>
 #include <sstream>
 
 #include "../gui/manager.h"
 #include "../gui/render.h"
 #include "../lib/log.h"
+#include "../util/thread_pool.h"
 
 #include "renderer.h"
 #include "scene.h"
@@ -441,17 +443,43 @@ static Material::Options load_material(aiMaterial* ai_mat, float& was_sphere) {
     return mat;
 }
 
+// A mesh converted to halfedge form, or the reason it couldn't be
+using Loaded_Mesh = std::pair<Halfedge_Mesh, std::string>;
+
+// Building halfedge meshes is the slow part of loading a scene, so every mesh
+// instance is converted up front on the pool, in the order load_node visits them.
+static void convert_meshes(Thread_Pool& pool, std::deque<std::future<Loaded_Mesh>>& meshes,
+                           const aiScene* scene, aiNode* node) {
+
+    for(unsigned int i = 0; i < node->mNumMeshes; i++) {
+        const aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+        meshes.push_back(pool.enqueue([mesh]() {
+            auto [verts, polys] = load_mesh(mesh);
+            Halfedge_Mesh hemesh;
+            std::string err = hemesh.from_poly(polys, verts);
+            return Loaded_Mesh{std::move(hemesh), std::move(err)};
+        }));
+    }
+
+    for(unsigned int i = 0; i < node->mNumChildren; i++) {
+        convert_meshes(pool, meshes, scene, node->mChildren[i]);
+    }
+}
+
 static void load_node(Scene& scobj, std::vector<std::string>& errors,
                       std::unordered_map<aiNode*, Scene_ID>& node_to_obj,
                       std::unordered_map<aiNode*, Joint*>& node_to_bone,
                       std::unordered_map<aiNode*, Skeleton::IK_Handle*>& node_to_ik,
-                      const aiScene* scene, aiNode* node, aiMatrix4x4 transform) {
+                      std::deque<std::future<Loaded_Mesh>>& meshes, const aiScene* scene,
+                      aiNode* node, aiMatrix4x4 transform) {
 
     transform = transform * node->mTransformation;
 
     for(unsigned int i = 0; i < node->mNumMeshes; i++) {
 
         const aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+        std::future<Loaded_Mesh> loaded = std::move(meshes.front());
+        meshes.pop_front();
 
         std::string name;
         bool do_flip = false, do_smooth = false;
@@ -471,8 +499,6 @@ static void load_node(Scene& scobj, std::vector<std::string>& errors,
             }
         }
 
-        auto [verts, polys] = load_mesh(mesh);
-
         aiVector3D ascale, arot, apos;
         transform.Decompose(ascale, arot, apos);
         Vec3 pos = aiVec(apos);
@@ -495,8 +521,7 @@ static void load_node(Scene& scobj, std::vector<std::string>& errors,
 
         } else {
 
-            Halfedge_Mesh hemesh;
-            std::string err = hemesh.from_poly(polys, verts);
+            auto [hemesh, err] = loaded.get();
             if(!err.empty()) {
 
                 GL::Mesh gmesh = mesh_from(mesh, do_flip);
@@ -586,8 +611,8 @@ static void load_node(Scene& scobj, std::vector<std::string>& errors,
     }
 
     for(unsigned int i = 0; i < node->mNumChildren; i++) {
-        load_node(scobj, errors, node_to_obj, node_to_bone, node_to_ik, scene, node->mChildren[i],
-                  transform);
+        load_node(scobj, errors, node_to_obj, node_to_bone, node_to_ik, meshes, scene,
+                  node->mChildren[i], transform);
     }
 }
 
@@ -644,8 +669,13 @@ std::string Scene::load(Scene::Load_Opts loader, Undo& undo, Gui::Manager& gui,
     scene->mRootNode->mTransformation = aiMatrix4x4();
 
     // Load objects
-    load_node(*this, errors, node_to_obj, node_to_bone, node_to_ik, scene, scene->mRootNode,
-              aiMatrix4x4());
+    std::deque<std::future<Loaded_Mesh>> meshes;
+    {
+        Thread_Pool pool(std::thread::hardware_concurrency());
+        convert_meshes(pool, meshes, scene, scene->mRootNode);
+        load_node(*this, errors, node_to_obj, node_to_bone, node_to_ik, meshes, scene,
+                  scene->mRootNode, aiMatrix4x4());
+    }
 
     // Load cameras
     if(loader.new_scene && scene->mNumCameras > 0) {
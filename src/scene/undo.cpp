@@ -8,8 +8,9 @@ Undo::Undo(Scene& sc, Gui::Manager& man) : scene(sc), gui(man) {
 }
 
 void Undo::reset() {
-    undos = {};
+    undos.clear();
     redos = {};
+    undo_bytes = 0;
 }
 
 Scene_Object& Undo::add_obj(Halfedge_Mesh&& mesh, std::string name) {
@@ -23,21 +24,17 @@ Scene_Object& Undo::add_obj(Halfedge_Mesh&& mesh, std::string name) {
     return scene.get<Scene_Object>(id);
 }
 
+void Undo::update_mesh(Scene_ID id, Halfedge_Mesh::Delta&& delta) {
+    action(std::make_unique<MeshOp>(scene, id, std::move(delta)));
+}
+
 void Undo::update_mesh_full(Scene_ID id, Halfedge_Mesh&& old_mesh) {
 
     Scene_Object& obj = scene.get<Scene_Object>(id);
     Halfedge_Mesh new_mesh;
     obj.copy_mesh(new_mesh);
 
-    action(
-        [id, this, nm = std::move(new_mesh)]() mutable {
-            Scene_Object& obj = scene.get<Scene_Object>(id);
-            obj.set_mesh(nm);
-        },
-        [id, this, om = std::move(old_mesh)]() mutable {
-            Scene_Object& obj = scene.get<Scene_Object>(id);
-            obj.set_mesh(om);
-        });
+    action(std::make_unique<MeshFullOp>(scene, id, std::move(old_mesh), std::move(new_mesh)));
 }
 
 void Undo::move_root(Scene_ID id, Vec3 old) {
@@ -681,34 +678,46 @@ void Undo::set_max_frame(Gui::Animate& anim, unsigned int fnew, unsigned int fol
 
 void Undo::action(std::unique_ptr<Action_Base>&& action) {
     redos = {};
-    undos.push(std::move(action));
+    undo_bytes += action->bytes();
+    undos.push_back(std::move(action));
     total_actions++;
+
+    // Mesh edits are cheap to keep, but global ops keep whole copies
+    while(undo_bytes > max_bytes && undos.size() > 1) {
+        undo_bytes -= undos.front()->bytes();
+        undos.pop_front();
+    }
 }
 
 void Undo::undo() {
     if(undos.empty()) return;
-    undos.top()->undo();
-    redos.push(std::move(undos.top()));
-    undos.pop();
+    undos.back()->undo();
+    undo_bytes -= undos.back()->bytes();
+    redos.push(std::move(undos.back()));
+    undos.pop_back();
     total_actions++;
 }
 
 void Undo::redo() {
     if(redos.empty()) return;
     redos.top()->redo();
-    undos.push(std::move(redos.top()));
+    undo_bytes += redos.top()->bytes();
+    undos.push_back(std::move(redos.top()));
     redos.pop();
     total_actions++;
 }
 
 void Undo::bundle_last(size_t n) {
 
+    // Some of them may have already been dropped to stay under max_bytes
+    n = std::min(n, undos.size());
+
     std::vector<std::unique_ptr<Action_Base>> undo_pack;
     for(size_t i = 0; i < n; i++) {
-        undo_pack.push_back(std::move(undos.top()));
-        undos.pop();
+        undo_pack.push_back(std::move(undos.back()));
+        undos.pop_back();
     }
-    undos.push(std::make_unique<Action_Bundle>(std::move(undo_pack)));
+    undos.push_back(std::make_unique<Action_Bundle>(std::move(undo_pack)));
 }
 
 size_t Undo::n_actions() {
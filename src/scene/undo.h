@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <deque>
 #include <memory>
 #include <stack>
 
@@ -12,6 +13,10 @@
 class Action_Base {
     virtual void undo() = 0;
     virtual void redo() = 0;
+    // Memory held by actions that keep mesh data, counted against the history's cap
+    virtual size_t bytes() const {
+        return 0;
+    }
     friend class Undo;
     friend class Action_Bundle;
 
@@ -43,6 +48,11 @@ class Action_Bundle : public Action_Base {
     void redo() {
         for(auto i = list.rbegin(); i != list.rend(); i++) (*i)->redo();
     }
+    size_t bytes() const {
+        size_t total = 0;
+        for(auto& a : list) total += a->bytes();
+        return total;
+    }
 
     std::vector<std::unique_ptr<Action_Base>> list;
 
@@ -51,30 +61,53 @@ public:
     ~Action_Bundle() = default;
 };
 
-template<typename T> class MeshOp : public Action_Base {
+class MeshOp : public Action_Base {
     void undo() {
         Scene_Object& obj = scene.get<Scene_Object>(id);
-        obj.set_mesh(mesh);
+        obj.get_mesh().undo(delta);
+        obj.set_mesh_dirty();
     }
     void redo() {
         Scene_Object& obj = scene.get<Scene_Object>(id);
-        auto sel = obj.set_mesh(mesh, eid);
-        op(obj.get_mesh(), sel);
-        obj.get_mesh().do_erase();
+        obj.get_mesh().redo(delta);
+        obj.set_mesh_dirty();
+    }
+    size_t bytes() const {
+        return delta.bytes();
     }
     Scene& scene;
     Scene_ID id;
-    unsigned int eid;
-    T op;
-    Halfedge_Mesh mesh;
+    Halfedge_Mesh::Delta delta;
 
 public:
-    MeshOp(Scene& s, Scene_ID i, unsigned int e, Halfedge_Mesh&& m, T&& t)
-        : scene(s), id(i), eid(e), op(std::move(t)), mesh(std::move(m)) {
+    MeshOp(Scene& s, Scene_ID i, Halfedge_Mesh::Delta&& d) : scene(s), id(i), delta(std::move(d)) {
     }
     ~MeshOp() = default;
 };
 
+class MeshFullOp : public Action_Base {
+    void undo() {
+        Scene_Object& obj = scene.get<Scene_Object>(id);
+        obj.set_mesh(old_mesh);
+    }
+    void redo() {
+        Scene_Object& obj = scene.get<Scene_Object>(id);
+        obj.set_mesh(new_mesh);
+    }
+    size_t bytes() const {
+        return old_mesh.bytes() + new_mesh.bytes();
+    }
+    Scene& scene;
+    Scene_ID id;
+    Halfedge_Mesh old_mesh, new_mesh;
+
+public:
+    MeshFullOp(Scene& s, Scene_ID i, Halfedge_Mesh&& o, Halfedge_Mesh&& n)
+        : scene(s), id(i), old_mesh(std::move(o)), new_mesh(std::move(n)) {
+    }
+    ~MeshFullOp() = default;
+};
+
 class Undo {
 public:
     Undo(Scene& scene, Gui::Manager& man);
@@ -113,13 +146,7 @@ public:
     void update_object(Scene_ID id, Scene_Object::Options old);
     void update_particles(Scene_ID id, Scene_Particles::Options old);
 
-    template<typename T>
-    void update_mesh(Scene_ID id, Halfedge_Mesh&& old, unsigned int e_id, T&& op) {
-        std::stack<std::unique_ptr<Action_Base>> empty;
-        redos.swap(empty);
-        undos.push(std::make_unique<MeshOp<T>>(scene, id, e_id, std::move(old), std::move(op)));
-        total_actions++;
-    }
+    void update_mesh(Scene_ID id, Halfedge_Mesh::Delta&& delta);
     void update_mesh_full(Scene_ID id, Halfedge_Mesh&& old_mesh);
 
     void anim_clear_light(Scene_ID id, float t);
@@ -155,7 +182,12 @@ private:
     void action(std::unique_ptr<Action_Base>&& action);
     void invalidate_obj(Scene_ID id);
 
-    std::stack<std::unique_ptr<Action_Base>> undos;
+    // Once the history holds more than this much mesh data, the oldest undos are dropped
+    static constexpr size_t max_bytes = size_t(256) << 20;
+
+    std::deque<std::unique_ptr<Action_Base>> undos;
     std::stack<std::unique_ptr<Action_Base>> redos;
     size_t total_actions = 0;
+    // Sum of bytes() over undos, kept up to date as they are pushed and popped
+    size_t undo_bytes = 0;
 };
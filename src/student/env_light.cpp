@@ -25,6 +25,14 @@ float Env_Map::pdf(Vec3 dir) const {
     return image_sampler.pdf(dir);
 }
 
+// Equirectangular texture coordinates of a direction; v = 0 points down
+static Vec2 env_uv(Vec3 dir) {
+    float phi = std::acos(clamp(dir.y, -1.0f, 1.0f));
+    float theta = std::atan2(dir.z, dir.x);
+    if(theta < 0.0f) theta += 2.0f * PI_F;
+    return Vec2(theta / (2.0f * PI_F), 1.0f - phi / PI_F);
+}
+
 Spectrum Env_Map::evaluate(Vec3 dir) const {
 
     // TODO (PathTracer): Task 7
@@ -33,43 +41,14 @@ Spectrum Env_Map::evaluate(Vec3 dir) const {
     // pixels in the enviornment image. You should bi-linearly interpolate the value
     // between the 4 nearest pixels.
 
-    
-    float phi = std::acos(dir.y);
-    // float sinphi = dir.z/(std::sin(theta));
-    // float cosphi = dir.x/(std::cos(theta));
-    float theta = std::atan2(dir.z, dir.x);
-    if (theta < 0.0f) theta += 2.0f * PI_F;
-    const auto [_w, _h] = image.dimension();
-    size_t w = (size_t) _w;
-    size_t h = (size_t) _h;
-    float height = h * (1.0f - phi / PI_F);
-    float width = w * theta / 2.0f / PI_F;
-    if (std::floor(height) < 0.0f || std::floor(width) < 0.0f){
-        return Spectrum{};
-    }
-    size_t hsmall = (size_t)std::floor(height);
-    size_t wsmall = (size_t)std::floor(width);
-    if ((hsmall + 1)>= h || (wsmall + 1)>= w)
-        return Spectrum{};
-    float hdelta = (float)height - (float)hsmall;
-    float wdelta = (float)width - (float)wsmall;
-    // printf("%zu %zu %zu %zu\n", wsmall, hsmall, w, h);
-
-    Spectrum ret = (1.0f-wdelta) * ((1.0f-hdelta)*image.at(wsmall, hsmall) + hdelta*image.at(wsmall, hsmall + 1)) +
-        (wdelta) * ((1.0f-hdelta)*image.at(wsmall+1, hsmall) + hdelta*image.at(wsmall+1, hsmall + 1));
-    // if (RNG::coin_flip(0.00005f))
-    // {
-    //     Spectrum p = image.at(wsmall, hsmall);
-    //     printf("%f %f %f\n", p.r, p.g, p.b);
-    //     printf("%f %f %f\n", ret.r, ret.g, ret.b);
-    //     printf("%f %f\n", wdelta, hdelta);
-    //     printf("%zu %zu\n", wsmall, hsmall);
-    //     printf("%zu %zu\n\n", w, h);
-    // }    
-    
-    return ret;
-
-    
+    return image.bilinear(0, env_uv(dir));
+}
+
+Spectrum Env_Map::evaluate(Vec3 dir, float spread) const {
+
+    // A cone of this half-angle spans 2 * spread / pi of the image height
+    float texels = 2.0f * spread / PI_F * image.dimension().second;
+    return image.lookup(env_uv(dir), texels);
 }
 
 Vec3 Env_Hemisphere::sample() const {
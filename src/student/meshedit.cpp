@@ -1,9 +1,11 @@
 
+#include <chrono>
 #include <queue>
 #include <set>
 #include <unordered_map>
 
 #include "../geometry/halfedge.h"
+#include "../util/thread_pool.h"
 #include "debug.h"
 #include <iostream>
 #include<float.h>
@@ -218,7 +220,7 @@ std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::collapse_edge(Halfedge_Me
                 return std::nullopt;
             }
             else
-                if (validate() != std::nullopt)
+                if (checkpoint() != std::nullopt)
                 {
                     printf("NOO\n");
                 }
@@ -275,7 +277,7 @@ std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::collapse_edge(Halfedge_Me
     Halfedge_Mesh::erase(h0);
     Halfedge_Mesh::erase(h1);
     Halfedge_Mesh::erase(e);
-    if (validate() != std::nullopt)
+    if (checkpoint() != std::nullopt)
     {
         printf("NOO\n");
     }
@@ -368,7 +370,7 @@ std::optional<Halfedge_Mesh::EdgeRef> Halfedge_Mesh::flip_edge(Halfedge_Mesh::Ed
     f0->halfedge() = h0;
     
     
-    validate();
+    checkpoint();
 
     // Check valid halfedge permutation
     
@@ -485,7 +487,7 @@ std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::split_edge(Halfedge_Mesh:
 
     
 
-    validate();
+    checkpoint();
     return v;
 }
     
@@ -675,7 +677,7 @@ std::optional<Halfedge_Mesh::FaceRef> Halfedge_Mesh::bevel_face(Halfedge_Mesh::F
 
     
 
-    validate();
+    checkpoint();
     // printf("YEs\n");
     return f;
 }
@@ -904,7 +906,7 @@ void Halfedge_Mesh::addEdge(std::vector<Halfedge_Mesh::HalfedgeRef>& hEgs,
     f0->halfedge() = hEgs[v0Idx];
     f1->halfedge() = hEgs[v1Idx];
     e->halfedge() = h0;
-    auto valid = validate();
+    auto valid = checkpoint();
     if(valid.has_value()) 
         std::cout << valid.value().second << "\n";
 
@@ -938,593 +940,554 @@ void Halfedge_Mesh::triangulate() {
     
 }
 
-/* Note on the quad subdivision process:
-
-        Unlike the local mesh operations (like bevel or edge flip), we will perform
-        subdivision by splitting *all* faces into quads "simultaneously."  Rather
-        than operating directly on the halfedge data structure (which as you've
-        seen is quite difficult to maintain!) we are going to do something a bit nicer:
-           1. Create a raw list of vertex positions and faces (rather than a full-
-              blown halfedge mesh).
-           2. Build a new halfedge mesh from these lists, replacing the old one.
-        Sometimes rebuilding a data structure from scratch is simpler (and even
-        more efficient) than incrementally modifying the existing one.  These steps are
-        detailed below.
-
-  Step I: Compute the vertex positions for the subdivided mesh.
-        Here we're going to do something a little bit strange: since we will
-        have one vertex in the subdivided mesh for each vertex, edge, and face in
-        the original mesh, we can nicely store the new vertex *positions* as
-        attributes on vertices, edges, and faces of the original mesh. These positions
-        can then be conveniently copied into the new, subdivided mesh.
-        This is what you will implement in linear_subdivide_positions() and
-        catmullclark_subdivide_positions().
-
-  Steps II-IV are provided (see Halfedge_Mesh::subdivide()), but are still detailed
-  here:
-
-  Step II: Assign a unique index (starting at 0) to each vertex, edge, and
-        face in the original mesh. These indices will be the indices of the
-        vertices in the new (subdivided) mesh. They do not have to be assigned
-        in any particular order, so long as no index is shared by more than one
-        mesh element, and the total number of indices is equal to V+E+F, i.e.,
-        the total number of vertices plus edges plus faces in the original mesh.
-        Basically we just need a one-to-one mapping between original mesh elements
-        and subdivided mesh vertices.
-
-  Step III: Build a list of quads in the new (subdivided) mesh, as tuples of
-        the element indices defined above. In other words, each new quad should be
-        of the form (i,j,k,l), where i,j,k and l are four of the indices stored on
-        our original mesh elements.  Note that it is essential to get the orientation
-        right here: (i,j,k,l) is not the same as (l,k,j,i).  Indices of new faces
-        should circulate in the same direction as old faces (think about the right-hand
-        rule).
-
-  Step IV: Pass the list of vertices and quads to a routine that clears
-        the internal data for this halfedge mesh, and builds new halfedge data from
-        scratch, using the two lists.
-*/
-
 /*
-    Compute new vertex positions for a mesh that splits each polygon
-    into quads (by inserting a vertex at the face midpoint and each
-    of the edge midpoints).  The new vertex positions will be stored
-    in the members Vertex::new_pos, Edge::new_pos, and
-    Face::new_pos.  The values of the positions are based on
-    simple linear interpolation, e.g., the edge midpoints and face
-    centroids.
+    Splits the edge e of a triangle mesh at its midpoint, along with the triangles on
+    either side of it. The new vertex's halfedge points along the part of e leaving it
+    towards e's original second vertex.
 */
-void Halfedge_Mesh::linear_subdivide_positions() {
-
-    // For each vertex, assign Vertex::new_pos to
-    // its original position, Vertex::pos.
-    for (auto& v : vertices)
-    {
-        v.new_pos =v.pos;
-    }
-
-    // For each edge, assign the midpoint of the two original
-    // positions to Edge::new_pos.
-    for (auto& e : edges) {
-        e.new_pos = (e.halfedge()->vertex()->pos + e.halfedge()->twin()->vertex()->pos) / 2;
-    }
-
-    // For each face, assign the centroid (i.e., arithmetic mean)
-    // of the original vertex positions to Face::new_pos. Note
-    // that in general, NOT all faces will be triangles!
-    Vec3 center;
-    for (auto& f : faces) {
-        
-        HalfedgeRef h = f.halfedge();
-        center = h->vertex()->pos;
+Halfedge_Mesh::VertexRef Halfedge_Mesh::split_edge_fast(EdgeRef e) {
+
+    // h0 runs v0 -> v1 in the triangle (v0, v1, a); h1 runs back, in (v1, v0, b)
+    HalfedgeRef h0 = e->halfedge(), h1 = h0->twin();
+    if(h0->is_boundary()) std::swap(h0, h1);
+    VertexRef v1 = h1->vertex();
+
+    VertexRef m = new_vertex();
+    m->pos = 0.5f * (h0->vertex()->pos + v1->pos);
+
+    // (v0, v1, a) becomes (v0, m, a) and (m, v1, a)
+    HalfedgeRef a0 = h0->next(), a1 = a0->next();
+    HalfedgeRef n0 = new_halfedge(), n1 = new_halfedge(), n2 = new_halfedge();
+    EdgeRef ea = new_edge(), e1 = new_edge();
+    FaceRef f2 = new_face();
+
+    n0->vertex() = m, n0->edge() = ea, n0->twin() = n2, n0->next() = a1, n0->face() = h0->face();
+    n1->vertex() = m, n1->edge() = e1, n1->twin() = h1, n1->next() = a0, n1->face() = f2;
+    n2->vertex() = a1->vertex(), n2->edge() = ea, n2->twin() = n0, n2->next() = n1;
+    n2->face() = f2;
+    h0->next() = n0;
+    a0->next() = n2;
+    a0->face() = f2;
+    ea->halfedge() = n0;
+    e1->halfedge() = n1;
+    f2->halfedge() = n1;
+    h0->face()->halfedge() = h0;
+    m->halfedge() = n1;
+
+    // h1 now runs v1 -> m, and the other half of e needs a halfedge going back
+    HalfedgeRef n4 = new_halfedge();
+    h1->twin() = n1;
+    h1->edge() = e1;
+    h0->twin() = n4;
+    n4->vertex() = m, n4->edge() = e, n4->twin() = h0;
+    e->halfedge() = h0;
 
-        for (h = f.halfedge()->next(); h != f.halfedge(); h = h->next())
-            center += h->vertex()->pos;
-        
-        center /= (float)f.degree();
-        f.new_pos = center;
-    }
+    if(h1->is_boundary()) {
+        n4->next() = h1->next(), n4->face() = h1->face();
+        h1->next() = n4;
+        return m;
+    }
+
+    // (v1, v0, b) becomes (v1, m, b) and (m, v0, b)
+    HalfedgeRef b0 = h1->next(), b1 = b0->next();
+    HalfedgeRef n3 = new_halfedge(), n5 = new_halfedge();
+    EdgeRef eb = new_edge();
+    FaceRef f3 = new_face();
+
+    n3->vertex() = m, n3->edge() = eb, n3->twin() = n5, n3->next() = b1, n3->face() = h1->face();
+    n5->vertex() = b1->vertex(), n5->edge() = eb, n5->twin() = n3, n5->next() = n4;
+    n5->face() = f3;
+    n4->next() = b0, n4->face() = f3;
+    h1->next() = n3;
+    b0->next() = n5;
+    b0->face() = f3;
+    eb->halfedge() = n3;
+    f3->halfedge() = n4;
+    h1->face()->halfedge() = h1;
+    return m;
 }
 
 /*
-    Compute new vertex positions for a mesh that splits each polygon
-    into quads (by inserting a vertex at the face midpoint and each
-    of the edge midpoints).  The new vertex positions will be stored
-    in the members Vertex::new_pos, Edge::new_pos, and
-    Face::new_pos. The values of the positions are based on
-    the Catmull-Clark rules for subdivision.
-
-    Note: this will only be called on meshes without boundary
+    Flips the edge e between two triangles, turning (v0, v1, a) and (v1, v0, b) into
+    (a, v0, b) and (b, v1, a).
 */
-void Halfedge_Mesh::catmullclark_subdivide_positions() {
-
-    // The implementation for this routine should be
-    // a lot like Halfedge_Mesh:linear_subdivide_positions:(),
-    // except that the calculation of the positions themsevles is
-    // slightly more involved, using the Catmull-Clark subdivision
-    // rules. (These rules are outlined in the Developer Manual.)
-
-    // Faces
-    Vec3 center;
-    for (auto& f : faces) {
-        
-        HalfedgeRef h = f.halfedge();
-        center = h->vertex()->pos;
+void Halfedge_Mesh::flip_edge_fast(EdgeRef e) {
+
+    HalfedgeRef h0 = e->halfedge(), h1 = h0->twin();
+    HalfedgeRef a0 = h0->next(), a1 = a0->next();
+    HalfedgeRef b0 = h1->next(), b1 = b0->next();
+    FaceRef f0 = h0->face(), f1 = h1->face();
+
+    h0->vertex()->halfedge() = b0;
+    h1->vertex()->halfedge() = a0;
+    h0->vertex() = b1->vertex();
+    h1->vertex() = a1->vertex();
+
+    a1->next() = b0, b0->next() = h0, h0->next() = a1;
+    b1->next() = a0, a0->next() = h1, h1->next() = b1;
+    b0->face() = f0;
+    a0->face() = f1;
+    f0->halfedge() = h0;
+    f1->halfedge() = h1;
+}
 
-        for (h = f.halfedge()->next(); h != f.halfedge(); h = h->next())
-            center += h->vertex()->pos;
-        
-        center /= (float)f.degree();
-        f.new_pos = center;
-    }
-    // Edges
-    for (auto& e: edges){
-        HalfedgeRef h0 = e.halfedge();
-        HalfedgeRef h1 = h0->twin();
-        Vec3 v0 = h0->vertex()->pos;
-        Vec3 v1 = h1->vertex()->pos;
-        Vec3 v2 = h0->face()->new_pos;
-        Vec3 v3 = h0->face()->new_pos;
-    
-        e.new_pos = (v0 + v1 + v2 + v3) / 4;
-    }
-    for (auto& v : vertices){
-        long n = (long)v.degree();
-        HalfedgeRef h = v.halfedge();
-        Vec3 q = h->face()->new_pos;
-        Vec3 r = (h->vertex()->pos + h->twin()->vertex()->pos) / 2;
-        for (h = v.halfedge()->twin()->next(); h != v.halfedge(); h = h->twin()->next()){
-            r += (h->vertex()->pos + h->twin()->vertex()->pos) / 2;
-            q += h->face()->new_pos;
-        }
-        q /= (float)v.degree();
-        r /= (float)v.degree();
-        v.new_pos = (q + 2.0f*r + ((float)n-3.0f) * v.pos) / (float)n;
-    }
-    // Vertices
+/*
+    Collapses the edge of h, which must lie between two triangles, into h's vertex.
+    The triangles' other edges on each side fold into one.
+*/
+void Halfedge_Mesh::collapse_edge_fast(HalfedgeRef h0) {
+
+    HalfedgeRef h1 = h0->twin();
+    HalfedgeRef a = h0->next(), b = a->next();
+    HalfedgeRef c = h1->next(), d = c->next();
+    HalfedgeRef ta = a->twin(), tb = b->twin(), tc = c->twin(), td = d->twin();
+    VertexRef keep = h0->vertex(), gone = h1->vertex();
+    VertexRef x = b->vertex(), y = d->vertex();
+    EdgeRef e = h0->edge(), ea = a->edge(), ed = d->edge();
+    FaceRef f0 = h0->face(), f1 = h1->face();
+
+    // Everything that left the collapsed vertex now leaves the kept one
+    HalfedgeRef h = h1;
+    do {
+        h->vertex() = keep;
+        h = h->twin()->next();
+    } while(h != h1);
+
+    ta->twin() = tb;
+    tb->twin() = ta;
+    ta->edge() = tb->edge();
+    tb->edge()->halfedge() = tb;
+
+    tc->twin() = td;
+    td->twin() = tc;
+    td->edge() = tc->edge();
+    tc->edge()->halfedge() = tc;
+
+    keep->halfedge() = tb;
+    x->halfedge() = ta;
+    y->halfedge() = tc;
+
+    for(HalfedgeRef dead : {h0, h1, a, b, c, d}) halfedges.erase(dead);
+    for(EdgeRef dead : {e, ea, ed}) edges.erase(dead);
+    faces.erase(f0);
+    faces.erase(f1);
+    vertices.erase(gone);
 }
 
 /*
-    This routine should increase the number of triangles in the mesh
-    using Loop subdivision. Note: this is will only be called on triangle meshes.
+    Whether collapsing h's edge (between two triangles) to p leaves a manifold mesh,
+    with no vertex of degree less than three and no neighboring face turned over.
+    mark has an entry per vertex slot; stamp is bumped so it needn't be cleared.
 */
-void Halfedge_Mesh::loop_subdivide() {
-
-    // Each vertex and edge of the original mesh can be associated with a
-    // vertex in the new (subdivided) mesh.
-    // Therefore, our strategy for computing the subdivided vertex locations is to
-    // *first* compute the new positions
-    // using the connectivity of the original (coarse) mesh. Navigating this mesh
-    // will be much easier than navigating
-    // the new subdivided (fine) mesh, which has more elements to traverse.  We
-    // will then assign vertex positions in
-    // the new mesh based on the values we computed for the original mesh.
-    
-    // Compute new positions for all the vertices in the input mesh using
-    // the Loop subdivision rule and store them in Vertex::new_pos.
-    //    At this point, we also want to mark each vertex as being a vertex of the
-    //    original mesh. Use Vertex::is_new for this.
-    for(auto v = vertices_begin(); v != vertices_end(); v++) {
-        v->is_new = false;
-        long n = (long)v->degree();
-        float u = (n == 3 ? 3.0f/16.0f : 3.0f/(8.0f * (float) n));
-        Vec3 new_pos =  (1.0f- (float)n*u) * v->pos + u * v->halfedge()->twin()->vertex()->pos;
-        for (HalfedgeRef h = v->halfedge()->twin()->next(); h != v->halfedge(); ){
-            h = h->twin();
-            new_pos += u * h->vertex()->pos;
-            h = h->next();
-        }
-        v->new_pos = new_pos;
-        bool finite = std::isfinite(new_pos.x) && std::isfinite(new_pos.y) && std::isfinite(new_pos.z);
-        if (!finite){
-            printf("NOT FINITE\n");
-        }
-        
-        // printf("%u %f %f %f\n", v->id(), v->new_pos.x, v->new_pos.y,v->new_pos.z);
-    }
-     
-    // Next, compute the subdivided vertex positions associated with edges, and
-    // store them in Edge::new_pos.
-    for(auto e = edges_begin(); e != edges_end(); e++) {
-        
-        e->is_new = false;
-        float aPlusB = 3.0f/8.0f;
-        float cPlusD = 1.0f/8.0f;
-        HalfedgeRef h0 = e->halfedge();
-        HalfedgeRef h1 = h0->twin();
-        Vec3 A = h0->vertex()->pos;
-        Vec3 B = h1->vertex()->pos;
-        Vec3 C = h0->next()->next()->vertex()->pos;
-        Vec3 D = h1->next()->next()->vertex()->pos;
-        e->new_pos = aPlusB * (A+B) + cPlusD * (C + D);
+static bool collapse_ok(Halfedge_Mesh::HalfedgeRef h, Vec3 p, std::vector<uint32_t>& mark,
+                        uint32_t& stamp) {
 
+    using HalfedgeRef = Halfedge_Mesh::HalfedgeRef;
+    using VertexRef = Halfedge_Mesh::VertexRef;
+    VertexRef v0 = h->vertex(), v1 = h->twin()->vertex();
 
-    }
-    size_t num = n_edges();
-    // auto valid = validate();
-    // if(valid.has_value()) 
-    //     std::cout << valid.value().second << "\n\n\n";
-    // Next, we're going to split every edge in the mesh, in any order.
-    // We're also going to distinguish subdivided edges that came from splitting 
-    // an edge in the original mesh from new edges by setting the boolean Edge::is_new. 
-    // Note that in this loop, we only want to iterate over edges of the original mesh.
-    // Otherwise, we'll end up splitting edges that we just split (and the
-    // loop will never end!)
-    // auto eEnd = edges_end();
-    
-    // printf("%u %u %lu\n", edges_begin()->id(), edges_end()->id(), num);
-    auto e = edges_begin();
-    for(size_t i = 0; i < num; i++) {
-        e++;
-        auto next = e;
-        e--;
-        // printf("%u\n", e->id());
-        HalfedgeRef h0 = e->halfedge();
-        HalfedgeRef h1 = h0->twin();
-        VertexRef v0 = h0->vertex();
-        VertexRef v1 = h1->vertex();
-        Vec3 pos = e->new_pos;
-        auto splitted = split_edge(e);
-        auto valid = validate();
-        if(valid.has_value()) 
-            std::cout << valid.value().second << "\n\n\n";
-        VertexRef vNew;
-        if (splitted)
-            vNew = *splitted;
-        else{
-            printf("ERROR when splitting edges\n");
-            return;
-        }
-        vNew->is_new = true;
-        vNew->new_pos = pos;
-        HalfedgeRef h = vNew->halfedge();
-        do{
-            if (h->twin()->vertex() != v0 && h->twin()->vertex() != v1){
-                h->twin()->edge()->is_new = true;
+    // The far vertices of the two triangles each lose an edge
+    if(h->next()->next()->vertex()->degree() <= 3) return false;
+    if(h->twin()->next()->next()->vertex()->degree() <= 3) return false;
+
+    // The endpoints may only share those two neighbors
+    stamp++;
+    HalfedgeRef k = v0->halfedge();
+    do {
+        mark[k->twin()->vertex().slot()] = stamp;
+        k = k->twin()->next();
+    } while(k != v0->halfedge());
+    int shared = 0;
+    k = v1->halfedge();
+    do {
+        if(mark[k->twin()->vertex().slot()] == stamp) shared++;
+        k = k->twin()->next();
+    } while(k != v1->halfedge());
+    if(shared != 2) return false;
+
+    for(VertexRef v : {v0, v1}) {
+        k = v->halfedge();
+        do {
+            if(k->face() != h->face() && k->face() != h->twin()->face()) {
+                Vec3 b = k->next()->vertex()->pos, c = k->next()->next()->vertex()->pos;
+                if(dot(cross(b - v->pos, c - v->pos), cross(b - p, c - p)) <= 0.0f) {
+                    return false;
+                }
             }
-            h = h->twin()->next();
-        }while (h != vNew->halfedge());
-        e = next;
-    }
-    
-    // Now flip any new edge that connects an old and new vertex.
-    for (; e < edges_end(); e++)
-    {
-        HalfedgeRef h0 = e->halfedge();
-        HalfedgeRef h1 = h0->twin();
-        VertexRef v0 = h0->vertex();
-        VertexRef v1 = h1->vertex();
-        if (v0->is_new != v1->is_new && e->is_new)
-        {
-            flip_edge(e);
-            printf("flipped %u\n", e->id());
-        }
+            k = k->twin()->next();
+        } while(k != v->halfedge());
     }
+    return true;
+}
 
-    // Finally, copy new vertex positions into the Vertex::pos.
-    for(auto v = vertices_begin(); v != vertices_end(); v++) {
-        Vec3 p = v->new_pos;
-        bool finite = std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z);
-        if (finite){
-            v->pos = v->new_pos;
-            // printf("%u %f %f %f\n", v->id(), v->pos.x, v->pos.y,v->pos.z);
-        }
-        else{
-            printf("not finite %u", v->id());
-        }
-            
-    }
+// Outside of Halfedge_Mesh, whose change log would shadow log()
+static void report_pass(int pass, size_t splits, size_t collapses, size_t flips, size_t faces,
+                        double ms) {
+    info("Remesh pass %d: %zu splits, %zu collapses, %zu flips, %zu faces (%.1fms)", pass, splits,
+         collapses, flips, faces, ms);
 }
 
 /*
     Isotropic remeshing. Note that this function returns success in a similar
     manner to the local operations, except with only a boolean value.
     (e.g. you may want to return false if this is not a triangle mesh)
-*/
-
-
-std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::collapse_edge_remesh(Halfedge_Mesh::EdgeRef e, std::vector<Halfedge_Mesh::EdgeRef>& shortE) {
 
-    if (e->on_boundary())
-        return std::nullopt;
-    
-    using halfEdgePtr = Halfedge_Mesh::HalfedgeRef;
-    using vertexPtr = Halfedge_Mesh::VertexRef;
-    // using facePtr = Halfedge_Mesh::FaceRef;
-
-    halfEdgePtr h0 = e->halfedge();
-    halfEdgePtr h1 = h0->twin();
-    vertexPtr v0 = h0->vertex();
-    vertexPtr v1 = h1->vertex();
-    std::set<vertexPtr>vtxIn;
-    std::vector<halfEdgePtr> left, right;
-    for(halfEdgePtr h = h1->next(); h->twin() != h1; h = h->twin()->next()){
-        
-        vtxIn.insert(h->twin()->vertex());
-        left.push_back(h);
-    }
-    size_t righthand = 0;
-    for(halfEdgePtr h = h0->next(); h->twin() != h0; h = h->twin()->next()){
-        vertexPtr t = h->twin()->vertex();
-        if (vtxIn.find(t) == vtxIn.end()){
-           righthand++;
+    Each pass (Botsch & Kobbelt) splits edges longer than 4/3 of their target length,
+    collapses those shorter than 4/5 of it, flips edges toward degree six (four on
+    the boundary), and relaxes vertices tangentially toward their neighbors' centroid.
+    Splits and collapses work through queues of candidate edges, to which each
+    operation adds the edges it changed, so nothing is rescanned. Boundary vertices
+    stay where they are. The mesh is checked once per batch of operations, by
+    checkpoint().
+*/
+bool Halfedge_Mesh::isotropic_remesh(const std::function<float(Vec3)>& target_length,
+                                     int passes) {
+
+    do_erase();
+    if(edges.empty()) return false;
+    for(FaceRef f = faces_begin(); f != faces_end(); f++) {
+        if(!f->is_boundary() && f->degree() != 3) return false;
+    }
+
+    Thread_Pool& pool = Thread_Pool::global();
+
+    // The target length at each vertex, by slot; an edge's is its vertices' average.
+    // Targets far below the current lengths (or NaN) would take endless splitting to
+    // reach, so they are clamped.
+    float mean = 0.0f;
+    for(EdgeRef e = edges_begin(); e != edges_end(); e++) mean += e->length();
+    mean /= (float)edges.size();
+    std::vector<float> target;
+    size_t max_splits = 16 * edges.size();
+    auto retarget = [&](VertexRef v) {
+        if(!target_length) return;
+        if(target.size() <= v.slot()) target.resize(vertices.capacity(), mean);
+        float t = target_length(v->pos), lo = 0.01f * mean;
+        if(!(t > lo)) t = lo;
+        target[v.slot()] = t;
+    };
+    auto goal = [&](EdgeRef e) {
+        if(!target_length) return mean;
+        HalfedgeRef h = e->halfedge();
+        return 0.5f * (target[h->vertex().slot()] + target[h->twin()->vertex().slot()]);
+    };
+    for(VertexRef v = vertices_begin(); v != vertices_end(); v++) retarget(v);
+
+    std::vector<EdgeRef> queue;
+    std::vector<VertexRef> vertex_list;
+    std::vector<uint8_t> locked, dead;
+    std::vector<uint32_t> mark;
+    uint32_t stamp = 0;
+
+    for(int pass = 0; pass < passes; pass++) {
+
+        auto start = std::chrono::steady_clock::now();
+        size_t n_splits = 0, n_collapses = 0, n_flips = 0;
+
+        // Split long edges, then whichever halves are still too long. (New edges across
+        // the split triangles wait for the next pass: where triangles are degenerate,
+        // splitting those could go on forever.) Splits per pass are capped by the
+        // starting size, so a target too small for the mesh can't exhaust memory.
+        queue.clear();
+        for(EdgeRef e = edges_begin(); e != edges_end(); e++) {
+            if(e->length() > 4.0f / 3.0f * goal(e)) queue.push_back(e);
         }
-        
-    }
-    if (righthand == 0){
-        return std::nullopt;
-    }
-    for(halfEdgePtr h = h0->next(); h->twin() != h0; h = h->twin()->next()){
-        vertexPtr t = h->twin()->vertex();
-        if (vtxIn.find(t) != vtxIn.end()){
-            if (find(shortE.begin(), shortE.end(), h->edge()) != shortE.end())
-                shortE.erase(find(shortE.begin(), shortE.end(), h->edge()));
-            
-            if (std::nullopt == Halfedge_Mesh::erase_edge(h->edge())){
-                return std::nullopt;
-            }
-            else
-                if (validate() != std::nullopt){
-                    printf("NOO\n");
-                }
+        while(!queue.empty() && n_splits < max_splits) {
+            EdgeRef e = queue.back();
+            queue.pop_back();
+            if(e->length() <= 4.0f / 3.0f * goal(e)) continue;
+
+            VertexRef m = split_edge_fast(e);
+            retarget(m);
+            n_splits++;
+            queue.push_back(e);
+            queue.push_back(m->halfedge()->edge());
         }
-    }
-    for(halfEdgePtr h = h0->next(); h->twin() != h0; h = h->twin()->next()){
-        right.push_back(h);
-        
-    }
-    if (faces.size() <= 2)
-        return std::nullopt;
-    size_t leftSize = left.size();
-    size_t rightSize = right.size();
-    if (leftSize < 1 || rightSize < 1) {
-        return std::nullopt;
-    }
-    vertexPtr v = new_vertex();
-    v->pos = v0->pos + v1->pos;
-    v->pos /= 2;
-    for(size_t i = 0; i < left.size(); i++){
-        halfEdgePtr h = left[i];
-        h->vertex() = v;
-        v->halfedge() = h;  
-    }
-    for(size_t i = 0; i < right.size(); i++){
-        halfEdgePtr h = right[i];
-        h->vertex() = v;
-        v->halfedge() = h;
-       
-    }
-
-    right[right.size()-1]->twin()->next() = left[0];
-    left[left.size()-1]->twin()->next() = right[0];
-    h0->face()->halfedge() = h0->face()->halfedge()->next();
-    h1->face()->halfedge() = h1->face()->halfedge()->next();
-
-    Halfedge_Mesh::erase(v0);
-    Halfedge_Mesh::erase(v1);
-    Halfedge_Mesh::erase(h0);
-    Halfedge_Mesh::erase(h1);
-    Halfedge_Mesh::erase(e);
-    if (find(shortE.begin(), shortE.end(), e) != shortE.end())
-        shortE.erase(find(shortE.begin(), shortE.end(), e));
-    
-    if (validate() != std::nullopt){
-        printf("NOO\n");
-    }
-    return v;
-}
-
-double Halfedge_Mesh::mean_edge_len()
-{
-    double result = 0.0;
-    for (auto e = edges_begin(); e != edges_end(); e++)
-    {
-        result += e->length();
-    }
-    return result / n_edges();
-}
-
-bool Halfedge_Mesh::isotropic_remesh() {
-
-    for(auto f = faces_begin(); f != faces_end(); f++)
-    {
-        if (f->degree() != 3) return false;
-    }
-    
-    int times = 6;
-    // Repeat the four main steps for 5 or 6 iterations
-    for (int time = 0; time < times; time++)
-    {// Compute the mean edge length.
-        double mean = mean_edge_len();
-        // -> Split edges much longer than the target length (being careful about
-    //    how the loop is written!)
-        long num = (long)n_edges();
-        auto e = edges_begin();
-        for (long i = 0; i < num; i++)
-        {
-            e++;
-            auto nextE = e;
-            e--;
-            if (e->length() > mean * 4 / 3) {
-                split_edge(e);
-                auto valid = validate();
-                
-            }
-            e = nextE;
+        checkpoint();
+
+        // Collapse short edges whose merged vertex wouldn't get any long ones. Only
+        // erasures happen here, so slots stay put.
+        locked.assign(vertices.capacity(), 0);
+        dead.assign(edges.capacity(), 0);
+        mark.resize(vertices.capacity());
+        for(FaceRef f = faces_begin(); f != faces_end(); f++) {
+            if(!f->is_boundary()) continue;
+            HalfedgeRef h = f->halfedge();
+            do {
+                locked[h->vertex().slot()] = 1;
+                h = h->next();
+            } while(h != f->halfedge());
         }
-
-    // -> Collapse edges much shorter than the target length.  Here we need to
-    //    be EXTRA careful about advancing the loop, because many edges may have
-    //    been destroyed by a collapse (which ones?)
-        num = (long)n_edges();
-        e = edges_begin();
-        std::vector<EdgeRef>shortE;
-        for (auto e2 = edges_begin(); e2 != edges_end(); e2++)
-        {
-            if (e2->length() > mean * 4 / 3) {
-                shortE.push_back(e2);
-            }
+        auto collapsible = [&](EdgeRef e) {
+            HalfedgeRef h = e->halfedge();
+            return !locked[h->vertex().slot()] && !locked[h->twin()->vertex().slot()] &&
+                   e->length() < 4.0f / 5.0f * goal(e);
+        };
+
+        queue.clear();
+        for(EdgeRef e = edges_begin(); e != edges_end(); e++) {
+            if(collapsible(e)) queue.push_back(e);
         }
-        // printf("\nstart: %lu\n", shortE.size());
-        // int i = shortE.size();
-        while (!shortE.empty()){
-            // i--;
-            auto e3 = shortE.front();
-            auto x = collapse_edge_remesh(e3, shortE);
-            if (x){
-                // printf("%lu\n", shortE.size());
-                continue;
+        while(!queue.empty()) {
+            EdgeRef e = queue.back();
+            queue.pop_back();
+            if(dead[e.slot()] || !collapsible(e)) continue;
+
+            HalfedgeRef h = e->halfedge();
+            VertexRef keep = h->vertex(), gone = h->twin()->vertex();
+            Vec3 p = 0.5f * (keep->pos + gone->pos);
+            float high = 4.0f / 3.0f * goal(e);
+            bool too_long = false;
+            for(VertexRef v : {keep, gone}) {
+                HalfedgeRef k = v->halfedge();
+                do {
+                    too_long = too_long || (k->twin()->vertex()->pos - p).norm() > high;
+                    k = k->twin()->next();
+                } while(!too_long && k != v->halfedge());
             }
-            else
-                shortE.erase(shortE.begin());
-            // printf("%lu\n", shortE.size());
+            if(too_long || !collapse_ok(h, p, mark, stamp)) continue;
+
+            dead[e.slot()] = 1;
+            dead[h->next()->edge().slot()] = 1;
+            dead[h->twin()->next()->next()->edge().slot()] = 1;
+            collapse_edge_fast(h);
+            keep->pos = p;
+            retarget(keep);
+            n_collapses++;
+
+            HalfedgeRef k = keep->halfedge();
+            do {
+                if(collapsible(k->edge())) queue.push_back(k->edge());
+                k = k->twin()->next();
+            } while(k != keep->halfedge());
         }
-
-        
-
-    // -> Now flip each edge if it improves vertex degree
-    for (auto e4 = edges_begin(); e4 != edges_end(); e4++)
-        {
-           int a1 = e4->halfedge()->vertex()->degree();
-           int b1 = e4->halfedge()->next()->next()->vertex()->degree();
-           int a2 = e4->halfedge()->twin()->vertex()->degree();
-           int b2 = e4->halfedge()->twin()->next()->next()->vertex()->degree();
-           int dev = abs(a1-6) + abs(a2-6) + abs(b1-6) + abs(b2-6);
-           int new_dev = abs(a1-6 - 1) + abs(a2-6 - 1) + abs(b1-6 + 1) + abs(b2-6 + 1);
-           if (new_dev < dev){
-               flip_edge(e4);
-           }
-
+        checkpoint();
+
+        // Flip edges that bring their four vertices closer to regular degree, as long
+        // as the new edge is not already there and neither new triangle is turned over
+        for(EdgeRef e = edges_begin(); e != edges_end(); e++) {
+            if(e->on_boundary()) continue;
+            HalfedgeRef h0 = e->halfedge(), h1 = h0->twin();
+            VertexRef v0 = h0->vertex(), v1 = h1->vertex();
+            VertexRef a = h0->next()->next()->vertex(), b = h1->next()->next()->vertex();
+            int d0 = (int)v0->degree(), d1 = (int)v1->degree();
+            if(d0 <= 3 || d1 <= 3) continue;
+            int x0 = d0 - (v0->on_boundary() ? 4 : 6), x1 = d1 - (v1->on_boundary() ? 4 : 6);
+            int xa = (int)a->degree() - (a->on_boundary() ? 4 : 6);
+            int xb = (int)b->degree() - (b->on_boundary() ? 4 : 6);
+            int before = std::abs(x0) + std::abs(x1) + std::abs(xa) + std::abs(xb);
+            int after = std::abs(x0 - 1) + std::abs(x1 - 1) + std::abs(xa + 1) + std::abs(xb + 1);
+            if(after >= before) continue;
+
+            bool connected = false;
+            HalfedgeRef k = a->halfedge();
+            do {
+                connected = connected || k->twin()->vertex() == b;
+                k = k->twin()->next();
+            } while(!connected && k != a->halfedge());
+            if(connected) continue;
+
+            Vec3 n = cross(v1->pos - v0->pos, a->pos - v0->pos) +
+                     cross(v0->pos - v1->pos, b->pos - v1->pos);
+            if(dot(cross(v0->pos - a->pos, b->pos - a->pos), n) <= 0.0f) continue;
+            if(dot(cross(v1->pos - b->pos, a->pos - b->pos), n) <= 0.0f) continue;
+
+            flip_edge_fast(e);
+            n_flips++;
         }
-    // -> Finally, apply some tangential smoothing to the vertex positions
-    for (auto v = vertices_begin(); v != vertices_end(); v++){
-        Vec3 direction = v->neighborhood_center() - v->pos;
-        v->new_pos = v->pos + 0.2 * direction;
-    }
-    for (auto v = vertices_begin(); v != vertices_end(); v++){
-        
-        v->pos = v->new_pos;
-    }
-
-    validate();
+        checkpoint();
 
+        // Move each interior vertex part of the way to its neighbors' centroid,
+        // within its tangent plane. Every vertex is computed before any moves.
+        vertex_list.clear();
+        for(VertexRef v = vertices_begin(); v != vertices_end(); v++) {
+            if(!v->on_boundary()) vertex_list.push_back(v);
+        }
+        std::vector<Vec3> moved(vertex_list.size());
+        pool.parallel_for(
+            0, vertex_list.size(),
+            [&](size_t begin, size_t end) {
+                for(size_t i = begin; i < end; i++) {
+                    VertexRef v = vertex_list[i];
+                    Vec3 n = v->normal();
+                    Vec3 d = v->neighborhood_center() - v->pos;
+                    // Degenerate neighborhoods have no normal to stay in the plane of
+                    moved[i] = n.valid() ? v->pos + 0.2f * (d - dot(d, n) * n) : v->pos;
+                }
+            },
+            1024);
+        for(size_t i = 0; i < vertex_list.size(); i++) {
+            vertex_list[i]->pos = moved[i];
+            retarget(vertex_list[i]);
+        }
 
+        std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+        report_pass(pass, n_splits, n_collapses, n_flips, faces.size(), time.count());
     }
-    // Note: if you erase elements in a local operation, they will not be actually deleted
-    // until do_erase or validate is called. This is to facilitate checking
-    // for dangling references to elements that will be erased.
-    // The rest of the codebase will automatically call validate() after each op,
-    // but here simply calling collapse_edge() will not erase the elements.
-    // You should use collapse_edge_erase() instead for the desired behavior.
 
     return true;
 }
 
-/* Helper type for quadric simplification */
-struct Edge_Record {
-    Edge_Record() {
-    }
-    Edge_Record(std::unordered_map<Halfedge_Mesh::VertexRef, Mat4>& vertex_quadrics,
-                Halfedge_Mesh::EdgeRef e)
-        : edge(e) {
-
-        // Compute the combined quadric from the edge endpoints.
-        // -> Build the 3x3 linear system whose solution minimizes the quadric error
-        //    associated with these two endpoints.
-        // -> Use this system to solve for the optimal position, and store it in
-        //    Edge_Record::optimal.
-        // -> Also store the cost associated with collapsing this edge in
-        //    Edge_Record::cost.
-    }
-    Halfedge_Mesh::EdgeRef edge;
-    Vec3 optimal;
-    float cost;
+/* Helper type for quadric simplification: the error quadric of a set of planes,
+   i.e. the symmetric 4x4 matrix Q for which [p 1] Q [p 1]^T is the (weighted) sum of
+   squared distances from p to the planes. Only the upper triangle is stored, in
+   doubles since errors are small differences of large sums. */
+struct Quadric {
+    Quadric() = default;
+    Quadric(Vec3 n, double d, double weight) {
+        a2 = weight * n.x * n.x, ab = weight * n.x * n.y, ac = weight * n.x * n.z;
+        ad = weight * n.x * d, b2 = weight * n.y * n.y, bc = weight * n.y * n.z;
+        bd = weight * n.y * d, c2 = weight * n.z * n.z, cd = weight * n.z * d;
+        d2 = weight * d * d;
+    }
+
+    Quadric& operator+=(const Quadric& q) {
+        a2 += q.a2, ab += q.ab, ac += q.ac, ad += q.ad, b2 += q.b2;
+        bc += q.bc, bd += q.bd, c2 += q.c2, cd += q.cd, d2 += q.d2;
+        return *this;
+    }
+    Quadric operator+(const Quadric& q) const {
+        Quadric ret = *this;
+        return ret += q;
+    }
+
+    double error(Vec3 p) const {
+        double x = p.x, y = p.y, z = p.z;
+        return a2 * x * x + 2.0 * ab * x * y + 2.0 * ac * x * z + 2.0 * ad * x + b2 * y * y +
+               2.0 * bc * y * z + 2.0 * bd * y + c2 * z * z + 2.0 * cd * z + d2;
+    }
+
+    /// The point of least error, if the planes pin one down
+    std::optional<Vec3> optimal() const {
+        // Solve A p = -b, where A is the upper-left 3x3 block, by Cramer's rule
+        double det = a2 * (b2 * c2 - bc * bc) - ab * (ab * c2 - bc * ac) + ac * (ab * bc - b2 * ac);
+        double scale = a2 + b2 + c2;
+        if(std::abs(det) <= 1e-10 * scale * scale * scale) return std::nullopt;
+        double x = -(ad * (b2 * c2 - bc * bc) - ab * (bd * c2 - bc * cd) +
+                     ac * (bd * bc - b2 * cd)) / det;
+        double y = -(a2 * (bd * c2 - cd * bc) - ad * (ab * c2 - bc * ac) +
+                     ac * (ab * cd - bd * ac)) / det;
+        double z = -(a2 * (b2 * cd - bc * bd) - ab * (ab * cd - bd * ac) +
+                     ad * (ab * bc - b2 * ac)) / det;
+        return Vec3((float)x, (float)y, (float)z);
+    }
+
+    double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
 };
 
-/* Comparison operator for Edge_Records so std::set will properly order them */
-bool operator<(const Edge_Record& r1, const Edge_Record& r2) {
-    if(r1.cost != r2.cost) {
-        return r1.cost < r2.cost;
-    }
-    Halfedge_Mesh::EdgeRef e1 = r1.edge;
-    Halfedge_Mesh::EdgeRef e2 = r2.edge;
-    return &*e1 < &*e2;
-}
-
 /** Helper type for quadric simplification
  *
- * A PQueue is a minimum-priority queue that
- * allows elements to be both inserted and removed from the
- * queue.  Together, one can easily change the priority of
- * an item by removing it, and re-inserting the same item
- * but with a different priority.  A priority queue, for
- * those who don't remember or haven't seen it before, is a
- * data structure that always keeps track of the item with
- * the smallest priority or "score," even as new elements
- * are inserted and removed.  Priority queues are often an
- * essential component of greedy algorithms, where one wants
- * to iteratively operate on the current "best" element.
- *
- * PQueue is templated on the type T of the object
- * being queued.  For this reason, T must define a comparison
- * operator of the form
- *
- *    bool operator<( const T& t1, const T& t2 )
- *
- * which returns true if and only if t1 is considered to have a
- * lower priority than t2.
- *
- * Basic use of a PQueue might look
- * something like this:
+ * A PQueue is a minimum-priority queue of the keys 0..n-1 (for us, edge slots), each
+ * with a priority. It is a binary heap that also tracks where each key sits in it,
+ * so the priority of any queued key can be changed, or the key removed, in
+ * O(log n) without searching for it:
  *
- *    // initialize an empty queue
- *    PQueue<myItemType> queue;
- *
- *    // add some items (which we assume have been created
- *    // elsewhere, each of which has its priority stored as
- *    // some kind of internal member variable)
- *    queue.insert( item1 );
- *    queue.insert( item2 );
- *    queue.insert( item3 );
- *
- *    // get the highest priority item currently in the queue
- *    myItemType highestPriorityItem = queue.top();
- *
- *    // remove the highest priority item, automatically
- *    // promoting the next-highest priority item to the top
+ *    PQueue queue(n);
+ *    queue.set(3, 1.0f);       // insert key 3
+ *    queue.set(5, 0.5f);
+ *    queue.set(3, 0.25f);      // decrease key 3
+ *    queue.top();              // 3
+ *    queue.remove(5);
  *    queue.pop();
  *
- *    myItemType nextHighestPriorityItem = queue.top();
- *
- *    // Etc.
- *
- *    // We can also remove an item, making sure it is no
- *    // longer in the queue (note that this item may already
- *    // have been removed, if it was the 1st or 2nd-highest
- *    // priority item!)
- *    queue.remove( item2 );
- *
+ * Keys of equal priority come out smallest first, so the order never depends on
+ * anything but the priorities.
  */
-template<class T> struct PQueue {
-    void insert(const T& item) {
-        queue.insert(item);
+class PQueue {
+public:
+    PQueue(size_t keys) : where(keys, absent) {
     }
-    void remove(const T& item) {
-        if(queue.find(item) != queue.end()) {
-            queue.erase(item);
-        }
+
+    bool empty() const {
+        return heap.empty();
+    }
+    size_t size() const {
+        return heap.size();
     }
-    const T& top(void) const {
-        return *(queue.begin());
+    bool contains(uint32_t key) const {
+        return where[key] != absent;
     }
-    void pop(void) {
-        queue.erase(queue.begin());
+    uint32_t top() const {
+        return heap[0].key;
     }
-    size_t size() {
-        return queue.size();
+    float top_priority() const {
+        return heap[0].priority;
+    }
+    void pop() {
+        remove(heap[0].key);
     }
 
-    std::set<T> queue;
+    /// Inserts key, or moves it to its new priority if it is already queued
+    void set(uint32_t key, float priority) {
+        if(!contains(key)) {
+            where[key] = (uint32_t)heap.size();
+            heap.push_back({priority, key});
+            up(heap.size() - 1);
+            return;
+        }
+        size_t i = where[key];
+        Entry old = heap[i];
+        heap[i].priority = priority;
+        if(heap[i] < old) {
+            up(i);
+        } else {
+            down(i);
+        }
+    }
+
+    void remove(uint32_t key) {
+        if(!contains(key)) return;
+        size_t i = where[key];
+        where[key] = absent;
+        Entry last = heap.back();
+        heap.pop_back();
+        if(i == heap.size()) return;
+        heap[i] = last;
+        where[last.key] = (uint32_t)i;
+        up(i);
+        down(where[last.key]);
+    }
+
+private:
+    struct Entry {
+        float priority;
+        uint32_t key;
+        bool operator<(const Entry& e) const {
+            if(priority != e.priority) return priority < e.priority;
+            return key < e.key;
+        }
+    };
+    static constexpr uint32_t absent = UINT32_MAX;
+
+    void up(size_t i) {
+        Entry e = heap[i];
+        while(i > 0) {
+            size_t parent = (i - 1) / 2;
+            if(!(e < heap[parent])) break;
+            heap[i] = heap[parent];
+            where[heap[i].key] = (uint32_t)i;
+            i = parent;
+        }
+        heap[i] = e;
+        where[e.key] = (uint32_t)i;
+    }
+    void down(size_t i) {
+        Entry e = heap[i];
+        for(;;) {
+            size_t child = 2 * i + 1;
+            if(child >= heap.size()) break;
+            if(child + 1 < heap.size() && heap[child + 1] < heap[child]) child++;
+            if(!(heap[child] < e)) break;
+            heap[i] = heap[child];
+            where[heap[i].key] = (uint32_t)i;
+            i = child;
+        }
+        heap[i] = e;
+        where[e.key] = (uint32_t)i;
+    }
+
+    std::vector<Entry> heap;
+    std::vector<uint32_t> where;
 };
 
 /*
@@ -1532,35 +1495,107 @@ template<class T> struct PQueue {
     manner to the local operations, except with only a boolean value.
     (e.g. you may want to return false if you can't simplify the mesh any
     further without destroying it.)
+
+    Greedily collapses the edge whose quadric error is lowest (Garland & Heckbert),
+    placing the merged vertex where that error is least, until at most target_faces
+    triangles remain or the next collapse would cost more than max_error. Only
+    triangle meshes are supported. Boundary vertices stay where they are.
 */
-bool Halfedge_Mesh::simplify() {
-
-    std::unordered_map<VertexRef, Mat4> vertex_quadrics;
-    std::unordered_map<FaceRef, Mat4> face_quadrics;
-    std::unordered_map<EdgeRef, Edge_Record> edge_records;
-    PQueue<Edge_Record> edge_queue;
-
-    // Compute initial quadrics for each face by simply writing the plane equation
-    // for the face in homogeneous coordinates. These quadrics should be stored
-    // in face_quadrics
-    // -> Compute an initial quadric for each vertex as the sum of the quadrics
-    //    associated with the incident faces, storing it in vertex_quadrics
-    // -> Build a priority queue of edges according to their quadric error cost,
-    //    i.e., by building an Edge_Record for each edge and sticking it in the
-    //    queue. You may want to use the above PQueue<Edge_Record> for this.
-    // -> Until we reach the target edge budget, collapse the best edge. Remember
-    //    to remove from the queue any edge that touches the collapsing edge
-    //    BEFORE it gets collapsed, and add back into the queue any edge touching
-    //    the collapsed vertex AFTER it's been collapsed. Also remember to assign
-    //    a quadric to the collapsed vertex, and to pop the collapsed edge off the
-    //    top of the queue.
-
-    // Note: if you erase elements in a local operation, they will not be actually deleted
-    // until do_erase or validate are called. This is to facilitate checking
-    // for dangling references to elements that will be erased.
-    // The rest of the codebase will automatically call validate() after each op,
-    // but here simply calling collapse_edge() will not erase the elements.
-    // You should use collapse_edge_erase() instead for the desired behavior.
-
-    return false;
+bool Halfedge_Mesh::simplify(size_t target_faces, float max_error) {
+
+    do_erase();
+
+    size_t n_triangles = 0;
+    for(FaceRef f = faces_begin(); f != faces_end(); f++) {
+        if(f->is_boundary()) continue;
+        if(f->degree() != 3) return false;
+        n_triangles++;
+    }
+    if(target_faces == 0) target_faces = n_triangles / 4;
+    if(n_triangles <= target_faces) return false;
+
+    // Per-element data lives in flat arrays indexed by slot. Collapsing only ever
+    // erases elements, so slots stay put for the whole run.
+    std::vector<Quadric> quadrics(vertices.capacity());
+    std::vector<bool> locked(vertices.capacity(), false);
+    std::vector<uint32_t> mark(vertices.capacity(), 0);
+    std::vector<EdgeRef> edge_at(edges.capacity());
+    std::vector<Vec3> optimal(edges.capacity());
+    PQueue queue(edges.capacity());
+
+    // Each vertex starts with the planes of its triangles, weighted by area
+    for(FaceRef f = faces_begin(); f != faces_end(); f++) {
+        HalfedgeRef h = f->halfedge();
+        if(f->is_boundary()) {
+            do {
+                locked[h->vertex().slot()] = true;
+                h = h->next();
+            } while(h != f->halfedge());
+            continue;
+        }
+        Vec3 p0 = h->vertex()->pos, p1 = h->next()->vertex()->pos;
+        Vec3 p2 = h->next()->next()->vertex()->pos;
+        Vec3 n = cross(p1 - p0, p2 - p0);
+        float area = 0.5f * n.norm();
+        if(area == 0.0f) continue;
+        n /= 2.0f * area;
+        Quadric q(n, -dot(n, p0), area);
+        for(int i = 0; i < 3; i++, h = h->next()) quadrics[h->vertex().slot()] += q;
+    }
+
+    // Queue each edge by the least error of any point it could collapse to
+    auto update = [&](EdgeRef e) {
+        VertexRef v0 = e->halfedge()->vertex(), v1 = e->halfedge()->twin()->vertex();
+        uint32_t slot = e.slot();
+        if(locked[v0.slot()] || locked[v1.slot()]) {
+            queue.remove(slot);
+            return;
+        }
+        Quadric q = quadrics[v0.slot()] + quadrics[v1.slot()];
+        std::optional<Vec3> best = q.optimal();
+        if(!best.has_value()) {
+            best = v0->pos;
+            for(Vec3 p : {v1->pos, 0.5f * (v0->pos + v1->pos)}) {
+                if(q.error(p) < q.error(*best)) best = p;
+            }
+        }
+        optimal[slot] = *best;
+        queue.set(slot, (float)std::max(q.error(*best), 0.0));
+    };
+    for(EdgeRef e = edges_begin(); e != edges_end(); e++) {
+        edge_at[e.slot()] = e;
+        update(e);
+    }
+
+    uint32_t stamp = 0;
+    size_t collapsed = 0;
+    while(n_triangles > target_faces && !queue.empty()) {
+
+        if(queue.top_priority() > max_error) break;
+        uint32_t slot = queue.top();
+        queue.pop();
+
+        // Edges that can't collapse now are queued again if their neighborhood changes
+        HalfedgeRef h = edge_at[slot]->halfedge();
+        Vec3 p = optimal[slot];
+        if(!collapse_ok(h, p, mark, stamp)) continue;
+
+        VertexRef keep = h->vertex();
+        quadrics[keep.slot()] += quadrics[h->twin()->vertex().slot()];
+        queue.remove(h->next()->edge().slot());
+        queue.remove(h->twin()->next()->next()->edge().slot());
+
+        collapse_edge_fast(h);
+        keep->pos = p;
+        n_triangles -= 2;
+        collapsed++;
+
+        HalfedgeRef k = keep->halfedge();
+        do {
+            update(k->edge());
+            k = k->twin()->next();
+        } while(k != keep->halfedge());
+    }
+
+    return collapsed > 0;
 }
@@ -1,4 +1,3 @@
-
 #include "../rays/pathtracer.h"
 #include "../rays/samplers.h"
 #include "../util/rand.h"
@@ -6,7 +5,23 @@
 
 namespace PT {
 
-Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
+// Balance heuristic weight for a sample drawn from the strategy with density pdf,
+// when the same direction could also have been produced with density other.
+static float mis_weight(float pdf, float other) {
+    float sum = pdf + other;
+    return sum > 0.0f ? pdf / sum : 0.0f;
+}
+
+// Widens a path's cone of directions (half-angle, radians) to cover a BSDF sample
+// with density pdf, which stands for about 1/pdf steradians of directions. Both
+// halves of the MIS estimate use this, so they read the environment map through
+// the same filter in any given direction.
+static float widen_spread(float spread, float pdf) {
+    float cos_spread = 1.0f - 1.0f / (2.0f * PI_F * pdf);
+    return std::max(spread, std::acos(clamp(cos_spread, -1.0f, 1.0f)));
+}
+
+Spectrum Pathtracer::trace_pixel(size_t x, size_t y, AOV_Sample* aov) {
 
     // TODO (PathTracer): Task 1
 
@@ -25,191 +40,169 @@ Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
     ray.depth = max_depth;
 
     // Pathtracer::trace() returns the incoming light split into emissive and reflected components.
-    auto [emissive, reflected] = trace(ray);
-    
-    return emissive + reflected; 
-}
+    auto [emissive, reflected] = trace(ray, aov);
 
-Spectrum Pathtracer::sample_indirect_lighting(const Shading_Info& hit) {
-
-    // TODO (PathTrace): Task 4
-
-    // This function computes a single-sample Monte Carlo estimate of the _indirect_
-    // lighting at our ray intersection point.
-
-    // (1) Randomly sample a new ray direction from the BSDF distribution using BSDF::scatter().
-    Scatter s = hit.bsdf.scatter(hit.out_dir);
-    // (2) Create a new world-space ray and call Pathtracer::trace() to get incoming light. You
-    // should modify time_bounds so that the ray does not intersect at time = 0. Remember to
-    // set the new depth value.
-    Ray ray;
-    ray.dist_bounds[0] = EPS_F ;
-    ray.dist_bounds[1] = FLT_MAX;
-    ray.point = hit.pos;
-    ray.depth = hit.depth - 1;
-    ray.dir = hit.object_to_world.rotate(s.direction);
-    auto [emissive, reflected] = trace(ray);
-
-    // (3) Add contribution due to incoming light scaled by BSDF attenuation. Whether you
-    // compute the BSDF scattering PDF should depend on if the BSDF is a discrete distribution
-    // (see BSDF::is_discrete()).
-
-    if (!hit.bsdf.is_discrete())
-    {
-        // ray.dir = hit.world_to_object.rotate(s.direction);
-        reflected *= s.attenuation *(1.0f/ hit.bsdf.pdf(hit.out_dir, s.direction));
-    }
-    else{
-        reflected *= s.attenuation;
-    }
-
-    // You should only use the indirect component of incoming light (the second value returned
-    // by Pathtracer::trace()), as the direct component will be computed in
-    // Pathtracer::sample_direct_lighting().
-
-    
-    return reflected;
+    return emissive + reflected;
 }
 
 Spectrum Pathtracer::sample_direct_lighting(const Shading_Info& hit) {
 
     // This function computes a Monte Carlo estimate of the _direct_ lighting at our ray
-    // intersection point by sampling both the BSDF and area lights.
+    // intersection point by sampling the lights. The BSDF-sampled half of the MIS estimate
+    // comes from the continuation ray in Pathtracer::trace(), so only one extra shadow ray
+    // is traced here.
 
     // Point lights are handled separately, as they cannot be intersected by tracing rays
     // into the scene.
     Spectrum radiance = point_lighting(hit);
-    // if (radiance.r > 0.0f)
-    //     printf("%f %f %f\n", radiance.r, radiance.g, radiance.b);
-    // TODO (PathTrace): Task 4
-
-    // For task 4, this function should perform almost the same sampling procedure as
-    // Pathtracer::sample_indirect_lighting(), but instead accumulates the emissive component of
-    // incoming light (the first value returned by Pathtracer::trace()). Note that since we only
-    // want emissive, we can trace a ray with depth = 0.
-
-    if (hit.bsdf.is_discrete())
-    {
-        // ray.dir = hit.world_to_object.rotate(s.direction);
-        Scatter s = hit.bsdf.scatter(hit.out_dir);
-        Ray ray;
-        ray.dist_bounds[0] = EPS_F;
-        ray.dist_bounds[1] = FLT_MAX;
-        ray.point = hit.pos;
-        ray.depth = 0;
-        ray.dir = hit.object_to_world.rotate(s.direction);
-        auto [emissive, reflected] = trace(ray);
-
-        emissive *= s.attenuation;
-        return radiance + emissive;
+
+    // Discrete BSDFs can't be evaluated for an arbitrary direction, so their direct lighting
+    // is entirely found by the continuation ray.
+    if(hit.bsdf.is_discrete()) return radiance;
+
+    std::optional<Vec3> sampled = sample_area_lights(hit.pos);
+    if(!sampled.has_value()) return radiance;
+
+    Vec3 dir = sampled.value();
+    Vec3 in_dir = hit.world_to_object.rotate(dir);
+
+    Spectrum attenuation = hit.bsdf.evaluate(hit.out_dir, in_dir);
+    if(attenuation.luma() == 0.0f) return radiance;
+
+    float light_pdf = area_lights_pdf(hit.pos, dir);
+    float bsdf_pdf = hit.bsdf.pdf(hit.out_dir, in_dir);
+    if(light_pdf <= 0.0f) return radiance;
+
+    // Only the emission at the first surface along the shadow ray contributes.
+    Ray ray(hit.pos, dir, Vec2{EPS_F, FLT_MAX});
+    Trace result = scene.hit(ray);
+
+    Spectrum emissive;
+    if(result.hit) {
+        emissive = materials[result.material].emissive();
+    } else if(env_light.has_value()) {
+        emissive = env_light.value().evaluate(dir, widen_spread(hit.spread, bsdf_pdf));
     }
-    else{
-        if (RNG::coin_flip(0.5f)){
-            Scatter s = hit.bsdf.scatter(hit.out_dir);
-            Ray ray;
-            ray.dist_bounds[0] = EPS_F;
-            ray.dist_bounds[1] = FLT_MAX;
-            ray.point = hit.pos;
-            ray.depth = 0;
-            ray.dir = hit.object_to_world.rotate(s.direction);
-            auto [emissive, reflected] = trace(ray);
-            float newPdf = (hit.bsdf.pdf(hit.out_dir, s.direction) + area_lights_pdf(hit.pos, ray.dir)) / 2.0f;
-            emissive *= s.attenuation * (1.0f/ newPdf);
-            return radiance + emissive;
-        }
-        else{
-            Vec3 sampleV = sample_area_lights(hit.pos);
-            Ray ray;
-            ray.dist_bounds[0] = EPS_F;
-            ray.dist_bounds[1] = FLT_MAX;
-            ray.point = hit.pos;
-            ray.depth = 0;
-            ray.dir = sampleV;
-            Vec3 objSampleV = hit.world_to_object.rotate(sampleV);
-            auto [emissive, reflected] = trace(ray);
-            float newPdf = (hit.bsdf.pdf(hit.out_dir, objSampleV) + area_lights_pdf(hit.pos, sampleV)) / 2.0f;
-            emissive *= hit.bsdf.evaluate(hit.out_dir, objSampleV) * (1.0f/ newPdf);
-            return radiance + emissive;
 
+    // f * Le / light_pdf * mis_weight(light_pdf, bsdf_pdf)
+    return radiance + attenuation * emissive * (1.0f / (light_pdf + bsdf_pdf));
+}
+
+std::pair<Spectrum, Spectrum> Pathtracer::trace(const Ray& camera_ray, AOV_Sample* aov) {
+
+    // This function runs the path tracing process. For convenience, it returns the
+    // incoming light along a ray in two components: emitted from the surface the ray
+    // hits, and reflected through that point from other sources.
+
+    // Each iteration finds the next path vertex, adds light sampled directly at it, and
+    // continues along a BSDF-sampled ray. Emission found by that ray is MIS-weighted
+    // against light sampling at the previous vertex, so the same ray serves as both the
+    // BSDF half of the direct lighting estimate and the indirect continuation.
+
+    Ray ray = camera_ray;
+    ray.throughput = Spectrum(1.0f);
+
+    Spectrum emitted, reflected;
+
+    // Half-angle of the cone of directions this path stands for, starting from the pixel's
+    // footprint; used to pick a blurrier environment map level after rough bounces.
+    float spread = 0.5f * Radians(camera.get_fov()) / out_h;
+
+    // Set at each vertex for weighting emission found by the outgoing ray
+    Vec3 prev_pos;
+    float prev_bsdf_pdf = 0.0f;
+    bool prev_discrete = true;
+
+    for(size_t vertex = 0;; vertex++) {
+
+        Spectrum& out = vertex == 0 ? emitted : reflected;
+
+        // Weight of emission hit by this ray, which light sampling could also have found
+        auto emission_weight = [&]() {
+            if(prev_discrete) return 1.0f;
+            return mis_weight(prev_bsdf_pdf, area_lights_pdf(prev_pos, ray.dir));
+        };
+
+        // Trace ray into scene.
+        Trace result = scene.hit(ray);
+        if(!result.hit) {
+
+            // If no surfaces were hit, sample the environemnt map.
+            if(env_light.has_value()) {
+                out += ray.throughput * env_light.value().evaluate(ray.dir, spread) *
+                       emission_weight();
+            }
+            break;
         }
-        
-        
-        
-    }
-    
-    // TODO (PathTrace): Task 6
 
-    // For task 6, we want to upgrade our direct light sampling procedure to also
-    // sample area lights using mixture sampling.
+        // If we're using a two-sided material, treat back-faces the same as front-faces
+        const BSDF& bsdf = materials[result.material];
+        if(!bsdf.is_sided() && dot(result.normal, ray.dir) > 0.0f) {
+            result.normal = -result.normal;
+        }
 
-    // (1) If the BSDF is discrete, we don't need to bother sampling lights: the behavior
-    // should be the same as task 4.
+        // Record the first surface hit, if asked to
+        if(vertex == 0 && aov) {
+            aov->hit = true;
+            aov->depth = result.distance;
+            aov->normal = result.normal;
+            aov->albedo = bsdf.albedo();
+            aov->material = result.material;
+        }
 
-    // (2) Otherwise, we should randomly choose whether we get our sample from `BSDF::scatter`
-    // or `Pathtracer::sample_area_lights`. Note that `Pathtracer::sample_area_lights` returns
-    // a world-space direction pointing toward an area light. Choose between the strategies 
-    // with equal probability.
+        // If the BSDF is emissive, stop tracing and return the emitted light
+        Spectrum emissive = bsdf.emissive();
+        if(emissive.luma() > 0.0f) {
+            out += ray.throughput * emissive * emission_weight();
+            break;
+        }
 
-    // (3) Create a new world-space ray and call Pathtracer::trace() to get incoming light. You
-    // should modify time_bounds so that the ray does not intersect at time = 0. We are again
-    // only interested in the emissive component, so the ray depth can be zero.
+        // If the ray has reached maximum depth, stop tracing
+        if(ray.depth == 0) break;
 
-    // (4) Add estimate of incoming light scaled by BSDF attenuation. Given a sample,
-    // we don't know whether it came from the BSDF or the light, so you should use BSDF::evaluate(),
-    // BSDF::pdf(), and Pathtracer::area_lights_pdf() to compute the proper weighting.
-    // What is the PDF of our sample, given it could have been produced from either source?
+        // Set up shading information
+        Mat4 object_to_world = Mat4::rotate_to(result.normal);
+        Mat4 world_to_object = object_to_world.T();
+        Vec3 out_dir = world_to_object.rotate(ray.point - result.position).unit();
 
-    // return radiance;
-}
+        Shading_Info hit = {bsdf,    world_to_object, object_to_world, result.position,
+                            out_dir, result.normal,   ray.depth,       spread};
+        if (RNG::coin_flip(0.00005f))
+            log_ray(ray, 3.0f);
 
-std::pair<Spectrum, Spectrum> Pathtracer::trace(const Ray& ray) {
+        reflected += ray.throughput * sample_direct_lighting(hit);
 
-    // This function orchestrates the path tracing process. For convenience, it
-    // returns the incoming light along a ray in two components: emitted from the
-    // surface the ray hits, and reflected through that point from other sources.
+        // Continue the path along a direction sampled from the BSDF
+        Scatter s = bsdf.scatter(out_dir);
 
-    // Trace ray into scene.
-    Trace result = scene.hit(ray);
-    if(!result.hit) {
-        
-        // If no surfaces were hit, sample the environemnt map.
-        if(env_light.has_value()) {
-            
-            return {env_light.value().evaluate(ray.dir), {}};
+        Spectrum weight = s.attenuation;
+        prev_discrete = bsdf.is_discrete();
+        prev_bsdf_pdf = 0.0f;
+        if(!prev_discrete) {
+            prev_bsdf_pdf = bsdf.pdf(out_dir, s.direction);
+            if(!(prev_bsdf_pdf > 0.0f)) break;
+            weight *= 1.0f / prev_bsdf_pdf;
+            spread = widen_spread(spread, prev_bsdf_pdf);
         }
-        return {};
-    }
+        prev_pos = result.position;
+
+        Spectrum throughput = ray.throughput * weight;
+        size_t depth = ray.depth - 1;
 
-    // If we're using a two-sided material, treat back-faces the same as front-faces
-    const BSDF& bsdf = materials[result.material];
-    if(!bsdf.is_sided() && dot(result.normal, ray.dir) > 0.0f) {
-        result.normal = -result.normal;
+        ray = Ray(result.position, object_to_world.rotate(s.direction), Vec2{EPS_F, FLT_MAX}, depth);
+        ray.throughput = throughput;
+
+        // Once the path is long enough, terminate it with probability inversely related to
+        // how much it can still contribute, and boost surviving paths to stay unbiased.
+        size_t bounces = max_depth - depth;
+        if(bounces > rr_depth) {
+            float survive = std::min(1.0f, std::max(throughput.r, std::max(throughput.g, throughput.b)));
+            if(!(survive > 0.0f) || !RNG::coin_flip(survive)) break;
+            ray.throughput *= 1.0f / survive;
+        }
     }
 
-    // TODO (PathTracer): Task 4
-    // You will want to change the default normal_colors in debug.h, or delete this early out.
-    // if(debug_data.normal_colors) return {Spectrum::direction(result.normal), {}};
-
-    // If the BSDF is emissive, stop tracing and return the emitted light
-    Spectrum emissive = bsdf.emissive();
-    if(emissive.luma() > 0.0f) return {emissive, {}};
-
-    // If the ray has reached maximum depth, stop tracing
-    if(ray.depth == 0) return {emissive, {}};
-
-    // Set up shading information
-    Mat4 object_to_world = Mat4::rotate_to(result.normal);
-    Mat4 world_to_object = object_to_world.T();
-    Vec3 out_dir = world_to_object.rotate(ray.point - result.position).unit();
-
-    Shading_Info hit = {bsdf,    world_to_object, object_to_world, result.position,
-                        out_dir, result.normal,   ray.depth};
-    if (RNG::coin_flip(0.00005f))
-        log_ray(ray, 3.0f);
-    // Sample and return light reflected through the intersection
-    
-       
-    return {emissive, sample_direct_lighting(hit) + sample_indirect_lighting(hit)};
+    return {emitted, reflected};
 }
 
 } // namespace PT
@@ -1,6 +1,7 @@
 
 #include "../rays/samplers.h"
 #include "../util/rand.h"
+#include "../util/thread_pool.h"
 
 namespace Samplers {
 
@@ -48,29 +49,53 @@ Sphere::Image::Image(const HDR_Image& image) {
     // TODO (PathTracer): Task 7
 
     // Set up importance sampling data structures for a spherical environment map image.
-    // You may make use of the _pdf, _cdf, and total members, or create your own.
+    // You may make use of the _pdf and total members, or create your own.
+
+    // Pixel (x, y) covers theta in [x, x + 1) * 2pi / w and phi in (h - y - 1, h - y] * pi / h,
+    // matching Env_Map::evaluate. Each pixel is weighted by its luminance times its solid angle,
+    // and directions are drawn uniformly in solid angle within the chosen pixel.
 
     const auto [_w, _h] = image.dimension();
     w = _w;
     h = _h;
     total = 0.0f;
-    for(size_t i = 0; i < (size_t) (w * h); i++)
-    {
-        size_t wi =(i % w);
-        size_t hi = (size_t)((float)(i - wi) / (float)w);
-        if (i == 0) hi = 0;
-        if (h == hi) hi -= 1;
-    
-        Spectrum pix = image.at(wi, (size_t)h - hi - 1);
-        float pdfNew = pix.luma() * std::sin(hi * PI_F / h);  
-        _pdf.push_back(pdfNew);
-        if (_cdf.size() == 0){
-            _cdf.push_back(pdfNew);
+
+    _pdf.resize(w * h);
+    col_prob.resize(w * h);
+    col_alias.resize(w * h);
+    std::vector<float> row_weights(h);
+
+    // Rows are independent, so build their tables in parallel
+    auto build_rows = [&](size_t begin, size_t end) {
+        for(size_t y = begin; y < end; y++) {
+            float* luma = &_pdf[y * w];
+            for(size_t x = 0; x < w; x++) luma[x] = std::max(image.at(x, y).luma(), 0.0f);
+            float sum = Alias::build(luma, w, &col_prob[y * w], &col_alias[y * w]);
+            row_weights[y] = sum * solid_angle(y);
         }
-        else 
-            _cdf.push_back(_cdf[_cdf.size() - 1] + pdfNew);
-        total += pdfNew;
-    } 
+    };
+
+    Thread_Pool::global().parallel_for(0, h, build_rows, 4096 / std::max<size_t>(w, 1) + 1);
+
+    rows = Alias(row_weights);
+    total = rows.total;
+
+    // Each pixel's probability is luma * solid angle / total, so its solid angle density
+    // is simply luma / total.
+    if(total > 0.0f) {
+        Thread_Pool::global().parallel_for(
+            0, _pdf.size(),
+            [&](size_t begin, size_t end) {
+                for(size_t i = begin; i < end; i++) _pdf[i] /= total;
+            },
+            1 << 16);
+    }
+}
+
+float Sphere::Image::solid_angle(size_t y) const {
+    float phi_0 = PI_F * (1.0f - (float)(y + 1) / h);
+    float phi_1 = PI_F * (1.0f - (float)y / h);
+    return (2.0f * PI_F / w) * (std::cos(phi_0) - std::cos(phi_1));
 }
 
 Vec3 Sphere::Image::sample() const {
@@ -79,24 +104,20 @@ Vec3 Sphere::Image::sample() const {
 
     // Use your importance sampling data structure to generate a sample direction.
     // Tip: std::upper_bound
-    float cdfPos = RNG::unit() * total;
-    auto start_iterator = _cdf.begin();
-    auto end_iterator = _cdf.end();
-    auto find_iterator = std::upper_bound(start_iterator, end_iterator, cdfPos);
-    size_t index = (size_t) (find_iterator - start_iterator);
-    if (index >= _cdf.size())
-        return Vec3{};
-    size_t wi =(index % w);
-    size_t hi = (size_t)((float)(index-wi) / (float)w);
-    float theta = (float)wi * (2.0f * PI_F) / w;
-    float phi = (float)hi * PI_F / h;
-    float xs = std::sin(phi) * std::cos(theta);
-    float ys = std::cos(phi);
-    float zs = std::sin(theta) * std::sin(phi);
 
-    return Vec3(xs, ys, zs);
+    if(total <= 0.0f) return Sphere::Uniform().sample();
 
-    
+    size_t y = rows.sample();
+    size_t x = Alias::sample(&col_prob[y * w], &col_alias[y * w], w);
+
+    // Uniform in theta and cos(phi) is uniform in solid angle
+    float theta = ((float)x + RNG::unit()) * 2.0f * PI_F / w;
+    float cos_0 = std::cos(PI_F * (1.0f - (float)(y + 1) / h));
+    float cos_1 = std::cos(PI_F * (1.0f - (float)y / h));
+    float cos_phi = lerp(cos_0, cos_1, RNG::unit());
+    float sin_phi = std::sqrt(std::max(1.0f - cos_phi * cos_phi, 0.0f));
+
+    return Vec3(sin_phi * std::cos(theta), cos_phi, sin_phi * std::sin(theta));
 }
 
 float Sphere::Image::pdf(Vec3 dir) const {
@@ -105,19 +126,15 @@ float Sphere::Image::pdf(Vec3 dir) const {
 
     // What is the PDF of this distribution at a particular direction?
 
+    if(total <= 0.0f) return 1.0f / (4.0f * PI_F);
 
-    float phi = std::acos(dir.y);
-
+    float phi = std::acos(clamp(dir.y, -1.0f, 1.0f));
     float theta = std::atan2(dir.z, dir.x);
-    if (theta < 0.0f) theta += 2.0*PI_F;
-
-    float hei = phi / PI_F * h;
-    float wid = theta / 2.0f / PI_F * (float)w;
-    if (wid < 0.0f) wid +=  (float)w;
+    if(theta < 0.0f) theta += 2.0f * PI_F;
 
-
-    return _pdf[(size_t)std::round(wid+ (float)w*hei)] / total * w * h / (2 * PI_F * PI_F * std::sin(phi));
-    
+    size_t x = std::min((size_t)(theta / (2.0f * PI_F) * w), w - 1);
+    size_t y = std::min((size_t)((1.0f - phi / PI_F) * h), h - 1);
+    return _pdf[y * w + x];
 }
 
 Vec3 Point::sample() const {
@@ -132,6 +149,67 @@ Vec3 Triangle::sample() const {
     return a * v0 + b * v1 + (1.0f - a - b) * v2;
 }
 
+Alias::Alias(const std::vector<float>& weights) {
+
+    size_t n = weights.size();
+    prob.resize(n);
+    alias.resize(n);
+    _pmf.resize(n);
+
+    total = build(weights.data(), n, prob.data(), alias.data());
+    for(size_t i = 0; i < n; i++) _pmf[i] = total > 0.0f ? weights[i] / total : 0.0f;
+}
+
+float Alias::build(const float* weights, size_t n, float* prob, unsigned int* alias) {
+
+    float total = 0.0f;
+    for(size_t i = 0; i < n; i++) total += weights[i];
+
+    for(size_t i = 0; i < n; i++) {
+        prob[i] = 1.0f;
+        alias[i] = (unsigned int)i;
+    }
+    if(n == 0 || total <= 0.0f) return total;
+
+    // Scale weights so the average bucket holds exactly 1, then repeatedly fill an
+    // underfull bucket with the excess of an overfull one.
+    std::vector<unsigned int> small, large;
+    std::vector<float> scaled(n);
+    for(size_t i = 0; i < n; i++) {
+        scaled[i] = weights[i] / total * n;
+        (scaled[i] < 1.0f ? small : large).push_back((unsigned int)i);
+    }
+
+    while(!small.empty() && !large.empty()) {
+        unsigned int s = small.back(), l = large.back();
+        small.pop_back();
+        prob[s] = scaled[s];
+        alias[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+        if(scaled[l] < 1.0f) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Anything left over is full up to rounding error
+    return total;
+}
+
+size_t Alias::sample(const float* prob, const unsigned int* alias, size_t n) {
+    if(n == 0) return 0;
+    float u = RNG::unit() * n;
+    size_t i = std::min((size_t)u, n - 1);
+    return (u - i) < prob[i] ? i : alias[i];
+}
+
+size_t Alias::sample() const {
+    return sample(prob.data(), alias.data(), prob.size());
+}
+
+float Alias::pmf(size_t i) const {
+    return i < _pmf.size() ? _pmf[i] : 0.0f;
+}
+
 Vec3 Hemisphere::Uniform::sample() const {
 
     float Xi1 = RNG::unit();
@@ -1,5 +1,8 @@
 
 #include "../scene/skeleton.h"
+#include "../util/thread_pool.h"
+
+#include <unordered_map>
 
 Vec3 closest_on_line_segment(Vec3 start, Vec3 end, Vec3 point) {
 
@@ -118,19 +121,30 @@ void Skeleton::find_joints(const GL::Mesh& mesh, std::vector<std::vector<Joint*>
     // For each i in [0, verts.size()), map[i] should contain the list of joints that
     // effect vertex i. Note that i is NOT Vert::id! i is the index in verts.
 
-    for_joints([&](Joint* j) {
-        Vec3 jEnd = end_of(j);
-        Vec3 jStart = joint_to_bind(j) * Vec3(0);
-        for (size_t i = 0; i < verts.size(); i++){
-            Vec3 iPos = verts[i].pos;
-            Vec3 iPos_segment = closest_on_line_segment(jStart, jEnd, iPos);
-            float dist = (iPos_segment - iPos).norm();
-            if (dist < j->radius){
-                map[i].push_back(j);
+    // Bind position bone segments, in for_joints order
+    struct Segment {
+        Joint* j;
+        Vec3 start, end;
+    };
+    std::vector<Segment> segments;
+    for_joints([&](Joint* j) { segments.push_back({j, joint_to_bind(j) * Vec3(0), end_of(j)}); });
+
+    // Vertices are independent, so split them over the pool
+    Thread_Pool::global().parallel_for(
+        0, verts.size(),
+        [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                Vec3 iPos = verts[i].pos;
+                for(const Segment& s : segments) {
+                    Vec3 iPos_segment = closest_on_line_segment(s.start, s.end, iPos);
+                    float dist = (iPos_segment - iPos).norm();
+                    if(dist < s.j->radius) {
+                        map[i].push_back(s.j);
+                    }
+                }
             }
-        }
-        
-    });
+        },
+        256);
 }
 
 void Skeleton::skin(const GL::Mesh& input, GL::Mesh& output,
@@ -147,45 +161,50 @@ void Skeleton::skin(const GL::Mesh& input, GL::Mesh& output,
 
     std::vector<GL::Mesh::Vert> verts = input.verts();
 
-    for(size_t i = 0; i < verts.size(); i++) {
-
-        // Skin vertex i. Note that its position is given in object bind space.
-        float distSum = 0.0f;
-        
-        for (size_t ji = 0; ji < map[i].size(); ji++){
-            Joint* j = map[i][ji];
-            Vec3 jEnd = end_of(j);
-            Vec3 jStart = joint_to_bind(j) * Vec3(0);
-            
-            Vec3 iPos = verts[i].pos;
-            float dist = (closest_on_line_segment(jStart, jEnd, iPos) - iPos).norm();
-            distSum += 1.0f/dist;
-        }
-        
-        Vec3 newPos = Vec3(0.0f);
-        Vec3 newNorm = Vec3(0.0f);
-        for (size_t ji = 0; ji < map[i].size(); ji++){
-            Joint* j = map[i][ji];
-            Vec3 jEnd = end_of(j);
-            Vec3 jStart = joint_to_bind(j) * Vec3(0);
-            Vec3 iPos = verts[i].pos;
-            Vec3 iNorm = verts[i].norm;
-            float dist = (closest_on_line_segment(jStart, jEnd, iPos) - iPos).norm();
-            float w = (1.0f/dist)/distSum;
-            Vec3 vPosJ = joint_to_posed(map[i][ji]) * Mat4::inverse(joint_to_bind(map[i][ji])) * (iPos);
-            Vec3 vNormJ = (joint_to_posed(map[i][ji]) * Mat4::inverse(joint_to_bind(map[i][ji])) * (Vec4(iNorm, 0.0f))).xyz();
-            newPos = w * vPosJ + newPos;
-            newNorm = w * vNormJ + newNorm;
-        }
-        verts[i].pos = newPos;
-        verts[i].norm = newNorm.unit();
-        
-        
-        
-
-
+    // Each joint's bind position segment and bind-to-posed transform, computed once
+    // rather than for every vertex it influences
+    struct Bone {
+        Vec3 start, end;
+        Mat4 bind_to_posed;
+    };
+    std::unordered_map<Joint*, Bone> bones;
+    for_joints([&](Joint* j) {
+        bones[j] = {joint_to_bind(j) * Vec3(0), end_of(j),
+                    joint_to_posed(j) * Mat4::inverse(joint_to_bind(j))};
+    });
 
-    }
+    Thread_Pool::global().parallel_for(
+        0, verts.size(),
+        [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+
+                // Skin vertex i. Note that its position is given in object bind space.
+                Vec3 iPos = verts[i].pos;
+                Vec3 iNorm = verts[i].norm;
+
+                float distSum = 0.0f;
+                for(Joint* j : map[i]) {
+                    const Bone& b = bones.at(j);
+                    float dist = (closest_on_line_segment(b.start, b.end, iPos) - iPos).norm();
+                    distSum += 1.0f / dist;
+                }
+
+                Vec3 newPos = Vec3(0.0f);
+                Vec3 newNorm = Vec3(0.0f);
+                for(Joint* j : map[i]) {
+                    const Bone& b = bones.at(j);
+                    float dist = (closest_on_line_segment(b.start, b.end, iPos) - iPos).norm();
+                    float w = (1.0f / dist) / distSum;
+                    Vec3 vPosJ = b.bind_to_posed * iPos;
+                    Vec3 vNormJ = (b.bind_to_posed * Vec4(iNorm, 0.0f)).xyz();
+                    newPos = w * vPosJ + newPos;
+                    newNorm = w * vNormJ + newNorm;
+                }
+                verts[i].pos = newPos;
+                verts[i].norm = newNorm.unit();
+            }
+        },
+        256);
 
     std::vector<GL::Mesh::Index> idxs = input.indices();
     output.recreate(std::move(verts), std::move(idxs));
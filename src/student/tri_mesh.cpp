@@ -144,10 +144,19 @@ void Tri_Mesh::build(const GL::Mesh& mesh, bool bvh) {
     const auto& idxs = mesh.indices();
 
     std::vector<Triangle> tris;
+    std::vector<float> areas;
     for(size_t i = 0; i < idxs.size(); i += 3) {
         tris.push_back(Triangle(verts.data(), idxs[i], idxs[i + 1], idxs[i + 2]));
+        Vec3 v0 = verts[idxs[i]].position;
+        Vec3 v1 = verts[idxs[i + 1]].position;
+        Vec3 v2 = verts[idxs[i + 2]].position;
+        areas.push_back(cross(v1 - v0, v2 - v0).norm() / 2.0f);
     }
 
+    sample_idxs.assign(idxs.begin(), idxs.end());
+    triangle_sampler = Samplers::Alias(areas);
+    total_area = triangle_sampler.total;
+
     if(use_bvh) {
         triangle_bvh.build(std::move(tris), 4);
     } else {
@@ -165,6 +174,9 @@ Tri_Mesh Tri_Mesh::copy() const {
     ret.triangle_bvh = triangle_bvh.copy();
     ret.triangle_list = triangle_list.copy();
     ret.use_bvh = use_bvh;
+    ret.sample_idxs = sample_idxs;
+    ret.triangle_sampler = triangle_sampler;
+    ret.total_area = total_area;
     return ret;
 }
 
@@ -185,17 +197,48 @@ size_t Tri_Mesh::visualize(GL::Lines& lines, GL::Lines& active, size_t level,
 }
 
 Vec3 Tri_Mesh::sample(Vec3 from) const {
-    if(use_bvh) {
-        die("Sampling BVH-based triangle meshes is not yet supported.");
-    }
-    return triangle_list.sample(from);
+    if(total_area <= 0.0f) return {};
+    size_t i = 3 * triangle_sampler.sample();
+    Samplers::Triangle sampler(verts[sample_idxs[i]].position, verts[sample_idxs[i + 1]].position,
+                               verts[sample_idxs[i + 2]].position);
+    return (sampler.sample() - from).unit();
 }
 
 float Tri_Mesh::pdf(Ray ray, const Mat4& T, const Mat4& iT) const {
-    if(use_bvh) {
-        die("Sampling BVH-based triangle meshes is not yet supported.");
+
+    if(total_area <= 0.0f) return 0.0f;
+
+    // Every point on the mesh along the ray could have produced this direction,
+    // so sum the density over all intersections, finding each with the BVH/list.
+    Ray tray = ray;
+    tray.transform(iT);
+
+    // Points are picked uniformly by object-space area; T may stretch each triangle
+    // differently, which scales its density by the change in area along its normal.
+    Mat4 nT = iT.T();
+    float det = std::abs(T.det());
+
+    // Each step moves at least one float past the last hit, or EPS_F would vanish
+    // at large distances and the same triangle would be hit forever. A ray can't
+    // cross more triangles than there are, which bounds the loop regardless.
+    const float inf = std::numeric_limits<float>::infinity();
+    float pdf = 0.0f;
+    float start = 0.0f;
+    for(size_t n = sample_idxs.size() / 3; n > 0; n--) {
+        tray.dist_bounds = Vec2{start, inf};
+        Trace trace = hit(tray);
+        if(!trace.hit) break;
+        start = std::max(trace.distance + EPS_F, std::nextafter(trace.distance, inf));
+
+        float area_scale = det * nT.rotate(trace.normal).norm();
+        trace.transform(T, nT);
+        float cos = std::abs(dot(trace.normal, ray.dir));
+        if(cos == 0.0f || area_scale == 0.0f) continue;
+
+        float g = (trace.position - ray.point).norm_squared() / cos;
+        pdf += g / (total_area * area_scale);
     }
-    return triangle_list.pdf(ray, T, iT);
+    return pdf;
 }
 
 } // namespace PT
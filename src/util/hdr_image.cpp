@@ -1,25 +1,166 @@
 
 #include "hdr_image.h"
 #include "../lib/log.h"
+#include "simd.h"
+#include "thread_pool.h"
 
 #include <sf_libs/stb_image.h>
 #include <sf_libs/tinyexr.h>
 
+#if defined(__F16C__) || defined(__AVX2__)
+#include <immintrin.h>
+#define HDR_IMAGE_F16C
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+const char* HDR_Format_Names[(int)HDR_Format::count] = {"RGB32F", "RGBA16F", "RGB9E5"};
+const char* Tonemap_Op_Names[(int)Tonemap_Op::count] = {"Exposure", "Reinhard", "ACES"};
+
+// Scalar IEEE half conversions (round to nearest even), after F. Giesen's
+// branch-light versions; used when the F16C instructions are unavailable.
+
+static uint32_t float_bits(float f) {
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static float bits_float(uint32_t u) {
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static uint16_t float_to_half(float f) {
+
+    uint32_t u = float_bits(f);
+    uint32_t sign = u & 0x80000000u;
+    u ^= sign;
+
+    uint16_t ret;
+    if(u >= (143u << 23)) {
+        // Too large for half: infinity, or NaN if it already was
+        ret = u > (255u << 23) ? 0x7e00 : 0x7c00;
+    } else if(u < (113u << 23)) {
+        // Subnormal half: let float addition do the rounding
+        float denorm_magic = bits_float(126u << 23);
+        ret = (uint16_t)(float_bits(bits_float(u) + denorm_magic) - (126u << 23));
+    } else {
+        uint32_t mant_odd = (u >> 13) & 1;
+        u += (uint32_t)(-112 * (1 << 23)) + 0xfff + mant_odd;
+        ret = (uint16_t)(u >> 13);
+    }
+    return ret | (uint16_t)(sign >> 16);
+}
+
+static float half_to_float(uint16_t h) {
+
+    const uint32_t shifted_exp = 0x7c00u << 13;
+    uint32_t u = (h & 0x7fffu) << 13;
+    uint32_t exp = shifted_exp & u;
+    u += 112u << 23;
+
+    if(exp == shifted_exp) {
+        u += 112u << 23;
+    } else if(exp == 0) {
+        u += 1u << 23;
+        u = float_bits(bits_float(u) - bits_float(113u << 23));
+    }
+    return bits_float(u | ((h & 0x8000u) << 16));
+}
+
+static void encode_half(const Spectrum* in, size_t n, uint16_t* out) {
+#ifdef HDR_IMAGE_F16C
+    for(size_t i = 0; i < n; i++) {
+        __m128 v = _mm_set_ps(1.0f, in[i].b, in[i].g, in[i].r);
+        __m128i h = _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+        _mm_storel_epi64((__m128i*)(out + 4 * i), h);
+    }
+#else
+    for(size_t i = 0; i < n; i++) {
+        out[4 * i] = float_to_half(in[i].r);
+        out[4 * i + 1] = float_to_half(in[i].g);
+        out[4 * i + 2] = float_to_half(in[i].b);
+        out[4 * i + 3] = 0x3c00;
+    }
+#endif
+}
+
+static void decode_half(const uint16_t* in, size_t n, Spectrum* out) {
+#ifdef HDR_IMAGE_F16C
+    alignas(16) float f[4];
+    for(size_t i = 0; i < n; i++) {
+        __m128i h = _mm_loadl_epi64((const __m128i*)(in + 4 * i));
+        _mm_store_ps(f, _mm_cvtph_ps(h));
+        out[i] = Spectrum(f[0], f[1], f[2]);
+    }
+#else
+    for(size_t i = 0; i < n; i++) {
+        out[i] = Spectrum(half_to_float(in[4 * i]), half_to_float(in[4 * i + 1]),
+                          half_to_float(in[4 * i + 2]));
+    }
+#endif
+}
+
+// Shared exponent packing as in EXT_texture_shared_exponent: 9-bit mantissas
+// in bits 0-26 and a biased 5-bit exponent in bits 27-31. Negative values clamp to zero.
+
+static uint32_t encode_rgb9e5(Spectrum s) {
+
+    const int N = 9, B = 15;
+    const float max_value = 65408.0f;
+
+    float r = clamp(std::isfinite(s.r) ? s.r : 0.0f, 0.0f, max_value);
+    float g = clamp(std::isfinite(s.g) ? s.g : 0.0f, 0.0f, max_value);
+    float b = clamp(std::isfinite(s.b) ? s.b : 0.0f, 0.0f, max_value);
+    float m = std::max(r, std::max(g, b));
+    if(m == 0.0f) return 0;
+
+    // frexp gives m = f * 2^e with f in [0.5, 1), so floor(log2(m)) = e - 1
+    int e;
+    std::frexp(m, &e);
+    int exp = std::max(-B - 1, e - 1) + 1 + B;
+
+    float scale = std::ldexp(1.0f, N + B - exp);
+    if((uint32_t)std::floor(m * scale + 0.5f) == (1u << N)) {
+        exp++;
+        scale *= 0.5f;
+    }
+
+    uint32_t rm = (uint32_t)std::floor(r * scale + 0.5f);
+    uint32_t gm = (uint32_t)std::floor(g * scale + 0.5f);
+    uint32_t bm = (uint32_t)std::floor(b * scale + 0.5f);
+    return rm | (gm << 9) | (bm << 18) | ((uint32_t)exp << 27);
+}
+
+static Spectrum decode_rgb9e5(uint32_t v) {
+    float scale = std::ldexp(1.0f, (int)(v >> 27) - 15 - 9);
+    return Spectrum((float)(v & 0x1ff), (float)((v >> 9) & 0x1ff), (float)((v >> 18) & 0x1ff)) *
+           scale;
+}
+
 HDR_Image::HDR_Image() : w(0), h(0) {
 }
 
-HDR_Image::HDR_Image(size_t w, size_t h) : w(w), h(h) {
+HDR_Image::HDR_Image(size_t w, size_t h, HDR_Format format) : w(w), h(h), fmt(format) {
     assert(w > 0 && h > 0);
-    pixels.resize(w * h);
+    resize(w, h);
 }
 
 HDR_Image HDR_Image::copy() const {
     HDR_Image ret;
-    ret.resize(w, h);
-    ret.pixels.insert(ret.pixels.begin(), pixels.begin(), pixels.end());
+    ret.fmt = fmt;
+    ret.w = w;
+    ret.h = h;
+    ret.pixels = pixels;
+    ret.half_pixels = half_pixels;
+    ret.shared_pixels = shared_pixels;
     ret.last_path = last_path;
     ret.dirty = true;
     ret.exposure = exposure;
+    ret.tonemap_op = tonemap_op;
     return ret;
 }
 
@@ -27,45 +168,109 @@ std::pair<size_t, size_t> HDR_Image::dimension() const {
     return {w, h};
 }
 
+HDR_Format HDR_Image::format() const {
+    return fmt;
+}
+
 void HDR_Image::resize(size_t _w, size_t _h) {
     w = _w;
     h = _h;
     pixels.clear();
-    pixels.resize(w * h);
+    half_pixels.clear();
+    shared_pixels.clear();
+    switch(fmt) {
+    case HDR_Format::rgba16f: {
+        // Zero, with alpha = 1
+        half_pixels.resize(4 * w * h, 0);
+        for(size_t i = 0; i < w * h; i++) half_pixels[4 * i + 3] = 0x3c00;
+    } break;
+    case HDR_Format::rgb9e5: shared_pixels.resize(w * h, 0); break;
+    default: pixels.resize(w * h); break;
+    }
     dirty = true;
 }
 
+void HDR_Image::convert(HDR_Format format) {
+
+    if(format == fmt) return;
+
+    // Decode everything to float, then encode in the new format
+    std::vector<Spectrum> data(w * h);
+    switch(fmt) {
+    case HDR_Format::rgba16f: decode_half(half_pixels.data(), w * h, data.data()); break;
+    case HDR_Format::rgb9e5: {
+        for(size_t i = 0; i < w * h; i++) data[i] = decode_rgb9e5(shared_pixels[i]);
+    } break;
+    default: data = std::move(pixels); break;
+    }
+
+    fmt = format;
+    resize(w, h);
+
+    switch(fmt) {
+    case HDR_Format::rgba16f: encode_half(data.data(), w * h, half_pixels.data()); break;
+    case HDR_Format::rgb9e5: {
+        for(size_t i = 0; i < w * h; i++) shared_pixels[i] = encode_rgb9e5(data[i]);
+    } break;
+    default: pixels = std::move(data); break;
+    }
+}
+
 void HDR_Image::clear(Spectrum color) {
-    for(auto& s : pixels) s = color;
+    for(size_t i = 0; i < w * h; i++) set(i, color);
     dirty = true;
 }
 
 Spectrum& HDR_Image::at(size_t i) {
     assert(i < w * h);
+    assert(fmt == HDR_Format::rgb32f);
     dirty = true;
     return pixels[i];
 }
 
 Spectrum HDR_Image::at(size_t i) const {
     assert(i < w * h);
-    return pixels[i];
+    switch(fmt) {
+    case HDR_Format::rgba16f: {
+        Spectrum ret;
+        decode_half(&half_pixels[4 * i], 1, &ret);
+        return ret;
+    }
+    case HDR_Format::rgb9e5: return decode_rgb9e5(shared_pixels[i]);
+    default: return pixels[i];
+    }
 }
 
 Spectrum& HDR_Image::at(size_t x, size_t y) {
     assert(x < w && y < h);
-    size_t idx = y * w + x;
-    dirty = true;
-    return pixels[idx];
+    return at(y * w + x);
 }
 
 Spectrum HDR_Image::at(size_t x, size_t y) const {
     assert(x < w && y < h);
-    size_t idx = y * w + x;
-    return pixels[idx];
+    return at(y * w + x);
+}
+
+void HDR_Image::set(size_t i, Spectrum s) {
+    assert(i < w * h);
+    switch(fmt) {
+    case HDR_Format::rgba16f: encode_half(&s, 1, &half_pixels[4 * i]); break;
+    case HDR_Format::rgb9e5: shared_pixels[i] = encode_rgb9e5(s); break;
+    default: pixels[i] = s; break;
+    }
+    dirty = true;
+}
+
+void HDR_Image::set(size_t x, size_t y, Spectrum s) {
+    assert(x < w && y < h);
+    set(y * w + x, s);
 }
 
 std::string HDR_Image::load_from(std::string file) {
 
+    // Images are decoded as float, then stored in this image's format
+    HDR_Format target = fmt;
+
     if(IsEXR(file.c_str()) == TINYEXR_SUCCESS) {
 
         int n_w, n_h;
@@ -85,6 +290,7 @@ std::string HDR_Image::load_from(std::string file) {
 
         } else {
 
+            fmt = HDR_Format::rgb32f;
             resize(n_w, n_h);
 
             for(size_t j = 0; j < h; j++) {
@@ -109,6 +315,7 @@ std::string HDR_Image::load_from(std::string file) {
         if(!data) return std::string(stbi_failure_reason());
         if(channels < 3) return "Image has less than 3 color channels.";
 
+        fmt = HDR_Format::rgb32f;
         resize(n_w, n_h);
 
         for(size_t i = 0; i < w * h * channels; i += channels) {
@@ -126,6 +333,7 @@ std::string HDR_Image::load_from(std::string file) {
         }
     }
 
+    convert(target);
     last_path = file;
     dirty = true;
     return {};
@@ -135,7 +343,7 @@ std::string HDR_Image::loaded_from() const {
     return last_path;
 }
 
-void HDR_Image::tonemap(float e) const {
+void HDR_Image::tonemap(float e, Tonemap_Op op) const {
 
     if(e <= 0.0f) {
         e = exposure;
@@ -143,47 +351,133 @@ void HDR_Image::tonemap(float e) const {
         exposure = e;
         dirty = true;
     }
+    if(op != tonemap_op) {
+        tonemap_op = op;
+        dirty = true;
+    }
 
     if(!dirty) return;
 
     std::vector<unsigned char> data;
-    tonemap_to(data, e);
+    tonemap_to(data, e, op);
     render_tex.image((int)w, (int)h, data.data());
 
     dirty = false;
 }
 
-const GL::Tex2D& HDR_Image::get_texture(float e) const {
-    tonemap(e);
+const GL::Tex2D& HDR_Image::get_texture(float e, Tonemap_Op op) const {
+    tonemap(e, op);
     return render_tex;
 }
 
-void HDR_Image::tonemap_to(std::vector<unsigned char>& data, float e) const {
+// sRGB encoding of [0,1], indexed by round(value * (srgb_lut_size - 1)). At this
+// resolution neighbouring entries differ by well under one 8-bit step, even near zero.
+static constexpr size_t srgb_lut_size = 1 << 14;
+
+static const unsigned char* srgb_lut() {
+    static const std::vector<unsigned char> lut = [] {
+        std::vector<unsigned char> ret(srgb_lut_size);
+        for(size_t i = 0; i < srgb_lut_size; i++) {
+            float v = Spectrum::to_srgb((float)i / (srgb_lut_size - 1));
+            ret[i] = (unsigned char)std::round(clamp(v, 0.0f, 1.0f) * 255.0f);
+        }
+        return ret;
+    }();
+    return lut.data();
+}
+
+static float tonemap_scalar(float x, float e, Tonemap_Op op) {
+    // Also maps NaN to zero
+    x = x * e > 0.0f ? x * e : 0.0f;
+    switch(op) {
+    case Tonemap_Op::reinhard: x = x / (1.0f + x); break;
+    case Tonemap_Op::aces: {
+        // K. Narkowicz's fit of the ACES reference rendering transform
+        x = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+    } break;
+    default: x = 1.0f - std::exp(-x); break;
+    }
+    return clamp(x, 0.0f, 1.0f);
+}
+
+// Apply the tonemapping operator to n floats in place, mapping them to [0,1]
+static void tonemap_span(float* v, size_t n, float e, Tonemap_Op op) {
+
+    size_t i = 0;
+
+#ifdef SIMD_SSE2
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(e);
+
+    for(; i + 4 <= n; i += 4) {
+        // max() returns its second operand for NaN, so NaN maps to zero
+        __m128 x = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(v + i), scale), zero);
+        switch(op) {
+        case Tonemap_Op::reinhard: x = _mm_div_ps(x, _mm_add_ps(one, x)); break;
+        case Tonemap_Op::aces: {
+            __m128 num = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), x),
+                                                  _mm_set1_ps(0.03f)));
+            __m128 den = _mm_add_ps(
+                _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), x), _mm_set1_ps(0.59f))),
+                _mm_set1_ps(0.14f));
+            x = _mm_div_ps(num, den);
+        } break;
+        default: x = _mm_sub_ps(one, SIMD::exp_neg(x)); break;
+        }
+        x = _mm_min_ps(_mm_max_ps(x, zero), one);
+        _mm_storeu_ps(v + i, x);
+    }
+#endif
+
+    for(; i < n; i++) v[i] = tonemap_scalar(v[i], e, op);
+}
+
+void HDR_Image::tonemap_to(std::vector<unsigned char>& data, float e, Tonemap_Op op) const {
 
     if(e <= 0.0f) {
         e = exposure;
     }
 
     if(data.size() != w * h * 4) data.resize(w * h * 4);
+    if(w == 0 || h == 0) return;
+
+    const unsigned char* lut = srgb_lut();
 
-    for(size_t j = 0; j < h; j++) {
-        for(size_t i = 0; i < w; i++) {
+    // Each row is decoded to floats, mapped to [0,1] in one pass, then sent through
+    // the sRGB table. Output rows are flipped, as the image is stored bottom-up.
+    auto tonemap_rows = [&](size_t begin, size_t end) {
+        std::vector<Spectrum> decoded(w);
+        std::vector<float> row(3 * w);
 
-            size_t pidx = (h - j - 1) * w + i;
-            const Spectrum& sample = pixels[pidx];
+        for(size_t j = begin; j < end; j++) {
 
-            float r = 1.0f - std::exp(-sample.r * exposure);
-            float g = 1.0f - std::exp(-sample.g * exposure);
-            float b = 1.0f - std::exp(-sample.b * exposure);
+            size_t src = (h - j - 1) * w;
+            switch(fmt) {
+            case HDR_Format::rgba16f: decode_half(&half_pixels[4 * src], w, decoded.data()); break;
+            case HDR_Format::rgb9e5: {
+                for(size_t i = 0; i < w; i++) decoded[i] = decode_rgb9e5(shared_pixels[src + i]);
+            } break;
+            default: std::copy_n(&pixels[src], w, decoded.begin()); break;
+            }
+            for(size_t i = 0; i < w; i++) {
+                row[3 * i] = decoded[i].r;
+                row[3 * i + 1] = decoded[i].g;
+                row[3 * i + 2] = decoded[i].b;
+            }
 
-            Spectrum out(r, g, b);
-            out = out.to_srgb();
+            tonemap_span(row.data(), row.size(), e, op);
 
-            size_t didx = 4 * (j * w + i);
-            data[didx] = (unsigned char)std::round(out.r * 255.0f);
-            data[didx + 1] = (unsigned char)std::round(out.g * 255.0f);
-            data[didx + 2] = (unsigned char)std::round(out.b * 255.0f);
-            data[didx + 3] = 255;
+            unsigned char* out = &data[4 * j * w];
+            for(size_t i = 0; i < w; i++) {
+                out[4 * i] = lut[(size_t)(row[3 * i] * (srgb_lut_size - 1) + 0.5f)];
+                out[4 * i + 1] = lut[(size_t)(row[3 * i + 1] * (srgb_lut_size - 1) + 0.5f)];
+                out[4 * i + 2] = lut[(size_t)(row[3 * i + 2] * (srgb_lut_size - 1) + 0.5f)];
+                out[4 * i + 3] = 255;
+            }
         }
-    }
+    };
+
+    // Small images aren't worth splitting up
+    const size_t min_pixels_per_chunk = 1 << 14;
+    Thread_Pool::global().parallel_for(0, h, tonemap_rows, min_pixels_per_chunk / w + 1);
 }
@@ -1,15 +1,26 @@
 
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 #include "../lib/spectrum.h"
 #include "../platform/gl.h"
 
+/// Pixel storage: 32-bit float RGB (12 bytes), 16-bit float RGBA (8 bytes),
+/// or RGB with 9-bit mantissas and a shared 5-bit exponent (4 bytes).
+enum class HDR_Format : int { rgb32f, rgba16f, rgb9e5, count };
+extern const char* HDR_Format_Names[(int)HDR_Format::count];
+
+/// Curve mapping exposure-scaled radiance x to display range: 1 - e^-x,
+/// x / (1 + x), or a fit of the ACES filmic curve.
+enum class Tonemap_Op : int { exposure, reinhard, aces, count };
+extern const char* Tonemap_Op_Names[(int)Tonemap_Op::count];
+
 class HDR_Image {
 public:
     HDR_Image();
-    HDR_Image(size_t w, size_t h);
+    HDR_Image(size_t w, size_t h, HDR_Format format = HDR_Format::rgb32f);
     HDR_Image(const HDR_Image& src) = delete;
     HDR_Image(HDR_Image&& src) = default;
     ~HDR_Image() = default;
@@ -19,29 +30,45 @@ public:
     HDR_Image& operator=(const HDR_Image& src) = delete;
     HDR_Image& operator=(HDR_Image&& src) = default;
 
+    // Mutable references are only available for rgb32f images; use set() otherwise
     Spectrum& at(size_t x, size_t y);
     Spectrum at(size_t x, size_t y) const;
     Spectrum& at(size_t i);
     Spectrum at(size_t i) const;
 
+    void set(size_t x, size_t y, Spectrum s);
+    void set(size_t i, Spectrum s);
+
     void clear(Spectrum color);
     void resize(size_t w, size_t h);
     std::pair<size_t, size_t> dimension() const;
 
+    HDR_Format format() const;
+    // Re-encode all pixels in the given format (lossy when reducing precision)
+    void convert(HDR_Format format);
+
     std::string load_from(std::string file);
     std::string loaded_from() const;
 
-    void tonemap_to(std::vector<unsigned char>& data, float exposure = 0.0f) const;
-    const GL::Tex2D& get_texture(float exposure = 0.0f) const;
+    void tonemap_to(std::vector<unsigned char>& data, float exposure = 0.0f,
+                    Tonemap_Op op = Tonemap_Op::exposure) const;
+    const GL::Tex2D& get_texture(float exposure = 0.0f,
+                                 Tonemap_Op op = Tonemap_Op::exposure) const;
 
 private:
-    void tonemap(float exposure = 0.0f) const;
+    void tonemap(float exposure, Tonemap_Op op) const;
 
     size_t w, h;
     std::string last_path;
+
+    // Only the vector matching fmt is populated
+    HDR_Format fmt = HDR_Format::rgb32f;
     std::vector<Spectrum> pixels;
+    std::vector<uint16_t> half_pixels;
+    std::vector<uint32_t> shared_pixels;
 
     mutable GL::Tex2D render_tex;
     mutable float exposure = 1.0f;
+    mutable Tonemap_Op tonemap_op = Tonemap_Op::exposure;
     mutable bool dirty = true;
 };
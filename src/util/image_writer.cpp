@@ -0,0 +1,212 @@
+
+#include "image_writer.h"
+
+#include <sf_libs/stb_image_write.h>
+#include <sf_libs/tinyexr.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+const char* Image_Format_Names[(int)Image_Format::count] = {"PNG", "EXR", "PFM"};
+const char* Image_Format_Extensions[(int)Image_Format::count] = {".png", ".exr", ".pfm"};
+
+Image_Writer::Image_Writer(size_t threads, size_t max_queued) : max_queued(max_queued) {
+    for(size_t i = 0; i < threads; i++) workers.emplace_back([this] { work(); });
+}
+
+Image_Writer::~Image_Writer() {
+    {
+        std::unique_lock<std::mutex> lock(queue_mut);
+        stop = true;
+    }
+    has_work.notify_all();
+    // Workers drain the queue before exiting, so nothing queued is lost
+    for(std::thread& t : workers) t.join();
+}
+
+void Image_Writer::write(Job&& job) {
+    {
+        std::unique_lock<std::mutex> lock(queue_mut);
+        has_room.wait(lock, [this] { return queue.size() < max_queued; });
+        queue.push_back(std::move(job));
+    }
+    has_work.notify_one();
+}
+
+std::string Image_Writer::wait() {
+    std::unique_lock<std::mutex> lock(queue_mut);
+    has_room.wait(lock, [this] { return queue.empty() && busy == 0; });
+    std::string ret = std::move(first_error);
+    first_error.clear();
+    return ret;
+}
+
+std::string Image_Writer::error() const {
+    std::unique_lock<std::mutex> lock(queue_mut);
+    return first_error;
+}
+
+void Image_Writer::work() {
+    for(;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(queue_mut);
+            has_work.wait(lock, [this] { return stop || !queue.empty(); });
+            if(queue.empty()) return;
+            job = std::move(queue.front());
+            queue.pop_front();
+            busy++;
+        }
+        has_room.notify_all();
+
+        std::string err = write_now(job);
+
+        {
+            std::unique_lock<std::mutex> lock(queue_mut);
+            if(!err.empty() && first_error.empty()) first_error = err;
+            busy--;
+        }
+        has_room.notify_all();
+    }
+}
+
+Image_Format Image_Writer::format_of(const std::string& path) {
+    std::string lower(path);
+    for(char& c : lower) c = (char)std::tolower((unsigned char)c);
+    for(int i = 0; i < (int)Image_Format::count; i++) {
+        std::string ext(Image_Format_Extensions[i]);
+        if(lower.length() >= ext.length() &&
+           lower.compare(lower.length() - ext.length(), ext.length(), ext) == 0) {
+            return (Image_Format)i;
+        }
+    }
+    return Image_Format::png;
+}
+
+static std::string write_png(const Image_Writer::Job& job) {
+
+    std::vector<unsigned char> data;
+    size_t w = job.w, h = job.h;
+
+    if(job.ldr.empty()) {
+        job.hdr.tonemap_to(data, job.exposure, job.op);
+        std::tie(w, h) = job.hdr.dimension();
+    } else if(job.flip) {
+        // Flip here rather than with stbi_flip_vertically_on_write, which sets a global
+        data.resize(w * h * 4);
+        for(size_t j = 0; j < h; j++) {
+            std::copy_n(&job.ldr[(h - j - 1) * w * 4], w * 4, &data[j * w * 4]);
+        }
+    }
+
+    const unsigned char* pixels = data.empty() ? job.ldr.data() : data.data();
+    if(!stbi_write_png(job.path.c_str(), (int)w, (int)h, 4, pixels, (int)w * 4)) {
+        return "Failed to write " + job.path + "!";
+    }
+    return {};
+}
+
+static std::string write_exr(const Image_Writer::Job& job) {
+
+    auto [w, h] = job.hdr.dimension();
+
+    // One plane per channel; EXR scanlines are stored top-down
+    std::vector<std::pair<std::string, std::vector<float>>> planes;
+    for(const char* name : {"R", "G", "B"}) planes.push_back({name, std::vector<float>(w * h)});
+    for(size_t j = 0; j < h; j++) {
+        for(size_t i = 0; i < w; i++) {
+            Spectrum s = job.hdr.at(i, h - j - 1);
+            for(int c = 0; c < 3; c++) planes[c].second[j * w + i] = s.data[c];
+        }
+    }
+    for(const Image_Writer::Channel& channel : job.channels) {
+        if(channel.data.size() != w * h) return "Channel " + channel.name + " has the wrong size!";
+        std::vector<float> plane(w * h);
+        for(size_t j = 0; j < h; j++) {
+            std::copy_n(&channel.data[(h - j - 1) * w], w, &plane[j * w]);
+        }
+        planes.push_back({channel.name, std::move(plane)});
+    }
+
+    // Readers expect channels sorted by name
+    std::sort(planes.begin(), planes.end(),
+              [](const auto& l, const auto& r) { return l.first < r.first; });
+
+    std::vector<EXRChannelInfo> infos(planes.size());
+    std::vector<int> types(planes.size(), TINYEXR_PIXELTYPE_FLOAT);
+    std::vector<float*> ptrs(planes.size());
+    for(size_t c = 0; c < planes.size(); c++) {
+        std::memset(&infos[c], 0, sizeof(EXRChannelInfo));
+        std::strncpy(infos[c].name, planes[c].first.c_str(), sizeof(infos[c].name) - 1);
+        ptrs[c] = planes[c].second.data();
+    }
+
+    EXRHeader header;
+    InitEXRHeader(&header);
+    header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+    header.num_channels = (int)planes.size();
+    header.channels = infos.data();
+    header.pixel_types = types.data();
+    header.requested_pixel_types = types.data();
+
+    EXRImage image;
+    InitEXRImage(&image);
+    image.num_channels = (int)planes.size();
+    image.images = (unsigned char**)ptrs.data();
+    image.width = (int)w;
+    image.height = (int)h;
+
+    const char* err = nullptr;
+    if(SaveEXRImageToFile(&image, &header, job.path.c_str(), &err) != TINYEXR_SUCCESS) {
+        std::string ret = "Failed to write " + job.path + "!";
+        if(err) {
+            ret += " (" + std::string(err) + ")";
+            FreeEXRErrorMessage(err);
+        }
+        return ret;
+    }
+    return {};
+}
+
+static std::string write_pfm(const Image_Writer::Job& job) {
+
+    auto [w, h] = job.hdr.dimension();
+
+    // PFM scanlines are stored bottom-up, like HDR_Image. A negative scale
+    // marks the floats as little-endian.
+    std::vector<float> data(w * 3);
+
+    FILE* file = std::fopen(job.path.c_str(), "wb");
+    if(!file) return "Failed to open " + job.path + "!";
+
+    bool ok = std::fprintf(file, "PF\n%zu %zu\n-1.0\n", w, h) > 0;
+    for(size_t j = 0; ok && j < h; j++) {
+        for(size_t i = 0; i < w; i++) {
+            Spectrum s = job.hdr.at(i, j);
+            data[3 * i] = s.r;
+            data[3 * i + 1] = s.g;
+            data[3 * i + 2] = s.b;
+        }
+        ok = std::fwrite(data.data(), sizeof(float), data.size(), file) == data.size();
+    }
+    ok = std::fclose(file) == 0 && ok;
+
+    if(!ok) return "Failed to write " + job.path + "!";
+    return {};
+}
+
+std::string Image_Writer::write_now(const Job& job) {
+
+    if(!job.ldr.empty() && job.format != Image_Format::png) {
+        return std::string("Tonemapped images cannot be written as ") +
+               Image_Format_Names[(int)job.format] + "!";
+    }
+
+    switch(job.format) {
+    case Image_Format::exr: return write_exr(job);
+    case Image_Format::pfm: return write_pfm(job);
+    default: return write_png(job);
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hdr_image.h"
+
+/// Output file encodings: tonemapped 8-bit PNG, linear 32-bit float OpenEXR,
+/// or linear 32-bit float PFM (raw floats behind a short text header).
+enum class Image_Format : int { png, exr, pfm, count };
+extern const char* Image_Format_Names[(int)Image_Format::count];
+extern const char* Image_Format_Extensions[(int)Image_Format::count];
+
+/// Encodes and writes images on background threads. Only a few images may be
+/// waiting at once: write() blocks when the queue is full, so a producer that
+/// outpaces the disk can't pile up frames in memory.
+class Image_Writer {
+public:
+    /// Extra named values per pixel, stored bottom-up like HDR_Image
+    struct Channel {
+        std::string name;
+        std::vector<float> data;
+    };
+
+    /// An image to write. Linear images are tonemapped on the writer thread if
+    /// written as PNG; already-tonemapped RGBA8 pixels can only be written as PNG.
+    struct Job {
+        std::string path;
+        Image_Format format = Image_Format::png;
+
+        HDR_Image hdr;
+        float exposure = 1.0f;
+        Tonemap_Op op = Tonemap_Op::exposure;
+
+        // Used instead of hdr when non-empty. Rows are top-down unless flip is set.
+        std::vector<unsigned char> ldr;
+        size_t w = 0, h = 0;
+        bool flip = false;
+
+        // Written after R, G, and B in EXR files
+        std::vector<Channel> channels;
+    };
+
+    Image_Writer(size_t threads = 2, size_t max_queued = 4);
+    ~Image_Writer();
+
+    Image_Writer(const Image_Writer& src) = delete;
+    Image_Writer& operator=(const Image_Writer& src) = delete;
+
+    void write(Job&& job);
+    /// Blocks until every queued image has been written. Returns the first error
+    /// since the last call, if any.
+    std::string wait();
+    /// First error since the last wait(), without blocking
+    std::string error() const;
+
+    /// Encode and write an image on the calling thread
+    static std::string write_now(const Job& job);
+    /// Guess the format from the file extension, defaulting to PNG
+    static Image_Format format_of(const std::string& path);
+
+private:
+    void work();
+
+    size_t max_queued;
+    size_t busy = 0;
+    bool stop = false;
+    std::string first_error;
+
+    mutable std::mutex queue_mut;
+    std::condition_variable has_work, has_room;
+    std::deque<Job> queue;
+    std::vector<std::thread> workers;
+};
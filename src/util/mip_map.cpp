@@ -0,0 +1,101 @@
+
+#include "mip_map.h"
+
+size_t Mip_Map::Level::index(size_t x, size_t y) const {
+    size_t tile = (y >> tile_bits) * tiles_x + (x >> tile_bits);
+    size_t in_tile = ((y & (tile_size - 1)) << tile_bits) | (x & (tile_size - 1));
+    return (tile << (2 * tile_bits)) | in_tile;
+}
+
+Spectrum Mip_Map::Level::at(size_t x, size_t y) const {
+    return texels.at(index(x, y));
+}
+
+Mip_Map::Mip_Map(const HDR_Image& image, HDR_Format format) {
+
+    const auto [w, h] = image.dimension();
+    if(w == 0 || h == 0) return;
+
+    auto make_level = [format](size_t lw, size_t lh) {
+        Level level;
+        level.w = lw;
+        level.h = lh;
+        level.tiles_x = (lw + tile_size - 1) / tile_size;
+        size_t tiles_y = (lh + tile_size - 1) / tile_size;
+        level.texels = HDR_Image(level.tiles_x * tiles_y * tile_size * tile_size, 1, format);
+        return level;
+    };
+
+    Level base = make_level(w, h);
+    for(size_t y = 0; y < h; y++) {
+        for(size_t x = 0; x < w; x++) {
+            base.texels.set(base.index(x, y), image.at(x, y));
+        }
+    }
+    pyramid.push_back(std::move(base));
+
+    // Box filter each level down to the next, stopping at a single texel
+    while(pyramid.back().w > 1 || pyramid.back().h > 1) {
+
+        const Level& src = pyramid.back();
+        Level dst = make_level(std::max(src.w / 2, size_t(1)), std::max(src.h / 2, size_t(1)));
+
+        for(size_t y = 0; y < dst.h; y++) {
+            size_t y0 = std::min(2 * y, src.h - 1), y1 = std::min(2 * y + 1, src.h - 1);
+            for(size_t x = 0; x < dst.w; x++) {
+                size_t x0 = std::min(2 * x, src.w - 1), x1 = std::min(2 * x + 1, src.w - 1);
+                dst.texels.set(dst.index(x, y), 0.25f * (src.at(x0, y0) + src.at(x1, y0) +
+                                                         src.at(x0, y1) + src.at(x1, y1)));
+            }
+        }
+        pyramid.push_back(std::move(dst));
+    }
+}
+
+size_t Mip_Map::levels() const {
+    return pyramid.size();
+}
+
+std::pair<size_t, size_t> Mip_Map::dimension(size_t level) const {
+    if(level >= pyramid.size()) return {0, 0};
+    return {pyramid[level].w, pyramid[level].h};
+}
+
+Spectrum Mip_Map::at(size_t level, size_t x, size_t y) const {
+    const Level& l = pyramid[level];
+    assert(x < l.w && y < l.h);
+    return l.at(x, y);
+}
+
+Spectrum Mip_Map::bilinear(size_t level, Vec2 uv) const {
+
+    if(pyramid.empty()) return {};
+    const Level& l = pyramid[std::min(level, pyramid.size() - 1)];
+
+    float x = uv.x * l.w - 0.5f;
+    float y = clamp(uv.y * l.h - 0.5f, 0.0f, (float)(l.h - 1));
+    float fx = std::floor(x), fy = std::floor(y);
+    float dx = x - fx, dy = y - fy;
+
+    // Wrap horizontally, clamp vertically
+    long long ix = (long long)fx % (long long)l.w;
+    if(ix < 0) ix += l.w;
+    size_t x0 = (size_t)ix, x1 = (x0 + 1) % l.w;
+    size_t y0 = (size_t)fy, y1 = std::min(y0 + 1, l.h - 1);
+
+    return (1.0f - dy) * ((1.0f - dx) * l.at(x0, y0) + dx * l.at(x1, y0)) +
+           dy * ((1.0f - dx) * l.at(x0, y1) + dx * l.at(x1, y1));
+}
+
+Spectrum Mip_Map::lookup(Vec2 uv, float width) const {
+
+    if(pyramid.empty()) return {};
+    if(!(width > 1.0f)) return bilinear(0, uv);
+
+    float level = std::min(std::log2(width), (float)(pyramid.size() - 1));
+    size_t l0 = (size_t)level;
+    if(l0 + 1 >= pyramid.size()) return bilinear(l0, uv);
+
+    float t = level - l0;
+    return (1.0f - t) * bilinear(l0, uv) + t * bilinear(l0 + 1, uv);
+}
@@ -0,0 +1,49 @@
+
+#pragma once
+
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../lib/spectrum.h"
+#include "hdr_image.h"
+
+/// Read-only mip pyramid of an HDR image, for filtered lookups. Each level is
+/// stored in small square tiles so that neighbouring texels share cache lines
+/// regardless of lookup direction. Lookups wrap in x and clamp in y, as suited
+/// to equirectangular environment maps. Texels may be kept in a compact format.
+class Mip_Map {
+public:
+    Mip_Map() = default;
+    Mip_Map(const HDR_Image& image, HDR_Format format = HDR_Format::rgb32f);
+
+    Mip_Map(const Mip_Map& src) = delete;
+    Mip_Map(Mip_Map&& src) = default;
+    Mip_Map& operator=(const Mip_Map& src) = delete;
+    Mip_Map& operator=(Mip_Map&& src) = default;
+
+    size_t levels() const;
+    std::pair<size_t, size_t> dimension(size_t level = 0) const;
+
+    Spectrum at(size_t level, size_t x, size_t y) const;
+
+    /// Bilinearly interpolate level at uv in [0,1]^2 (texel centers at half-integers)
+    Spectrum bilinear(size_t level, Vec2 uv) const;
+
+    /// Trilinearly interpolate a footprint that is width texels wide at level 0
+    Spectrum lookup(Vec2 uv, float width) const;
+
+private:
+    static constexpr size_t tile_bits = 3;
+    static constexpr size_t tile_size = size_t(1) << tile_bits;
+
+    struct Level {
+        size_t w = 0, h = 0, tiles_x = 0;
+        // Tiled texels, stored as a single row
+        HDR_Image texels;
+
+        size_t index(size_t x, size_t y) const;
+        Spectrum at(size_t x, size_t y) const;
+    };
+
+    std::vector<Level> pyramid;
+};
@@ -33,4 +33,13 @@ void seed() {
     rng.seed(seed);
 }
 
+void seed(unsigned long long value) {
+    std::seed_seq seq{(unsigned int)(value & 0xffffffff), (unsigned int)(value >> 32)};
+    rng.seed(seq);
+}
+
+unsigned long long bits() {
+    return ((unsigned long long)rng() << 32) | (unsigned long long)rng();
+}
+
 } // namespace RNG
@@ -16,4 +16,10 @@ bool coin_flip(float p = 0.5f);
 
 // Seed the current thread's PRNG
 void seed();
+
+// Seed the current thread's PRNG with a fixed value, making its sequence reproducible
+void seed(unsigned long long value);
+
+// Generate a random 64-bit value (e.g. to derive reproducible seeds from)
+unsigned long long bits();
 } // namespace RNG
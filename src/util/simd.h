@@ -0,0 +1,38 @@
+#pragma once
+
+// SSE2 is part of the x86-64 baseline, so using it needs no extra compiler flags
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_SSE2
+
+namespace SIMD {
+
+/// e^-x for x >= 0, to about single precision. The power of two is built directly
+/// in the exponent bits and the fractional part comes from a degree 5 polynomial.
+inline __m128 exp_neg(__m128 x) {
+
+    __m128 t = _mm_mul_ps(x, _mm_set1_ps(-1.44269504f));
+    t = _mm_max_ps(t, _mm_set1_ps(-126.0f));
+
+    // Floor via truncation, which rounds toward zero for negative t
+    __m128i i = _mm_cvttps_epi32(t);
+    __m128 fi = _mm_cvtepi32_ps(i);
+    __m128 adjust = _mm_cmpgt_ps(fi, t);
+    fi = _mm_sub_ps(fi, _mm_and_ps(adjust, _mm_set1_ps(1.0f)));
+    i = _mm_cvttps_epi32(fi);
+    __m128 f = _mm_sub_ps(t, fi);
+
+    __m128 p = _mm_set1_ps(1.8775767e-3f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(8.9893397e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5826318e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4015361e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9315308e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.9999994e-1f));
+
+    __m128i pow2 = _mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(pow2));
+}
+
+} // namespace SIMD
+
+#endif
@@ -2,71 +2,325 @@
 #include "thread_pool.h"
 #include "../util/rand.h"
 
-Thread_Pool::Thread_Pool(size_t threads) {
-    start(threads);
+const char* Task_Priority_Names[(int)Task_Priority::count] = {"Interactive", "Normal",
+                                                               "Background"};
+
+// The pool and worker index of the current thread, if it is a worker
+static thread_local Thread_Pool* current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+Cancel_Token Cancel_Token::make() {
+    Cancel_Token token;
+    token.flag = std::make_shared<std::atomic<bool>>(false);
+    return token;
+}
+
+void Cancel_Token::cancel() const {
+    assert(flag);
+    flag->store(true);
+}
+
+bool Cancel_Token::cancelled() const {
+    return flag && flag->load(std::memory_order_relaxed);
+}
+
+// Chase-Lev work-stealing deque, with the memory orderings given by Le et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models". Only the owning
+// thread may push() and pop(); any thread may steal(), which returns null if the
+// deque is empty or another thread won the race for the last element.
+template<typename T> class Work_Deque {
+public:
+    Work_Deque() {
+        rings.push_back(std::make_unique<Ring>(64));
+        ring.store(rings.back().get(), std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+    }
+
+    void push(T* x) {
+        long long b = bottom.load(std::memory_order_relaxed);
+        long long t = top.load(std::memory_order_acquire);
+        Ring* r = ring.load(std::memory_order_relaxed);
+        if(b - t > r->size() - 1) r = grow(r, t, b);
+        r->put(b, x);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    T* pop() {
+        long long b = bottom.load(std::memory_order_relaxed) - 1;
+        Ring* r = ring.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long t = top.load(std::memory_order_relaxed);
+
+        if(t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        T* x = r->get(b);
+        if(t == b) {
+            // Last element: race any thieves for it
+            if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                            std::memory_order_relaxed)) {
+                x = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return x;
+    }
+
+    T* steal() {
+        long long t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long b = bottom.load(std::memory_order_acquire);
+        if(t >= b) return nullptr;
+
+        Ring* r = ring.load(std::memory_order_acquire);
+        T* x = r->get(t);
+        if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return x;
+    }
+
+private:
+    struct Ring {
+        Ring(long long n) : mask(n - 1), slots(new std::atomic<T*>[n]) {
+        }
+        long long size() const {
+            return mask + 1;
+        }
+        T* get(long long i) const {
+            return slots[i & mask].load(std::memory_order_relaxed);
+        }
+        void put(long long i, T* x) {
+            slots[i & mask].store(x, std::memory_order_relaxed);
+        }
+        long long mask;
+        std::unique_ptr<std::atomic<T*>[]> slots;
+    };
+
+    Ring* grow(Ring* r, long long t, long long b) {
+        std::unique_ptr<Ring> bigger = std::make_unique<Ring>(r->size() * 2);
+        for(long long i = t; i < b; i++) bigger->put(i, r->get(i));
+        Ring* ret = bigger.get();
+        // Thieves may still be reading the old ring, so it is kept until the deque dies
+        rings.push_back(std::move(bigger));
+        ring.store(ret, std::memory_order_release);
+        return ret;
+    }
+
+    alignas(64) std::atomic<long long> top{0};
+    alignas(64) std::atomic<long long> bottom{0};
+    std::atomic<Ring*> ring;
+    std::vector<std::unique_ptr<Ring>> rings;
+};
+
+struct Thread_Pool::Item {
+    Task task;
+    Cancel_Token token;
+};
+
+struct alignas(64) Thread_Pool::Worker {
+    Work_Deque<Item> deques[(int)Task_Priority::count];
+};
+
+Thread_Pool::Thread_Pool(size_t n_threads) {
+    n_threads = std::max<size_t>(n_threads, 1);
+    for(size_t i = 0; i < n_threads; i++) workers.push_back(std::make_unique<Worker>());
+    for(size_t i = 0; i < n_threads; i++) threads.emplace_back([this, i] { work(i); });
 }
 
 Thread_Pool::~Thread_Pool() {
     stop();
 }
 
-void Thread_Pool::start(size_t threads) {
-    n_threads = threads;
-    stop_now = false;
-    stop_when_done = false;
-    for(size_t i = 0; i < threads; i++)
-        workers.emplace_back([this] {
-            RNG::seed();
-            for(;;) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this] {
-                        return this->stop_now || this->stop_when_done || !this->tasks.empty();
-                    });
-                    if(this->stop_now || (this->stop_when_done && this->tasks.empty())) return;
-                    task = std::move(this->tasks.front());
-                    this->tasks.pop();
-                }
-                task();
+Thread_Pool& Thread_Pool::global() {
+    static Thread_Pool pool(std::thread::hardware_concurrency());
+    return pool;
+}
+
+size_t Thread_Pool::size() const {
+    return workers.size();
+}
+
+void Thread_Pool::submit(Task&& task, Task_Priority priority, Cancel_Token token) {
+
+    assert(!stopping);
+    assert(priority < Task_Priority::count);
+
+    Item* item = new Item{std::move(task), std::move(token)};
+    int p = (int)priority;
+
+    // Count the task before it becomes visible, so it can't be finished first
+    unfinished++;
+    queued++;
+
+    if(current_pool == this) {
+        workers[current_index]->deques[p].push(item);
+    } else {
+        std::lock_guard<std::mutex> lock(inject_mut);
+        injected[p].push_back(item);
+    }
+
+    { std::lock_guard<std::mutex> lock(sleep_mut); }
+    sleep_cv.notify_one();
+}
+
+Thread_Pool::Item* Thread_Pool::find(size_t index) {
+
+    Worker& self = *workers[index];
+    size_t n = workers.size();
+
+    for(int p = 0; p < (int)Task_Priority::count; p++) {
+
+        if(Item* item = self.deques[p].pop()) return item;
+
+        {
+            std::lock_guard<std::mutex> lock(inject_mut);
+            std::deque<Item*>& queue = injected[p];
+            if(!queue.empty()) {
+                // Take a share of the queue at once, leaving the rest of it to be
+                // stolen from our deque rather than contending on this lock.
+                size_t take = std::max<size_t>(queue.size() / n, 1);
+                Item* item = queue.front();
+                for(size_t i = take - 1; i > 0; i--) self.deques[p].push(queue[i]);
+                queue.erase(queue.begin(), queue.begin() + take);
+                return item;
             }
-        });
+        }
+
+        for(size_t i = 1; i < n; i++) {
+            if(Item* item = workers[(index + i) % n]->deques[p].steal()) return item;
+        }
+    }
+    return nullptr;
 }
 
-void Thread_Pool::clear() {
-    stop();
-    start(n_threads);
+void Thread_Pool::finish(Item* item, bool run) {
+
+    if(run && !item->token.cancelled()) item->task();
+    delete item;
+
+    if(unfinished.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> lock(done_mut);
+        done_cv.notify_all();
+    }
 }
 
-void Thread_Pool::wait() {
+void Thread_Pool::work(size_t index) {
+
+    RNG::seed();
+    current_pool = this;
+    current_index = index;
+
+    for(;;) {
+        if(Item* item = find(index)) {
+            queued--;
+            finish(item, true);
+            continue;
+        }
+
+        // Lost a race for the last task of a deque; someone else has it
+        if(queued.load() > 0) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mut);
+        sleep_cv.wait(lock, [this] { return stopping || queued.load() > 0; });
+        if(stopping) return;
+    }
+}
+
+size_t Thread_Pool::chunk_size(size_t n, size_t min_grain) const {
+    // A few chunks per thread (counting the caller) evens out uneven chunk costs
+    // without making the per-chunk overhead matter.
+    size_t chunks = 4 * (workers.size() + 1);
+    return std::max((n + chunks - 1) / chunks, std::max<size_t>(min_grain, 1));
+}
+
+void Thread_Pool::run_chunks(size_t chunks, void* body, void (*run)(void* body, size_t chunk)) {
+
+    // Helpers may start after every chunk is already taken (and this call has
+    // returned), so they only share this state, never the caller's stack.
+    struct State {
+        std::atomic<size_t> next{0}, done{0};
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+
+    auto take = [chunks](State& s, void* body, void (*run)(void*, size_t)) {
+        for(size_t c = s.next++; c < chunks; c = s.next++) {
+            run(body, c);
+            s.done++;
+        }
+    };
+
+    size_t helpers = std::min(chunks - 1, workers.size());
+    for(size_t i = 0; i < helpers; i++) {
+        submit([state, take, body, run]() { take(*state, body, run); },
+               Task_Priority::interactive);
+    }
+
+    take(*state, body, run);
+
+    // Whatever is left is already running on other threads
+    while(state->done.load() < chunks) std::this_thread::yield();
+}
+
+void Thread_Pool::clear() {
 
+    std::vector<Item*> dropped;
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop_when_done = true;
+        // Holding the lock keeps workers from moving injected tasks to their deques
+        std::lock_guard<std::mutex> lock(inject_mut);
+        for(std::deque<Item*>& queue : injected) {
+            dropped.insert(dropped.end(), queue.begin(), queue.end());
+            queue.clear();
+        }
+        for(std::unique_ptr<Worker>& worker : workers) {
+            for(Work_Deque<Item>& deque : worker->deques) {
+                while(!deque.empty()) {
+                    if(Item* item = deque.steal()) dropped.push_back(item);
+                }
+            }
+        }
     }
 
-    condition.notify_all();
-    for(std::thread& worker : workers) {
-        worker.join();
+    for(Item* item : dropped) {
+        queued--;
+        finish(item, false);
     }
-    workers.clear();
 
-    start(n_threads);
+    wait();
+}
+
+void Thread_Pool::wait() {
+
+    assert(current_pool != this);
+
+    std::unique_lock<std::mutex> lock(done_mut);
+    done_cv.wait(lock, [this] { return unfinished.load() == 0; });
 }
 
 void Thread_Pool::stop() {
 
+    if(threads.empty()) return;
+
+    clear();
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop_now = true;
+        std::lock_guard<std::mutex> lock(sleep_mut);
+        stopping = true;
     }
 
-    condition.notify_all();
-    for(std::thread& worker : workers) {
-        worker.join();
+    sleep_cv.notify_all();
+    for(std::thread& thread : threads) {
+        thread.join();
     }
-    workers.clear();
-
-    std::queue<std::function<void()>> empty;
-    std::swap(tasks, empty);
+    threads.clear();
 }
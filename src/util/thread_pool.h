@@ -1,50 +1,253 @@
-
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
-#include <functional>
+#include <cstddef>
+#include <deque>
+#include <exception>
 #include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "../lib/log.h"
 
+/// Queued work is started in this order: interactive work (someone is waiting on
+/// the result right now) before normal work before background work.
+enum class Task_Priority : int { interactive, normal, background, count };
+extern const char* Task_Priority_Names[(int)Task_Priority::count];
+
+/// Shared flag for abandoning a group of tasks. Queued tasks whose token has been
+/// cancelled are dropped instead of run; long-running tasks may poll cancelled().
+class Cancel_Token {
+public:
+    /// A token that is never cancelled
+    Cancel_Token() = default;
+    /// A fresh token that can be cancelled
+    static Cancel_Token make();
+
+    void cancel() const;
+    bool cancelled() const;
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag;
+};
+
+/// Move-only type-erased void() callable. Callables up to inline_size bytes are
+/// stored in place rather than on the heap.
+class Task {
+public:
+    Task() = default;
+    ~Task() {
+        reset();
+    }
+
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) {
+        using T = std::decay_t<F>;
+        if constexpr(sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t) &&
+                     std::is_nothrow_move_constructible_v<T>) {
+            new(storage) T(std::forward<F>(f));
+            ops = &inline_ops<T>;
+        } else {
+            new(storage) T*(new T(std::forward<F>(f)));
+            ops = &heap_ops<T>;
+        }
+    }
+
+    Task(Task&& src) noexcept {
+        take(src);
+    }
+    Task& operator=(Task&& src) noexcept {
+        if(this != &src) {
+            reset();
+            take(src);
+        }
+        return *this;
+    }
+
+    Task(const Task& src) = delete;
+    Task& operator=(const Task& src) = delete;
+
+    void operator()() {
+        assert(ops);
+        ops->invoke(storage);
+    }
+    explicit operator bool() const {
+        return ops != nullptr;
+    }
+
+    static constexpr size_t inline_size = 48;
+
+private:
+    struct Ops {
+        void (*invoke)(void* f);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* f);
+    };
+
+    template<typename T>
+    static constexpr Ops inline_ops = {
+        [](void* f) { (*std::launder(static_cast<T*>(f)))(); },
+        [](void* dst, void* src) {
+            T* s = std::launder(static_cast<T*>(src));
+            new(dst) T(std::move(*s));
+            s->~T();
+        },
+        [](void* f) { std::launder(static_cast<T*>(f))->~T(); }};
+
+    template<typename T>
+    static constexpr Ops heap_ops = {
+        [](void* f) { (**std::launder(static_cast<T**>(f)))(); },
+        [](void* dst, void* src) { new(dst) T*(*std::launder(static_cast<T**>(src))); },
+        [](void* f) { delete *std::launder(static_cast<T**>(f)); }};
+
+    void take(Task& src) {
+        if(src.ops) {
+            src.ops->move(storage, src.storage);
+            ops = src.ops;
+            src.ops = nullptr;
+        }
+    }
+    void reset() {
+        if(ops) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    const Ops* ops = nullptr;
+};
+
+/// Work-stealing thread pool. Each worker owns a lock-free deque per priority:
+/// tasks submitted from a worker go onto its own deque, idle workers steal from
+/// the others, and tasks submitted from outside the pool are handed out in
+/// batches from a shared queue.
 class Thread_Pool {
 public:
     Thread_Pool(size_t threads);
     ~Thread_Pool();
 
+    Thread_Pool(const Thread_Pool& src) = delete;
+    Thread_Pool& operator=(const Thread_Pool& src) = delete;
+
+    /// Pool shared by code that just wants to spread a loop over the machine
+    static Thread_Pool& global();
+    size_t size() const;
+
+    /// Drops queued tasks, waits for running ones, and shuts down the workers
     void stop();
+    /// Blocks until every queued and running task has finished. Must not be
+    /// called from a task.
     void wait();
+    /// Drops queued tasks and waits for running ones; the pool stays usable
     void clear();
 
-    template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args)
-        -> std::future<typename std::invoke_result<F, Args...>::type> {
+    /// Queue a task. It is skipped if the token is cancelled before it starts.
+    void submit(Task&& task, Task_Priority priority = Task_Priority::normal,
+                Cancel_Token token = {});
 
-        using return_type = typename std::invoke_result<F, Args...>::type;
-        assert(!stop_now && !stop_when_done);
+    /// Queue a task and get a future for its result. The future reports a
+    /// broken promise if the task is dropped by clear() or its token.
+    template<class F>
+    auto enqueue(F&& f, Task_Priority priority = Task_Priority::normal, Cancel_Token token = {})
+        -> std::future<std::invoke_result_t<F>> {
 
-        auto task = std::make_shared<std::packaged_task<return_type()>>(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        using return_type = std::invoke_result_t<F>;
 
-        std::future<return_type> res = task->get_future();
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            tasks.emplace([task]() { (*task)(); });
-        }
-        condition.notify_one();
+        std::promise<return_type> promise;
+        std::future<return_type> res = promise.get_future();
+
+        submit(
+            [promise = std::move(promise), f = std::forward<F>(f)]() mutable {
+                try {
+                    if constexpr(std::is_void_v<return_type>) {
+                        f();
+                        promise.set_value();
+                    } else {
+                        promise.set_value(f());
+                    }
+                } catch(...) {
+                    promise.set_exception(std::current_exception());
+                }
+            },
+            priority, std::move(token));
         return res;
     }
 
+    /// Calls f(chunk_begin, chunk_end) over disjoint chunks covering [begin, end),
+    /// with the calling thread working alongside the pool until all are done.
+    /// Chunks hold at least min_grain indices, so ranges that are too small to
+    /// be worth splitting run inline. May be called from inside a task.
+    template<class F> void parallel_for(size_t begin, size_t end, F&& f, size_t min_grain = 1) {
+
+        if(begin >= end) return;
+
+        size_t step = chunk_size(end - begin, min_grain);
+        size_t chunks = (end - begin + step - 1) / step;
+        if(chunks == 1) {
+            f(begin, end);
+            return;
+        }
+
+        auto body = [&](size_t c) {
+            size_t lo = begin + c * step;
+            f(lo, std::min(end, lo + step));
+        };
+        run_chunks(chunks, &body, [](void* b, size_t c) { (*static_cast<decltype(body)*>(b))(c); });
+    }
+
+    /// Reduces f(chunk_begin, chunk_end) over chunks of [begin, end) as in
+    /// parallel_for. Partial results are combined in order with reduce, so the
+    /// result doesn't depend on scheduling as long as reduce is associative.
+    template<class T, class F, class R>
+    T parallel_reduce(size_t begin, size_t end, T identity, F&& f, R&& reduce,
+                      size_t min_grain = 1) {
+
+        if(begin >= end) return identity;
+
+        size_t step = chunk_size(end - begin, min_grain);
+        size_t chunks = (end - begin + step - 1) / step;
+        if(chunks == 1) return reduce(identity, f(begin, end));
+
+        std::vector<T> partial(chunks, identity);
+        auto body = [&](size_t c) {
+            size_t lo = begin + c * step;
+            partial[c] = f(lo, std::min(end, lo + step));
+        };
+        run_chunks(chunks, &body, [](void* b, size_t c) { (*static_cast<decltype(body)*>(b))(c); });
+
+        T ret = identity;
+        for(T& p : partial) ret = reduce(ret, p);
+        return ret;
+    }
+
 private:
-    void start(size_t);
-    size_t n_threads;
-    bool stop_now = true;
-    bool stop_when_done = true;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    struct Item;
+    struct Worker;
+
+    size_t chunk_size(size_t n, size_t min_grain) const;
+    void run_chunks(size_t chunks, void* body, void (*run)(void* body, size_t chunk));
+
+    void work(size_t index);
+    Item* find(size_t index);
+    void finish(Item* item, bool run);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex inject_mut;
+    std::deque<Item*> injected[(int)Task_Priority::count];
+
+    // queued: submitted but not yet taken by a worker; unfinished: not yet completed
+    std::atomic<size_t> queued{0}, unfinished{0};
+    std::atomic<bool> stopping{false};
+
+    std::mutex sleep_mut, done_mut;
+    std::condition_variable sleep_cv, done_cv;
 };